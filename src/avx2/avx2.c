@@ -1,15 +1,158 @@
+#include <ctype.h>
 #include <float.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
 #include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define MATRIX_ALIGNMENT 64
+#define OUTPUT_BUFFER_SIZE (1 << 22)
+// Bytes a result line needs beyond its two words: two separators, the
+// newline and the value, which is up to DBL_MAX_10_EXP + 9 characters.
+#define SLOW_LINE_EXTRA (DBL_MAX_10_EXP + 12)
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define DEFAULT_L1D_SIZE (32 * 1024)
+#define DEFAULT_L2_SIZE (256 * 1024)
+#define TUNE_DEFAULT_SIZE 480
 const int _MAX_DISTANCE = 5;
 const double _INFINITY = DBL_MAX;
 
+// Every n x n matrix is a single MATRIX_ALIGNMENT-aligned allocation with
+// rows padded to a multiple of 8 doubles. Any column index that is a multiple
+// of 4 is therefore 32-byte aligned, which lets the AVX2 kernels below use
+// aligned loads and work on tiles in place through the row stride.
+int matrix_stride(int n) {
+    int per_line = MATRIX_ALIGNMENT / sizeof(double);
+    return (n + per_line - 1) / per_line * per_line;
+}
+
+double **alloc_matrix(int n) {
+    size_t stride = matrix_stride(n);
+    size_t bytes = (size_t)n * stride * sizeof(double);
+    double **M = (double **)malloc((n > 0 ? n : 1) * sizeof(double *));
+
+    M[0] = (double *)aligned_alloc(MATRIX_ALIGNMENT, bytes > 0 ? bytes : MATRIX_ALIGNMENT);
+    for (int i = 1; i < n; i++) {
+        M[i] = M[0] + i * stride;
+    }
+
+    return M;
+}
+
+void free_matrix(double **M) {
+    if (M != NULL) {
+        free(M[0]);
+        free(M);
+    }
+}
+
+// Minkowski r combine of two path lengths: a + b, sqrt(a^2 + b^2) and
+// max(a, b) for r = 1, 2 and infinity, the general formula otherwise.
+static inline double minkowski_distance(double a, double b, double r) {
+    if (r == 1.0) {
+        return a + b;
+    } else if (r == 2.0) {
+        return sqrt(a * a + b * b);
+    } else if (r == _INFINITY) {
+        return a > b ? a : b;
+    } else {
+        return pow((pow(a, r) + pow(b, r)), (1.0 / r));
+    }
+}
+
+// The inner loops exist once per instruction set: AVX-512, AVX2 with FMA,
+// and a portable version for any other CPU. main() picks one set at startup
+// with select_kernels() and the closure and similarity stages call through
+// it, so the binary itself only needs the baseline instruction set.
+struct kernels {
+    const char *name;
+    // c[j] = min(c[j], a (+) b[j]) for j < len, (+) being the combine for r.
+    void (*relax_row)(double *c, const double *b, double a, int len, double r);
+    // relax_row for two rows of C against the same row b.
+    void (*relax_rows2)(double *c0, double *c1, const double *b, double a0, double a1,
+                        int len, double r);
+    double (*cosine)(const double *a, const double *b, int n);
+};
+
+struct kernels kernels;
+
+// Plain loops the compiler can vectorize for the baseline SSE2 when r is
+// 1, 2 or infinity.
+void portable_relax_row(double *c, const double *b, double a, int len, double r) {
+    if (r == 1.0) {
+        for (int j = 0; j < len; j++) {
+            double t = a + b[j];
+            c[j] = t < c[j] ? t : c[j];
+        }
+    } else if (r == 2.0) {
+        for (int j = 0; j < len; j++) {
+            double t = sqrt(a * a + b[j] * b[j]);
+            c[j] = t < c[j] ? t : c[j];
+        }
+    } else if (r == _INFINITY) {
+        for (int j = 0; j < len; j++) {
+            double t = a > b[j] ? a : b[j];
+            c[j] = t < c[j] ? t : c[j];
+        }
+    } else {
+        for (int j = 0; j < len; j++) {
+            double t = minkowski_distance(a, b[j], r);
+            c[j] = t < c[j] ? t : c[j];
+        }
+    }
+}
+
+void portable_relax_rows2(double *c0, double *c1, const double *b, double a0, double a1,
+                          int len, double r) {
+    portable_relax_row(c0, b, a0, len, r);
+    portable_relax_row(c1, b, a1, len, r);
+}
+
+// Four partial sums, in the same lanes as the AVX2 version.
+double portable_cosine(const double *a, const double *b, int n) {
+    double dot_arr[4] = {0}, norm_a_arr[4] = {0}, norm_b_arr[4] = {0};
+
+    int i = 0;
+    for (; i <= n - 4; i += 4) {
+        for (int l = 0; l < 4; l++) {
+            dot_arr[l] += a[i + l] * b[i + l];
+            norm_a_arr[l] += a[i + l] * a[i + l];
+            norm_b_arr[l] += b[i + l] * b[i + l];
+        }
+    }
+
+    double dot = dot_arr[0] + dot_arr[1] + dot_arr[2] + dot_arr[3];
+    double norm_a = norm_a_arr[0] + norm_a_arr[1] + norm_a_arr[2] + norm_a_arr[3];
+    double norm_b = norm_b_arr[0] + norm_b_arr[1] + norm_b_arr[2] + norm_b_arr[3];
+
+    for (; i < n; i++) {
+        dot += a[i] * b[i];
+        norm_a += a[i] * a[i];
+        norm_b += b[i] * b[i];
+    }
+
+    norm_a = sqrt(norm_a);
+    norm_b = sqrt(norm_b);
+
+    if (norm_a == 0 || norm_b == 0)
+        return 0;
+
+    return dot / (norm_a * norm_b);
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx2,fma")))
 static inline __m256d avx2_minkowski_distance(__m256d a, __m256d b, double r) {
     if (r == 1.0) {
         return _mm256_add_pd(a, b);
@@ -33,237 +176,653 @@ static inline __m256d avx2_minkowski_distance(__m256d a, __m256d b, double r) {
     }
 }
 
-void floyd_warshall(double **D, int n, double r) {
-    for (int k = 0; k < n; k++) {
-        for (int i = 0; i < n; i++) {
-            __m256d a_vec = _mm256_set1_pd(D[i][k]);
+// Rows of D and tile columns at multiples of 4 are 32-byte aligned, so the
+// loads and stores are aligned.
+__attribute__((target("avx2,fma")))
+void avx2_relax_row(double *c, const double *b, double a, int len, double r) {
+    __m256d a_vec = _mm256_set1_pd(a);
 
-            int j = 0;
-            for (; j <= n - 4; j += 4) {
-                __m256d b_vec = _mm256_loadu_pd(&D[k][j]);
-                __m256d c_vec = _mm256_loadu_pd(&D[i][j]);
+    int j = 0;
+    for (; j <= len - 4; j += 4) {
+        __m256d b_vec = _mm256_load_pd(&b[j]);
+        __m256d c_vec = _mm256_load_pd(&c[j]);
 
-                __m256d t_vec = avx2_minkowski_distance(a_vec, b_vec, r);
-                __m256d result_vec = _mm256_min_pd(c_vec, t_vec);
+        __m256d t_vec = avx2_minkowski_distance(a_vec, b_vec, r);
+        __m256d result_vec = _mm256_min_pd(c_vec, t_vec);
 
-                _mm256_storeu_pd(&D[i][j], result_vec);
-            }
+        _mm256_store_pd(&c[j], result_vec);
+    }
 
-            for (; j < n; j++) {
-                double a = D[i][k];
-                double b = D[k][j];
-                double t = pow((pow(a, r) + pow(b, r)), (1.0 / r));
+    for (; j < len; j++) {
+        double t = minkowski_distance(a, b[j], r);
 
-                if (t < D[i][j]) {
-                    D[i][j] = t;
-                }
-            }
+        if (t < c[j]) {
+            c[j] = t;
         }
     }
 }
 
-void blocked_floyd_warshall(double **D, int n, int block_size, double r) {
-    int n_blocks = n / block_size;
+__attribute__((target("avx2,fma")))
+void avx2_relax_rows2(double *c0, double *c1, const double *b, double a0, double a1,
+                      int len, double r) {
+    __m256d a0_vec = _mm256_set1_pd(a0);
+    __m256d a1_vec = _mm256_set1_pd(a1);
 
-    double *A = (double *)_mm_malloc(block_size * block_size * sizeof(double), 32);
-    double *block_B = (double *)_mm_malloc(block_size * block_size * sizeof(double), 32);
-    double *block_C = (double *)_mm_malloc(block_size * block_size * sizeof(double), 32);
+    int j = 0;
+    for (; j <= len - 4; j += 4) {
+        __m256d b_vec = _mm256_load_pd(&b[j]);
+        __m256d c0_vec = _mm256_load_pd(&c0[j]);
+        __m256d c1_vec = _mm256_load_pd(&c1[j]);
 
-    for (int k_block = 0; k_block < n_blocks; k_block++) {
+        __m256d t0_vec = avx2_minkowski_distance(a0_vec, b_vec, r);
+        __m256d t1_vec = avx2_minkowski_distance(a1_vec, b_vec, r);
 
-        for (int i = 0; i < block_size; i++) {
-            for (int j = 0; j < block_size; j++) {
-                A[i * block_size + j] = D[k_block * block_size + i][k_block * block_size + j];
-            }
+        _mm256_store_pd(&c0[j], _mm256_min_pd(c0_vec, t0_vec));
+        _mm256_store_pd(&c1[j], _mm256_min_pd(c1_vec, t1_vec));
+    }
+
+    for (; j < len; j++) {
+        double t0 = minkowski_distance(a0, b[j], r);
+        double t1 = minkowski_distance(a1, b[j], r);
+
+        if (t0 < c0[j]) {
+            c0[j] = t0;
         }
+        if (t1 < c1[j]) {
+            c1[j] = t1;
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+double avx2_cosine(const double *a, const double *b, int n) {
+    __m256d dot_vec = _mm256_setzero_pd();
+    __m256d norm_a_vec = _mm256_setzero_pd();
+    __m256d norm_b_vec = _mm256_setzero_pd();
+
+    int i = 0;
+    for (; i <= n - 4; i += 4) {
+        __m256d a_vec = _mm256_load_pd(&a[i]);
+        __m256d b_vec = _mm256_load_pd(&b[i]);
 
-        for (int k = 0; k < block_size; k++) {
-            for (int i = 0; i < block_size; i++) {
-                __m256d a_vec = _mm256_set1_pd(A[i * block_size + k]);
+        __m256d mul_vec = _mm256_mul_pd(a_vec, b_vec);
+        dot_vec = _mm256_add_pd(dot_vec, mul_vec);
 
-                int j = 0;
-                for (; j <= block_size - 4; j += 4) {
-                    __m256d b_vec = _mm256_loadu_pd(&A[k * block_size + j]);
-                    __m256d c_vec = _mm256_loadu_pd(&A[i * block_size + j]);
+        __m256d a_squared = _mm256_mul_pd(a_vec, a_vec);
+        __m256d b_squared = _mm256_mul_pd(b_vec, b_vec);
+        norm_a_vec = _mm256_add_pd(norm_a_vec, a_squared);
+        norm_b_vec = _mm256_add_pd(norm_b_vec, b_squared);
+    }
 
-                    __m256d t_vec = avx2_minkowski_distance(a_vec, b_vec, r);
-                    __m256d result_vec = _mm256_min_pd(c_vec, t_vec);
+    double dot_arr[4], norm_a_arr[4], norm_b_arr[4];
+    _mm256_storeu_pd(dot_arr, dot_vec);
+    _mm256_storeu_pd(norm_a_arr, norm_a_vec);
+    _mm256_storeu_pd(norm_b_arr, norm_b_vec);
 
-                    _mm256_storeu_pd(&A[i * block_size + j], result_vec);
-                }
+    double dot = dot_arr[0] + dot_arr[1] + dot_arr[2] + dot_arr[3];
+    double norm_a = norm_a_arr[0] + norm_a_arr[1] + norm_a_arr[2] + norm_a_arr[3];
+    double norm_b = norm_b_arr[0] + norm_b_arr[1] + norm_b_arr[2] + norm_b_arr[3];
 
-                for (; j < block_size; j++) {
-                    double a = A[i * block_size + k];
-                    double b = A[k * block_size + j];
-                    double t = pow((pow(a, r) + pow(b, r)), (1.0 / r));
+    for (; i < n; i++) {
+        dot += a[i] * b[i];
+        norm_a += a[i] * a[i];
+        norm_b += b[i] * b[i];
+    }
 
-                    if (t < A[i * block_size + j]) {
-                        A[i * block_size + j] = t;
-                    }
-                }
-            }
+    norm_a = sqrt(norm_a);
+    norm_b = sqrt(norm_b);
+
+    if (norm_a == 0 || norm_b == 0)
+        return 0;
+
+    return dot / (norm_a * norm_b);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d avx512_minkowski_distance(__m512d a, __m512d b, double r) {
+    if (r == 1.0) {
+        return _mm512_add_pd(a, b);
+    } else if (r == 2.0) {
+        return _mm512_sqrt_pd(_mm512_fmadd_pd(a, a, _mm512_mul_pd(b, b)));
+    } else if (r == _INFINITY) {
+        return _mm512_max_pd(a, b);
+    } else {
+        double a_vals[8], b_vals[8], result[8];
+        _mm512_storeu_pd(a_vals, a);
+        _mm512_storeu_pd(b_vals, b);
+
+        for (int i = 0; i < 8; i++) {
+            result[i] = pow((pow(a_vals[i], r) + pow(b_vals[i], r)), (1.0 / r));
         }
 
+        return _mm512_loadu_pd(result);
+    }
+}
+
+// Tile columns are only 32-byte aligned, so the loads are unaligned; the
+// last len % 8 columns go through a masked load and store instead of a
+// scalar loop.
+__attribute__((target("avx512f")))
+void avx512_relax_row(double *c, const double *b, double a, int len, double r) {
+    __m512d a_vec = _mm512_set1_pd(a);
+
+    int j = 0;
+    for (; j <= len - 8; j += 8) {
+        __m512d b_vec = _mm512_loadu_pd(&b[j]);
+        __m512d c_vec = _mm512_loadu_pd(&c[j]);
+
+        __m512d t_vec = avx512_minkowski_distance(a_vec, b_vec, r);
+        _mm512_storeu_pd(&c[j], _mm512_min_pd(c_vec, t_vec));
+    }
+
+    if (j < len) {
+        __mmask8 mask = (__mmask8)((1u << (len - j)) - 1);
+        __m512d b_vec = _mm512_maskz_loadu_pd(mask, &b[j]);
+        __m512d c_vec = _mm512_maskz_loadu_pd(mask, &c[j]);
+
+        __m512d t_vec = avx512_minkowski_distance(a_vec, b_vec, r);
+        _mm512_mask_storeu_pd(&c[j], mask, _mm512_min_pd(c_vec, t_vec));
+    }
+}
+
+__attribute__((target("avx512f")))
+void avx512_relax_rows2(double *c0, double *c1, const double *b, double a0, double a1,
+                        int len, double r) {
+    __m512d a0_vec = _mm512_set1_pd(a0);
+    __m512d a1_vec = _mm512_set1_pd(a1);
+
+    int j = 0;
+    for (; j <= len - 8; j += 8) {
+        __m512d b_vec = _mm512_loadu_pd(&b[j]);
+        __m512d c0_vec = _mm512_loadu_pd(&c0[j]);
+        __m512d c1_vec = _mm512_loadu_pd(&c1[j]);
+
+        __m512d t0_vec = avx512_minkowski_distance(a0_vec, b_vec, r);
+        __m512d t1_vec = avx512_minkowski_distance(a1_vec, b_vec, r);
+
+        _mm512_storeu_pd(&c0[j], _mm512_min_pd(c0_vec, t0_vec));
+        _mm512_storeu_pd(&c1[j], _mm512_min_pd(c1_vec, t1_vec));
+    }
+
+    if (j < len) {
+        __mmask8 mask = (__mmask8)((1u << (len - j)) - 1);
+        __m512d b_vec = _mm512_maskz_loadu_pd(mask, &b[j]);
+        __m512d c0_vec = _mm512_maskz_loadu_pd(mask, &c0[j]);
+        __m512d c1_vec = _mm512_maskz_loadu_pd(mask, &c1[j]);
+
+        __m512d t0_vec = avx512_minkowski_distance(a0_vec, b_vec, r);
+        __m512d t1_vec = avx512_minkowski_distance(a1_vec, b_vec, r);
+
+        _mm512_mask_storeu_pd(&c0[j], mask, _mm512_min_pd(c0_vec, t0_vec));
+        _mm512_mask_storeu_pd(&c1[j], mask, _mm512_min_pd(c1_vec, t1_vec));
+    }
+}
+
+// Eight partial sums instead of four, so the last bits of a similarity can
+// differ from the other kernel sets.
+__attribute__((target("avx512f")))
+double avx512_cosine(const double *a, const double *b, int n) {
+    __m512d dot_vec = _mm512_setzero_pd();
+    __m512d norm_a_vec = _mm512_setzero_pd();
+    __m512d norm_b_vec = _mm512_setzero_pd();
+
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        __m512d a_vec = _mm512_loadu_pd(&a[i]);
+        __m512d b_vec = _mm512_loadu_pd(&b[i]);
+
+        dot_vec = _mm512_fmadd_pd(a_vec, b_vec, dot_vec);
+        norm_a_vec = _mm512_fmadd_pd(a_vec, a_vec, norm_a_vec);
+        norm_b_vec = _mm512_fmadd_pd(b_vec, b_vec, norm_b_vec);
+    }
+
+    if (i < n) {
+        __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+        __m512d a_vec = _mm512_maskz_loadu_pd(mask, &a[i]);
+        __m512d b_vec = _mm512_maskz_loadu_pd(mask, &b[i]);
+
+        dot_vec = _mm512_fmadd_pd(a_vec, b_vec, dot_vec);
+        norm_a_vec = _mm512_fmadd_pd(a_vec, a_vec, norm_a_vec);
+        norm_b_vec = _mm512_fmadd_pd(b_vec, b_vec, norm_b_vec);
+    }
+
+    double dot = _mm512_reduce_add_pd(dot_vec);
+    double norm_a = sqrt(_mm512_reduce_add_pd(norm_a_vec));
+    double norm_b = sqrt(_mm512_reduce_add_pd(norm_b_vec));
+
+    if (norm_a == 0 || norm_b == 0)
+        return 0;
+
+    return dot / (norm_a * norm_b);
+}
+#endif
+
+// The widest set the CPU (and the OS, which must save the wider registers)
+// supports, unless PFNET_KERNELS names another one. A set the CPU cannot run
+// is refused with a warning rather than left to crash.
+void select_kernels(void) {
+    static const struct kernels portable = {
+        "portable", portable_relax_row, portable_relax_rows2, portable_cosine};
+    kernels = portable;
+
+#ifdef HAVE_X86_KERNELS
+    static const struct kernels avx2 = {
+        "avx2", avx2_relax_row, avx2_relax_rows2, avx2_cosine};
+    static const struct kernels avx512 = {
+        "avx512", avx512_relax_row, avx512_relax_rows2, avx512_cosine};
+
+    __builtin_cpu_init();
+    int has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    int has_avx512 = __builtin_cpu_supports("avx512f");
+
+    if (has_avx512) {
+        kernels = avx512;
+    } else if (has_avx2) {
+        kernels = avx2;
+    }
+#endif
+
+    const char *forced = getenv("PFNET_KERNELS");
+    if (forced == NULL || forced[0] == '\0' || strcmp(forced, kernels.name) == 0) {
+        return;
+    }
+    if (strcmp(forced, "portable") == 0) {
+        kernels = portable;
+        return;
+    }
+#ifdef HAVE_X86_KERNELS
+    if (strcmp(forced, "avx2") == 0 && has_avx2) {
+        kernels = avx2;
+        return;
+    }
+    if (strcmp(forced, "avx512") == 0 && has_avx512) {
+        kernels = avx512;
+        return;
+    }
+#endif
+    fprintf(stderr, "Warning: PFNET_KERNELS=%s is not available here, using %s\n",
+            forced, kernels.name);
+}
+
+// Live progress of the closure for --progress. The closure is the only
+// writer and a reporter thread the only reader, so relaxed stores of plain
+// values suffice: a few per tile row, a mov each on x86.
+struct telemetry {
+    atomic_int running;
+    atomic_int round;
+    atomic_int rounds;
+    atomic_llong updates;
+    atomic_llong total_updates;
+    atomic_llong started_ns;
+    atomic_llong busy_ns;
+};
+
+struct telemetry telemetry;
+
+long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void telemetry_begin(int rounds, long long total_updates) {
+    atomic_store_explicit(&telemetry.round, 0, memory_order_relaxed);
+    atomic_store_explicit(&telemetry.rounds, rounds, memory_order_relaxed);
+    atomic_store_explicit(&telemetry.updates, 0, memory_order_relaxed);
+    atomic_store_explicit(&telemetry.total_updates, total_updates, memory_order_relaxed);
+    atomic_store_explicit(&telemetry.busy_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&telemetry.started_ns, monotonic_ns(), memory_order_relaxed);
+    atomic_store_explicit(&telemetry.running, 1, memory_order_relaxed);
+}
+
+// Ends a round: the rounds done, the updates so far and the time spent in
+// the closure loops since started.
+void telemetry_round(int round, long long updates, long long busy_ns) {
+    atomic_store_explicit(&telemetry.round, round, memory_order_relaxed);
+    atomic_store_explicit(&telemetry.updates, updates, memory_order_relaxed);
+    atomic_store_explicit(&telemetry.busy_ns, busy_ns, memory_order_relaxed);
+}
+
+void floyd_warshall(double **D, int n, double r) {
+    long long started = monotonic_ns();
+    telemetry_begin(n, (long long)n * n * n);
+
+    for (int k = 0; k < n; k++) {
+        for (int i = 0; i < n; i++) {
+            kernels.relax_row(D[i], D[k], D[i][k], n, r);
+        }
+        telemetry_round(k + 1, (long long)(k + 1) * n * n, monotonic_ns() - started);
+    }
+}
+
+// Relaxes the tile C against the pivot tiles A (same rows as C) and B (same
+// columns as C). All three point into D and share its row stride; C may alias
+// A or B in the dependent phases, which is why k is the outermost loop.
+static inline void update_tile(double *C, const double *A, const double *B,
+                               int block_size, int stride, double r) {
+    for (int k = 0; k < block_size; k++) {
         for (int i = 0; i < block_size; i++) {
-            for (int j = 0; j < block_size; j++) {
-                D[k_block * block_size + i][k_block * block_size + j] = A[i * block_size + j];
-            }
+            kernels.relax_row(&C[i * stride], &B[k * stride], A[i * stride + k],
+                              block_size, r);
         }
+    }
+}
 
-        for (int j_block = 0; j_block < n_blocks; j_block++) {
-            if (j_block == k_block) continue;
+// update_tile with two rows of C per pass, so each vector of the pivot row
+// B is loaded once for both. Row k of B and column k of A do not change
+// while k is the intermediate, so the pairing is safe when C aliases them.
+static inline void update_tile_pairs(double *C, const double *A, const double *B,
+                                     int block_size, int stride, double r) {
+    for (int k = 0; k < block_size; k++) {
+        for (int i = 0; i < block_size; i += 2) {
+            kernels.relax_rows2(&C[i * stride], &C[(i + 1) * stride], &B[k * stride],
+                                A[i * stride + k], A[(i + 1) * stride + k], block_size, r);
+        }
+    }
+}
 
-            for (int i = 0; i < block_size; i++) {
-                for (int j = 0; j < block_size; j++) {
-                    block_B[i * block_size + j] = D[k_block * block_size + i][j_block * block_size + j];
-                }
-            }
+// Tile edge and rows of C per kernel pass (1 or 2) of the blocked closure.
+struct tile_shape {
+    int block_size;
+    int kernel_rows;
+};
 
-            for (int k = 0; k < block_size; k++) {
-                for (int i = 0; i < block_size; i++) {
-                    __m256d a_vec = _mm256_set1_pd(A[i * block_size + k]);
+typedef void (*tile_kernel)(double *C, const double *A, const double *B,
+                            int block_size, int stride, double r);
 
-                    int j = 0;
-                    for (; j <= block_size - 4; j += 4) {
-                        __m256d b_vec = _mm256_loadu_pd(&block_B[k * block_size + j]);
-                        __m256d c_vec = _mm256_loadu_pd(&block_B[i * block_size + j]);
+void blocked_floyd_warshall(double **D, int n, struct tile_shape shape, double r) {
+    int block_size = shape.block_size;
+    int n_blocks = n / block_size;
+    int stride = matrix_stride(n);
+    tile_kernel kernel = shape.kernel_rows == 2 ? update_tile_pairs : update_tile;
+    long long tile_updates = (long long)block_size * block_size * block_size;
+    long long done = 0;
+    long long started = monotonic_ns();
+    telemetry_begin(n_blocks, (long long)n * n * n);
 
-                        __m256d t_vec = avx2_minkowski_distance(a_vec, b_vec, r);
-                        __m256d result_vec = _mm256_min_pd(c_vec, t_vec);
+    for (int k_block = 0; k_block < n_blocks; k_block++) {
+        double *A = &D[k_block * block_size][k_block * block_size];
 
-                        _mm256_storeu_pd(&block_B[i * block_size + j], result_vec);
-                    }
+        kernel(A, A, A, block_size, stride, r);
 
-                    for (; j < block_size; j++) {
-                        double a = A[i * block_size + k];
-                        double b = block_B[k * block_size + j];
-                        double t = pow((pow(a, r) + pow(b, r)), (1.0 / r));
+        for (int j_block = 0; j_block < n_blocks; j_block++) {
+            if (j_block == k_block) continue;
 
-                        if (t < block_B[i * block_size + j]) {
-                            block_B[i * block_size + j] = t;
-                        }
-                    }
-                }
-            }
+            double *B = &D[k_block * block_size][j_block * block_size];
+            kernel(B, A, B, block_size, stride, r);
+        }
 
-            for (int i = 0; i < block_size; i++) {
-                for (int j = 0; j < block_size; j++) {
-                    D[k_block * block_size + i][j_block * block_size + j] = block_B[i * block_size + j];
-                }
-            }
+        for (int i_block = 0; i_block < n_blocks; i_block++) {
+            if (i_block == k_block) continue;
+
+            double *C = &D[i_block * block_size][k_block * block_size];
+            kernel(C, C, A, block_size, stride, r);
         }
+        done += (2 * n_blocks - 1) * tile_updates;
+        atomic_store_explicit(&telemetry.updates, done, memory_order_relaxed);
 
         for (int i_block = 0; i_block < n_blocks; i_block++) {
             if (i_block == k_block) continue;
 
-            for (int i = 0; i < block_size; i++) {
-                for (int j = 0; j < block_size; j++) {
-                    block_C[i * block_size + j] = D[i_block * block_size + i][k_block * block_size + j];
-                }
-            }
+            for (int j_block = 0; j_block < n_blocks; j_block++) {
+                if (j_block == k_block) continue;
 
-            for (int k = 0; k < block_size; k++) {
-                for (int i = 0; i < block_size; i++) {
-                    __m256d a_vec = _mm256_set1_pd(block_C[i * block_size + k]);
+                double *C = &D[i_block * block_size][j_block * block_size];
+                const double *A_col = &D[i_block * block_size][k_block * block_size];
+                const double *B_row = &D[k_block * block_size][j_block * block_size];
+                kernel(C, A_col, B_row, block_size, stride, r);
+            }
+            done += (n_blocks - 1) * tile_updates;
+            atomic_store_explicit(&telemetry.updates, done, memory_order_relaxed);
+        }
 
-                    int j = 0;
-                    for (; j <= block_size - 4; j += 4) {
-                        __m256d b_vec = _mm256_loadu_pd(&A[k * block_size + j]);
-                        __m256d c_vec = _mm256_loadu_pd(&block_C[i * block_size + j]);
+        telemetry_round(k_block + 1, done, monotonic_ns() - started);
+    }
+}
 
-                        __m256d t_vec = avx2_minkowski_distance(a_vec, b_vec, r);
-                        __m256d result_vec = _mm256_min_pd(c_vec, t_vec);
+// Sizes in sysfs read like "48K" or "32M".
+size_t read_cache_size(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
 
-                        _mm256_storeu_pd(&block_C[i * block_size + j], result_vec);
-                    }
+    unsigned long long size = 0;
+    char unit = 0;
+    int fields = fscanf(file, "%llu%c", &size, &unit);
+    fclose(file);
 
-                    for (; j < block_size; j++) {
-                        double a = block_C[i * block_size + k];
-                        double b = A[k * block_size + j];
-                        double t = pow((pow(a, r) + pow(b, r)), (1.0 / r));
+    if (fields < 1) {
+        return 0;
+    }
+    if (fields == 2 && unit == 'K') {
+        size <<= 10;
+    } else if (fields == 2 && unit == 'M') {
+        size <<= 20;
+    }
+    return (size_t)size;
+}
 
-                        if (t < block_C[i * block_size + j]) {
-                            block_C[i * block_size + j] = t;
-                        }
-                    }
-                }
+// L1 data and L2 sizes of cpu0 from sysfs, 0 where they are not reported.
+void read_caches(size_t *l1d, size_t *l2) {
+    *l1d = 0;
+    *l2 = 0;
+
+    for (int index = 0;; index++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            break;
+        }
+        int level = 0;
+        if (fscanf(file, "%d", &level) != 1) {
+            level = 0;
+        }
+        fclose(file);
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+        char type[32] = "";
+        file = fopen(path, "r");
+        if (file != NULL) {
+            if (fscanf(file, "%31s", type) != 1) {
+                type[0] = '\0';
             }
+            fclose(file);
+        }
+        if (strcmp(type, "Instruction") == 0) {
+            continue;
+        }
 
-            for (int i = 0; i < block_size; i++) {
-                for (int j = 0; j < block_size; j++) {
-                    D[i_block * block_size + i][k_block * block_size + j] = block_C[i * block_size + j];
-                }
-            }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+        if (level == 1) {
+            *l1d = read_cache_size(path);
+        } else if (level == 2) {
+            *l2 = read_cache_size(path);
         }
+    }
+}
 
-        for (int i_block = 0; i_block < n_blocks; i_block++) {
-            if (i_block == k_block) continue;
+// The tuning file shared with libpfnet (see the OpenMP version): one line
+// "backend cpu_model l1d l2 block_size" per backend and machine. This
+// program's backend is its kernel set (avx512, avx2 or portable), each tuned
+// on its own, and its lines carry the kernel row count as a sixth field. It is
+// $PFNET_TUNING, or ~/.pfnet_tuning without it; NULL if there is neither.
+const char *tuning_path(char *buffer, size_t size) {
+    const char *path = getenv("PFNET_TUNING");
+    if (path != NULL && path[0] != '\0') {
+        return path;
+    }
 
-            for (int j_block = 0; j_block < n_blocks; j_block++) {
-                if (j_block == k_block) continue;
+    const char *home = getenv("HOME");
+    if (home == NULL || home[0] == '\0') {
+        return NULL;
+    }
+    snprintf(buffer, size, "%s/.pfnet_tuning", home);
+    return buffer;
+}
 
-                for (int i = 0; i < block_size; i++) {
-                    for (int j = 0; j < block_size; j++) {
-                        block_C[i * block_size + j] = D[i_block * block_size + i][j_block * block_size + j];
-                    }
+// The CPU model with blanks replaced, so a tuning line splits on whitespace.
+void cpu_model(char *model, size_t size) {
+    snprintf(model, size, "unknown");
+
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (file != NULL) {
+        char line[512];
+        while (fgets(line, sizeof(line), file) != NULL) {
+            char *colon = strchr(line, ':');
+            if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+                char *value = colon + 1;
+                while (*value == ' ' || *value == '\t') {
+                    value++;
                 }
-
-                for (int i = 0; i < block_size; i++) {
-                    for (int j = 0; j < block_size; j++) {
-                        block_B[i * block_size + j] = D[i_block * block_size + i][k_block * block_size + j];
-                    }
+                value[strcspn(value, "\n")] = '\0';
+                if (*value != '\0') {
+                    snprintf(model, size, "%s", value);
                 }
+                break;
+            }
+        }
+        fclose(file);
+    }
 
-                for (int k = 0; k < block_size; k++) {
-                    for (int i = 0; i < block_size; i++) {
-                        __m256d a_vec = _mm256_set1_pd(block_B[i * block_size + k]);
+    for (char *c = model; *c; c++) {
+        if (isspace((unsigned char)*c)) {
+            *c = '_';
+        }
+    }
+}
 
-                        int j = 0;
-                        for (; j <= block_size - 4; j += 4) {
-                            __m256d b_vec = _mm256_loadu_pd(&D[k_block * block_size + k][j_block * block_size + j]);
-                            __m256d c_vec = _mm256_loadu_pd(&block_C[i * block_size + j]);
+// Whether line is the line of this machine and kernel set; fills shape
+// from it.
+int tuning_line_matches(const char *line, const char *model, size_t l1d, size_t l2,
+                        struct tile_shape *shape) {
+    char backend[32], line_model[256];
+    unsigned long long line_l1d, line_l2;
+    int block_size, kernel_rows = 1;
+
+    int fields = sscanf(line, "%31s %255s %llu %llu %d %d", backend, line_model,
+                        &line_l1d, &line_l2, &block_size, &kernel_rows);
+    if (fields < 5 || strcmp(backend, kernels.name) != 0
+        || strcmp(line_model, model) != 0 || line_l1d != l1d || line_l2 != l2) {
+        return 0;
+    }
 
-                            __m256d t_vec = avx2_minkowski_distance(a_vec, b_vec, r);
-                            __m256d result_vec = _mm256_min_pd(c_vec, t_vec);
+    shape->block_size = block_size;
+    shape->kernel_rows = kernel_rows == 2 ? 2 : 1;
+    return 1;
+}
 
-                            _mm256_storeu_pd(&block_C[i * block_size + j], result_vec);
-                        }
+// The tuned shape of this machine, or block_size 0 if it has none.
+struct tile_shape load_tuning(void) {
+    struct tile_shape shape = {0, 1};
+    char buffer[4096];
+    const char *path = tuning_path(buffer, sizeof(buffer));
+    FILE *file = path != NULL ? fopen(path, "r") : NULL;
+    if (file == NULL) {
+        return shape;
+    }
 
-                        for (; j < block_size; j++) {
-                            double a = block_B[i * block_size + k];
-                            double b = D[k_block * block_size + k][j_block * block_size + j];
-                            double t = pow((pow(a, r) + pow(b, r)), (1.0 / r));
+    char model[256];
+    size_t l1d, l2;
+    cpu_model(model, sizeof(model));
+    read_caches(&l1d, &l2);
 
-                            if (t < block_C[i * block_size + j]) {
-                                block_C[i * block_size + j] = t;
-                            }
-                        }
-                    }
-                }
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        struct tile_shape found;
+        if (tuning_line_matches(line, model, l1d, l2, &found) && found.block_size > 0) {
+            shape = found;
+        }
+    }
+    fclose(file);
 
-                for (int i = 0; i < block_size; i++) {
-                    for (int j = 0; j < block_size; j++) {
-                        D[i_block * block_size + i][j_block * block_size + j] = block_C[i * block_size + j];
-                    }
-                }
+    return shape;
+}
+
+// Replaces the line of this machine and kernel set, keeping every other
+// line. Written to path.tmp and renamed over path, so a reader never sees
+// half a file.
+int save_tuning(const char *path, struct tile_shape shape) {
+    char model[256];
+    size_t l1d, l2;
+    cpu_model(model, sizeof(model));
+    read_caches(&l1d, &l2);
+
+    char tmp_path[4096 + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(out, "# backend cpu_model l1d_bytes l2_bytes block_size\n");
+    } else {
+        char line[512];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            struct tile_shape old;
+            if (!tuning_line_matches(line, model, l1d, l2, &old)) {
+                fputs(line, out);
             }
         }
+        fclose(in);
+    }
+
+    fprintf(out, "%s %s %llu %llu %d %d\n", kernels.name, model, (unsigned long long)l1d,
+            (unsigned long long)l2, shape.block_size, shape.kernel_rows);
+
+    int failed = ferror(out);
+    if (fclose(out) != 0 || failed || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
     }
+    return 0;
+}
 
-    _mm_free(A);
-    _mm_free(block_B);
-    _mm_free(block_C);
+// For any r but 1, 2 and infinity the closure runs on D^r instead of D.
+// x -> x^r is increasing, so (a^r + b^r)^(1/r) < c exactly when
+// a^r + b^r < c^r: in the power domain the Minkowski combine is a plain sum
+// and the r = 1 kernels apply, with no pow in the inner loops. D is raised
+// once before the closure and the root taken once after, n^2 pow calls in
+// place of three per relaxation. Unreachable pairs stay _INFINITY.
+int power_domain(double r) {
+    return r != 1.0 && r != 2.0 && r != _INFINITY;
 }
 
-double **pathfinder_network(double **graph, int n, int q, double r) {
-    double **D = (double **)malloc(n * sizeof(double *));
+void to_power_domain(double **D, int n, double r) {
     for (int i = 0; i < n; i++) {
-        D[i] = (double *)_mm_malloc(n * sizeof(double), 32);
-        memcpy(D[i], graph[i], n * sizeof(double));
+        for (int j = 0; j < n; j++) {
+            D[i][j] = D[i][j] == _INFINITY ? INFINITY : pow(D[i][j], r);
+        }
     }
+}
 
-    const int L1_CACHE_SIZE = 32 * 1024;
-    int block_size = sqrt(L1_CACHE_SIZE / (3 * sizeof(double)));
+void from_power_domain(double **D, int n, double r) {
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            D[i][j] = isinf(D[i][j]) ? _INFINITY : pow(D[i][j], 1.0 / r);
+        }
+    }
+}
+
+// Closes D in place. The closure only ever shortens a distance, so it
+// already keeps every direct link that is a shortest path and no copy of the
+// input is needed. Without a tuned shape the tiles are sized so that three
+// of them share the L1 data cache, 32KB where sysfs does not report it.
+double **pathfinder_network(double **D, int n, int q, double r, struct tile_shape tuned) {
+    struct tile_shape shape = tuned;
+    if (shape.block_size <= 0) {
+        size_t l1d, l2;
+        read_caches(&l1d, &l2);
+        if (l1d == 0) {
+            l1d = DEFAULT_L1D_SIZE;
+        }
+        shape.block_size = sqrt(l1d / (3 * sizeof(double)));
+        shape.kernel_rows = 1;
+    }
+    int block_size = shape.block_size;
 
     block_size = (block_size / 4) * 4;
     if (block_size < 4) block_size = 4;
@@ -275,76 +834,161 @@ double **pathfinder_network(double **graph, int n, int q, double r) {
                 break;
             }
         }
+    }
+    shape.block_size = block_size;
 
-        if (n % block_size != 0) {
-            floyd_warshall(D, n, r);
-        } else {
-            blocked_floyd_warshall(D, n, block_size, r);
-        }
+    int powered = power_domain(r);
+    if (powered) {
+        to_power_domain(D, n, r);
+    }
+    double closure_r = powered ? 1.0 : r;
+
+    if (n % block_size != 0) {
+        floyd_warshall(D, n, closure_r);
     } else {
-        blocked_floyd_warshall(D, n, block_size, r);
+        blocked_floyd_warshall(D, n, shape, closure_r);
+    }
+
+    if (powered) {
+        from_power_domain(D, n, r);
     }
 
+    return D;
+}
+
+// Seconds on the monotonic clock. clock() counts CPU time in coarse steps
+// and would hide everything below a second.
+double wall_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// --tune: times the blocked closure of a sample matrix for every tile size
+// (multiples of 4 from 8 up that divide n and keep three tiles within L2)
+// with one and two rows per kernel pass, and records the fastest shape.
+int run_tune(int n, double r) {
+    size_t l1d, l2;
+    read_caches(&l1d, &l2);
+    size_t l2_limit = l2 > 0 ? l2 : DEFAULT_L2_SIZE;
+
+    printf("Sample size:\t%d\n", n);
+    printf("L1d cache:\t%zu KB\n", l1d >> 10);
+    printf("L2 cache:\t%zu KB\n", l2 >> 10);
+    printf("===============================================\n");
+    printf("TUNING\n");
+    printf("===============================================\n");
+
+    // Random direct distances in [0.05, 1.05), the same for every trial.
+    double **sample = alloc_matrix(n);
+    double **D = alloc_matrix(n);
+    int stride = matrix_stride(n);
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
     for (int i = 0; i < n; i++) {
-        int j = 0;
-        for (; j <= n - 4; j += 4) {
-            __m256d graph_vec = _mm256_loadu_pd(&graph[i][j]);
-            __m256d d_vec = _mm256_loadu_pd(&D[i][j]);
-            __m256d result_vec = _mm256_min_pd(graph_vec, d_vec);
-            _mm256_storeu_pd(&D[i][j], result_vec);
+        sample[i][i] = 0;
+        for (int j = i + 1; j < n; j++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            double distance = 0.05 + (double)(state >> 11) / (double)(1ULL << 53);
+            sample[i][j] = distance;
+            sample[j][i] = distance;
         }
+    }
 
-        for (; j < n; j++) {
-            if (graph[i][j] < D[i][j]) {
-                D[i][j] = graph[i][j];
+    struct tile_shape best = {0, 1};
+    double best_seconds = 0;
+    for (int b = 8; b <= n; b += 4) {
+        if (n % b != 0 || 3 * (size_t)b * b * sizeof(double) > l2_limit) {
+            continue;
+        }
+
+        for (int rows = 1; rows <= 2; rows++) {
+            struct tile_shape shape = {b, rows};
+            double seconds = 0;
+            for (int rep = 0; rep < 2; rep++) {
+                memcpy(D[0], sample[0], (size_t)n * stride * sizeof(double));
+                double start = wall_time();
+                // A general r runs the r = 1 kernels, see power_domain().
+                blocked_floyd_warshall(D, n, shape, power_domain(r) ? 1.0 : r);
+                double elapsed = wall_time() - start;
+                if (rep == 0 || elapsed < seconds) {
+                    seconds = elapsed;
+                }
+            }
+
+            printf("Block %d x%d:\t%.3f s\n", b, rows, seconds);
+            if (best.block_size == 0 || seconds < best_seconds) {
+                best = shape;
+                best_seconds = seconds;
             }
         }
     }
 
-    return D;
-}
-
-double cosine_similarity(double *a, double *b, int n) {
-    __m256d dot_vec = _mm256_setzero_pd();
-    __m256d norm_a_vec = _mm256_setzero_pd();
-    __m256d norm_b_vec = _mm256_setzero_pd();
+    free_matrix(sample);
+    free_matrix(D);
 
-    int i = 0;
-    for (; i <= n - 4; i += 4) {
-        __m256d a_vec = _mm256_loadu_pd(&a[i]);
-        __m256d b_vec = _mm256_loadu_pd(&b[i]);
+    if (best.block_size == 0) {
+        fprintf(stderr, "Error: no tile size divides %d\n", n);
+        return 1;
+    }
 
-        __m256d mul_vec = _mm256_mul_pd(a_vec, b_vec);
-        dot_vec = _mm256_add_pd(dot_vec, mul_vec);
+    printf("===============================================\n");
+    printf("Best block:\t%d x%d\n", best.block_size, best.kernel_rows);
 
-        __m256d a_squared = _mm256_mul_pd(a_vec, a_vec);
-        __m256d b_squared = _mm256_mul_pd(b_vec, b_vec);
-        norm_a_vec = _mm256_add_pd(norm_a_vec, a_squared);
-        norm_b_vec = _mm256_add_pd(norm_b_vec, b_squared);
+    char buffer[4096];
+    const char *path = tuning_path(buffer, sizeof(buffer));
+    if (path == NULL || save_tuning(path, best) != 0) {
+        fprintf(stderr, "Error: could not save the tuning file\n");
+        return 1;
     }
+    printf("Saved to:\t%s\n", path);
 
-    double dot_arr[4], norm_a_arr[4], norm_b_arr[4];
-    _mm256_storeu_pd(dot_arr, dot_vec);
-    _mm256_storeu_pd(norm_a_arr, norm_a_vec);
-    _mm256_storeu_pd(norm_b_arr, norm_b_vec);
+    return 0;
+}
 
-    double dot = dot_arr[0] + dot_arr[1] + dot_arr[2] + dot_arr[3];
-    double norm_a = norm_a_arr[0] + norm_a_arr[1] + norm_a_arr[2] + norm_a_arr[3];
-    double norm_b = norm_b_arr[0] + norm_b_arr[1] + norm_b_arr[2] + norm_b_arr[3];
+double cosine_similarity(double *a, double *b, int n) {
+    return kernels.cosine(a, b, n);
+}
 
-    for (; i < n; i++) {
-        dot += a[i] * b[i];
-        norm_a += a[i] * a[i];
-        norm_b += b[i] * b[i];
+// Bump-pointer storage for the token strings, which all live until exit:
+// they are packed back to back in ARENA_BLOCK_SIZE blocks instead of one
+// malloc each, and the whole arena is released with one pass over the blocks.
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+};
+
+struct arena {
+    struct arena_block *head;
+};
+
+char *arena_strdup(struct arena *arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    struct arena_block *block = arena->head;
+
+    if (block == NULL || block->size - block->used < len) {
+        size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        block = (struct arena_block *)malloc(sizeof(struct arena_block) + size);
+        block->next = arena->head;
+        block->used = 0;
+        block->size = size;
+        arena->head = block;
     }
 
-    norm_a = sqrt(norm_a);
-    norm_b = sqrt(norm_b);
-
-    if (norm_a == 0 || norm_b == 0)
-        return 0;
+    char *copy = (char *)(block + 1) + block->used;
+    memcpy(copy, s, len);
+    block->used += len;
+    return copy;
+}
 
-    return dot / (norm_a * norm_b);
+void arena_free(struct arena *arena) {
+    while (arena->head != NULL) {
+        struct arena_block *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
 }
 
 int find_index(char **array, int size, const char *word) {
@@ -360,10 +1004,10 @@ int word_exists(char **array, int size, const char *word) {
     return find_index(array, size, word) != -1;
 }
 
-int add_word(char ***array, int *size, const char *word) {
+int add_word(char ***array, int *size, char *word) {
     if (!word_exists(*array, *size, word)) {
         *array = realloc(*array, (*size + 1) * sizeof(char *));
-        (*array)[*size] = strdup(word);
+        (*array)[*size] = word;
         (*size)++;
         return 1;
     }
@@ -374,24 +1018,343 @@ int compare_strings(const void *a, const void *b) {
     return strcmp(*(const char **)a, *(const char **)b);
 }
 
-int main() {
+// Renders value exactly like printf("%f") (six decimals, round-half-even on
+// the exact binary value) without going through stdio or the locale. Values
+// of 1e12 and above, infinities and NaNs are rare and handed to sprintf, so
+// out needs room for DBL_MAX_10_EXP + 9 characters.
+int format_fixed6(char *out, double value) {
+    char *p = out;
+
+    if (signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+
+    if (!(value < 1e12)) {
+        return (int)(p - out) + sprintf(p, "%f", value);
+    }
+
+    // value = m * 2^e exactly, with m < 2^53 and e < 0 for every value below
+    // 1e12, so value * 10^6 = (m * 10^6) / 2^-e fits 128-bit arithmetic.
+    int exp;
+    double mant = frexp(value, &exp);
+    uint64_t m = (uint64_t)ldexp(mant, 53);
+    int shift = 53 - exp;
+
+    unsigned __int128 scaled = (unsigned __int128)m * 1000000;
+    uint64_t q = 0;
+    if (shift < 128) {
+        unsigned __int128 whole = scaled >> shift;
+        unsigned __int128 rem = scaled - (whole << shift);
+        unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+
+        q = (uint64_t)whole;
+        if (rem > half || (rem == half && (q & 1))) {
+            q++;
+        }
+    }
+
+    uint64_t int_part = q / 1000000;
+    uint32_t frac_part = (uint32_t)(q % 1000000);
+
+    char digits[20];
+    int len = 0;
+    do {
+        digits[len++] = (char)('0' + int_part % 10);
+        int_part /= 10;
+    } while (int_part > 0);
+    while (len > 0) {
+        *p++ = digits[--len];
+    }
+
+    *p++ = '.';
+    for (int i = 5; i >= 0; i--) {
+        p[i] = (char)('0' + frac_part % 10);
+        frac_part /= 10;
+    }
+    p += 6;
+
+    return (int)(p - out);
+}
+
+void write_all(int fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written <= 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        buffer += written;
+        length -= written;
+    }
+}
+
+// Prints every pair (i, j > i) as "%s %s %f\n". Lines are rendered
+// into one OUTPUT_BUFFER_SIZE buffer that is flushed with large write()
+// calls, so the text is identical to the printf loop it replaces.
+void write_results(char **wordSet, double **pf_net, int n) {
+    fflush(stdout);
+
+    int *word_len = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        word_len[i] = strlen(wordSet[i]);
+    }
+
+    // Missing links are _INFINITY, the most frequent slow-path value, so its
+    // text is rendered once up front.
+    char inf_text[DBL_MAX_10_EXP + 16];
+    int inf_len = format_fixed6(inf_text, _INFINITY);
+
+    char *buffer = (char *)malloc(OUTPUT_BUFFER_SIZE);
+    size_t used = 0;
+
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            // Words are shorter than the 1024-byte input buffer, so one line
+            // always fits an empty buffer.
+            if (used + word_len[i] + word_len[j] + SLOW_LINE_EXTRA
+                > OUTPUT_BUFFER_SIZE) {
+                write_all(STDOUT_FILENO, buffer, used);
+                used = 0;
+            }
+
+            char *p = buffer + used;
+            memcpy(p, wordSet[i], word_len[i]);
+            p += word_len[i];
+            *p++ = ' ';
+            memcpy(p, wordSet[j], word_len[j]);
+            p += word_len[j];
+            *p++ = ' ';
+            if (pf_net[i][j] == _INFINITY) {
+                memcpy(p, inf_text, inf_len);
+                p += inf_len;
+            } else {
+                p += format_fixed6(p, pf_net[i][j]);
+            }
+            *p++ = '\n';
+            used = p - buffer;
+        }
+    }
+
+    write_all(STDOUT_FILENO, buffer, used);
+
+    free(buffer);
+    free(word_len);
+}
+
+void format_eta(char *out, size_t size, double seconds) {
+    if (seconds < 0) {
+        snprintf(out, size, "-");
+        return;
+    }
+    long s = (long)(seconds + 0.5);
+    snprintf(out, size, "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+}
+
+// --progress SECONDS: a thread that prints the closure's telemetry every
+// interval, in the format of the OpenMP version: the round, updates per
+// second over the last interval, the ETA at the average rate, and the busy
+// and idle seconds of the closure thread. Lines go to stderr, or as JSON to
+// the --progress-file.
+struct progress_reporter {
+    double interval;
+    FILE *file;
+    long long last_updates;
+    double last_elapsed;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    int active;
+};
+
+void progress_report(struct progress_reporter *reporter) {
+    if (!atomic_load_explicit(&telemetry.running, memory_order_relaxed)) {
+        return;
+    }
+    int round = atomic_load_explicit(&telemetry.round, memory_order_relaxed);
+    int rounds = atomic_load_explicit(&telemetry.rounds, memory_order_relaxed);
+    long long updates = atomic_load_explicit(&telemetry.updates, memory_order_relaxed);
+    long long total = atomic_load_explicit(&telemetry.total_updates, memory_order_relaxed);
+    double busy = atomic_load_explicit(&telemetry.busy_ns, memory_order_relaxed) / 1e9;
+    double elapsed = (monotonic_ns()
+                      - atomic_load_explicit(&telemetry.started_ns, memory_order_relaxed)) / 1e9;
+
+    double interval = elapsed - reporter->last_elapsed;
+    double rate = interval > 0 ? (updates - reporter->last_updates) / interval : 0;
+    double average = elapsed > 0 ? updates / elapsed : 0;
+    double eta = average > 0 ? (total - updates) / average : -1;
+    double done = total > 0 ? 100.0 * updates / total : 0;
+    double idle = fmax(elapsed - busy, 0);
+    reporter->last_updates = updates;
+    reporter->last_elapsed = elapsed;
+
+    if (reporter->file == NULL) {
+        char eta_text[32];
+        format_eta(eta_text, sizeof(eta_text), eta);
+        fprintf(stderr,
+                "Progress:\tround %d/%d (%.1f%%), %.3g updates/s, ETA %s, busy/idle s: "
+                "%.1f/%.1f\n",
+                round, rounds, done, rate, eta_text, busy, idle);
+        return;
+    }
+
+    fprintf(reporter->file,
+            "{\"elapsed\":%.3f,\"round\":%d,\"rounds\":%d,\"updates\":%lld,"
+            "\"total_updates\":%lld,\"updates_per_s\":%.1f,\"eta\":%.1f,"
+            "\"busy\":[%.3f],\"idle\":[%.3f]}\n",
+            elapsed, round, rounds, updates, total, rate, eta, busy, idle);
+    fflush(reporter->file);
+}
+
+void *progress_thread(void *arg) {
+    struct progress_reporter *reporter = (struct progress_reporter *)arg;
+
+    pthread_mutex_lock(&reporter->lock);
+    while (!reporter->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        double seconds = deadline.tv_nsec / 1e9 + reporter->interval;
+        deadline.tv_sec += (time_t)seconds;
+        deadline.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+
+        while (!reporter->stop
+               && pthread_cond_timedwait(&reporter->wake, &reporter->lock, &deadline) == 0) {
+        }
+        if (reporter->stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&reporter->lock);
+        progress_report(reporter);
+        pthread_mutex_lock(&reporter->lock);
+    }
+    pthread_mutex_unlock(&reporter->lock);
+
+    return NULL;
+}
+
+void progress_start(struct progress_reporter *reporter, double interval, const char *path) {
+    memset(reporter, 0, sizeof(*reporter));
+    if (interval <= 0) {
+        return;
+    }
+
+    if (path != NULL) {
+        reporter->file = fopen(path, "a");
+        if (reporter->file == NULL) {
+            fprintf(stderr, "Warning: cannot open progress file %s, using stderr\n", path);
+        }
+    }
+    reporter->interval = interval;
+    pthread_mutex_init(&reporter->lock, NULL);
+    pthread_cond_init(&reporter->wake, NULL);
+    reporter->active = pthread_create(&reporter->thread, NULL, progress_thread, reporter) == 0;
+}
+
+void progress_stop(struct progress_reporter *reporter) {
+    if (reporter->active) {
+        pthread_mutex_lock(&reporter->lock);
+        reporter->stop = 1;
+        pthread_cond_signal(&reporter->wake);
+        pthread_mutex_unlock(&reporter->lock);
+        pthread_join(reporter->thread, NULL);
+        pthread_mutex_destroy(&reporter->lock);
+        pthread_cond_destroy(&reporter->wake);
+    }
+    if (reporter->file != NULL) {
+        fclose(reporter->file);
+    }
+}
+
+// Per-phase wall times of one run.
+struct phase_times {
+    double word_set;
+    double graph;
+    double similarity;
+    double pathfinder;
+    double output;
+    double total;
+};
+
+// Appends one JSON object per run to path, with the fields of the other
+// backends' --stats plus the kernel set.
+void write_stats(const char *path, const struct phase_times *times,
+                 int text_size, int unique_words) {
+    FILE *file = fopen(path, "a");
+    if (file == NULL) {
+        fprintf(stderr, "Warning: cannot open stats file %s\n", path);
+        return;
+    }
+
+    fprintf(file,
+            "{\"backend\":\"avx2\",\"kernels\":\"%s\",\"threads\":1,"
+            "\"text_size\":%d,\"unique_words\":%d,\"word_set\":%.6f,"
+            "\"graph\":%.6f,\"similarity\":%.6f,\"pathfinder\":%.6f,"
+            "\"output\":%.6f,\"total\":%.6f}\n",
+            kernels.name, text_size, unique_words, times->word_set, times->graph,
+            times->similarity, times->pathfinder, times->output, times->total);
+    fclose(file);
+}
+
+int main(int argc, char **argv) {
+    // const double r = 1;
+    // const double r = 2;
+    const double r = _INFINITY;
+
     printf("===============================================\n");
-    printf("PATHFINDER NETWORK (AVX2 Only)\n");
+    printf("PATHFINDER NETWORK (SIMD)\n");
     printf("===============================================\n");
 
+    select_kernels();
+    printf("Kernels:\t%s\n", kernels.name);
+
+    int tune = 0;
+    int tune_size = TUNE_DEFAULT_SIZE;
+    const char *stats_path = NULL;
+    double progress_interval = 0;
+    const char *progress_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--tune") == 0) {
+            tune = 1;
+        } else if (strcmp(argv[i], "--tune-size") == 0 && i + 1 < argc) {
+            tune_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--progress") == 0 && i + 1 < argc) {
+            progress_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--progress-file") == 0 && i + 1 < argc) {
+            progress_path = argv[++i];
+        }
+    }
+    if (tune) {
+        return run_tune(tune_size, r);
+    }
+
+    struct tile_shape tuned = load_tuning();
+    if (tuned.block_size > 0) {
+        printf("Tuned block:\t%d x%d\n", tuned.block_size, tuned.kernel_rows);
+    }
+
     char buffer[1024];
     char **text = NULL;
     int text_size = 0;
+    int text_capacity = 0;
+    struct arena strings = {NULL};
 
     while (scanf("%s", buffer) == 1) {
-        text = realloc(text, (text_size + 1) * sizeof(char *));
-        text[text_size] = strdup(buffer);
+        if (text_size == text_capacity) {
+            text_capacity = text_capacity > 0 ? 2 * text_capacity : 1024;
+            text = realloc(text, text_capacity * sizeof(char *));
+        }
+        text[text_size] = arena_strdup(&strings, buffer);
         text_size++;
     }
 
     printf("Text size:\t%d\n", text_size);
 
-    clock_t start_time = clock();
+    struct phase_times times;
+    double start_time = wall_time();
 
     char **wordSet = NULL;
     int wordSetSize = 0;
@@ -404,15 +1367,14 @@ int main() {
 
     printf("Unique words:\t%d\n", wordSetSize);
 
-    clock_t wordset_time = clock();
-    printf("Word Set:\t%.2f s\n",
-           (double)(wordset_time - start_time) / CLOCKS_PER_SEC);
+    double wordset_time = wall_time();
+    times.word_set = wordset_time - start_time;
+    printf("Word Set:\t%.2f s\n", times.word_set);
 
     int n = wordSetSize;
 
-    double **graph = (double **)malloc(n * sizeof(double *));
+    double **graph = alloc_matrix(n);
     for (int i = 0; i < n; i++) {
-        graph[i] = (double *)_mm_malloc(n * sizeof(double), 32);
         memset(graph[i], 0, n * sizeof(double));
     }
 
@@ -430,13 +1392,12 @@ int main() {
         }
     }
 
-    clock_t graph_time = clock();
-    printf("Graph Init:\t%.2f s\n",
-           (double)(graph_time - wordset_time) / CLOCKS_PER_SEC);
+    double graph_time = wall_time();
+    times.graph = graph_time - wordset_time;
+    printf("Graph Init:\t%.2f s\n", times.graph);
 
-    double **D = (double **)malloc(n * sizeof(double *));
+    double **D = alloc_matrix(n);
     for (int i = 0; i < n; i++) {
-        D[i] = (double *)_mm_malloc(n * sizeof(double), 32);
         for (int j = 0; j < n; j++) {
             D[i][j] = (i == j) ? 0 : _INFINITY;
         }
@@ -456,50 +1417,45 @@ int main() {
         }
     }
 
-    clock_t similarity_time = clock();
-    printf("Similarity:\t%.2f s\n",
-           (double)(similarity_time - graph_time) / CLOCKS_PER_SEC);
+    // The co-occurrence counts are not needed past this point, so the closure
+    // runs with a single n x n matrix.
+    free_matrix(graph);
+
+    double similarity_time = wall_time();
+    times.similarity = similarity_time - graph_time;
+    printf("Similarity:\t%.2f s\n", times.similarity);
 
     const int q = n - 1;
-    // const double r = 1;
-    // const double r = 2;
-    const double r = _INFINITY;
 
-    double **pf_net = pathfinder_network(D, n, q, r);
+    struct progress_reporter reporter;
+    progress_start(&reporter, progress_interval, progress_path);
+    double **pf_net = pathfinder_network(D, n, q, r, tuned);
+    atomic_store_explicit(&telemetry.running, 0, memory_order_relaxed);
+    progress_stop(&reporter);
 
-    clock_t pf_time = clock();
-    printf("Pathfinder:\t%.2f s\n",
-           (double)(pf_time - similarity_time) / CLOCKS_PER_SEC);
-    printf("Total:\t%.2f s\n",
-           (double)(pf_time - start_time) / CLOCKS_PER_SEC);
+    double pf_time = wall_time();
+    times.pathfinder = pf_time - similarity_time;
+    printf("Pathfinder:\t%.2f s\n", times.pathfinder);
+    printf("Total:\t%.2f s\n", pf_time - start_time);
     printf("===============================================\n");
     printf("RESULT\n");
     printf("===============================================\n");
 
-    for (int i = 0; i < n; i++) {
-        for (int j = i + 1; j < n; j++) {
-            printf("%s %s %f\n", wordSet[i], wordSet[j], pf_net[i][j]);
-        }
-    }
+    write_results(wordSet, pf_net, n);
 
-    for (int i = 0; i < text_size; i++) {
-        free(text[i]);
+    if (stats_path != NULL) {
+        times.output = wall_time() - pf_time;
+        times.total = wall_time() - start_time;
+        write_stats(stats_path, &times, text_size, wordSetSize);
     }
-    free(text);
 
-    for (int i = 0; i < wordSetSize; i++) {
-        free(wordSet[i]);
-    }
+    // The words point into the token strings, so one release frees both.
+    free(text);
     free(wordSet);
+    arena_free(&strings);
 
-    for (int i = 0; i < n; i++) {
-        _mm_free(graph[i]);
-        _mm_free(D[i]);
-        _mm_free(pf_net[i]);
-    }
-    free(graph);
-    free(D);
-    free(pf_net);
+    // The closure ran in place, so pf_net is D.
+    free_matrix(pf_net);
 
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,6 @@
 echo "Creating compiled code..."
 
-gcc -mavx2 -O2 avx2.c -o avx2 -lm -mfma
+gcc -O2 avx2.c -o avx2 -pthread -lm
 
 if ($LASTEXITCODE -ne 0) {
     Write-Host "Error: Compilation failed."
@@ -0,0 +1,217 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Synthetic text for scaling tests. Word frequencies follow a Zipf law, and
+// the text runs through topics that each rank the vocabulary in their own
+// order, so the words at the head of a topic co-occur. The same options and
+// seed always give the same text.
+
+#define DEFAULT_TOKENS 100000
+#define DEFAULT_VOCAB 5000
+#define DEFAULT_ZIPF 1.0
+#define DEFAULT_TOPICS 10
+#define DEFAULT_TOPIC_LENGTH 100
+#define DEFAULT_TOPIC_SHARE 0.5
+#define DEFAULT_SEED 1
+
+struct options {
+    long tokens;
+    int vocab;
+    double zipf;
+    int topics;
+    double topic_length;
+    double topic_share;
+    uint64_t seed;
+};
+
+void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [--tokens N] [--vocab V] [--zipf S] [--topics T] "
+            "[--topic-length L] [--topic-share P] [--seed X] > corpus.txt\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+void parse_options(int argc, char **argv, struct options *opts)
+{
+    opts->tokens = DEFAULT_TOKENS;
+    opts->vocab = DEFAULT_VOCAB;
+    opts->zipf = DEFAULT_ZIPF;
+    opts->topics = DEFAULT_TOPICS;
+    opts->topic_length = DEFAULT_TOPIC_LENGTH;
+    opts->topic_share = DEFAULT_TOPIC_SHARE;
+    opts->seed = DEFAULT_SEED;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        if (strcmp(argv[i], "--tokens") == 0) {
+            opts->tokens = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--vocab") == 0) {
+            opts->vocab = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--zipf") == 0) {
+            opts->zipf = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--topics") == 0) {
+            opts->topics = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--topic-length") == 0) {
+            opts->topic_length = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--topic-share") == 0) {
+            opts->topic_share = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            opts->seed = strtoull(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (opts->tokens < 0 || opts->vocab < 1 || opts->zipf < 0 || opts->topics < 0
+        || opts->topic_length < 1 || opts->topic_share < 0 || opts->topic_share > 1) {
+        fprintf(stderr, "Error: --tokens must be >= 0, --vocab >= 1, --zipf >= 0, "
+                        "--topics >= 0, --topic-length >= 1 and --topic-share in [0, 1]\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// splitmix64: small, fast, and plenty for sampling words.
+uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1).
+double next_uniform(uint64_t *state)
+{
+    return (next_random(state) >> 11) * 0x1.0p-53;
+}
+
+uint64_t gcd(uint64_t a, uint64_t b)
+{
+    while (b != 0) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// cdf[k] is the probability of the ranks 0..k, with rank k weighted
+// 1 / (k + 1)^s.
+double *zipf_cdf(int vocab, double s)
+{
+    double *cdf = (double *)malloc(vocab * sizeof(double));
+    if (cdf == NULL) {
+        return NULL;
+    }
+
+    double sum = 0;
+    for (int k = 0; k < vocab; k++) {
+        sum += pow(k + 1, -s);
+        cdf[k] = sum;
+    }
+    for (int k = 0; k < vocab; k++) {
+        cdf[k] /= sum;
+    }
+    return cdf;
+}
+
+// The first rank whose cumulative probability exceeds u.
+int sample_rank(const double *cdf, int vocab, double u)
+{
+    int lo = 0;
+    int hi = vocab - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cdf[mid] > u) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+// Word i is i written in base 80, one consonant-vowel syllable per digit
+// and at least two syllables, so every word is distinct and pronounceable.
+void word_name(int index, char *out)
+{
+    static const char consonants[] = "bdfghjklmnprstvz";
+    static const char vowels[] = "aeiou";
+    int digits[8];
+    int n = 0;
+
+    do {
+        digits[n++] = index % 80;
+        index /= 80;
+    } while (index > 0 || n < 2);
+
+    for (int d = n - 1; d >= 0; d--) {
+        *out++ = consonants[digits[d] / 5];
+        *out++ = vowels[digits[d] % 5];
+    }
+    *out = '\0';
+}
+
+int main(int argc, char **argv)
+{
+    struct options opts;
+    parse_options(argc, argv, &opts);
+
+    double *cdf = zipf_cdf(opts.vocab, opts.zipf);
+    if (cdf == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    // Topic t ranks the vocabulary by rank * stride + offset (mod vocab),
+    // with the stride coprime to it, so every topic is a permutation and its
+    // frequent words differ from the background's. The background (no
+    // topic) ranks the words in order.
+    uint64_t state = opts.seed;
+    uint64_t *strides = (uint64_t *)malloc((opts.topics > 0 ? opts.topics : 1) * sizeof(uint64_t));
+    uint64_t *offsets = (uint64_t *)malloc((opts.topics > 0 ? opts.topics : 1) * sizeof(uint64_t));
+    if (strides == NULL || offsets == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+    for (int t = 0; t < opts.topics; t++) {
+        do {
+            strides[t] = 1 + next_random(&state) % (opts.vocab > 1 ? opts.vocab - 1 : 1);
+        } while (gcd(strides[t], opts.vocab) != 1);
+        offsets[t] = next_random(&state) % opts.vocab;
+    }
+
+    // Topics last topic_length tokens on average: after every token the
+    // text moves to a random topic with probability 1 / topic_length.
+    int topic = opts.topics > 0 ? (int)(next_random(&state) % opts.topics) : -1;
+    char word[32];
+
+    for (long i = 0; i < opts.tokens; i++) {
+        if (opts.topics > 0 && next_uniform(&state) < 1 / opts.topic_length) {
+            topic = (int)(next_random(&state) % opts.topics);
+        }
+
+        uint64_t rank = sample_rank(cdf, opts.vocab, next_uniform(&state));
+        int index = (int)rank;
+        if (topic >= 0 && next_uniform(&state) < opts.topic_share) {
+            index = (int)((rank * strides[topic] + offsets[topic]) % opts.vocab);
+        }
+
+        word_name(index, word);
+        fputs(word, stdout);
+        putchar(' ');
+    }
+    putchar('\n');
+
+    free(cdf);
+    free(strides);
+    free(offsets);
+    return fflush(stdout) == 0 ? 0 : 1;
+}
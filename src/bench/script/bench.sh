@@ -0,0 +1,161 @@
+#!/bin/bash
+
+# Per-phase benchmark of the serial, AVX2 and OpenMP pipelines.
+#
+# Usage: ./script/bench.sh <input> [input ...]
+#
+# Environment:
+#   BACKENDS  backends to run (default "serial avx2 openmp")
+#   WARMUP    untimed runs per input and backend (default 1)
+#   REPS      timed runs per input and backend (default 5)
+#   OUT_DIR   where binaries, raw stats and the summary are written
+#             (default results)
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <input> [input ...]"
+    exit 1
+fi
+
+BACKENDS=${BACKENDS:-"serial avx2 openmp"}
+WARMUP=${WARMUP:-1}
+REPS=${REPS:-5}
+OUT_DIR=${OUT_DIR:-results}
+
+mkdir -p "$OUT_DIR/bin"
+
+# Every backend is built with the same optimization level, so the numbers
+# compare the code and not the flags of each setup script.
+build() {
+    local backend=$1
+
+    echo "Compiling $backend..."
+    case $backend in
+    serial) gcc -O2 ../serial/main.c -o "$OUT_DIR/bin/serial" -lm ;;
+    avx2) gcc -O2 ../avx2/avx2.c -o "$OUT_DIR/bin/avx2" -pthread -lm ;;
+    openmp) gcc -O2 ../openmp/mp.c ../openmp/pfnet.c -o "$OUT_DIR/bin/openmp" -fopenmp -pthread -lm ;;
+    *)
+        echo "Error: unknown backend $backend."
+        exit 1
+        ;;
+    esac
+    if [ $? -ne 0 ]; then
+        echo "Error: Compilation failed."
+        exit 1
+    fi
+}
+
+# One run with --stats; the JSON line it appends gets the input name.
+run_once() {
+    local backend=$1
+    local input=$2
+    local stats=$3
+
+    rm -f "$OUT_DIR/run.jsonl"
+    "$OUT_DIR/bin/$backend" --stats "$OUT_DIR/run.jsonl" <"$input" >/dev/null
+    if [ $? -ne 0 ] || [ ! -s "$OUT_DIR/run.jsonl" ]; then
+        echo "Error: run failed ($backend on $input)."
+        exit 1
+    fi
+    sed "s|^{|{\"input\":\"$input\",|" "$OUT_DIR/run.jsonl" >>"$stats"
+}
+
+for input in "$@"; do
+    if [ ! -f "$input" ]; then
+        echo "Error: input $input does not exist."
+        exit 1
+    fi
+done
+
+for backend in $BACKENDS; do
+    build "$backend"
+done
+
+rm -f "$OUT_DIR/runs.jsonl"
+for input in "$@"; do
+    for backend in $BACKENDS; do
+        for rep in $(seq 1 "$WARMUP"); do
+            echo "[$backend] $input warmup $rep"
+            run_once "$backend" "$input" /dev/null
+        done
+        for rep in $(seq 1 "$REPS"); do
+            echo "[$backend] $input rep $rep"
+            run_once "$backend" "$input" "$OUT_DIR/runs.jsonl"
+        done
+    done
+done
+rm -f "$OUT_DIR/run.jsonl"
+
+# Median, mean, sample standard deviation, minimum and maximum of every
+# phase per (backend, input), and throughput from the medians:
+#   tokens_per_s        text size over the total time
+#   pairs_per_s         word pairs i < j over the similarity time
+#   cell_updates_per_s  n^3 closure updates over the pathfinder time
+#   gflops              2 n^3 / pathfinder / 1e9, one combine and one compare
+#                       per update, whatever r costs in the backend
+awk -v json="$OUT_DIR/summary.json" '
+    BEGIN {
+        n_phases = split("word_set graph similarity pathfinder output total", phases, " ")
+    }
+    {
+        n = split($0, kv, /[{}":,]+/)
+        delete row
+        for (i = 2; i < n; i += 2) {
+            row[kv[i]] = kv[i + 1]
+        }
+        key = row["backend"] SUBSEP row["input"]
+        if (!(key in count)) {
+            order[++keys] = key
+            backend[key] = row["backend"]
+            input[key] = row["input"]
+            threads[key] = row["threads"]
+            text_size[key] = row["text_size"]
+            words[key] = row["unique_words"]
+        }
+        c = ++count[key]
+        for (p = 1; p <= n_phases; p++) {
+            value[key, phases[p], c] = row[phases[p]]
+        }
+    }
+    END {
+        printf "[\n" > json
+        printf "%-8s %-32s %8s %12s %12s %12s %10s\n", "backend", "input", "words",
+               "total_s", "pathfinder_s", "pf_stddev_s", "gflops"
+        for (k = 1; k <= keys; k++) {
+            key = order[k]
+            c = count[key]
+            printf "  {\"backend\": \"%s\", \"input\": \"%s\", \"threads\": %d, \"text_size\": %d, \"unique_words\": %d, \"reps\": %d", backend[key], input[key], threads[key], text_size[key], words[key], c > json
+
+            for (p = 1; p <= n_phases; p++) {
+                phase = phases[p]
+                # Insertion sort: repetitions are few.
+                sum = 0
+                for (i = 1; i <= c; i++) {
+                    v = value[key, phase, i] + 0
+                    sum += v
+                    for (j = i - 1; j >= 1 && sorted[j] > v; j--) {
+                        sorted[j + 1] = sorted[j]
+                    }
+                    sorted[j + 1] = v
+                }
+                mean = sum / c
+                squares = 0
+                for (i = 1; i <= c; i++) {
+                    squares += (sorted[i] - mean) ^ 2
+                }
+                median[phase] = (c % 2) ? sorted[(c + 1) / 2] : (sorted[c / 2] + sorted[c / 2 + 1]) / 2
+                stddev[phase] = c > 1 ? sqrt(squares / (c - 1)) : 0
+                printf ", \"%s\": {\"median\": %.6f, \"mean\": %.6f, \"stddev\": %.6f, \"min\": %.6f, \"max\": %.6f}", phase, median[phase], mean, stddev[phase], sorted[1], sorted[c] > json
+            }
+
+            n = words[key]
+            cells = n * n * n
+            tokens_per_s = median["total"] > 0 ? text_size[key] / median["total"] : 0
+            pairs_per_s = median["similarity"] > 0 ? n * (n - 1) / 2 / median["similarity"] : 0
+            updates_per_s = median["pathfinder"] > 0 ? cells / median["pathfinder"] : 0
+            printf ", \"tokens_per_s\": %.1f, \"pairs_per_s\": %.1f, \"cell_updates_per_s\": %.1f, \"gflops\": %.4f}%s\n", tokens_per_s, pairs_per_s, updates_per_s, 2 * updates_per_s / 1e9, (k < keys) ? "," : "" > json
+            printf "%-8s %-32s %8d %12.6f %12.6f %12.6f %10.4f\n", backend[key], input[key], n, median["total"], median["pathfinder"], stddev["pathfinder"], 2 * updates_per_s / 1e9
+        }
+        printf "]\n" > json
+    }' "$OUT_DIR/runs.jsonl"
+
+echo "Benchmark completed. Runs saved to $OUT_DIR/runs.jsonl, summary to $OUT_DIR/summary.json."
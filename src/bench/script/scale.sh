@@ -0,0 +1,142 @@
+#!/bin/bash
+
+# Scaling sweep over synthetic corpora: writes one corpus per vocabulary
+# size and text length with corpus.c, runs bench.sh over all of them and
+# fits how every phase grows with n and with the text length.
+#
+# Usage: ./script/scale.sh
+#
+# Environment:
+#   VOCABS    vocabulary sizes (default "250 500 1000")
+#   TOKENS    text lengths in tokens (default "10000 40000 160000")
+#   ZIPF      Zipf exponent (default 1.0)
+#   TOPICS    topics, 0 for plain Zipf text (default 10)
+#   SEED      generator seed (default 1)
+#   BACKENDS, WARMUP, REPS
+#             passed to bench.sh
+#   OUT_DIR   where corpora, runs and fits are written
+#             (default results/scaling)
+
+VOCABS=${VOCABS:-"250 500 1000"}
+TOKENS=${TOKENS:-"10000 40000 160000"}
+ZIPF=${ZIPF:-1.0}
+TOPICS=${TOPICS:-10}
+SEED=${SEED:-1}
+OUT_DIR=${OUT_DIR:-results/scaling}
+
+mkdir -p "$OUT_DIR/bin" "$OUT_DIR/corpora"
+
+echo "Compiling corpus..."
+gcc -O2 corpus.c -o "$OUT_DIR/bin/corpus" -lm
+if [ $? -ne 0 ]; then
+    echo "Error: Compilation failed."
+    exit 1
+fi
+
+# The vocabulary size is the upper bound on n: a short text does not draw
+# every word of the Zipf tail, so the fits use the n each run reports.
+inputs=()
+for vocab in $VOCABS; do
+    for tokens in $TOKENS; do
+        corpus="$OUT_DIR/corpora/v${vocab}_t${tokens}.txt"
+        echo "Generating $corpus..."
+        "$OUT_DIR/bin/corpus" --tokens "$tokens" --vocab "$vocab" --zipf "$ZIPF" \
+            --topics "$TOPICS" --seed "$SEED" >"$corpus"
+        if [ $? -ne 0 ]; then
+            echo "Error: corpus generation failed."
+            exit 1
+        fi
+        inputs+=("$corpus")
+    done
+done
+
+OUT_DIR="$OUT_DIR" ./script/bench.sh "${inputs[@]}" || exit 1
+
+# scaling.csv has the median of every phase per backend and corpus.
+# exponents.csv has, per backend and phase, the slope of log(time) against
+# log(n) among corpora of the same text length, and against log(tokens)
+# among corpora of the same vocabulary size. Each is one least-squares fit
+# over all groups, with every group centered on its own mean, so a slope of
+# 3 means the phase grows as n^3. Phases that round to zero are left out.
+awk -v csv="$OUT_DIR/scaling.csv" -v fits="$OUT_DIR/exponents.csv" '
+    BEGIN {
+        n_phases = split("word_set graph similarity pathfinder output total", phases, " ")
+        printf "backend,vocab,tokens,unique_words" > csv
+        for (p = 1; p <= n_phases; p++) {
+            printf ",%s", phases[p] > csv
+        }
+        printf "\n" > csv
+    }
+    /^  {/ {
+        n = split($0, kv, /[{}":, ]+/)
+        delete row
+        for (i = 2; i < n; i++) {
+            if (kv[i] == "median") {
+                row[kv[i - 1]] = kv[i + 1]
+            } else if (!(kv[i] in row)) {
+                row[kv[i]] = kv[i + 1]
+            }
+        }
+        match(row["input"], /v[0-9]+_t/)
+        vocab = substr(row["input"], RSTART + 1, RLENGTH - 3)
+
+        printf "%s,%d,%d,%d", row["backend"], vocab, row["text_size"], row["unique_words"] > csv
+        for (p = 1; p <= n_phases; p++) {
+            printf ",%s", row[phases[p]] > csv
+        }
+        printf "\n" > csv
+
+        b = row["backend"]
+        if (!(b in seen)) {
+            seen[b] = 1
+            backends[++n_backends] = b
+        }
+        m = ++points
+        backend_of[m] = b
+        x_n[m] = log(row["unique_words"])
+        x_t[m] = log(row["text_size"])
+        by_n[m] = b SUBSEP row["text_size"]
+        by_t[m] = b SUBSEP vocab
+        for (p = 1; p <= n_phases; p++) {
+            y[m, phases[p]] = row[phases[p]] + 0
+        }
+    }
+    # Slope of y against x, pooled over groups: sum (x - mean_g x)(y - mean_g y)
+    # over sum (x - mean_g x)^2.
+    function slope(b, phase, x, group,    m, g, sx, sy, k, num, den, dx) {
+        delete sx
+        delete sy
+        delete k
+        for (m = 1; m <= points; m++) {
+            if (backend_of[m] == b && y[m, phase] > 0) {
+                g = group[m]
+                sx[g] += x[m]
+                sy[g] += log(y[m, phase])
+                k[g]++
+            }
+        }
+        num = den = 0
+        for (m = 1; m <= points; m++) {
+            if (backend_of[m] == b && y[m, phase] > 0) {
+                g = group[m]
+                dx = x[m] - sx[g] / k[g]
+                num += dx * (log(y[m, phase]) - sy[g] / k[g])
+                den += dx * dx
+            }
+        }
+        return den > 0 ? sprintf("%.2f", num / den) : "-"
+    }
+    END {
+        printf "backend,phase,exponent_n,exponent_tokens\n" > fits
+        printf "\n%-8s %-12s %12s %16s\n", "backend", "phase", "time ~ n^", "time ~ tokens^"
+        for (i = 1; i <= n_backends; i++) {
+            for (p = 1; p <= n_phases; p++) {
+                en = slope(backends[i], phases[p], x_n, by_n)
+                et = slope(backends[i], phases[p], x_t, by_t)
+                printf "%s,%s,%s,%s\n", backends[i], phases[p], en, et > fits
+                printf "%-8s %-12s %12s %16s\n", backends[i], phases[p], en, et
+            }
+        }
+    }' "$OUT_DIR/summary.json"
+
+echo "Scaling completed. Medians saved to $OUT_DIR/scaling.csv, fits to $OUT_DIR/exponents.csv."
@@ -9,6 +9,7 @@
 const double _INFINITY = DBL_MAX;
 const int _MAX_DISTANCE = 5;
 const int BLOCK_SIZE = 64;
+const size_t ARENA_BLOCK_SIZE = 1 << 20;
 
 void cudaCheckError() {
     cudaError_t e = cudaGetLastError();
@@ -124,6 +125,46 @@ void floyd_warshall_cuda(double *D, int n, double r) {
     cudaCheckError();
 }
 
+// Bump-pointer storage for the token strings, which all live until exit:
+// they are packed back to back in ARENA_BLOCK_SIZE blocks instead of one
+// malloc each, and the whole arena is released with one pass over the blocks.
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+};
+
+struct arena {
+    struct arena_block *head;
+};
+
+char *arena_strdup(struct arena *arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    struct arena_block *block = arena->head;
+
+    if (block == NULL || block->size - block->used < len) {
+        size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        block = (struct arena_block *)malloc(sizeof(struct arena_block) + size);
+        block->next = arena->head;
+        block->used = 0;
+        block->size = size;
+        arena->head = block;
+    }
+
+    char *copy = (char *)(block + 1) + block->used;
+    memcpy(copy, s, len);
+    block->used += len;
+    return copy;
+}
+
+void arena_free(struct arena *arena) {
+    while (arena->head != NULL) {
+        struct arena_block *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
 int find_index(char **array, int size, const char *word) {
     for (int i = 0; i < size; i++) {
         if (strcmp(array[i], word) == 0) {
@@ -137,10 +178,10 @@ int word_exists(char **array, int size, const char *word) {
     return find_index(array, size, word) != -1;
 }
 
-int add_word(char ***array, int *size, const char *word) {
+int add_word(char ***array, int *size, char *word) {
     if (!word_exists(*array, *size, word)) {
         *array = (char **)realloc(*array, (*size + 1) * sizeof(char *));
-        (*array)[*size] = strdup(word);
+        (*array)[*size] = word;
         (*size)++;
         return 1;
     }
@@ -161,10 +202,15 @@ int main() {
     char buffer[1024];
     char **text = NULL;
     int text_size = 0;
+    int text_capacity = 0;
+    struct arena strings = {NULL};
 
     while (scanf("%s", buffer) == 1) {
-        text = (char **)realloc(text, (text_size + 1) * sizeof(char *));
-        text[text_size] = strdup(buffer);
+        if (text_size == text_capacity) {
+            text_capacity = text_capacity > 0 ? 2 * text_capacity : 1024;
+            text = (char **)realloc(text, text_capacity * sizeof(char *));
+        }
+        text[text_size] = arena_strdup(&strings, buffer);
         text_size++;
     }
 
@@ -272,15 +318,10 @@ int main() {
         }
     }
 
-    for (int i = 0; i < text_size; i++) {
-        free(text[i]);
-    }
+    // The words point into the token strings, so one release frees both.
     free(text);
-
-    for (int i = 0; i < wordSetSize; i++) {
-        free(wordSet[i]);
-    }
     free(wordSet);
+    arena_free(&strings);
 
     free(graph);
     free(D);
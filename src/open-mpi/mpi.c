@@ -1,14 +1,387 @@
+#include <fcntl.h>
 #include <float.h>
+#include <limits.h>
 #include <math.h>
 #include <mpi.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define MATRIX_ALIGNMENT 64
+#define OUTPUT_BUFFER_SIZE (1 << 22)
+// Bytes a result line needs beyond its two words: two separators, the
+// newline and the value, which is up to DBL_MAX_10_EXP + 9 characters.
+#define SLOW_LINE_EXTRA (DBL_MAX_10_EXP + 12)
 
 const double _INFINITY = DBL_MAX;
 const int _MAX_DISTANCE = 5;
 
+// Every n x n matrix is a single MATRIX_ALIGNMENT-aligned allocation with rows
+// padded to a multiple of 8 doubles, the layout shared by all backends. A
+// range of rows is one contiguous buffer, so it travels in a single message.
+int matrix_stride(int n) {
+  int per_line = MATRIX_ALIGNMENT / sizeof(double);
+  return (n + per_line - 1) / per_line * per_line;
+}
+
+double **alloc_matrix(int n) {
+  size_t stride = matrix_stride(n);
+  size_t bytes = (size_t)n * stride * sizeof(double);
+  double **M = (double **)malloc((n > 0 ? n : 1) * sizeof(double *));
+
+  M[0] = (double *)aligned_alloc(MATRIX_ALIGNMENT,
+                                 bytes > 0 ? bytes : MATRIX_ALIGNMENT);
+  for (int i = 1; i < n; i++) {
+    M[i] = M[0] + i * stride;
+  }
+
+  return M;
+}
+
+void free_matrix(double **M) {
+  if (M != NULL) {
+    free(M[0]);
+    free(M);
+  }
+}
+
+// Largest number of padded rows that fits one MPI message.
+int rows_per_message(int n) {
+  return INT_MAX / (matrix_stride(n) > 0 ? matrix_stride(n) : 1);
+}
+
+#define RESULT_MAGIC "PFNETB1"
+#define RESULT_MATRIX 0
+#define RESULT_EDGES 1
+
+#define CHECKPOINT_MAGIC "PFCKPT1"
+#define CHECKPOINT_DEFAULT_INTERVAL 60.0
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+// What the result lists: every pair with its closure distance, only the
+// retained PFNET links, or the links as one adjacency line per word.
+enum output_mode { OUTPUT_PAIRS, OUTPUT_EDGES, OUTPUT_ADJACENCY };
+
+struct options {
+  const char *output_path;
+  const char *stats_path;
+  const char *checkpoint_path;
+  double checkpoint_interval;
+  int resume;
+  enum output_mode output_mode;
+  const char *binary_path;
+  double progress_interval;
+  const char *progress_path;
+};
+
+void parse_options(int argc, char **argv, struct options *opts) {
+  opts->output_path = NULL;
+  opts->stats_path = NULL;
+  opts->checkpoint_path = NULL;
+  opts->checkpoint_interval = CHECKPOINT_DEFAULT_INTERVAL;
+  opts->resume = 0;
+  opts->output_mode = OUTPUT_PAIRS;
+  opts->binary_path = NULL;
+  opts->progress_interval = 0;
+  opts->progress_path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) &&
+        i + 1 < argc) {
+      opts->output_path = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+      opts->stats_path = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      opts->checkpoint_path = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc) {
+      opts->checkpoint_interval = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--resume") == 0) {
+      opts->resume = 1;
+    } else if (strcmp(argv[i], "--edges") == 0) {
+      opts->output_mode = OUTPUT_EDGES;
+    } else if (strcmp(argv[i], "--adjacency") == 0) {
+      opts->output_mode = OUTPUT_ADJACENCY;
+    } else if (strcmp(argv[i], "--binary") == 0 && i + 1 < argc) {
+      opts->binary_path = argv[++i];
+    } else if (strcmp(argv[i], "--progress") == 0 && i + 1 < argc) {
+      opts->progress_interval = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--progress-file") == 0 && i + 1 < argc) {
+      opts->progress_path = argv[++i];
+    }
+  }
+
+  if (opts->resume && opts->checkpoint_path == NULL) {
+    opts->checkpoint_path = "pfnet.ckpt";
+  }
+}
+
+// Binary result layout (see --binary). All fields are little-endian and
+// every section starts on an 8-byte boundary, so a reader can mmap the file
+// and index it in place:
+//   struct result_header
+//   vocabulary: uint64_t offsets[n + 1] into the string pool that follows,
+//     then the NUL-terminated words in sorted order, padded to 8 bytes
+//   RESULT_MATRIX: the closure distances of the pairs i < j row by row, as
+//     doubles, pair (i, j) at i * n - i * (i + 1) / 2 + j - i - 1
+//   RESULT_EDGES: uint64_t row_offsets[n + 1], then one struct result_edge
+//     per PFNET link i < j, grouped by i and sorted by j
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the binary result format is written in host byte order"
+#endif
+
+struct result_header {
+  char magic[8];
+  uint32_t kind;
+  uint32_t reserved;
+  uint64_t n;
+  uint64_t vocab_offset;
+  uint64_t data_offset;
+  uint64_t data_count;
+  uint64_t file_size;
+};
+
+struct result_edge {
+  uint32_t i;
+  uint32_t j;
+  double weight;
+};
+
+// On-disk layout: this header followed by the n * n matrix, row-major. The
+// matrix is closed over the intermediates 0 .. next_k - 1, so checkpoints of
+// the blocked OpenMP engine can be continued here as well.
+struct checkpoint_header {
+  char magic[8];
+  uint64_t input_hash;
+  int32_t n;
+  int32_t next_k;
+};
+
+// Only rank 0 checkpoints: it already gathers the full D after every k.
+struct checkpoint {
+  const char *path;
+  uint64_t input_hash;
+  int n;
+  int start_k;
+  double interval;
+  double last_time;
+
+  // The compute loop copies D into staging and hands it to the writer thread;
+  // while a write is still in flight further checkpoints are skipped instead
+  // of waiting for it.
+  double *staging;
+  int staged_next_k;
+  pthread_t writer;
+  int writer_active;
+  atomic_int writer_done;
+};
+
+uint64_t hash_input(char **text, int text_size, double r) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (int i = 0; i < text_size; i++) {
+    for (const unsigned char *c = (const unsigned char *)text[i]; *c; c++) {
+      hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    hash = (hash ^ ' ') * 1099511628211ULL;
+  }
+
+  const unsigned char *bytes = (const unsigned char *)&r;
+  for (size_t i = 0; i < sizeof(r); i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  hash = (hash ^ _MAX_DISTANCE) * 1099511628211ULL;
+
+  return hash;
+}
+
+void *checkpoint_writer(void *arg) {
+  struct checkpoint *ckpt = (struct checkpoint *)arg;
+  size_t tmp_len = strlen(ckpt->path) + 5;
+  char *tmp_path = (char *)malloc(tmp_len);
+  snprintf(tmp_path, tmp_len, "%s.tmp", ckpt->path);
+
+  struct checkpoint_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  header.input_hash = ckpt->input_hash;
+  header.n = ckpt->n;
+  header.next_k = ckpt->staged_next_k;
+
+  size_t cells = (size_t)ckpt->n * ckpt->n;
+  FILE *file = fopen(tmp_path, "wb");
+  if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1 ||
+      fwrite(ckpt->staging, sizeof(double), cells, file) != cells ||
+      fclose(file) != 0) {
+    fprintf(stderr, "Warning: failed to write checkpoint %s\n", tmp_path);
+  } else {
+    // rename() replaces the previous checkpoint atomically, so a job killed
+    // mid-write still resumes from the last complete one.
+    rename(tmp_path, ckpt->path);
+  }
+
+  free(tmp_path);
+  atomic_store_explicit(&ckpt->writer_done, 1, memory_order_release);
+  return NULL;
+}
+
+void checkpoint_init(struct checkpoint *ckpt, const char *path,
+                     uint64_t input_hash, int n, double interval) {
+  memset(ckpt, 0, sizeof(*ckpt));
+  ckpt->path = path;
+  ckpt->input_hash = input_hash;
+  ckpt->n = n;
+  ckpt->interval = interval;
+  ckpt->last_time = MPI_Wtime();
+}
+
+// Loads a checkpoint written for the same input. Returns the saved matrix, or
+// NULL when there is no usable checkpoint.
+double **checkpoint_load(const char *path, uint64_t input_hash, int n,
+                         int *next_k) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+
+  struct checkpoint_header header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+      header.input_hash != input_hash || header.n != n ||
+      header.next_k < 0 || header.next_k > n) {
+    fclose(file);
+    return NULL;
+  }
+
+  double **D = alloc_matrix(n);
+  int ok = 1;
+  for (int i = 0; i < n && ok; i++) {
+    if (fread(D[i], sizeof(double), n, file) != (size_t)n) {
+      ok = 0;
+    }
+  }
+  fclose(file);
+
+  if (!ok) {
+    free_matrix(D);
+    return NULL;
+  }
+
+  *next_k = header.next_k;
+  return D;
+}
+
+// Called on rank 0 after every completed k. Cheap when no checkpoint is due:
+// one clock read.
+void checkpoint_save(struct checkpoint *ckpt, double **D, int next_k) {
+  if (ckpt == NULL) {
+    return;
+  }
+
+  double now = MPI_Wtime();
+  if (now - ckpt->last_time < ckpt->interval) {
+    return;
+  }
+
+  if (ckpt->writer_active) {
+    if (!atomic_load_explicit(&ckpt->writer_done, memory_order_acquire)) {
+      return;
+    }
+    pthread_join(ckpt->writer, NULL);
+    ckpt->writer_active = 0;
+  }
+
+  int n = ckpt->n;
+  if (ckpt->staging == NULL) {
+    ckpt->staging = (double *)malloc((size_t)n * n * sizeof(double));
+  }
+
+  for (int i = 0; i < n; i++) {
+    memcpy(&ckpt->staging[(size_t)i * n], D[i], n * sizeof(double));
+  }
+
+  ckpt->staged_next_k = next_k;
+  atomic_store_explicit(&ckpt->writer_done, 0, memory_order_relaxed);
+  if (pthread_create(&ckpt->writer, NULL, checkpoint_writer, ckpt) == 0) {
+    ckpt->writer_active = 1;
+  }
+  ckpt->last_time = now;
+}
+
+// Waits for an outstanding write and removes the checkpoint once the closure
+// has finished, since there is nothing left to resume.
+void checkpoint_finish(struct checkpoint *ckpt) {
+  if (ckpt == NULL) {
+    return;
+  }
+
+  if (ckpt->writer_active) {
+    pthread_join(ckpt->writer, NULL);
+    ckpt->writer_active = 0;
+  }
+
+  remove(ckpt->path);
+  free(ckpt->staging);
+  ckpt->staging = NULL;
+}
+
+// Time, volume and number of the MPI calls this rank made in the pipeline,
+// reported with --stats. File I/O of the parallel output is not included.
+struct comm_stats {
+  double time;
+  long long bytes;
+  long long calls;
+};
+
+static struct comm_stats comm = {0.0, 0, 0};
+
+void comm_record(double start, int count, MPI_Datatype type) {
+  int type_size;
+  MPI_Type_size(type, &type_size);
+
+  comm.time += MPI_Wtime() - start;
+  comm.bytes += (long long)count * type_size;
+  comm.calls++;
+}
+
+void comm_bcast(void *buffer, int count, MPI_Datatype type, int root) {
+  double start = MPI_Wtime();
+  MPI_Bcast(buffer, count, type, root, MPI_COMM_WORLD);
+  comm_record(start, count, type);
+}
+
+void comm_send(const void *buffer, int count, MPI_Datatype type, int dest) {
+  double start = MPI_Wtime();
+  MPI_Send(buffer, count, type, dest, 0, MPI_COMM_WORLD);
+  comm_record(start, count, type);
+}
+
+void comm_recv(void *buffer, int count, MPI_Datatype type, int source) {
+  double start = MPI_Wtime();
+  MPI_Recv(buffer, count, type, source, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  comm_record(start, count, type);
+}
+
+void comm_barrier(void) {
+  double start = MPI_Wtime();
+  MPI_Barrier(MPI_COMM_WORLD);
+  comm_record(start, 0, MPI_BYTE);
+}
+
+void row_range(int n, int rank, int size, int *start_row, int *end_row) {
+  int rows_per_proc = n / size;
+  int remainder = n % size;
+
+  *start_row = rank * rows_per_proc + (rank < remainder ? rank : remainder);
+  *end_row = *start_row + rows_per_proc + (rank < remainder ? 1 : 0);
+}
+
 void update_row(double **D, const int i, const int n, const int k,
                 const double r) {
   for (int j = 0; j < n; j++) {
@@ -25,30 +398,219 @@ void update_row(double **D, const int i, const int n, const int k,
   }
 }
 
-void floyd_warshall(double **D, int q, int r) {
+// Live progress of this rank's closure for --progress. The compute loop is
+// the only writer and the reporter thread the only reader, so relaxed
+// stores suffice, a few per k. Busy is this rank's time in the row updates;
+// the rest of the closure is idle: broadcasts, the gather and its barriers.
+struct telemetry {
+  atomic_int running;
+  atomic_int round;
+  atomic_int rounds;
+  atomic_llong updates;
+  atomic_llong total_updates;
+  atomic_llong started_ns;
+  atomic_llong busy_ns;
+};
+
+static struct telemetry telemetry;
+
+long long monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void telemetry_begin(int round, int rounds, long long total_updates) {
+  atomic_store_explicit(&telemetry.round, round, memory_order_relaxed);
+  atomic_store_explicit(&telemetry.rounds, rounds, memory_order_relaxed);
+  atomic_store_explicit(&telemetry.updates, 0, memory_order_relaxed);
+  atomic_store_explicit(&telemetry.total_updates, total_updates,
+                        memory_order_relaxed);
+  atomic_store_explicit(&telemetry.busy_ns, 0, memory_order_relaxed);
+  atomic_store_explicit(&telemetry.started_ns, monotonic_ns(),
+                        memory_order_relaxed);
+  atomic_store_explicit(&telemetry.running, 1, memory_order_relaxed);
+}
+
+void telemetry_round(int round, long long updates, long long busy_ns) {
+  atomic_store_explicit(&telemetry.round, round, memory_order_relaxed);
+  atomic_store_explicit(&telemetry.updates, updates, memory_order_relaxed);
+  atomic_store_explicit(&telemetry.busy_ns, busy_ns, memory_order_relaxed);
+}
+
+void format_eta(char *out, size_t size, double seconds) {
+  if (seconds < 0) {
+    snprintf(out, size, "-");
+    return;
+  }
+  long s = (long)(seconds + 0.5);
+  snprintf(out, size, "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+}
+
+// --progress SECONDS: a thread on every rank that prints the rank's
+// telemetry every interval, in the format of the OpenMP version plus the
+// rank. It makes no MPI calls, so MPI_THREAD_FUNNELED covers it. Lines go to
+// stderr, or as JSON to the --progress-file, one write(2) each so the ranks
+// of a node can append to the same file.
+struct progress_reporter {
+  int rank;
+  double interval;
+  int fd;
+  long long last_updates;
+  double last_elapsed;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int stop;
+  int active;
+};
+
+void progress_report(struct progress_reporter *reporter) {
+  if (!atomic_load_explicit(&telemetry.running, memory_order_relaxed)) {
+    return;
+  }
+  int round = atomic_load_explicit(&telemetry.round, memory_order_relaxed);
+  int rounds = atomic_load_explicit(&telemetry.rounds, memory_order_relaxed);
+  long long updates =
+      atomic_load_explicit(&telemetry.updates, memory_order_relaxed);
+  long long total =
+      atomic_load_explicit(&telemetry.total_updates, memory_order_relaxed);
+  double busy =
+      atomic_load_explicit(&telemetry.busy_ns, memory_order_relaxed) / 1e9;
+  double elapsed =
+      (monotonic_ns() -
+       atomic_load_explicit(&telemetry.started_ns, memory_order_relaxed)) /
+      1e9;
+
+  double interval = elapsed - reporter->last_elapsed;
+  double rate =
+      interval > 0 ? (updates - reporter->last_updates) / interval : 0;
+  double average = elapsed > 0 ? updates / elapsed : 0;
+  double eta = average > 0 ? (total - updates) / average : -1;
+  double done = total > 0 ? 100.0 * updates / total : 0;
+  double idle = fmax(elapsed - busy, 0);
+  reporter->last_updates = updates;
+  reporter->last_elapsed = elapsed;
+
+  char line[512];
+  int length;
+  if (reporter->fd < 0) {
+    char eta_text[32];
+    format_eta(eta_text, sizeof(eta_text), eta);
+    length = snprintf(line, sizeof(line),
+                      "Progress:\trank %d, round %d/%d (%.1f%%), %.3g "
+                      "updates/s, ETA %s, busy/idle s: %.1f/%.1f\n",
+                      reporter->rank, round, rounds, done, rate, eta_text, busy,
+                      idle);
+  } else {
+    length = snprintf(line, sizeof(line),
+                      "{\"rank\":%d,\"elapsed\":%.3f,\"round\":%d,\"rounds\":%d,"
+                      "\"updates\":%lld,\"total_updates\":%lld,"
+                      "\"updates_per_s\":%.1f,\"eta\":%.1f,\"busy\":[%.3f],"
+                      "\"idle\":[%.3f]}\n",
+                      reporter->rank, elapsed, round, rounds, updates, total,
+                      rate, eta, busy, idle);
+  }
+  if (write(reporter->fd < 0 ? STDERR_FILENO : reporter->fd, line,
+            min(length, (int)sizeof(line) - 1)) < 0) {
+    // Progress is best effort; the closure does not wait on it.
+  }
+}
+
+void *progress_thread(void *arg) {
+  struct progress_reporter *reporter = (struct progress_reporter *)arg;
+
+  pthread_mutex_lock(&reporter->lock);
+  while (!reporter->stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    double seconds = deadline.tv_nsec / 1e9 + reporter->interval;
+    deadline.tv_sec += (time_t)seconds;
+    deadline.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+
+    while (!reporter->stop &&
+           pthread_cond_timedwait(&reporter->wake, &reporter->lock,
+                                  &deadline) == 0) {
+    }
+    if (reporter->stop) {
+      break;
+    }
+
+    pthread_mutex_unlock(&reporter->lock);
+    progress_report(reporter);
+    pthread_mutex_lock(&reporter->lock);
+  }
+  pthread_mutex_unlock(&reporter->lock);
+
+  return NULL;
+}
+
+void progress_start(struct progress_reporter *reporter, int rank,
+                    double interval, const char *path) {
+  memset(reporter, 0, sizeof(*reporter));
+  reporter->fd = -1;
+  if (interval <= 0) {
+    return;
+  }
+
+  if (path != NULL) {
+    reporter->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (reporter->fd < 0 && rank == 0) {
+      fprintf(stderr, "Warning: cannot open progress file %s, using stderr\n",
+              path);
+    }
+  }
+  reporter->rank = rank;
+  reporter->interval = interval;
+  pthread_mutex_init(&reporter->lock, NULL);
+  pthread_cond_init(&reporter->wake, NULL);
+  reporter->active =
+      pthread_create(&reporter->thread, NULL, progress_thread, reporter) == 0;
+}
+
+void progress_stop(struct progress_reporter *reporter) {
+  if (reporter->active) {
+    pthread_mutex_lock(&reporter->lock);
+    reporter->stop = 1;
+    pthread_cond_signal(&reporter->wake);
+    pthread_mutex_unlock(&reporter->lock);
+    pthread_join(reporter->thread, NULL);
+    pthread_mutex_destroy(&reporter->lock);
+    pthread_cond_destroy(&reporter->wake);
+  }
+  if (reporter->fd >= 0) {
+    close(reporter->fd);
+  }
+}
+
+void floyd_warshall(double **D, int q, int r, struct checkpoint *ckpt,
+                    int start_k) {
   int rank, size;
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &size);
 
   int n = q + 1;
+  int stride = matrix_stride(n);
+  int chunk = rows_per_message(n);
 
   double *k_row = (double *)malloc(n * sizeof(double));
 
-  for (int k = 0; k < n; k++) {
+  int start_row, end_row;
+  row_range(n, rank, size, &start_row, &end_row);
+  long long row_updates = (long long)(end_row - start_row) * (n - 1);
+  long long busy_ns = 0;
+  telemetry_begin(start_k, n, (n - start_k) * row_updates);
+
+  for (int k = start_k; k < n; k++) {
     if (rank == 0) {
       for (int j = 0; j < n; j++) {
         k_row[j] = D[k][j];
       }
     }
 
-    MPI_Bcast(k_row, n, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-
-    int rows_per_proc = n / size;
-    int remainder = n % size;
-
-    int start_row = rank * rows_per_proc + (rank < remainder ? rank : remainder);
-    int end_row = start_row + rows_per_proc + (rank < remainder ? 1 : 0);
+    comm_bcast(k_row, n, MPI_DOUBLE, 0);
 
+    long long compute_start = monotonic_ns();
     for (int i = start_row; i < end_row; i++) {
       for (int j = 0; j < n; j++) {
         if (i == j)
@@ -63,82 +625,103 @@ void floyd_warshall(double **D, int q, int r) {
         }
       }
     }
+    busy_ns += monotonic_ns() - compute_start;
+    telemetry_round(k + 1, (k + 1 - start_k) * row_updates, busy_ns);
 
     for (int i = 0; i < size; i++) {
-      int proc_start = i * rows_per_proc + (i < remainder ? i : remainder);
-      int proc_end = proc_start + rows_per_proc + (i < remainder ? 1 : 0);
-      int proc_rows = proc_end - proc_start;
+      int proc_start, proc_end;
+      row_range(n, i, size, &proc_start, &proc_end);
 
       if (rank == 0 && i != 0) {
-        for (int row = proc_start; row < proc_end; row++) {
-          MPI_Recv(D[row], n, MPI_DOUBLE, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        for (int row = proc_start; row < proc_end; row += chunk) {
+          int rows = min(chunk, proc_end - row);
+          comm_recv(D[row], rows * stride, MPI_DOUBLE, i);
         }
       } else if (rank == i && i != 0) {
-        for (int row = start_row; row < end_row; row++) {
-          MPI_Send(D[row], n, MPI_DOUBLE, 0, 0, MPI_COMM_WORLD);
+        for (int row = start_row; row < end_row; row += chunk) {
+          int rows = min(chunk, end_row - row);
+          comm_send(D[row], rows * stride, MPI_DOUBLE, 0);
         }
       }
 
-      MPI_Barrier(MPI_COMM_WORLD);
+      comm_barrier();
+    }
+
+    if (rank == 0) {
+      checkpoint_save(ckpt, D, k + 1);
     }
   }
 
+  atomic_store_explicit(&telemetry.running, 0, memory_order_relaxed);
   free(k_row);
 }
 
-double **pathfinder_network(double **graph, int n, int q, int r, int rank) {
-  double **D = NULL;
-
-  if (rank == 0) {
-    D = (double **)malloc(n * sizeof(double *));
-    for (int i = 0; i < n; i++) {
-      D[i] = (double *)malloc(n * sizeof(double));
-      for (int j = 0; j < n; j++) {
-        D[i][j] = graph[i][j];
-      }
-    }
-  } else {
-    D = (double **)malloc(n * sizeof(double *));
-    for (int i = 0; i < n; i++) {
-      D[i] = (double *)malloc(n * sizeof(double));
-    }
+// Closes the direct distances held by rank 0 in place; the other ranks pass
+// NULL and receive them. The closure only ever shortens a distance, so the
+// result already keeps every direct link that is a shortest path.
+double **pathfinder_network(double **D, int n, int q, int r, int rank,
+                            struct checkpoint *ckpt) {
+  if (rank != 0) {
+    D = alloc_matrix(n);
   }
 
-  for (int i = 0; i < n; i++) {
-    MPI_Bcast(D[i], n, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  int stride = matrix_stride(n);
+  int chunk = rows_per_message(n);
+  for (int row = 0; row < n; row += chunk) {
+    int rows = min(chunk, n - row);
+    comm_bcast(D[row], rows * stride, MPI_DOUBLE, 0);
   }
 
-  floyd_warshall(D, q, r);
+  int start_k = (rank == 0 && ckpt != NULL) ? ckpt->start_k : 0;
+  comm_bcast(&start_k, 1, MPI_INT, 0);
+
+  floyd_warshall(D, q, r, rank == 0 ? ckpt : NULL, start_k);
 
   if (rank == 0) {
-    for (int i = 0; i < n; i++) {
-      for (int j = 0; j < n; j++) {
-        if (graph[i][j] < D[i][j]) {
-          D[i][j] = graph[i][j];
-        }
-      }
-    }
+    checkpoint_finish(ckpt);
   }
 
   return D;
 }
 
-double cosine_similarity(double *a, double *b, int n) {
-  double dot = 0.0, norm_a = 0.0, norm_b = 0.0;
+// Bump-pointer storage for the token strings, which all live until exit:
+// they are packed back to back in ARENA_BLOCK_SIZE blocks instead of one
+// malloc each, and the whole arena is released with one pass over the blocks.
+struct arena_block {
+  struct arena_block *next;
+  size_t used;
+  size_t size;
+};
 
-  for (int i = 0; i < n; i++) {
-    dot += a[i] * b[i];
-    norm_a += a[i] * a[i];
-    norm_b += b[i] * b[i];
-  }
+struct arena {
+  struct arena_block *head;
+};
 
-  norm_a = sqrt(norm_a);
-  norm_b = sqrt(norm_b);
+char *arena_strdup(struct arena *arena, const char *s) {
+  size_t len = strlen(s) + 1;
+  struct arena_block *block = arena->head;
 
-  if (norm_a == 0 || norm_b == 0)
-    return 0;
+  if (block == NULL || block->size - block->used < len) {
+    size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+    block = (struct arena_block *)malloc(sizeof(struct arena_block) + size);
+    block->next = arena->head;
+    block->used = 0;
+    block->size = size;
+    arena->head = block;
+  }
 
-  return dot / (norm_a * norm_b);
+  char *copy = (char *)(block + 1) + block->used;
+  memcpy(copy, s, len);
+  block->used += len;
+  return copy;
+}
+
+void arena_free(struct arena *arena) {
+  while (arena->head != NULL) {
+    struct arena_block *next = arena->head->next;
+    free(arena->head);
+    arena->head = next;
+  }
 }
 
 int find_index(char **array, int size, const char *word) {
@@ -154,10 +737,10 @@ int word_exists(char **array, int size, const char *word) {
   return find_index(array, size, word) != -1;
 }
 
-int add_word(char ***array, int *size, const char *word) {
+int add_word(char ***array, int *size, char *word) {
   if (!word_exists(*array, *size, word)) {
     *array = realloc(*array, (*size + 1) * sizeof(char *));
-    (*array)[*size] = strdup(word);
+    (*array)[*size] = word;
     (*size)++;
     return 1;
   }
@@ -168,14 +751,638 @@ int compare_strings(const void *a, const void *b) {
   return strcmp(*(const char **)a, *(const char **)b);
 }
 
+// Co-occurrence counts in compressed rows: the neighbours of word i are
+// col[row_start[i] .. row_start[i + 1]), in increasing order. A window holds
+// at most _MAX_DISTANCE following tokens, so this is O(text_size) where a
+// dense n x n count matrix would be O(n^2).
+struct sparse_graph {
+  int *row_start;
+  int *col;
+  double *count;
+  double *norm;
+};
+
+int compare_words(const void *key, const void *item) {
+  return strcmp((const char *)key, *(char *const *)item);
+}
+
+int compare_keys(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Counts how often two different words appear within _MAX_DISTANCE tokens of
+// each other. The (row, col) keys are sorted and merged instead of being
+// added into an n x n matrix, and each row's norm is kept for
+// direct_distance(). wordSet must be sorted.
+void build_sparse_graph(struct sparse_graph *g, char **text, int text_size,
+                        char **wordSet, int wordSetSize) {
+  int *token = (int *)malloc((text_size > 0 ? text_size : 1) * sizeof(int));
+  for (int i = 0; i < text_size; i++) {
+    char **found = (char **)bsearch(text[i], wordSet, wordSetSize,
+                                    sizeof(char *), compare_words);
+    token[i] = (int)(found - wordSet);
+  }
+
+  size_t capacity =
+      2 * (size_t)_MAX_DISTANCE * (text_size > 0 ? text_size : 1);
+  uint64_t *keys = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+  size_t count = 0;
+  for (int i = 0; i < text_size; i++) {
+    int max_neighbor = (i + 1 + _MAX_DISTANCE < text_size)
+                           ? i + 1 + _MAX_DISTANCE
+                           : text_size;
+    for (int j = i + 1; j < max_neighbor; j++) {
+      if (token[i] != token[j]) {
+        keys[count++] = (uint64_t)token[i] << 32 | (uint32_t)token[j];
+        keys[count++] = (uint64_t)token[j] << 32 | (uint32_t)token[i];
+      }
+    }
+  }
+  qsort(keys, count, sizeof(uint64_t), compare_keys);
+
+  g->row_start = (int *)calloc(wordSetSize + 1, sizeof(int));
+  g->col = (int *)malloc((count > 0 ? count : 1) * sizeof(int));
+  g->count = (double *)malloc((count > 0 ? count : 1) * sizeof(double));
+
+  int entries = 0;
+  for (size_t e = 0; e < count; e++) {
+    if (e > 0 && keys[e] == keys[e - 1]) {
+      g->count[entries - 1]++;
+      continue;
+    }
+    g->row_start[(keys[e] >> 32) + 1]++;
+    g->col[entries] = (int)(uint32_t)keys[e];
+    g->count[entries] = 1;
+    entries++;
+  }
+  for (int i = 0; i < wordSetSize; i++) {
+    g->row_start[i + 1] += g->row_start[i];
+  }
+
+  g->norm =
+      (double *)malloc((wordSetSize > 0 ? wordSetSize : 1) * sizeof(double));
+  for (int i = 0; i < wordSetSize; i++) {
+    double sum = 0.0;
+    for (int e = g->row_start[i]; e < g->row_start[i + 1]; e++) {
+      sum += g->count[e] * g->count[e];
+    }
+    g->norm[i] = sqrt(sum);
+  }
+
+  free(keys);
+  free(token);
+}
+
+void free_sparse_graph(struct sparse_graph *g) {
+  free(g->row_start);
+  free(g->col);
+  free(g->count);
+  free(g->norm);
+  memset(g, 0, sizeof(*g));
+}
+
+// Direct distance of words i != j: 1 - the cosine similarity of their
+// co-occurrence rows, or _INFINITY if they share no neighbour. Counts are
+// small integers, so the sparse dot product and norms are exact and equal to
+// the sums over full dense rows.
+double direct_distance(const struct sparse_graph *g, int i, int j) {
+  if (g->norm[i] == 0 || g->norm[j] == 0) {
+    return _INFINITY;
+  }
+
+  double dot = 0.0;
+  int x = g->row_start[i];
+  int y = g->row_start[j];
+  while (x < g->row_start[i + 1] && y < g->row_start[j + 1]) {
+    if (g->col[x] < g->col[y]) {
+      x++;
+    } else if (g->col[x] > g->col[y]) {
+      y++;
+    } else {
+      dot += g->count[x++] * g->count[y++];
+    }
+  }
+
+  double similarity = dot / (g->norm[i] * g->norm[j]);
+  return similarity == 0 ? _INFINITY : 1 - similarity;
+}
+
+// Every rank needs the vocabulary to format its own rows, so rank 0 packs the
+// sorted words into one NUL-separated buffer and broadcasts it.
+char **broadcast_word_set(char **wordSet, int wordSetSize, int rank,
+                          char **pool) {
+  long long pool_size = 0;
+
+  if (rank == 0) {
+    for (int i = 0; i < wordSetSize; i++) {
+      pool_size += strlen(wordSet[i]) + 1;
+    }
+  }
+
+  comm_bcast(&pool_size, 1, MPI_LONG_LONG, 0);
+
+  *pool = (char *)malloc(pool_size > 0 ? pool_size : 1);
+
+  if (rank == 0) {
+    char *p = *pool;
+    for (int i = 0; i < wordSetSize; i++) {
+      size_t len = strlen(wordSet[i]) + 1;
+      memcpy(p, wordSet[i], len);
+      p += len;
+    }
+  }
+
+  comm_bcast(*pool, (int)pool_size, MPI_CHAR, 0);
+
+  char **words = (char **)malloc(wordSetSize * sizeof(char *));
+  char *p = *pool;
+  for (int i = 0; i < wordSetSize; i++) {
+    words[i] = p;
+    p += strlen(p) + 1;
+  }
+
+  return words;
+}
+
+// Renders value exactly like printf("%f") (six decimals, round-half-even on
+// the exact binary value) without going through stdio or the locale. Values
+// of 1e12 and above, infinities and NaNs are rare and handed to sprintf, so
+// out needs room for DBL_MAX_10_EXP + 9 characters.
+int format_fixed6(char *out, double value) {
+  char *p = out;
+
+  if (signbit(value)) {
+    *p++ = '-';
+    value = -value;
+  }
+
+  if (!(value < 1e12)) {
+    return (int)(p - out) + sprintf(p, "%f", value);
+  }
+
+  // value = m * 2^e exactly, with m < 2^53 and e < 0 for every value below
+  // 1e12, so value * 10^6 = (m * 10^6) / 2^-e fits 128-bit arithmetic.
+  int exp;
+  double mant = frexp(value, &exp);
+  uint64_t m = (uint64_t)ldexp(mant, 53);
+  int shift = 53 - exp;
+
+  unsigned __int128 scaled = (unsigned __int128)m * 1000000;
+  uint64_t q = 0;
+  if (shift < 128) {
+    unsigned __int128 whole = scaled >> shift;
+    unsigned __int128 rem = scaled - (whole << shift);
+    unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+
+    q = (uint64_t)whole;
+    if (rem > half || (rem == half && (q & 1))) {
+      q++;
+    }
+  }
+
+  uint64_t int_part = q / 1000000;
+  uint32_t frac_part = (uint32_t)(q % 1000000);
+
+  char digits[20];
+  int len = 0;
+  do {
+    digits[len++] = (char)('0' + int_part % 10);
+    int_part /= 10;
+  } while (int_part > 0);
+  while (len > 0) {
+    *p++ = digits[--len];
+  }
+
+  *p++ = '.';
+  for (int i = 5; i >= 0; i--) {
+    p[i] = (char)('0' + frac_part % 10);
+    frac_part /= 10;
+  }
+  p += 6;
+
+  return (int)(p - out);
+}
+
+void write_all(int fd, const char *buffer, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, buffer, length);
+    if (written <= 0) {
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+    buffer += written;
+    length -= written;
+  }
+}
+
+// Prints every pair (i, j > i) as "%s %s %f\n". Lines are rendered
+// into one OUTPUT_BUFFER_SIZE buffer that is flushed with large write()
+// calls, so the text is identical to the printf loop it replaces.
+void write_results(char **wordSet, double **pf_net, int n) {
+  fflush(stdout);
+
+  int *word_len = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+  for (int i = 0; i < n; i++) {
+    word_len[i] = strlen(wordSet[i]);
+  }
+
+  // Missing links are _INFINITY, the most frequent slow-path value, so its
+  // text is rendered once up front.
+  char inf_text[DBL_MAX_10_EXP + 16];
+  int inf_len = format_fixed6(inf_text, _INFINITY);
+
+  char *buffer = (char *)malloc(OUTPUT_BUFFER_SIZE);
+  size_t used = 0;
+
+  for (int i = 0; i < n; i++) {
+    for (int j = i + 1; j < n; j++) {
+      // Words are shorter than the 1024-byte input buffer, so one line
+      // always fits an empty buffer.
+      if (used + word_len[i] + word_len[j] + SLOW_LINE_EXTRA >
+          OUTPUT_BUFFER_SIZE) {
+        write_all(STDOUT_FILENO, buffer, used);
+        used = 0;
+      }
+
+      char *p = buffer + used;
+      memcpy(p, wordSet[i], word_len[i]);
+      p += word_len[i];
+      *p++ = ' ';
+      memcpy(p, wordSet[j], word_len[j]);
+      p += word_len[j];
+      *p++ = ' ';
+      if (pf_net[i][j] == _INFINITY) {
+        memcpy(p, inf_text, inf_len);
+        p += inf_len;
+      } else {
+        p += format_fixed6(p, pf_net[i][j]);
+      }
+      *p++ = '\n';
+      used = p - buffer;
+    }
+  }
+
+  write_all(STDOUT_FILENO, buffer, used);
+
+  free(buffer);
+  free(word_len);
+}
+
+// Renders the pairs (i, j > i) of rows [start_row, end_row) with the same
+// "%s %s %f\n" format rank 0 prints to stdout.
+char *format_rows(char **words, double **D, int n, int start_row,
+                  int end_row, long long *length) {
+  char inf_text[DBL_MAX_10_EXP + 16];
+  int inf_len = format_fixed6(inf_text, _INFINITY);
+
+  long long capacity = 1 << 16;
+  long long used = 0;
+  char *buffer = (char *)malloc(capacity);
+
+  for (int i = start_row; i < end_row; i++) {
+    size_t len_i = strlen(words[i]);
+
+    for (int j = i + 1; j < n; j++) {
+      size_t len_j = strlen(words[j]);
+      long long needed = len_i + len_j + SLOW_LINE_EXTRA;
+
+      if (used + needed > capacity) {
+        while (used + needed > capacity) {
+          capacity *= 2;
+        }
+        buffer = (char *)realloc(buffer, capacity);
+      }
+
+      char *p = buffer + used;
+      memcpy(p, words[i], len_i);
+      p += len_i;
+      *p++ = ' ';
+      memcpy(p, words[j], len_j);
+      p += len_j;
+      *p++ = ' ';
+      if (D[i][j] == _INFINITY) {
+        memcpy(p, inf_text, inf_len);
+        p += inf_len;
+      } else {
+        p += format_fixed6(p, D[i][j]);
+      }
+      *p++ = '\n';
+      used = p - buffer;
+    }
+  }
+
+  *length = used;
+  return buffer;
+}
+
+// Finds the PFNET links: pairs whose direct distance is finite and survives
+// the closure, direct_distance(i, j) <= pf_net[i][j]. Returns the column
+// indices grouped by row, with row i at cols[offsets[i] .. offsets[i + 1]).
+// With symmetric every row lists all of its neighbours, otherwise only j > i.
+int *collect_links(const struct sparse_graph *g, double **pf_net, int n,
+                   int symmetric, int **offsets) {
+  int *row_start = (int *)malloc((n + 1) * sizeof(int));
+  int capacity = n > 0 ? n : 1;
+  int *cols = (int *)malloc(capacity * sizeof(int));
+  int count = 0;
+
+  for (int i = 0; i < n; i++) {
+    row_start[i] = count;
+    for (int j = symmetric ? 0 : i + 1; j < n; j++) {
+      // The closure never exceeds the direct distance, so an unreachable
+      // pair has no direct link to test.
+      if (j == i || pf_net[i][j] == _INFINITY ||
+          direct_distance(g, i, j) > pf_net[i][j]) {
+        continue;
+      }
+      if (count == capacity) {
+        capacity *= 2;
+        cols = (int *)realloc(cols, capacity * sizeof(int));
+      }
+      cols[count++] = j;
+    }
+  }
+  row_start[n] = count;
+
+  *offsets = row_start;
+  return cols;
+}
+
+// Renders the PFNET links found by collect_links(). Each link (i < j) is a
+// "%s %s %f\n" line; in adjacency mode every word gets one line instead, the
+// word followed by a tab-separated "neighbour weight" entry per link.
+char *format_links(char **words, const struct sparse_graph *g, double **pf_net,
+                   int n, enum output_mode mode, long long *length) {
+  int adjacency = mode == OUTPUT_ADJACENCY;
+  int *offsets;
+  int *cols = collect_links(g, pf_net, n, adjacency, &offsets);
+
+  size_t capacity = 1 << 16;
+  size_t used = 0;
+  char *buffer = (char *)malloc(capacity);
+
+  for (int i = 0; i < n; i++) {
+    size_t len_i = strlen(words[i]);
+
+    if (adjacency) {
+      if (used + len_i + 1 > capacity) {
+        capacity = 2 * capacity + len_i + 1;
+        buffer = (char *)realloc(buffer, capacity);
+      }
+      memcpy(buffer + used, words[i], len_i);
+      used += len_i;
+    }
+
+    for (int e = offsets[i]; e < offsets[i + 1]; e++) {
+      int j = cols[e];
+      size_t len_j = strlen(words[j]);
+      size_t needed = len_i + len_j + SLOW_LINE_EXTRA;
+      if (used + needed > capacity) {
+        while (used + needed > capacity) {
+          capacity *= 2;
+        }
+        buffer = (char *)realloc(buffer, capacity);
+      }
+
+      char *p = buffer + used;
+      if (adjacency) {
+        *p++ = '\t';
+      } else {
+        memcpy(p, words[i], len_i);
+        p += len_i;
+        *p++ = ' ';
+      }
+      memcpy(p, words[j], len_j);
+      p += len_j;
+      *p++ = ' ';
+      p += format_fixed6(p, pf_net[i][j]);
+      if (!adjacency) {
+        *p++ = '\n';
+      }
+      used = p - buffer;
+    }
+
+    // Every entry reserves SLOW_LINE_EXTRA bytes, so there is room left.
+    if (adjacency) {
+      buffer[used++] = '\n';
+    }
+  }
+
+  free(cols);
+  free(offsets);
+
+  *length = used;
+  return buffer;
+}
+
+// Writes the result in the binary layout above: the full upper triangle for
+// OUTPUT_PAIRS, the PFNET links otherwise.
+void write_binary_result(const char *path, char **wordSet,
+                         const struct sparse_graph *g, double **pf_net, int n,
+                         enum output_mode mode) {
+  struct result_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RESULT_MAGIC, sizeof(RESULT_MAGIC));
+  header.kind = mode == OUTPUT_PAIRS ? RESULT_MATRIX : RESULT_EDGES;
+  header.n = n;
+
+  uint64_t *vocab = (uint64_t *)malloc((n + 1) * sizeof(uint64_t));
+  vocab[0] = 0;
+  for (int i = 0; i < n; i++) {
+    vocab[i + 1] = vocab[i] + strlen(wordSet[i]) + 1;
+  }
+
+  uint64_t vocab_end = sizeof(header) + (n + 1) * sizeof(uint64_t) + vocab[n];
+  header.vocab_offset = sizeof(header);
+  header.data_offset = (vocab_end + 7) & ~(uint64_t)7;
+
+  int *offsets = NULL;
+  int *cols = NULL;
+  if (header.kind == RESULT_MATRIX) {
+    header.data_count = n > 1 ? (uint64_t)n * (n - 1) / 2 : 0;
+    header.file_size = header.data_offset + header.data_count * sizeof(double);
+  } else {
+    cols = collect_links(g, pf_net, n, 0, &offsets);
+    header.data_count = offsets[n];
+    header.file_size = header.data_offset + (n + 1) * sizeof(uint64_t) +
+                       header.data_count * sizeof(struct result_edge);
+  }
+
+  static const char padding[8] = {0};
+  FILE *file = fopen(path, "wb");
+  int ok = file != NULL;
+
+  if (ok) {
+    ok &= fwrite(&header, sizeof(header), 1, file) == 1;
+    ok &= fwrite(vocab, sizeof(uint64_t), n + 1, file) == (size_t)n + 1;
+    for (int i = 0; i < n; i++) {
+      size_t len = vocab[i + 1] - vocab[i];
+      ok &= fwrite(wordSet[i], 1, len, file) == len;
+    }
+    size_t pad = header.data_offset - vocab_end;
+    ok &= fwrite(padding, 1, pad, file) == pad;
+  }
+
+  if (ok && header.kind == RESULT_MATRIX) {
+    for (int i = 0; i < n - 1; i++) {
+      size_t count = n - i - 1;
+      ok &= fwrite(pf_net[i] + i + 1, sizeof(double), count, file) == count;
+    }
+  } else if (ok) {
+    for (int i = 0; i <= n; i++) {
+      uint64_t offset = offsets[i];
+      ok &= fwrite(&offset, sizeof(offset), 1, file) == 1;
+    }
+    for (int i = 0; i < n; i++) {
+      for (int e = offsets[i]; e < offsets[i + 1]; e++) {
+        struct result_edge edge = {(uint32_t)i, (uint32_t)cols[e],
+                                   pf_net[i][cols[e]]};
+        ok &= fwrite(&edge, sizeof(edge), 1, file) == 1;
+      }
+    }
+  }
+
+  if (file != NULL && fclose(file) != 0) {
+    ok = 0;
+  }
+  if (!ok) {
+    fprintf(stderr, "Error: failed to write binary result %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  free(cols);
+  free(offsets);
+  free(vocab);
+}
+
+// Writes each rank's formatted rows to one shared file. Offsets are the
+// exclusive prefix sum of the per-rank lengths, so the file matches the
+// row-major order rank 0 would have printed.
+void write_result_file(const char *path, const char *buffer,
+                       long long length) {
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  long long offset = 0;
+  MPI_Exscan(&length, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  if (rank == 0) {
+    offset = 0;
+  }
+
+  // MPI counts are ints, so large buffers go out in several collective rounds.
+  const long long chunk = INT_MAX / 2;
+  long long rounds = (length + chunk - 1) / chunk;
+  long long max_rounds = 0;
+  MPI_Allreduce(&rounds, &max_rounds, 1, MPI_LONG_LONG, MPI_MAX,
+                MPI_COMM_WORLD);
+
+  MPI_File fh;
+  int err = MPI_File_open(MPI_COMM_WORLD, path,
+                          MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                          &fh);
+  if (err != MPI_SUCCESS) {
+    if (rank == 0) {
+      fprintf(stderr, "Error: cannot open output file %s\n", path);
+    }
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+
+  MPI_File_set_size(fh, 0);
+
+  long long written = 0;
+  for (long long round = 0; round < max_rounds; round++) {
+    long long remaining = length - written;
+    int count = (int)(remaining < chunk ? remaining : chunk);
+
+    MPI_File_write_at_all(fh, offset + written, buffer + written, count,
+                          MPI_CHAR, MPI_STATUS_IGNORE);
+    written += count;
+  }
+
+  MPI_File_close(&fh);
+}
+
+double **build_similarity(const struct sparse_graph *g, int n) {
+  double **D = alloc_matrix(n);
+
+  for (int i = 0; i < n; i++) {
+    D[i][i] = 0;
+    for (int j = i + 1; j < n; j++) {
+      double inverse_similarity = direct_distance(g, i, j);
+      D[i][j] = inverse_similarity;
+      D[j][i] = inverse_similarity;
+    }
+  }
+
+  return D;
+}
+
+// Per-phase wall times measured on rank 0.
+struct phase_times {
+  double word_set;
+  double graph;
+  double similarity;
+  double pathfinder;
+  double output;
+  double total;
+};
+
+// Appends one JSON object per run to path. Communication figures are reduced
+// over all ranks, so every rank has to call this.
+void write_stats(const char *path, const struct phase_times *times,
+                 int text_size, int unique_words) {
+  int rank, size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+  double comm_time_max = 0, comm_time_sum = 0;
+  long long comm_bytes = 0, comm_calls = 0;
+  MPI_Reduce(&comm.time, &comm_time_max, 1, MPI_DOUBLE, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(&comm.time, &comm_time_sum, 1, MPI_DOUBLE, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(&comm.bytes, &comm_bytes, 1, MPI_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(&comm.calls, &comm_calls, 1, MPI_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+
+  if (rank != 0) {
+    return;
+  }
+
+  FILE *file = fopen(path, "a");
+  if (file == NULL) {
+    fprintf(stderr, "Warning: cannot open stats file %s\n", path);
+    return;
+  }
+
+  fprintf(file,
+          "{\"procs\":%d,\"text_size\":%d,\"unique_words\":%d,"
+          "\"word_set\":%.6f,\"graph\":%.6f,\"similarity\":%.6f,"
+          "\"pathfinder\":%.6f,\"output\":%.6f,\"total\":%.6f,"
+          "\"comm_time_max\":%.6f,\"comm_time_avg\":%.6f,"
+          "\"comm_bytes\":%lld,\"comm_calls\":%lld}\n",
+          size, text_size, unique_words, times->word_set, times->graph,
+          times->similarity, times->pathfinder, times->output, times->total,
+          comm_time_max, comm_time_sum / size, comm_bytes, comm_calls);
+  fclose(file);
+}
+
 int main(int argc, char **argv) {
-  // Initialize MPI
-  MPI_Init(&argc, &argv);
+  // Initialize MPI. Rank 0 may write checkpoints from a helper thread that
+  // never calls MPI, which FUNNELED permits.
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 
   int rank, size;
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &size);
 
+  struct options opts;
+  parse_options(argc, argv, &opts);
+
   double start_time = MPI_Wtime();
 
   if (rank == 0) {
@@ -189,16 +1396,25 @@ int main(int argc, char **argv) {
   int wordSetSize = 0;
   char **text = NULL;
   int text_size = 0;
-  double **graph = NULL;
+  int text_capacity = 0;
+  struct arena strings = {NULL};
+  struct sparse_graph sparse = {NULL};
   double **D = NULL;
   double **pf_net = NULL;
+  struct checkpoint ckpt_state;
+  struct phase_times times = {0, 0, 0, 0, 0, 0};
+
+  const double r = 1;
 
   if (rank == 0) {
     char buffer[1024];
 
     while (scanf("%s", buffer) == 1) {
-      text = realloc(text, (text_size + 1) * sizeof(char *));
-      text[text_size] = strdup(buffer);
+      if (text_size == text_capacity) {
+        text_capacity = text_capacity > 0 ? 2 * text_capacity : 1024;
+        text = realloc(text, text_capacity * sizeof(char *));
+      }
+      text[text_size] = arena_strdup(&strings, buffer);
       text_size++;
     }
 
@@ -210,105 +1426,152 @@ int main(int argc, char **argv) {
 
     qsort(wordSet, wordSetSize, sizeof(char *), compare_strings);
 
+    times.word_set = MPI_Wtime() - start_time;
     printf("Unique words:\t%d\n", wordSetSize);
-    printf("Word Set:\t%.2f s\n", MPI_Wtime() - start_time);
+    printf("Word Set:\t%.2f s\n", times.word_set);
 
     double wordset_time = MPI_Wtime();
 
     int n = wordSetSize;
 
-    MPI_Bcast(&wordSetSize, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    comm_bcast(&wordSetSize, 1, MPI_INT, 0);
 
-    graph = (double **)malloc(n * sizeof(double *));
-    for (int i = 0; i < n; i++) {
-      graph[i] = (double *)calloc(n, sizeof(double));
-    }
+    struct checkpoint *ckpt = NULL;
+    if (opts.checkpoint_path != NULL) {
+      ckpt = &ckpt_state;
+      checkpoint_init(ckpt, opts.checkpoint_path,
+                      hash_input(text, text_size, r), n,
+                      opts.checkpoint_interval);
 
-    for (int i = 0; i < text_size; i++) {
-      int token_i = find_index(wordSet, wordSetSize, text[i]);
-
-      int max_neighbor = (i + 1 + _MAX_DISTANCE < text_size)
-                             ? i + 1 + _MAX_DISTANCE
-                             : text_size;
-      for (int j = i + 1; j < max_neighbor; j++) {
-        int token_j = find_index(wordSet, wordSetSize, text[j]);
-        if (token_i != token_j) {
-          graph[token_i][token_j]++;
-          graph[token_j][token_i]++;
-        }
+      if (opts.resume) {
+        D = checkpoint_load(opts.checkpoint_path, ckpt->input_hash, n,
+                            &ckpt->start_k);
       }
     }
 
-    printf("Graph Init:\t%.2f s\n", MPI_Wtime() - wordset_time);
-    double graph_time = MPI_Wtime();
+    if (D != NULL) {
+      // The checkpointed matrix already holds the similarities, partially
+      // closed, so graph construction and the similarity stage are skipped.
+      printf("Resumed:\t%s (k = %d of %d)\n", opts.checkpoint_path,
+             ckpt->start_k, n);
+    } else {
+      build_sparse_graph(&sparse, text, text_size, wordSet, wordSetSize);
 
-    D = (double **)malloc(n * sizeof(double *));
-    for (int i = 0; i < n; i++) {
-      D[i] = (double *)malloc(n * sizeof(double));
-    }
+      times.graph = MPI_Wtime() - wordset_time;
+      printf("Graph Init:\t%.2f s\n", times.graph);
+      double graph_time = MPI_Wtime();
 
-    for (int i = 0; i < n; i++) {
-      D[i][i] = 0;
-      for (int j = i + 1; j < n; j++) {
-        double similarity = cosine_similarity(graph[i], graph[j], n);
-        double inverse_similarity;
-        if (similarity == 0) {
-          inverse_similarity = _INFINITY;
-        } else {
-          inverse_similarity = 1 - similarity;
-        }
-        D[i][j] = inverse_similarity;
-        D[j][i] = inverse_similarity;
+      D = build_similarity(&sparse, n);
+
+      // Only the link modes look at the direct distances again, so plain
+      // pair output drops the co-occurrence counts before the closure.
+      if (opts.output_mode == OUTPUT_PAIRS) {
+        free_sparse_graph(&sparse);
       }
-    }
 
-    printf("Similarity:\t%.2f s\n", MPI_Wtime() - graph_time);
+      times.similarity = MPI_Wtime() - graph_time;
+      printf("Similarity:\t%.2f s\n", times.similarity);
+    }
   } else {
-    MPI_Bcast(&wordSetSize, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    comm_bcast(&wordSetSize, 1, MPI_INT, 0);
   }
 
   double pathfinder_start = MPI_Wtime();
 
   const int q = wordSetSize - 1;
-  const double r = 1;
 
-  pf_net = pathfinder_network(D, wordSetSize, q, r, rank);
+  struct progress_reporter reporter;
+  progress_start(&reporter, rank, opts.progress_interval, opts.progress_path);
+  pf_net = pathfinder_network(D, wordSetSize, q, r, rank,
+                              opts.checkpoint_path != NULL ? &ckpt_state
+                                                           : NULL);
+  progress_stop(&reporter);
 
   if (rank == 0) {
-    printf("Pathfinder:\t%.2f s\n", MPI_Wtime() - pathfinder_start);
+    times.pathfinder = MPI_Wtime() - pathfinder_start;
+    printf("Pathfinder:\t%.2f s\n", times.pathfinder);
     printf("Total:\t%.2f s\n", MPI_Wtime() - start_time);
     printf("===============================================\n");
     printf("RESULT\n");
     printf("===============================================\n");
+    fflush(stdout);
+  }
 
-    for (int i = 0; i < wordSetSize; i++) {
-      for (int j = i + 1; j < wordSetSize; j++) {
-        printf("%s %s %f\n", wordSet[i], wordSet[j], pf_net[i][j]);
-      }
+  double output_start = MPI_Wtime();
+
+  if (rank == 0 && opts.output_mode != OUTPUT_PAIRS &&
+      sparse.row_start == NULL) {
+    // A resumed run never saw the direct distances the links are selected
+    // by, so the co-occurrence counts are rebuilt from the input.
+    build_sparse_graph(&sparse, text, text_size, wordSet, wordSetSize);
+  }
+
+  if (opts.binary_path != NULL) {
+    // Process with rank 0 holds the whole closure, so it writes the file.
+    if (rank == 0) {
+      write_binary_result(opts.binary_path, wordSet, &sparse, pf_net,
+                          wordSetSize, opts.output_mode);
     }
+  } else if (opts.output_mode != OUTPUT_PAIRS) {
+    // The links are O(n) lines, so rank 0 renders them all; with -o the other
+    // ranks join the collective write with nothing to add.
+    char *buffer = NULL;
+    long long length = 0;
 
-    for (int i = 0; i < text_size; i++) {
-      free(text[i]);
+    if (rank == 0) {
+      buffer = format_links(wordSet, &sparse, pf_net, wordSetSize,
+                            opts.output_mode, &length);
     }
-    free(text);
 
-    for (int i = 0; i < wordSetSize; i++) {
-      free(wordSet[i]);
-      free(graph[i]);
-      free(D[i]);
-      free(pf_net[i]);
+    if (opts.output_path != NULL) {
+      write_result_file(opts.output_path, buffer, length);
+    } else if (rank == 0) {
+      write_all(STDOUT_FILENO, buffer, length);
     }
-    free(wordSet);
-    free(graph);
-    free(D);
-    free(pf_net);
-  } else {
-    for (int i = 0; i < wordSetSize; i++) {
-      free(pf_net[i]);
+
+    free(buffer);
+  } else if (opts.output_path != NULL) {
+    // Each rank already holds the final values of the rows it computed, so it
+    // formats those and writes them straight into the shared output file.
+    char *pool = NULL;
+    char **words = broadcast_word_set(wordSet, wordSetSize, rank, &pool);
+
+    int start_row, end_row;
+    row_range(wordSetSize, rank, size, &start_row, &end_row);
+
+    long long length = 0;
+    char *buffer =
+        format_rows(words, pf_net, wordSetSize, start_row, end_row, &length);
+
+    write_result_file(opts.output_path, buffer, length);
+
+    free(buffer);
+    free(words);
+    free(pool);
+  } else if (rank == 0) {
+    write_results(wordSet, pf_net, wordSetSize);
+  }
+
+  if (opts.stats_path != NULL) {
+    if (rank == 0) {
+      fflush(stdout);
+      times.output = MPI_Wtime() - output_start;
+      times.total = MPI_Wtime() - start_time;
     }
-    free(pf_net);
+    write_stats(opts.stats_path, &times, text_size, wordSetSize);
   }
 
+  if (rank == 0) {
+    // The words point into the token strings, so one release frees both.
+    free(text);
+    free(wordSet);
+    arena_free(&strings);
+    free_sparse_graph(&sparse);
+  }
+
+  // On rank 0 the closure ran in place, so pf_net is D there.
+  free_matrix(pf_net);
+
   MPI_Finalize();
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,177 @@
+#!/bin/bash
+
+# Strong and weak scaling benchmark for mpi.c on a single machine.
+#
+# Usage: ./script/bench.sh <max_procs> [vocab_size ...]
+#
+# Environment:
+#   CORPUS       token source for the generated inputs (default test_case/case4.txt)
+#   REPS         repetitions per configuration (default 3)
+#   OUT_DIR      where inputs, raw stats and tables are written (default bench)
+#   MPIRUN_FLAGS extra flags for mpirun (default --oversubscribe)
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <max_procs> [vocab_size ...]"
+    exit 1
+fi
+
+MAX_PROCS=$1
+shift
+VOCABS=${*:-"500 1000 2000"}
+CORPUS=${CORPUS:-test_case/case4.txt}
+REPS=${REPS:-3}
+OUT_DIR=${OUT_DIR:-bench}
+MPIRUN_FLAGS=${MPIRUN_FLAGS:---oversubscribe}
+
+if [ "$(id -u)" -eq 0 ]; then
+    MPIRUN_FLAGS="$MPIRUN_FLAGS --allow-run-as-root"
+fi
+
+if [ ! -f "$CORPUS" ]; then
+    echo "Error: corpus $CORPUS does not exist."
+    exit 1
+fi
+
+mkdir -p "$OUT_DIR/input"
+
+echo "Compiling mpi.c..."
+mpicc -O2 mpi.c -o mpi -pthread -lm
+if [ $? -ne 0 ]; then
+    echo "Error: Compilation failed."
+    exit 1
+fi
+
+# Writes the shortest prefix of the corpus with the requested number of
+# unique words, so vocabulary size can be swept independently of the files
+# in test_case.
+make_input() {
+    local vocab=$1
+    local file="$OUT_DIR/input/vocab-$vocab.txt"
+
+    if [ ! -f "$file" ]; then
+        awk -v target="$vocab" '
+            {
+                for (i = 1; i <= NF; i++) {
+                    if (!($i in seen)) {
+                        if (unique == target) { exit }
+                        seen[$i] = 1
+                        unique++
+                    }
+                    printf "%s ", $i
+                }
+            }
+            END {
+                if (unique < target) {
+                    printf "Warning: corpus only has %d unique words\n", unique > "/dev/stderr"
+                }
+            }' "$CORPUS" >"$file"
+    fi
+
+    echo "$file"
+}
+
+run_config() {
+    local mode=$1
+    local procs=$2
+    local vocab=$3
+    local input
+    input=$(make_input "$vocab")
+
+    for rep in $(seq 1 "$REPS"); do
+        echo "[$mode] procs=$procs vocab=$vocab rep=$rep"
+        mpirun $MPIRUN_FLAGS -np "$procs" ./mpi --stats "$OUT_DIR/$mode.jsonl" \
+            -o "$OUT_DIR/result.txt" <"$input" >/dev/null
+        if [ $? -ne 0 ]; then
+            echo "Error: run failed (procs=$procs vocab=$vocab)."
+            exit 1
+        fi
+    done
+}
+
+rm -f "$OUT_DIR/strong.jsonl" "$OUT_DIR/weak.jsonl"
+
+# Strong scaling: fixed vocabulary, growing number of processes.
+for vocab in $VOCABS; do
+    for procs in $(seq 1 "$MAX_PROCS"); do
+        run_config strong "$procs" "$vocab"
+    done
+done
+
+# Weak scaling: the closure is O(n^3), so the vocabulary grows with the cube
+# root of the process count to keep the work per process constant.
+BASE_VOCAB=$(echo $VOCABS | awk '{ print $1 }')
+for procs in $(seq 1 "$MAX_PROCS"); do
+    vocab=$(awk -v n="$BASE_VOCAB" -v p="$procs" 'BEGIN { printf "%d", n * p ^ (1 / 3) + 0.5 }')
+    run_config weak "$procs" "$vocab"
+done
+
+# Averages the repetitions of every (procs, unique_words) pair and derives
+# speed-up and efficiency against the single-process run of the same group
+# (same vocabulary for strong scaling, the whole sweep for weak scaling).
+summarize() {
+    local mode=$1
+
+    awk -v mode="$mode" -v csv="$OUT_DIR/$mode.csv" -v json="$OUT_DIR/$mode.json" '
+        BEGIN {
+            split("word_set graph similarity pathfinder output total comm_time_max comm_time_avg comm_bytes", fields, " ")
+        }
+        {
+            n = split($0, kv, /[{}":,]+/)
+            delete row
+            for (i = 2; i < n; i += 2) {
+                row[kv[i]] = kv[i + 1]
+            }
+            key = row["unique_words"] SUBSEP row["procs"]
+            if (!(key in count)) {
+                order[++keys] = key
+                words[key] = row["unique_words"]
+                procs[key] = row["procs"]
+            }
+            count[key]++
+            for (f in fields) {
+                sum[key, fields[f]] += row[fields[f]]
+            }
+        }
+        END {
+            printf "procs,unique_words,reps" > csv
+            for (f = 1; f <= length(fields); f++) {
+                printf ",%s", fields[f] > csv
+            }
+            printf ",speedup,efficiency\n" > csv
+            printf "[\n" > json
+
+            for (k = 1; k <= keys; k++) {
+                key = order[k]
+                group = (mode == "strong") ? words[key] : "all"
+                if (procs[key] == 1) {
+                    base[group] = sum[key, "total"] / count[key]
+                }
+            }
+
+            for (k = 1; k <= keys; k++) {
+                key = order[k]
+                group = (mode == "strong") ? words[key] : "all"
+                total = sum[key, "total"] / count[key]
+                speedup = (group in base && total > 0) ? base[group] / total : 0
+                efficiency = (mode == "strong") ? speedup / procs[key] : speedup
+
+                printf "%d,%d,%d", procs[key], words[key], count[key] > csv
+                printf "  {\"procs\": %d, \"unique_words\": %d, \"reps\": %d", procs[key], words[key], count[key] > json
+                for (f = 1; f <= length(fields); f++) {
+                    value = sum[key, fields[f]] / count[key]
+                    format = (fields[f] == "comm_bytes") ? "%.0f" : "%.6f"
+                    printf "," format, value > csv
+                    printf ", \"%s\": " format, fields[f], value > json
+                }
+                printf ",%.4f,%.4f\n", speedup, efficiency > csv
+                printf ", \"speedup\": %.4f, \"efficiency\": %.4f}%s\n", speedup, efficiency, (k < keys) ? "," : "" > json
+            }
+            printf "]\n" > json
+        }' "$OUT_DIR/$mode.jsonl"
+}
+
+summarize strong
+summarize weak
+rm -f "$OUT_DIR/result.txt"
+
+echo "Benchmark completed. Tables saved to $OUT_DIR/strong.csv, $OUT_DIR/weak.csv (and .json)."
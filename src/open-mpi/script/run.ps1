@@ -9,7 +9,7 @@ if (-not $N -or -not $TESTCASE) {
 }
 
 Write-Host "Compiling MPI program on node1..."
-docker exec -it node1 sh -c "mpicc mpi.c -o mpi -lm"
+docker exec -it node1 sh -c "mpicc mpi.c -o mpi -pthread -lm"
 
 Write-Host "Running MPI program with $N nodes (Test Case: $TESTCASE)..."
 docker exec -it node1 sh -c "mpirun --allow-run-as-root -np $N --hostfile /mpi/hostfile mpi < test_case/case$TESTCASE.txt > output/out-$TESTCASE.txt"
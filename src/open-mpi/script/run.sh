@@ -11,5 +11,5 @@ fi
 N=$1 # Number of nodes
 TESTCASE=$2
 
-docker exec -it node1 sh -c "mpicc mpi.c -o mpi -lm"
+docker exec -it node1 sh -c "mpicc mpi.c -o mpi -pthread -lm"
 docker exec -it node1 sh -c "mpirun --allow-run-as-root -np $N --hostfile /mpi/hostfile mpi < test_case/case$TESTCASE.txt > output/out-$N-$TESTCASE.txt"
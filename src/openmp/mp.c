@@ -1,314 +1,2378 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <linux/perf_event.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 #include <omp.h>
 
+#include "pfnet.h"
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define _MAX_DISTANCE 5
 #define _INFINITY DBL_MAX
 
-void blocked_floyd_warshall(double **D, int n, int block_size, int r)
-{
-    int n_blocks = n / block_size;
-    
-    int num_threads;
+#define MATRIX_ALIGNMENT 64
+#define OUTPUT_CHUNK_PAIRS (1 << 18)
+#define OUTPUT_BUFFER_SIZE (1 << 22)
+// Bytes a result line needs beyond its two words: two separators, the
+// newline and the value, which is at most 20 characters below 1e12 and up to
+// DBL_MAX_10_EXP + 9 otherwise.
+#define FAST_LINE_EXTRA 23
+#define SLOW_LINE_EXTRA (DBL_MAX_10_EXP + 12)
+
+#define RESULT_MAGIC "PFNETB1"
+#define RESULT_MATRIX 0
+#define RESULT_EDGES 1
+
+#define CHECKPOINT_MAGIC "PFCKPT1"
+#define CHECKPOINT_DEFAULT_INTERVAL 60.0
+
+#define OOC_DEFAULT_BUDGET_MB 1024
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define BATCH_DEFAULT_WORDS 1024
+
+#define INCREMENTAL_MAGIC "PFINC1"
+
+#define TUNE_DEFAULT_SIZE 480
+#define TUNE_MAX_TRIALS 64
+
+#define RECALL_SAMPLES 100
+
+#define VERIFY_SOURCES 8
+#define VERIFY_SEED 0x5eed
+
+// The library reports failures as codes; here they are fatal like any other
+// input error.
+void check_status(int status, const char *stage)
+{
+    if (status != PFNET_OK) {
+        fprintf(stderr, "Error: %s failed: %s\n", stage, pfnet_strerror(status));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Row table over a library matrix, so the output code keeps D[i][j].
+double **matrix_rows(double *matrix, int n, size_t stride)
+{
+    double **D = (double **)malloc((n > 0 ? n : 1) * sizeof(double *));
+    D[0] = matrix;
+    for (int i = 1; i < n; i++) {
+        D[i] = matrix + i * stride;
+    }
+    return D;
+}
+
+// What the RESULT section lists: every pair with its closure distance, only
+// the retained PFNET links, or the links as one adjacency line per word.
+enum output_mode {
+    OUTPUT_PAIRS,
+    OUTPUT_EDGES,
+    OUTPUT_ADJACENCY
+};
+
+struct options {
+    const char *checkpoint_path;
+    double checkpoint_interval;
+    int resume;
+    enum output_mode output_mode;
+    const char *binary_path;
+    const char *ooc_path;
+    size_t memory_budget;
+    int numa;
+    const char *batch_path;
+    int batch_words;
+    const char *incremental_path;
+    int tune;
+    int tune_size;
+    int approximate;
+    struct pfnet_lsh lsh;
+    int min_count;
+    int max_vocab;
+    const char *stopwords_path;
+    int prune_mode;
+    const char *stats_path;
+    int perf;
+    int verify;
+    double progress_interval;
+    const char *progress_path;
+};
+
+void parse_options(int argc, char **argv, struct options *opts)
+{
+    opts->checkpoint_path = NULL;
+    opts->checkpoint_interval = CHECKPOINT_DEFAULT_INTERVAL;
+    opts->resume = 0;
+    opts->output_mode = OUTPUT_PAIRS;
+    opts->binary_path = NULL;
+    opts->ooc_path = NULL;
+    opts->memory_budget = (size_t)OOC_DEFAULT_BUDGET_MB << 20;
+    opts->numa = 0;
+    opts->batch_path = NULL;
+    opts->batch_words = BATCH_DEFAULT_WORDS;
+    opts->incremental_path = NULL;
+    opts->tune = 0;
+    opts->tune_size = TUNE_DEFAULT_SIZE;
+    opts->approximate = 0;
+    pfnet_default_lsh(&opts->lsh);
+    opts->min_count = 0;
+    opts->max_vocab = 0;
+    opts->stopwords_path = NULL;
+    opts->prune_mode = PFNET_PRUNE_DROP;
+    opts->stats_path = NULL;
+    opts->perf = 0;
+    opts->verify = 0;
+    opts->progress_interval = 0;
+    opts->progress_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--edges") == 0) {
+            opts->output_mode = OUTPUT_EDGES;
+        } else if (strcmp(argv[i], "--adjacency") == 0) {
+            opts->output_mode = OUTPUT_ADJACENCY;
+        } else if (strcmp(argv[i], "--binary") == 0 && i + 1 < argc) {
+            opts->binary_path = argv[++i];
+        } else if (strcmp(argv[i], "--out-of-core") == 0 && i + 1 < argc) {
+            opts->ooc_path = argv[++i];
+        } else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+            opts->memory_budget = (size_t)(atof(argv[++i]) * (1 << 20));
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            opts->checkpoint_path = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc) {
+            opts->checkpoint_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            opts->resume = 1;
+        } else if (strcmp(argv[i], "--numa") == 0) {
+            opts->numa = 1;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            opts->batch_path = argv[++i];
+        } else if (strcmp(argv[i], "--batch-words") == 0 && i + 1 < argc) {
+            opts->batch_words = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--incremental") == 0 && i + 1 < argc) {
+            opts->incremental_path = argv[++i];
+        } else if (strcmp(argv[i], "--tune") == 0) {
+            opts->tune = 1;
+        } else if (strcmp(argv[i], "--tune-size") == 0 && i + 1 < argc) {
+            opts->tune_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lsh") == 0 && i + 1 < argc) {
+            opts->approximate = 1;
+            opts->lsh.top_k = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lsh-bands") == 0 && i + 1 < argc) {
+            opts->lsh.bands = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lsh-bits") == 0 && i + 1 < argc) {
+            opts->lsh.band_bits = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lsh-probe") == 0 && i + 1 < argc) {
+            opts->lsh.probe = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--min-count") == 0 && i + 1 < argc) {
+            opts->min_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-vocab") == 0 && i + 1 < argc) {
+            opts->max_vocab = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stopwords") == 0 && i + 1 < argc) {
+            opts->stopwords_path = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            opts->stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            opts->perf = 1;
+        } else if (strcmp(argv[i], "--verify") == 0 && i + 1 < argc) {
+            opts->verify = atoi(argv[++i]);
+        } else if (strncmp(argv[i], "--verify=", 9) == 0) {
+            opts->verify = atoi(argv[i] + 9);
+        } else if (strcmp(argv[i], "--progress") == 0 && i + 1 < argc) {
+            opts->progress_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--progress-file") == 0 && i + 1 < argc) {
+            opts->progress_path = argv[++i];
+        } else if (strcmp(argv[i], "--pruned") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "drop") == 0) {
+                opts->prune_mode = PFNET_PRUNE_DROP;
+            } else if (strcmp(argv[i], "skip") == 0) {
+                opts->prune_mode = PFNET_PRUNE_SKIP;
+            } else {
+                fprintf(stderr, "Error: --pruned takes drop or skip\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (opts->resume && opts->checkpoint_path == NULL) {
+        opts->checkpoint_path = "pfnet.ckpt";
+    }
+
+    // The out-of-core engine streams the closure to the pair listing and
+    // never holds the matrices the other modes read.
+    if (opts->ooc_path != NULL
+        && (opts->checkpoint_path != NULL || opts->binary_path != NULL
+            || opts->output_mode != OUTPUT_PAIRS || opts->numa || opts->verify > 0)) {
+        fprintf(stderr, "Error: --out-of-core cannot be combined with "
+                        "--checkpoint, --resume, --binary, --edges, --adjacency, "
+                        "--numa or --verify\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A batch writes one text result per document and keeps no matrix
+    // beyond the document it belongs to.
+    if (opts->batch_path != NULL
+        && (opts->checkpoint_path != NULL || opts->binary_path != NULL
+            || opts->ooc_path != NULL || opts->numa || opts->stats_path != NULL
+            || opts->perf || opts->verify > 0 || opts->progress_interval > 0)) {
+        fprintf(stderr, "Error: --batch cannot be combined with --checkpoint, "
+                        "--resume, --binary, --out-of-core, --numa, --stats, --perf, "
+                        "--verify or --progress\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The incremental state is the closed matrix itself, so it replaces the
+    // checkpoint and needs the matrix in memory.
+    if (opts->incremental_path != NULL
+        && (opts->checkpoint_path != NULL || opts->ooc_path != NULL
+            || opts->batch_path != NULL)) {
+        fprintf(stderr, "Error: --incremental cannot be combined with --checkpoint, "
+                        "--resume, --out-of-core or --batch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Which words survive depends on the counts of the whole text, which a
+    // saved state only knows in part.
+    if (opts->incremental_path != NULL
+        && (opts->min_count > 1 || opts->max_vocab > 0 || opts->stopwords_path != NULL)) {
+        fprintf(stderr, "Error: --incremental cannot be combined with --min-count, "
+                        "--max-vocab or --stopwords\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The sparse closure is a single call over an in-memory matrix, with no
+    // rounds to checkpoint and no saved closure to update.
+    if (opts->approximate
+        && (opts->checkpoint_path != NULL || opts->ooc_path != NULL
+            || opts->batch_path != NULL || opts->incremental_path != NULL)) {
+        fprintf(stderr, "Error: --lsh cannot be combined with --checkpoint, --resume, "
+                        "--out-of-core, --batch or --incremental\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The limits of pfnet_similarity_lsh(), checked here so a bad value
+    // fails before the word set and graph are built. atoi() gives 0 for a
+    // non-number, which they reject as well.
+    if (opts->lsh.top_k < 1 || opts->lsh.bands < 1 || opts->lsh.band_bits < 1
+        || opts->lsh.band_bits > 32 || opts->lsh.probe < 1) {
+        fprintf(stderr, "Error: --lsh and --lsh-bands take at least 1, --lsh-bits "
+                        "1 to 32 and --lsh-probe at least 1\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Binary result layout (see --binary). All fields are little-endian and
+// every section starts on an 8-byte boundary, so a reader can mmap the file
+// and index it in place:
+//   struct result_header
+//   vocabulary: uint64_t offsets[n + 1] into the string pool that follows,
+//     then the NUL-terminated words in sorted order, padded to 8 bytes
+//   RESULT_MATRIX: the closure distances of the pairs i < j row by row, as
+//     doubles, pair (i, j) at i * n - i * (i + 1) / 2 + j - i - 1
+//   RESULT_EDGES: uint64_t row_offsets[n + 1], then one struct result_edge
+//     per PFNET link i < j, grouped by i and sorted by j
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the binary result format is written in host byte order"
+#endif
+
+struct result_header {
+    char magic[8];
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t n;
+    uint64_t vocab_offset;
+    uint64_t data_offset;
+    uint64_t data_count;
+    uint64_t file_size;
+};
+
+struct result_edge {
+    uint32_t i;
+    uint32_t j;
+    double weight;
+};
+
+// On-disk layout: this header followed by the n * n matrix, row-major. The
+// matrix is closed over the intermediates 0 .. next_k - 1, which is all any
+// engine needs to continue, whatever tile size wrote it.
+struct checkpoint_header {
+    char magic[8];
+    uint64_t input_hash;
+    int32_t n;
+    int32_t next_k;
+};
+
+struct checkpoint {
+    const char *path;
+    uint64_t input_hash;
+    int n;
+    int start_k;
+    double interval;
+    double last_time;
+
+    // The compute loop copies D into staging and hands it to the writer
+    // thread; while a write is still in flight further checkpoints are skipped
+    // instead of waiting for it.
+    double *staging;
+    int staged_next_k;
+    pthread_t writer;
+    int writer_active;
+    atomic_int writer_done;
+};
+
+uint64_t hash_input(char **text, int text_size, double r)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int i = 0; i < text_size; i++) {
+        for (const unsigned char *c = (const unsigned char *)text[i]; *c; c++) {
+            hash = (hash ^ *c) * 1099511628211ULL;
+        }
+        hash = (hash ^ ' ') * 1099511628211ULL;
+    }
+
+    const unsigned char *bytes = (const unsigned char *)&r;
+    for (size_t i = 0; i < sizeof(r); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    hash = (hash ^ _MAX_DISTANCE) * 1099511628211ULL;
+
+    return hash;
+}
+
+// Pruning changes the network of the same text, so its settings belong to
+// the input a checkpoint is for. Without pruning the hash is left as it is,
+// which keeps checkpoints interchangeable with the Open MPI version.
+uint64_t hash_pruning(uint64_t hash, const struct pfnet_options *lib)
+{
+    if (lib->min_count <= 1 && lib->max_vocab <= 0 && lib->n_stopwords <= 0) {
+        return hash;
+    }
+
+    int settings[3] = {lib->min_count, lib->max_vocab, lib->prune_mode};
+    const unsigned char *bytes = (const unsigned char *)settings;
+    for (size_t i = 0; i < sizeof(settings); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    for (int i = 0; i < lib->n_stopwords; i++) {
+        for (const unsigned char *c = (const unsigned char *)lib->stopwords[i]; *c; c++) {
+            hash = (hash ^ *c) * 1099511628211ULL;
+        }
+        hash = (hash ^ ' ') * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+void *checkpoint_writer(void *arg)
+{
+    struct checkpoint *ckpt = (struct checkpoint *)arg;
+    size_t tmp_len = strlen(ckpt->path) + 5;
+    char *tmp_path = (char *)malloc(tmp_len);
+    snprintf(tmp_path, tmp_len, "%s.tmp", ckpt->path);
+
+    struct checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.input_hash = ckpt->input_hash;
+    header.n = ckpt->n;
+    header.next_k = ckpt->staged_next_k;
+
+    size_t cells = (size_t)ckpt->n * ckpt->n;
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL
+        || fwrite(&header, sizeof(header), 1, file) != 1
+        || fwrite(ckpt->staging, sizeof(double), cells, file) != cells
+        || fclose(file) != 0) {
+        fprintf(stderr, "Warning: failed to write checkpoint %s\n", tmp_path);
+    } else {
+        // rename() replaces the previous checkpoint atomically, so a job killed
+        // mid-write still resumes from the last complete one.
+        rename(tmp_path, ckpt->path);
+    }
+
+    free(tmp_path);
+    atomic_store_explicit(&ckpt->writer_done, 1, memory_order_release);
+    return NULL;
+}
+
+void checkpoint_init(struct checkpoint *ckpt, const char *path, uint64_t input_hash,
+                     int n, double interval)
+{
+    memset(ckpt, 0, sizeof(*ckpt));
+    ckpt->path = path;
+    ckpt->input_hash = input_hash;
+    ckpt->n = n;
+    ckpt->interval = interval;
+    ckpt->last_time = omp_get_wtime();
+}
+
+// Loads a checkpoint written for the same input into D, which the caller has
+// already allocated (and placed). Returns 0 and leaves next_k alone when
+// there is no usable checkpoint.
+int checkpoint_load(const char *path, uint64_t input_hash, int n, double **D,
+                    int *next_k)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+
+    struct checkpoint_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0
+        || header.input_hash != input_hash
+        || header.n != n || header.next_k < 0 || header.next_k > n) {
+        fclose(file);
+        return 0;
+    }
+
+    int ok = 1;
+    for (int i = 0; i < n && ok; i++) {
+        if (fread(D[i], sizeof(double), n, file) != (size_t)n) {
+            ok = 0;
+        }
+    }
+    fclose(file);
+
+    if (!ok) {
+        return 0;
+    }
+
+    *next_k = header.next_k;
+    return 1;
+}
+
+// Called after every completed round of the closure. Cheap when no
+// checkpoint is due: one clock read.
+void checkpoint_save(struct checkpoint *ckpt, const double *D, size_t stride,
+                     int next_k)
+{
+    if (ckpt == NULL) {
+        return;
+    }
+
+    double now = omp_get_wtime();
+    if (now - ckpt->last_time < ckpt->interval) {
+        return;
+    }
+
+    if (ckpt->writer_active) {
+        if (!atomic_load_explicit(&ckpt->writer_done, memory_order_acquire)) {
+            return;
+        }
+        pthread_join(ckpt->writer, NULL);
+        ckpt->writer_active = 0;
+    }
+
+    int n = ckpt->n;
+    if (ckpt->staging == NULL) {
+        ckpt->staging = (double *)malloc((size_t)n * n * sizeof(double));
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        memcpy(&ckpt->staging[(size_t)i * n], D + i * stride, n * sizeof(double));
+    }
+
+    ckpt->staged_next_k = next_k;
+    atomic_store_explicit(&ckpt->writer_done, 0, memory_order_relaxed);
+    if (pthread_create(&ckpt->writer, NULL, checkpoint_writer, ckpt) == 0) {
+        ckpt->writer_active = 1;
+    }
+    ckpt->last_time = now;
+}
+
+// Progress hook of pfnet_closure(), user being the checkpoint.
+void checkpoint_progress(void *user, const double *D, size_t stride, int n,
+                         int next_k)
+{
+    (void)n;
+    checkpoint_save((struct checkpoint *)user, D, stride, next_k);
+}
+
+// Waits for an outstanding write and removes the checkpoint once the closure
+// has finished, since there is nothing left to resume.
+void checkpoint_finish(struct checkpoint *ckpt)
+{
+    if (ckpt == NULL) {
+        return;
+    }
+
+    if (ckpt->writer_active) {
+        pthread_join(ckpt->writer, NULL);
+        ckpt->writer_active = 0;
+    }
+
+    remove(ckpt->path);
+    free(ckpt->staging);
+    ckpt->staging = NULL;
+}
+
+// Incremental state (--incremental), rewritten at the end of every run:
+//   struct incremental_header
+//   vocabulary: uint64_t offsets[n + 1] into the NUL-terminated words that
+//     follow, in sorted order
+//   context: int32_t vocabulary indices of the last n_context tokens, the
+//     ones the windows of appended text reach back to
+//   the co-occurrence graph, see pfnet_graph_write()
+//   the closed matrix, n rows of n doubles
+struct incremental_header {
+    char magic[8];
+    uint64_t n;
+    uint64_t text_size;
+    int32_t window;
+    int32_t n_context;
+    double r;
+};
+
+struct incremental_state {
+    FILE *file;
+    struct incremental_header header;
+    char *pool;
+    const char **words;
+    const char **context;
+    struct pfnet_graph *graph;
+};
+
+void incremental_corrupt(const char *path)
+{
+    fprintf(stderr, "Error: %s is not an incremental state of this program\n", path);
+    exit(EXIT_FAILURE);
+}
+
+// Reads all of a saved state but the matrix, which is loaded once the new
+// vocabulary has fixed its shape. Returns 0 when there is no state yet.
+int incremental_open(struct incremental_state *inc, const char *path, int window,
+                     double r)
+{
+    memset(inc, 0, sizeof(*inc));
+    inc->file = fopen(path, "rb");
+    if (inc->file == NULL) {
+        return 0;
+    }
+
+    struct incremental_header *h = &inc->header;
+    if (fread(h, sizeof(*h), 1, inc->file) != 1
+        || memcmp(h->magic, INCREMENTAL_MAGIC, sizeof(INCREMENTAL_MAGIC)) != 0
+        || h->n > INT32_MAX || h->n_context < 0 || h->n_context > window) {
+        incremental_corrupt(path);
+    }
+    if (h->window != window || h->r != r) {
+        fprintf(stderr, "Error: %s was built with window %d and r %g\n", path,
+                h->window, h->r);
+        exit(EXIT_FAILURE);
+    }
+
+    int n = (int)h->n;
+    uint64_t *offsets = (uint64_t *)malloc((n + 1) * sizeof(uint64_t));
+    if (fread(offsets, sizeof(uint64_t), n + 1, inc->file) != (size_t)n + 1
+        || offsets[0] != 0) {
+        incremental_corrupt(path);
+    }
+
+    inc->pool = (char *)malloc(offsets[n] > 0 ? offsets[n] : 1);
+    inc->words = (const char **)malloc((n > 0 ? n : 1) * sizeof(char *));
+    if (fread(inc->pool, 1, offsets[n], inc->file) != offsets[n]) {
+        incremental_corrupt(path);
+    }
+    for (int i = 0; i < n; i++) {
+        if (offsets[i + 1] <= offsets[i] || inc->pool[offsets[i + 1] - 1] != '\0') {
+            incremental_corrupt(path);
+        }
+        inc->words[i] = inc->pool + offsets[i];
+    }
+    free(offsets);
+
+    int32_t *context = (int32_t *)malloc((h->n_context > 0 ? h->n_context : 1)
+                                         * sizeof(int32_t));
+    inc->context = (const char **)malloc((h->n_context > 0 ? h->n_context : 1)
+                                         * sizeof(char *));
+    if (fread(context, sizeof(int32_t), h->n_context, inc->file) != (size_t)h->n_context) {
+        incremental_corrupt(path);
+    }
+    for (int i = 0; i < h->n_context; i++) {
+        if (context[i] < 0 || context[i] >= n) {
+            incremental_corrupt(path);
+        }
+        inc->context[i] = inc->words[context[i]];
+    }
+    free(context);
+
+    if (pfnet_graph_read(inc->file, &inc->graph) != PFNET_OK
+        || pfnet_graph_size(inc->graph) != n) {
+        incremental_corrupt(path);
+    }
+
+    return 1;
+}
+
+// Reads the saved closure into the new n x n matrix, old word i at new index
+// map[i]. Pairs with a new word start unconnected.
+void incremental_load_matrix(struct incremental_state *inc, const char *path,
+                             double *matrix, size_t stride, int n, const int *map)
+{
+    int n_old = (int)inc->header.n;
+
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            matrix[i * stride + j] = i == j ? 0 : _INFINITY;
+        }
+    }
+
+    double *row = (double *)malloc((n_old > 0 ? n_old : 1) * sizeof(double));
+    for (int i = 0; i < n_old; i++) {
+        if (fread(row, sizeof(double), n_old, inc->file) != (size_t)n_old) {
+            incremental_corrupt(path);
+        }
+        double *out = matrix + map[i] * stride;
+        for (int j = 0; j < n_old; j++) {
+            out[map[j]] = row[j];
+        }
+    }
+    free(row);
+
+    fclose(inc->file);
+    inc->file = NULL;
+}
+
+void incremental_close(struct incremental_state *inc)
+{
+    if (inc->file != NULL) {
+        fclose(inc->file);
+    }
+    pfnet_graph_free(inc->graph);
+    free(inc->context);
+    free(inc->words);
+    free(inc->pool);
+}
+
+struct lowered_pair {
+    int u;
+    int v;
+    double w;
+};
+
+int compare_pairs(const void *a, const void *b)
+{
+    const struct lowered_pair *x = (const struct lowered_pair *)a;
+    const struct lowered_pair *y = (const struct lowered_pair *)b;
+    if (x->u != y->u) {
+        return (x->u > y->u) - (x->u < y->u);
+    }
+    return (x->v > y->v) - (x->v < y->v);
+}
+
+// Direct distances between the saved graph and the extended one, for
+// pfnet_closure_raise(): the larger of the two, so only the grown pairs
+// change before the lowered ones are applied.
+struct raised_graphs {
+    const struct pfnet_graph *old_graph;
+    const int *old_index;
+    const struct pfnet_graph *graph;
+};
+
+double old_distance(const struct raised_graphs *g, int i, int j)
+{
+    if (g->old_index[i] < 0 || g->old_index[j] < 0) {
+        return _INFINITY;
+    }
+    return pfnet_direct_distance(g->old_graph, g->old_index[i], g->old_index[j]);
+}
+
+double raised_distance(void *user, int i, int j)
+{
+    const struct raised_graphs *g = (const struct raised_graphs *)user;
+    double w_old = old_distance(g, i, j);
+    double w_new = pfnet_direct_distance(g->graph, i, j);
+    return w_new > w_old ? w_new : w_old;
+}
+
+// A direct distance only depends on the co-occurrence rows of its two words,
+// so only pairs with a touched word (one in the appended windows) can have
+// changed. The lowered ones go to pairs, sorted by word, and raised[i] marks
+// the touched words with a pair that grew and was its own shortest path; a
+// pair that was not can grow without changing any path. Returns the number
+// of lowered pairs.
+int incremental_changes(const struct raised_graphs *g, const char *touched, double **D,
+                        int n, char *raised, struct lowered_pair **pairs)
+{
+    struct lowered_pair *lowered = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < n; i++) {
+        if (!touched[i]) {
+            continue;
+        }
+
+        for (int j = 0; j < n; j++) {
+            if (j == i || (touched[j] && j < i)) {
+                continue;
+            }
+
+            double w_old = old_distance(g, i, j);
+            double w_new = pfnet_direct_distance(g->graph, i, j);
+
+            // D never exceeds the direct distance, so equality means the
+            // pair was a shortest path.
+            if (w_new > w_old && D[i][j] >= w_old) {
+                raised[i] = 1;
+            } else if (w_new < w_old) {
+                #pragma omp critical
+                {
+                    if (count == capacity) {
+                        capacity = capacity > 0 ? 2 * capacity : 1024;
+                        lowered = (struct lowered_pair *)realloc(
+                            lowered, capacity * sizeof(struct lowered_pair));
+                    }
+                    lowered[count++] = (struct lowered_pair){i, j, w_new};
+                }
+            }
+        }
+    }
+
+    qsort(lowered, count, sizeof(struct lowered_pair), compare_pairs);
+    *pairs = lowered;
+    return count;
+}
+
+// Brings the saved closure in D up to date with the appended text: first the
+// pairs through words with a grown shortest-path pair are recomputed, then
+// the lowered pairs are applied, one O(n^2) pass per touched word. Returns 0
+// without finishing when rebuilding D is cheaper, which is when more than
+// half the words are touched or more than n^2 / deg pairs need recomputing,
+// for an average of deg neighbours per word: each costs up to n direct
+// distances of O(deg), about what the full similarity and closure take.
+int incremental_closure(const struct raised_graphs *g, const char *touched,
+                        double *matrix, double **D, int n, size_t stride,
+                        const struct pfnet_options *lib, int *n_lowered)
+{
+    int n_touched = 0;
+    for (int i = 0; i < n; i++) {
+        n_touched += touched[i];
+    }
+    if (2 * n_touched > n) {
+        return 0;
+    }
+
+    char *raised = (char *)calloc(n > 0 ? n : 1, 1);
+    struct lowered_pair *lowered;
+    int count = incremental_changes(g, touched, D, n, raised, &lowered);
+
+    int *vertices = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+    int n_vertices = 0;
+    for (int i = 0; i < n; i++) {
+        if (raised[i]) {
+            vertices[n_vertices++] = i;
+        }
+    }
+
+    size_t deg = n > 0 ? pfnet_graph_entries(g->graph) / n : 0;
+    int status = pfnet_closure_raise(matrix, n, stride, vertices, n_vertices,
+                                     raised_distance, (void *)g,
+                                     (size_t)n * n / (deg > 1 ? deg : 1), lib);
+    if (status != PFNET_ERANGE) {
+        check_status(status, "closure update");
+
+        int *u = (int *)malloc((count > 0 ? count : 1) * sizeof(int));
+        int *v = (int *)malloc((count > 0 ? count : 1) * sizeof(int));
+        double *w = (double *)malloc((count > 0 ? count : 1) * sizeof(double));
+        for (int e = 0; e < count; e++) {
+            u[e] = lowered[e].u;
+            v[e] = lowered[e].v;
+            w[e] = lowered[e].w;
+        }
+        check_status(pfnet_closure_update(matrix, n, stride, u, v, w, count, lib),
+                     "closure update");
+        free(u);
+        free(v);
+        free(w);
+    }
+
+    free(raised);
+    free(lowered);
+    free(vertices);
+
+    *n_lowered = count;
+    return status != PFNET_ERANGE;
+}
+
+// Writes the state through a temporary file and rename(), like a checkpoint,
+// so an interrupted run keeps the previous state.
+void incremental_save(const char *path, const char *const *wordSet, int n,
+                      const int32_t *context, int n_context, uint64_t text_size,
+                      const struct pfnet_graph *graph, double **D, int window, double r)
+{
+    size_t tmp_len = strlen(path) + 5;
+    char *tmp_path = (char *)malloc(tmp_len);
+    snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+    struct incremental_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INCREMENTAL_MAGIC, sizeof(INCREMENTAL_MAGIC));
+    header.n = n;
+    header.text_size = text_size;
+    header.window = window;
+    header.n_context = n_context;
+    header.r = r;
+
+    uint64_t *offsets = (uint64_t *)malloc((n + 1) * sizeof(uint64_t));
+    offsets[0] = 0;
+    for (int i = 0; i < n; i++) {
+        offsets[i + 1] = offsets[i] + strlen(wordSet[i]) + 1;
+    }
+
+    FILE *file = fopen(tmp_path, "wb");
+    int ok = file != NULL;
+    if (ok) {
+        ok &= fwrite(&header, sizeof(header), 1, file) == 1;
+        ok &= fwrite(offsets, sizeof(uint64_t), n + 1, file) == (size_t)n + 1;
+        for (int i = 0; i < n; i++) {
+            size_t len = offsets[i + 1] - offsets[i];
+            ok &= fwrite(wordSet[i], 1, len, file) == len;
+        }
+        ok &= fwrite(context, sizeof(int32_t), n_context, file) == (size_t)n_context;
+        ok &= pfnet_graph_write(graph, file) == PFNET_OK;
+        for (int i = 0; i < n; i++) {
+            ok &= fwrite(D[i], sizeof(double), n, file) == (size_t)n;
+        }
+    }
+    if (file != NULL && fclose(file) != 0) {
+        ok = 0;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error: failed to write incremental state %s\n", tmp_path);
+        exit(EXIT_FAILURE);
+    }
+    rename(tmp_path, path);
+
+    free(offsets);
+    free(tmp_path);
+}
+
+// Bump-pointer storage for the token strings, which all live until exit:
+// they are packed back to back in ARENA_BLOCK_SIZE blocks instead of one
+// malloc each, and the whole arena is released with one pass over the blocks.
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+};
+
+struct arena {
+    struct arena_block *head;
+};
+
+char *arena_strdup(struct arena *arena, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    struct arena_block *block = arena->head;
+
+    if (block == NULL || block->size - block->used < len) {
+        size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        block = (struct arena_block *)malloc(sizeof(struct arena_block) + size);
+        block->next = arena->head;
+        block->used = 0;
+        block->size = size;
+        arena->head = block;
+    }
+
+    char *copy = (char *)(block + 1) + block->used;
+    memcpy(copy, s, len);
+    block->used += len;
+    return copy;
+}
+
+void arena_free(struct arena *arena)
+{
+    while (arena->head != NULL) {
+        struct arena_block *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+// Empties the arena for the next input but keeps its newest block, so a
+// batch does not go back to malloc for every document.
+void arena_reset(struct arena *arena)
+{
+    struct arena_block *keep = arena->head;
+    if (keep == NULL) {
+        return;
+    }
+
+    arena->head = keep->next;
+    arena_free(arena);
+    keep->next = NULL;
+    keep->used = 0;
+    arena->head = keep;
+}
+
+// Appends every whitespace-separated token of in to text, growing it as
+// needed, and returns the new token count.
+int read_tokens(FILE *in, char ***text, int text_size, int *text_capacity,
+                struct arena *strings)
+{
+    char buffer[1024];
+
+    while (fscanf(in, "%1023s", buffer) == 1) {
+        if (text_size == *text_capacity) {
+            *text_capacity = *text_capacity > 0 ? 2 * *text_capacity : 1024;
+            *text = realloc(*text, *text_capacity * sizeof(char *));
+        }
+        (*text)[text_size] = arena_strdup(strings, buffer);
+        text_size++;
+    }
+
+    return text_size;
+}
+
+// Renders value exactly like printf("%f") (six decimals, round-half-even on
+// the exact binary value) without going through stdio or the locale. Values
+// of 1e12 and above, infinities and NaNs are rare and handed to sprintf, so
+// out needs room for DBL_MAX_10_EXP + 9 characters.
+int format_fixed6(char *out, double value)
+{
+    char *p = out;
+
+    if (signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+
+    if (!(value < 1e12)) {
+        return (int)(p - out) + sprintf(p, "%f", value);
+    }
+
+    // value = m * 2^e exactly, with m < 2^53 and e < 0 for every value below
+    // 1e12, so value * 10^6 = (m * 10^6) / 2^-e fits 128-bit arithmetic.
+    int exp;
+    double mant = frexp(value, &exp);
+    uint64_t m = (uint64_t)ldexp(mant, 53);
+    int shift = 53 - exp;
+
+    unsigned __int128 scaled = (unsigned __int128)m * 1000000;
+    uint64_t q = 0;
+    if (shift < 128) {
+        unsigned __int128 whole = scaled >> shift;
+        unsigned __int128 rem = scaled - (whole << shift);
+        unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+
+        q = (uint64_t)whole;
+        if (rem > half || (rem == half && (q & 1))) {
+            q++;
+        }
+    }
+
+    uint64_t int_part = q / 1000000;
+    uint32_t frac_part = (uint32_t)(q % 1000000);
+
+    char digits[20];
+    int len = 0;
+    do {
+        digits[len++] = (char)('0' + int_part % 10);
+        int_part /= 10;
+    } while (int_part > 0);
+    while (len > 0) {
+        *p++ = digits[--len];
+    }
+
+    *p++ = '.';
+    for (int i = 5; i >= 0; i--) {
+        p[i] = (char)('0' + frac_part % 10);
+        frac_part /= 10;
+    }
+    p += 6;
+
+    return (int)(p - out);
+}
+
+void write_all(int fd, const char *buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written <= 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        buffer += written;
+        length -= written;
+    }
+}
+
+// Prints every pair (i, j > i) of rows row_begin .. row_end - 1 as
+// "%s %s %f\n"; only those rows of pf_net are read. Rows are grouped into
+// chunks of about OUTPUT_CHUNK_PAIRS pairs; each round formats one chunk per
+// slot in parallel into reusable buffers, then writes the slots in order with
+// large write() calls, so the text is identical to the printf loop it
+// replaces.
+void write_result_rows(int fd, const char *const *wordSet, double **pf_net, int n,
+                       int row_begin, int row_end)
+{
+    fflush(stdout);
+
+    int *word_len = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+    size_t *suffix_len = (size_t *)malloc((n + 1) * sizeof(size_t));
+    suffix_len[n] = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        word_len[i] = strlen(wordSet[i]);
+        suffix_len[i] = suffix_len[i + 1] + word_len[i];
+    }
+
+    int *chunk_start = (int *)malloc((n + 1) * sizeof(int));
+    int n_chunks = 0;
+    long long pairs = 0;
+    for (int i = row_begin; i < row_end; i++) {
+        if (i == row_begin || pairs >= OUTPUT_CHUNK_PAIRS) {
+            chunk_start[n_chunks++] = i;
+            pairs = 0;
+        }
+        pairs += n - 1 - i;
+    }
+    chunk_start[n_chunks] = row_end;
+
+    // Missing links are _INFINITY, the most frequent slow-path value, so its
+    // text is rendered once up front.
+    char inf_text[DBL_MAX_10_EXP + 16];
+    int inf_len = format_fixed6(inf_text, _INFINITY);
+
+    int slots = 2 * omp_get_max_threads();
+    char **buffer = (char **)calloc(slots, sizeof(char *));
+    size_t *capacity = (size_t *)calloc(slots, sizeof(size_t));
+    size_t *used = (size_t *)calloc(slots, sizeof(size_t));
+
+    for (int first = 0; first < n_chunks; first += slots) {
+        int count = min(slots, n_chunks - first);
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int s = 0; s < count; s++) {
+            int c = first + s;
+            // Lines whose value takes the fast path are at most
+            // FAST_LINE_EXTRA characters longer than the two words.
+            size_t needed = 0;
+            for (int i = chunk_start[c]; i < chunk_start[c + 1]; i++) {
+                needed += (size_t)(n - 1 - i) * (word_len[i] + FAST_LINE_EXTRA)
+                          + suffix_len[i + 1];
+            }
+            if (capacity[s] < needed) {
+                free(buffer[s]);
+                capacity[s] = needed;
+                buffer[s] = (char *)malloc(capacity[s]);
+            }
+
+            char *p = buffer[s];
+            for (int i = chunk_start[c]; i < chunk_start[c + 1]; i++) {
+                for (int j = i + 1; j < n; j++) {
+                    // Values past the fast path are long, so grow on demand.
+                    size_t offset = p - buffer[s];
+                    size_t line = word_len[i] + word_len[j] + SLOW_LINE_EXTRA;
+                    if (offset + line > capacity[s]) {
+                        capacity[s] = 2 * capacity[s] + line;
+                        buffer[s] = (char *)realloc(buffer[s], capacity[s]);
+                        p = buffer[s] + offset;
+                    }
+
+                    memcpy(p, wordSet[i], word_len[i]);
+                    p += word_len[i];
+                    *p++ = ' ';
+                    memcpy(p, wordSet[j], word_len[j]);
+                    p += word_len[j];
+                    *p++ = ' ';
+                    if (pf_net[i][j] == _INFINITY) {
+                        memcpy(p, inf_text, inf_len);
+                        p += inf_len;
+                    } else {
+                        p += format_fixed6(p, pf_net[i][j]);
+                    }
+                    *p++ = '\n';
+                }
+            }
+            used[s] = p - buffer[s];
+        }
+
+        for (int s = 0; s < count; s++) {
+            write_all(fd, buffer[s], used[s]);
+        }
+    }
+
+    for (int s = 0; s < slots; s++) {
+        free(buffer[s]);
+    }
+    free(buffer);
+    free(capacity);
+    free(used);
+    free(chunk_start);
+    free(suffix_len);
+    free(word_len);
+}
+
+void write_results(int fd, const char *const *wordSet, double **pf_net, int n)
+{
+    write_result_rows(fd, wordSet, pf_net, n, 0, n);
+}
+
+// The pairs pfnet_similarity_lsh_kept() kept, as compressed rows.
+struct kept_pairs {
+    int *offsets;
+    int *cols;
+};
+
+// The PFNET links as compressed rows, see pfnet_links(): row i at
+// cols[offsets[i] .. offsets[i + 1]). With --lsh, kept holds the pairs the
+// approximate similarity kept, the only ones with a direct distance.
+int *collect_links(const struct pfnet_graph *g, double **pf_net, int n,
+                   int symmetric, const struct kept_pairs *kept, int **offsets)
+{
+    int *row_start = (int *)malloc((n + 1) * sizeof(int));
+    int *cols;
+    size_t stride = pfnet_matrix_stride(n);
+
+    if (kept != NULL) {
+        check_status(pfnet_links_among(g, pf_net[0], stride, symmetric, kept->offsets,
+                                       kept->cols, row_start, &cols, NULL),
+                     "link extraction");
+    } else {
+        check_status(pfnet_links_alloc(g, pf_net[0], stride, symmetric, row_start,
+                                       &cols, NULL),
+                     "link extraction");
+    }
+
+    *offsets = row_start;
+    return cols;
+}
+
+// Prints the retained links only, as "%s %s %f\n" per link (i < j) or, in
+// adjacency mode, one line per word: the word followed by a tab-separated
+// "neighbour weight" entry for each of its links.
+void write_links(int fd, const char *const *wordSet, const struct pfnet_graph *g,
+                 double **pf_net, int n, const struct kept_pairs *kept,
+                 enum output_mode mode)
+{
+    fflush(stdout);
+
+    int adjacency = mode == OUTPUT_ADJACENCY;
+    int *offsets;
+    int *cols = collect_links(g, pf_net, n, adjacency, kept, &offsets);
+
+    char *buffer = (char *)malloc(OUTPUT_BUFFER_SIZE);
+    size_t used = 0;
+
+    for (int i = 0; i < n; i++) {
+        size_t len_i = strlen(wordSet[i]);
+
+        if (adjacency) {
+            if (used + len_i + 1 > OUTPUT_BUFFER_SIZE) {
+                write_all(fd, buffer, used);
+                used = 0;
+            }
+            memcpy(buffer + used, wordSet[i], len_i);
+            used += len_i;
+        }
+
+        for (int e = offsets[i]; e < offsets[i + 1]; e++) {
+            int j = cols[e];
+            size_t len_j = strlen(wordSet[j]);
+            // Words are shorter than the 1024-byte input buffer, so one entry
+            // always fits an empty buffer.
+            if (used + len_i + len_j + SLOW_LINE_EXTRA > OUTPUT_BUFFER_SIZE) {
+                write_all(fd, buffer, used);
+                used = 0;
+            }
+
+            char *p = buffer + used;
+            if (adjacency) {
+                *p++ = '\t';
+            } else {
+                memcpy(p, wordSet[i], len_i);
+                p += len_i;
+                *p++ = ' ';
+            }
+            memcpy(p, wordSet[j], len_j);
+            p += len_j;
+            *p++ = ' ';
+            p += format_fixed6(p, pf_net[i][j]);
+            if (!adjacency) {
+                *p++ = '\n';
+            }
+            used = p - buffer;
+        }
+
+        if (adjacency) {
+            buffer[used++] = '\n';
+        }
+    }
+
+    write_all(fd, buffer, used);
+
+    free(buffer);
+    free(cols);
+    free(offsets);
+}
+
+// Writes the result in the binary layout above: the full upper triangle for
+// OUTPUT_PAIRS, the PFNET links otherwise.
+void write_binary_result(const char *path, const char *const *wordSet,
+                         const struct pfnet_graph *g, double **pf_net, int n,
+                         const struct kept_pairs *kept, enum output_mode mode)
+{
+    struct result_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RESULT_MAGIC, sizeof(RESULT_MAGIC));
+    header.kind = mode == OUTPUT_PAIRS ? RESULT_MATRIX : RESULT_EDGES;
+    header.n = n;
+
+    uint64_t *vocab = (uint64_t *)malloc((n + 1) * sizeof(uint64_t));
+    vocab[0] = 0;
+    for (int i = 0; i < n; i++) {
+        vocab[i + 1] = vocab[i] + strlen(wordSet[i]) + 1;
+    }
+
+    uint64_t vocab_end = sizeof(header) + (n + 1) * sizeof(uint64_t) + vocab[n];
+    header.vocab_offset = sizeof(header);
+    header.data_offset = (vocab_end + 7) & ~(uint64_t)7;
+
+    int *offsets = NULL;
+    int *cols = NULL;
+    if (header.kind == RESULT_MATRIX) {
+        header.data_count = n > 1 ? (uint64_t)n * (n - 1) / 2 : 0;
+        header.file_size = header.data_offset + header.data_count * sizeof(double);
+    } else {
+        cols = collect_links(g, pf_net, n, 0, kept, &offsets);
+        header.data_count = offsets[n];
+        header.file_size = header.data_offset + (n + 1) * sizeof(uint64_t)
+                           + header.data_count * sizeof(struct result_edge);
+    }
+
+    static const char padding[8] = {0};
+    FILE *file = fopen(path, "wb");
+    int ok = file != NULL;
+
+    if (ok) {
+        ok &= fwrite(&header, sizeof(header), 1, file) == 1;
+        ok &= fwrite(vocab, sizeof(uint64_t), n + 1, file) == (size_t)n + 1;
+        for (int i = 0; i < n; i++) {
+            size_t len = vocab[i + 1] - vocab[i];
+            ok &= fwrite(wordSet[i], 1, len, file) == len;
+        }
+        size_t pad = header.data_offset - vocab_end;
+        ok &= fwrite(padding, 1, pad, file) == pad;
+    }
+
+    if (ok && header.kind == RESULT_MATRIX) {
+        for (int i = 0; i < n - 1; i++) {
+            size_t count = n - i - 1;
+            ok &= fwrite(pf_net[i] + i + 1, sizeof(double), count, file) == count;
+        }
+    } else if (ok) {
+        for (int i = 0; i <= n; i++) {
+            uint64_t offset = offsets[i];
+            ok &= fwrite(&offset, sizeof(offset), 1, file) == 1;
+        }
+        for (int i = 0; i < n; i++) {
+            for (int e = offsets[i]; e < offsets[i + 1]; e++) {
+                struct result_edge edge = {(uint32_t)i, (uint32_t)cols[e],
+                                           pf_net[i][cols[e]]};
+                ok &= fwrite(&edge, sizeof(edge), 1, file) == 1;
+            }
+        }
+    }
+
+    if (file != NULL && fclose(file) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: failed to write binary result %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    free(cols);
+    free(offsets);
+    free(vocab);
+}
+
+// Prints one strip of the out-of-core closure, see pfnet_ooc_rows().
+void ooc_write_rows(void *user, double **rows, int row_begin, int row_end)
+{
+    const struct pfnet_vocab *vocab = (const struct pfnet_vocab *)user;
+    write_result_rows(STDOUT_FILENO, pfnet_vocab_words(vocab), rows,
+                      pfnet_vocab_size(vocab), row_begin, row_end);
+}
+
+// Batch mode (--batch): one manifest line per document, "input [output]",
+// the output defaulting to input.pfnet. Blank lines and lines starting with
+// '#' are skipped.
+struct batch_job {
+    char *input;
+    char *output;
+};
+
+enum batch_status {
+    BATCH_DONE,
+    BATCH_DEFERRED,
+    BATCH_FAILED
+};
+
+// Buffers a thread keeps from one document to the next: the token table,
+// the token strings and the distance matrix with its row table only grow,
+// so after the first few documents a thread stops allocating.
+struct batch_scratch {
+    char **text;
+    int text_capacity;
+    struct arena strings;
+    double *matrix;
+    size_t matrix_cells;
+    double **rows;
+    int rows_capacity;
+};
+
+struct batch_job *read_manifest(const char *path, int *n_jobs)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    struct batch_job *jobs = NULL;
+    int count = 0;
+    int capacity = 0;
+    char line[4096];
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char input[4096];
+        char output[4096];
+        int fields = sscanf(line, "%4095s %4095s", input, output);
+        if (fields < 1 || input[0] == '#') {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 64;
+            jobs = (struct batch_job *)realloc(jobs, capacity * sizeof(struct batch_job));
+        }
+
+        jobs[count].input = strdup(input);
+        if (fields == 2) {
+            jobs[count].output = strdup(output);
+        } else {
+            size_t len = strlen(input) + sizeof(".pfnet");
+            jobs[count].output = (char *)malloc(len);
+            snprintf(jobs[count].output, len, "%s.pfnet", input);
+        }
+        count++;
+    }
+
+    fclose(file);
+    *n_jobs = count;
+    return jobs;
+}
+
+// An n x n matrix in the scratch buffer, reallocated only when n outgrows
+// every earlier document of this thread.
+double **batch_matrix(struct batch_scratch *s, int n)
+{
+    size_t stride = pfnet_matrix_stride(n);
+    size_t cells = (size_t)n * stride;
+
+    if (s->matrix == NULL || cells > s->matrix_cells) {
+        pfnet_matrix_free(s->matrix);
+        s->matrix = pfnet_matrix_alloc(n, NULL);
+        if (s->matrix == NULL) {
+            check_status(PFNET_ENOMEM, "matrix allocation");
+        }
+        s->matrix_cells = cells;
+    }
+
+    if (n > s->rows_capacity) {
+        s->rows_capacity = n;
+        s->rows = (double **)realloc(s->rows, n * sizeof(double *));
+    }
+    for (int i = 0; i < n; i++) {
+        s->rows[i] = s->matrix + i * stride;
+    }
+
+    return s->rows;
+}
+
+void batch_scratch_free(struct batch_scratch *s)
+{
+    free(s->text);
+    arena_free(&s->strings);
+    pfnet_matrix_free(s->matrix);
+    free(s->rows);
+}
+
+// Runs the whole pipeline for one document on the buffers of the calling
+// thread, with lib->threads threads. A document with more than max_words
+// unique words is left for the parallel engine (max_words < 0 takes any).
+enum batch_status batch_document(const struct batch_job *job, struct batch_scratch *s,
+                                 const struct pfnet_options *lib,
+                                 enum output_mode mode, int max_words)
+{
+    FILE *in = fopen(job->input, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Warning: cannot open %s, skipped\n", job->input);
+        return BATCH_FAILED;
+    }
+
+    double wtime = omp_get_wtime();
+
+    arena_reset(&s->strings);
+    int text_size = read_tokens(in, &s->text, 0, &s->text_capacity, &s->strings);
+    fclose(in);
+    const char *const *text = (const char *const *)s->text;
+
+    struct pfnet_vocab *vocab;
+    check_status(pfnet_vocab_build(text, text_size, lib, &vocab), "word set");
+    int n = pfnet_vocab_size(vocab);
+
+    if (max_words >= 0 && n > max_words) {
+        pfnet_vocab_free(vocab);
+        return BATCH_DEFERRED;
+    }
+
+    struct pfnet_graph *graph;
+    check_status(pfnet_graph_build(vocab, text, text_size, lib, &graph),
+                 "graph construction");
+
+    double **D = batch_matrix(s, n);
+    size_t stride = pfnet_matrix_stride(n);
+    check_status(pfnet_similarity(graph, s->matrix, stride, lib), "similarity");
+    check_status(pfnet_closure(s->matrix, n, stride, 0, lib), "closure");
+
+    enum batch_status status = BATCH_DONE;
+    int fd = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Warning: cannot create %s, skipped\n", job->output);
+        status = BATCH_FAILED;
+    } else {
+        if (mode == OUTPUT_PAIRS) {
+            write_results(fd, pfnet_vocab_words(vocab), D, n);
+        } else {
+            write_links(fd, pfnet_vocab_words(vocab), graph, D, n, NULL, mode);
+        }
+        close(fd);
+
+        printf("%s\t%d\t%d\t%.2f s\n", job->input, text_size, n,
+               omp_get_wtime() - wtime);
+    }
+
+    pfnet_graph_free(graph);
+    pfnet_vocab_free(vocab);
+    return status;
+}
+
+int compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Processes every document of the manifest in this one process, so the
+// OpenMP threads are started once for the whole batch. Documents of up to
+// batch_words unique words run concurrently, one per thread, each on a
+// single thread with that thread's scratch buffers. Larger ones, where one
+// closure has enough work for the whole team, are deferred and then run
+// one after another with all threads, on the same pool.
+int run_batch(const struct options *opts, const struct pfnet_options *lib)
+{
+    int n_jobs;
+    struct batch_job *jobs = read_manifest(opts->batch_path, &n_jobs);
+    int num_threads = lib->threads;
+
+    printf("Documents:\t%d\n", n_jobs);
+    printf("===============================================\n");
+    printf("BATCH\n");
+    printf("===============================================\n");
+
+    double wtime = omp_get_wtime();
+
+    struct batch_scratch *scratch =
+        (struct batch_scratch *)calloc(num_threads, sizeof(struct batch_scratch));
+    int *deferred = (int *)malloc((n_jobs > 0 ? n_jobs : 1) * sizeof(int));
+    int n_deferred = 0;
+    int failed = 0;
+
+    struct pfnet_options serial = *lib;
+    serial.threads = 1;
+
+    #pragma omp parallel num_threads(num_threads) reduction(+:failed)
+    {
+        struct batch_scratch *s = &scratch[omp_get_thread_num()];
+        // The output writers open their own parallel regions; nested here
+        // they must stay on this thread.
+        omp_set_num_threads(1);
+
+        #pragma omp for schedule(dynamic, 1)
+        for (int d = 0; d < n_jobs; d++) {
+            enum batch_status status = batch_document(&jobs[d], s, &serial,
+                                                      opts->output_mode,
+                                                      opts->batch_words);
+            if (status == BATCH_DEFERRED) {
+                #pragma omp critical
+                deferred[n_deferred++] = d;
+            } else if (status == BATCH_FAILED) {
+                failed++;
+            }
+        }
+    }
+
+    // Large documents in manifest order, reusing the first thread's buffers.
+    qsort(deferred, n_deferred, sizeof(int), compare_ints);
+    for (int i = 0; i < n_deferred; i++) {
+        if (batch_document(&jobs[deferred[i]], &scratch[0], lib, opts->output_mode,
+                           -1) == BATCH_FAILED) {
+            failed++;
+        }
+    }
+
+    printf("===============================================\n");
+    printf("Parallel:\t%d documents\n", n_deferred);
+    printf("Failed:\t%d documents\n", failed);
+    printf("Total:\t%.2f s\n", omp_get_wtime() - wtime);
+
+    for (int t = 0; t < num_threads; t++) {
+        batch_scratch_free(&scratch[t]);
+    }
+    for (int d = 0; d < n_jobs; d++) {
+        free(jobs[d].input);
+        free(jobs[d].output);
+    }
+    free(scratch);
+    free(deferred);
+    free(jobs);
+
+    return failed > 0 ? EXIT_FAILURE : 0;
+}
+
+// Recall of an approximate D against the exact k nearest words, by direct
+// distance, of up to RECALL_SAMPLES words spread over the vocabulary: the
+// share of them D kept. Ties are broken by word index as in the library.
+double lsh_recall(const struct pfnet_graph *g, double **D, int n, int k,
+                  int *n_sampled)
+{
+    int samples = min(n, RECALL_SAMPLES);
+    long found = 0;
+    long wanted = 0;
+
+    #pragma omp parallel reduction(+:found, wanted)
+    {
+        double *dist = (double *)malloc(k * sizeof(double));
+        int *word = (int *)malloc(k * sizeof(int));
+
+        #pragma omp for schedule(dynamic, 1)
+        for (int s = 0; s < samples; s++) {
+            int i = (int)((long)s * n / samples);
+            int size = 0;
+            for (int j = 0; j < n; j++) {
+                double d = j == i ? _INFINITY : pfnet_direct_distance(g, i, j);
+                if (d == _INFINITY || (size == k && d >= dist[size - 1])) {
+                    continue;
+                }
+                int at = size < k ? size++ : size - 1;
+                while (at > 0 && dist[at - 1] > d) {
+                    dist[at] = dist[at - 1];
+                    word[at] = word[at - 1];
+                    at--;
+                }
+                dist[at] = d;
+                word[at] = j;
+            }
+
+            wanted += size;
+            for (int t = 0; t < size; t++) {
+                found += D[i][word[t]] != _INFINITY;
+            }
+        }
+
+        free(dist);
+        free(word);
+    }
+
+    *n_sampled = samples;
+    return wanted > 0 ? (double)found / wanted : 1.0;
+}
+
+// --verify N recomputes N sampled pairs of the closed matrix by a method
+// that shares no code with the closure engines: Dijkstra over the direct
+// distances of the co-occurrence graph, with its own Minkowski combine.
+// One search gives the whole row of its source, so the pairs are drawn from
+// at most VERIFY_SOURCES words and the check costs that many searches.
+struct verify_result {
+    int pairs;
+    int sources;
+    double max_error;
+    double mean_error;
+    int unreachable;   // pairs finite on one side only
+    int link_flips;    // pairs whose PFNET link test disagrees
+};
+
+uint64_t verify_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// The length of a two-step path under r. Dijkstra is exact here because
+// the combine never shortens either step.
+double minkowski(double a, double b, double r)
+{
+    if (r == _INFINITY) {
+        return fmax(a, b);
+    }
+    if (r == 1) {
+        return a + b;
+    }
+    return pow(pow(a, r) + pow(b, r), 1.0 / r);
+}
+
+// Shortest path lengths from s on the dense direct-distance graph, by
+// scanning for the closest open word instead of keeping a heap: every
+// settled word relaxes all others anyway.
+void reference_row(const struct pfnet_graph *g, int n, int s, double r, double *dist,
+                   char *settled)
+{
+    for (int v = 0; v < n; v++) {
+        dist[v] = _INFINITY;
+        settled[v] = 0;
+    }
+    dist[s] = 0;
+
+    for (;;) {
+        int u = -1;
+        for (int v = 0; v < n; v++) {
+            if (!settled[v] && dist[v] != _INFINITY && (u < 0 || dist[v] < dist[u])) {
+                u = v;
+            }
+        }
+        if (u < 0) {
+            break;
+        }
+        settled[u] = 1;
+
+        for (int v = 0; v < n; v++) {
+            if (settled[v]) {
+                continue;
+            }
+            double w = pfnet_direct_distance(g, u, v);
+            if (w != _INFINITY) {
+                dist[v] = fmin(dist[v], minkowski(dist[u], w, r));
+            }
+        }
+    }
+}
+
+void verify_closure(const struct pfnet_graph *g, double **D, int n, double r, int samples,
+                    struct verify_result *result)
+{
+    memset(result, 0, sizeof(*result));
+    if (n < 2 || samples <= 0) {
+        return;
+    }
+
+    // The sample is fixed by VERIFY_SEED, so reruns check the same pairs.
+    uint64_t state = VERIFY_SEED;
+    int n_sources = min(min(samples, VERIFY_SOURCES), n);
+    int *sources = (int *)malloc(n_sources * sizeof(int));
+    for (int s = 0; s < n_sources; s++) {
+        int word;
+        int seen;
+        do {
+            word = (int)(verify_random(&state) % n);
+            seen = 0;
+            for (int t = 0; t < s; t++) {
+                seen |= sources[t] == word;
+            }
+        } while (seen);
+        sources[s] = word;
+    }
+
+    int *targets = (int *)malloc(samples * sizeof(int));
+    for (int p = 0; p < samples; p++) {
+        int s = sources[p % n_sources];
+        do {
+            targets[p] = (int)(verify_random(&state) % n);
+        } while (targets[p] == s);
+    }
+
+    double *rows = (double *)malloc((size_t)n_sources * n * sizeof(double));
     #pragma omp parallel
     {
-        #pragma omp master
-        num_threads = omp_get_num_threads();
-    }
-    
-    double *A = (double *)malloc(block_size * block_size * sizeof(double));
-    
-    double **block_C = (double **)malloc(num_threads * sizeof(double *));
-    double **block_A = (double **)malloc(num_threads * sizeof(double *));
-    double **block_B = (double **)malloc(num_threads * sizeof(double *));
-    
-    for (int t = 0; t < num_threads; t++) {
-        block_C[t] = (double *)malloc(block_size * block_size * sizeof(double));
-        block_A[t] = (double *)malloc(block_size * block_size * sizeof(double));
-        block_B[t] = (double *)malloc(block_size * block_size * sizeof(double));
-    }
-    
-    for (int k_block = 0; k_block < n_blocks; k_block++) {
-        // Phase 1: Dependent phase
-        for (int i = 0; i < block_size; i++) {
-            for (int j = 0; j < block_size; j++) {
-                A[i * block_size + j] = D[k_block * block_size + i][k_block * block_size + j];
-            }
+        char *settled = (char *)malloc(n);
+        #pragma omp for schedule(dynamic, 1)
+        for (int s = 0; s < n_sources; s++) {
+            reference_row(g, n, sources[s], r, rows + (size_t)s * n, settled);
         }
-        
-        for (int k = 0; k < block_size; k++) {
-            for (int i = 0; i < block_size; i++) {
-                for (int j = 0; j < block_size; j++) {
-                    double a = A[i * block_size + k];
-                    double b = A[k * block_size + j];
-                    double t = pow((pow(a, r) + pow(b, r)), (1.0 / r));
+        free(settled);
+    }
 
-                    if (t < A[i * block_size + j]) {
-                        A[i * block_size + j] = t;
-                    }
-                }
-            }
+    double sum = 0;
+    int finite = 0;
+    for (int p = 0; p < samples; p++) {
+        int i = sources[p % n_sources];
+        int j = targets[p];
+        double got = D[i][j];
+        double want = rows[(size_t)(p % n_sources) * n + j];
+
+        if ((got == _INFINITY) != (want == _INFINITY)) {
+            result->unreachable++;
+        } else if (got != _INFINITY) {
+            double error = fabs(got - want);
+            result->max_error = fmax(result->max_error, error);
+            sum += error;
+            finite++;
         }
-        
-        for (int i = 0; i < block_size; i++) {
-            for (int j = 0; j < block_size; j++) {
-                D[k_block * block_size + i][k_block * block_size + j] = A[i * block_size + j];
-            }
+
+        // The link test of pfnet_links: a direct link that no path beats.
+        double direct = pfnet_direct_distance(g, i, j);
+        if (direct != _INFINITY && (direct <= got) != (direct <= want)) {
+            result->link_flips++;
         }
-        
-        // Phase 2: Partially dependent phase
-        #pragma omp parallel
-        {
-            int thread_id = omp_get_thread_num();
-            double *thread_C = block_C[thread_id];
-            double *thread_B = block_B[thread_id];
-            
-            #pragma omp for schedule(dynamic)
-            for (int j_block = 0; j_block < n_blocks; j_block++) {
-                if (j_block == k_block) continue;
-                
-                for (int i = 0; i < block_size; i++) {
-                    for (int j = 0; j < block_size; j++) {
-                        thread_B[i * block_size + j] = D[k_block * block_size + i][j_block * block_size + j];
-                    }
-                }
-                
-                for (int k = 0; k < block_size; k++) {
-                    for (int i = 0; i < block_size; i++) {
-                        for (int j = 0; j < block_size; j++) {
-                            thread_B[i * block_size + j] = min(thread_B[i * block_size + j], 
-                                                            A[i * block_size + k] + thread_B[k * block_size + j]);
-                        }
-                    }
-                }
-                
-                for (int i = 0; i < block_size; i++) {
-                    for (int j = 0; j < block_size; j++) {
-                        D[k_block * block_size + i][j_block * block_size + j] = thread_B[i * block_size + j];
-                    }
-                }
-            }
-            
-            #pragma omp for schedule(dynamic)
-            for (int i_block = 0; i_block < n_blocks; i_block++) {
-                if (i_block == k_block) continue;
-                
-                for (int i = 0; i < block_size; i++) {
-                    for (int j = 0; j < block_size; j++) {
-                        thread_C[i * block_size + j] = D[i_block * block_size + i][k_block * block_size + j];
-                    }
-                }
-                
-                for (int k = 0; k < block_size; k++) {
-                    for (int i = 0; i < block_size; i++) {
-                        for (int j = 0; j < block_size; j++) {
-                            double a = thread_C[i * block_size + k];
-                            double b = A[k * block_size + j];
-                            double t = pow((pow(a, r) + pow(b, r)), (1.0 / r));
-
-                            if (t < thread_C[i * block_size + j]) {
-                                thread_C[i * block_size + j] = t;
-                            }
-                        }
-                    }
-                }
-                
-                for (int i = 0; i < block_size; i++) {
-                    for (int j = 0; j < block_size; j++) {
-                        D[i_block * block_size + i][k_block * block_size + j] = thread_C[i * block_size + j];
-                    }
-                }
-            }
+    }
+
+    result->pairs = samples;
+    result->sources = n_sources;
+    result->mean_error = finite > 0 ? sum / finite : 0;
+
+    free(sources);
+    free(targets);
+    free(rows);
+}
+
+// --progress SECONDS reports on a running closure from a thread of its own,
+// every interval, from the library's telemetry: the round, path updates per
+// second over the last interval, the ETA at the average rate so far, and
+// the busy and idle seconds of every thread. Lines go to stderr, or as JSON
+// to the --progress-file.
+struct progress_reporter {
+    struct pfnet_telemetry *telemetry;
+    int threads;
+    double interval;
+    FILE *file;
+    double *busy;
+    long long last_updates;
+    double last_elapsed;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    int active;
+};
+
+void format_eta(char *out, size_t size, double seconds)
+{
+    if (seconds < 0) {
+        snprintf(out, size, "-");
+        return;
+    }
+    long s = (long)(seconds + 0.5);
+    snprintf(out, size, "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+}
+
+void progress_report(struct progress_reporter *reporter)
+{
+    struct pfnet_progress p;
+    pfnet_telemetry_read(reporter->telemetry, &p, reporter->busy, reporter->threads);
+    if (!p.running) {
+        return;
+    }
+
+    double interval = p.elapsed - reporter->last_elapsed;
+    double rate = interval > 0 ? (p.updates - reporter->last_updates) / interval : 0;
+    double average = p.elapsed > 0 ? p.updates / p.elapsed : 0;
+    double eta = average > 0 ? (p.total_updates - p.updates) / average : -1;
+    double done = p.total_updates > 0 ? 100.0 * p.updates / p.total_updates : 0;
+    reporter->last_updates = p.updates;
+    reporter->last_elapsed = p.elapsed;
+
+    if (reporter->file == NULL) {
+        char eta_text[32];
+        format_eta(eta_text, sizeof(eta_text), eta);
+        fprintf(stderr, "Progress:\tround %d/%d (%.1f%%), %.3g updates/s, ETA %s, busy/idle s:",
+                p.round, p.rounds, done, rate, eta_text);
+        for (int t = 0; t < reporter->threads; t++) {
+            fprintf(stderr, " %.1f/%.1f", reporter->busy[t],
+                    fmax(p.elapsed - reporter->busy[t], 0));
         }
-        #pragma omp barrier
-        
-        // Phase 3: Independent phase
-        #pragma omp parallel
-        {
-            int thread_id = omp_get_thread_num();
-            double *thread_C = block_C[thread_id];
-            double *thread_A = block_A[thread_id];
-            double *thread_B = block_B[thread_id];
-            
-            #pragma omp for collapse(2) schedule(dynamic)
-            for (int i_block = 0; i_block < n_blocks; i_block++) {
-                for (int j_block = 0; j_block < n_blocks; j_block++) {
-                    if (i_block == k_block || j_block == k_block) continue;
-                    
-                    for (int i = 0; i < block_size; i++) {
-                        for (int j = 0; j < block_size; j++) {
-                            thread_C[i * block_size + j] = D[i_block * block_size + i][j_block * block_size + j];
-                        }
-                    }
-                    
-                    for (int i = 0; i < block_size; i++) {
-                        for (int j = 0; j < block_size; j++) {
-                            thread_A[i * block_size + j] = D[i_block * block_size + i][k_block * block_size + j];
-                        }
-                    }
-                    
-                    for (int i = 0; i < block_size; i++) {
-                        for (int j = 0; j < block_size; j++) {
-                            thread_B[i * block_size + j] = D[k_block * block_size + i][j_block * block_size + j];
-                        }
-                    }
-                    
-                    for (int k = 0; k < block_size; k++) {
-                        for (int i = 0; i < block_size; i++) {
-                            for (int j = 0; j < block_size; j++) {
-                                double a = thread_A[i * block_size + k];
-                                double b = thread_B[k * block_size + j];
-                                double t = pow((pow(a, r) + pow(b, r)), (1.0 / r));
-
-                                if (t < thread_C[i * block_size + j]) {
-                                    thread_C[i * block_size + j] = t;
-                                }
-                            }
-                        }
-                    }
-                    
-                    for (int i = 0; i < block_size; i++) {
-                        for (int j = 0; j < block_size; j++) {
-                            D[i_block * block_size + i][j_block * block_size + j] = thread_C[i * block_size + j];
-                        }
-                    }
-                }
-            }
+        fprintf(stderr, "\n");
+        return;
+    }
+
+    FILE *file = reporter->file;
+    fprintf(file,
+            "{\"elapsed\":%.3f,\"round\":%d,\"rounds\":%d,\"updates\":%lld,"
+            "\"total_updates\":%lld,\"updates_per_s\":%.1f,\"eta\":%.1f,\"busy\":[",
+            p.elapsed, p.round, p.rounds, p.updates, p.total_updates, rate, eta);
+    for (int t = 0; t < reporter->threads; t++) {
+        fprintf(file, "%s%.3f", t > 0 ? "," : "", reporter->busy[t]);
+    }
+    fprintf(file, "],\"idle\":[");
+    for (int t = 0; t < reporter->threads; t++) {
+        fprintf(file, "%s%.3f", t > 0 ? "," : "", fmax(p.elapsed - reporter->busy[t], 0));
+    }
+    fprintf(file, "]}\n");
+    fflush(file);
+}
+
+void *progress_thread(void *arg)
+{
+    struct progress_reporter *reporter = (struct progress_reporter *)arg;
+
+    pthread_mutex_lock(&reporter->lock);
+    while (!reporter->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        double seconds = deadline.tv_nsec / 1e9 + reporter->interval;
+        deadline.tv_sec += (time_t)seconds;
+        deadline.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+
+        while (!reporter->stop
+               && pthread_cond_timedwait(&reporter->wake, &reporter->lock, &deadline) == 0) {
+        }
+        if (reporter->stop) {
+            break;
         }
+
+        pthread_mutex_unlock(&reporter->lock);
+        progress_report(reporter);
+        pthread_mutex_lock(&reporter->lock);
     }
-    
-    free(A);
-    
-    for (int t = 0; t < num_threads; t++) {
-        free(block_C[t]);
-        free(block_A[t]);
-        free(block_B[t]);
+    pthread_mutex_unlock(&reporter->lock);
+
+    return NULL;
+}
+
+// Opens the telemetry and starts the thread; without --progress, or if
+// either fails, the closure runs unwatched.
+void progress_start(struct progress_reporter *reporter, const struct options *opts,
+                    int threads, struct pfnet_options *lib)
+{
+    memset(reporter, 0, sizeof(*reporter));
+    if (opts->progress_interval <= 0) {
+        return;
+    }
+
+    reporter->telemetry = pfnet_telemetry_alloc(threads);
+    reporter->busy = (double *)calloc(threads, sizeof(double));
+    if (reporter->telemetry == NULL || reporter->busy == NULL) {
+        fprintf(stderr, "Warning: --progress disabled, out of memory\n");
+        pfnet_telemetry_free(reporter->telemetry);
+        free(reporter->busy);
+        return;
+    }
+    if (opts->progress_path != NULL) {
+        reporter->file = fopen(opts->progress_path, "a");
+        if (reporter->file == NULL) {
+            fprintf(stderr, "Warning: cannot open progress file %s, using stderr\n",
+                    opts->progress_path);
+        }
+    }
+    reporter->threads = threads;
+    reporter->interval = opts->progress_interval;
+    pthread_mutex_init(&reporter->lock, NULL);
+    pthread_cond_init(&reporter->wake, NULL);
+
+    reporter->active = pthread_create(&reporter->thread, NULL, progress_thread, reporter) == 0;
+    if (reporter->active) {
+        lib->telemetry = reporter->telemetry;
     }
-    free(block_C);
-    free(block_A);
-    free(block_B);
 }
 
-void floyd_warshall(double **D, int n, int r)
+void progress_stop(struct progress_reporter *reporter, struct pfnet_options *lib)
 {
-    for (int k = 0; k < n; k++) {
-        #pragma omp parallel for collapse(2) schedule(dynamic, 32)
-        for (int i = 0; i < n; i++) {
-            for (int j = 0; j < n; j++) {
-                double a = D[i][k];
-                double b = D[k][j];
-                double t = pow((pow(a, r) + pow(b, r)), (1.0 / r));
-                
-                if (t < D[i][j]) {
-                    D[i][j] = t;
-                }
+    if (reporter->active) {
+        pthread_mutex_lock(&reporter->lock);
+        reporter->stop = 1;
+        pthread_cond_signal(&reporter->wake);
+        pthread_mutex_unlock(&reporter->lock);
+        pthread_join(reporter->thread, NULL);
+        pthread_mutex_destroy(&reporter->lock);
+        pthread_cond_destroy(&reporter->wake);
+        lib->telemetry = NULL;
+    }
+    if (reporter->file != NULL) {
+        fclose(reporter->file);
+    }
+    pfnet_telemetry_free(reporter->telemetry);
+    free(reporter->busy);
+}
+
+// The tuning file is $PFNET_TUNING, or ~/.pfnet_tuning without it; NULL if
+// there is neither.
+const char *tuning_path(char *buffer, size_t size)
+{
+    const char *path = getenv("PFNET_TUNING");
+    if (path != NULL && path[0] != '\0') {
+        return path;
+    }
+
+    const char *home = getenv("HOME");
+    if (home == NULL || home[0] == '\0') {
+        return NULL;
+    }
+    snprintf(buffer, size, "%s/.pfnet_tuning", home);
+    return buffer;
+}
+
+// --tune: times the closure for each candidate tile size on a sample matrix
+// with this run's threads, r and NUMA setting, and records the fastest for
+// this machine. Later runs pick it up from the tuning file.
+int run_tune(const struct options *opts, const struct pfnet_options *lib,
+             const char *path)
+{
+    struct pfnet_caches caches;
+    pfnet_read_caches(&caches);
+
+    printf("Sample size:\t%d\n", opts->tune_size);
+    printf("L1d cache:\t%zu KB\n", caches.l1d >> 10);
+    printf("L2 cache:\t%zu KB\n", caches.l2 >> 10);
+    printf("===============================================\n");
+    printf("TUNING\n");
+    printf("===============================================\n");
+
+    struct pfnet_tuning_trial trials[TUNE_MAX_TRIALS];
+    int n_trials;
+    int best;
+    check_status(pfnet_tune(opts->tune_size, lib, trials, TUNE_MAX_TRIALS, &n_trials, &best),
+                 "tuning");
+
+    for (int t = 0; t < n_trials; t++) {
+        printf("Block %d:\t%.3f s\n", trials[t].block_size, trials[t].seconds);
+    }
+    printf("===============================================\n");
+    printf("Best block:\t%d\n", best);
+
+    if (path == NULL) {
+        fprintf(stderr, "Error: set PFNET_TUNING or HOME to save the tuning\n");
+        return EXIT_FAILURE;
+    }
+    check_status(pfnet_tuning_save(path, best), "saving the tuning");
+    printf("Saved to:\t%s\n", path);
+
+    return 0;
+}
+
+// Per-phase wall times of one run.
+struct phase_times {
+    double word_set;
+    double graph;
+    double similarity;
+    double pathfinder;
+    double output;
+    double total;
+};
+
+// Appends one JSON object per run to path, with the fields of the other
+// backends' --stats.
+void write_stats(const char *path, const struct phase_times *times, int threads,
+                 int text_size, int unique_words)
+{
+    FILE *file = fopen(path, "a");
+    if (file == NULL) {
+        fprintf(stderr, "Warning: cannot open stats file %s\n", path);
+        return;
+    }
+
+    fprintf(file,
+            "{\"backend\":\"openmp\",\"threads\":%d,\"text_size\":%d,"
+            "\"unique_words\":%d,\"word_set\":%.6f,\"graph\":%.6f,"
+            "\"similarity\":%.6f,\"pathfinder\":%.6f,\"output\":%.6f,"
+            "\"total\":%.6f}\n",
+            threads, text_size, unique_words, times->word_set, times->graph,
+            times->similarity, times->pathfinder, times->output, times->total);
+    fclose(file);
+}
+
+// --perf brackets every stage of the run with perf_event_open(2) counters,
+// one set per OpenMP thread. A thread opens its own counters, which then
+// follow it; libgomp runs every region of a fixed team size on the same
+// threads, so thread t of one region is thread t of the next. The main
+// thread reads them all between stages, while no other thread works.
+#define PERF_COUNTERS 4
+#define PERF_LINE_BYTES 64
+#define PERF_STREAM_DOUBLES (4 << 20)
+// A stage that streams at least this share of the triad bandwidth is
+// reported as memory-bound.
+#define PERF_MEMORY_BOUND 0.5
+
+enum perf_counter {
+    COUNTER_TASK_CLOCK,
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_LLC_MISSES
+};
+
+enum perf_stage {
+    STAGE_NONE = -1,
+    STAGE_WORD_SET,
+    STAGE_GRAPH,
+    STAGE_SIMILARITY,
+    STAGE_CLOSURE,
+    STAGE_PIVOT,
+    STAGE_ROW_COLUMN,
+    STAGE_REMAINDER,
+    STAGE_OUTPUT,
+    STAGES
+};
+
+const char *const stage_names[STAGES] = {
+    "word set", "graph init", "similarity", "closure",
+    "fw pivot", "fw row/col", "fw remainder", "output"};
+
+const char *const counter_names[PERF_COUNTERS] = {
+    "task clock", "cycles", "instructions", "LLC misses"};
+
+struct perf_state {
+    int threads;
+    int *fd;           // threads x PERF_COUNTERS, -1 where not available
+    double *last;      // the reading of every counter at the last switch
+    double *reading;
+    double *count;     // STAGES x threads x PERF_COUNTERS
+    double seconds[STAGES];
+    int available[PERF_COUNTERS];
+    int stage;
+    double since;
+    double stream;     // triad bandwidth in bytes/s
+    // What the closure did, to count the updates and pow calls of each
+    // of its phases.
+    int n;
+    int start_k;
+    double r;
+    int rounds;
+    int unblocked;
+};
+
+// Best of three parallel triads over arrays well beyond the last level
+// cache, as the bandwidth the stages are compared to.
+double stream_bandwidth(int threads)
+{
+    size_t n = PERF_STREAM_DOUBLES;
+    double *a = (double *)malloc(n * sizeof(double));
+    double *b = (double *)malloc(n * sizeof(double));
+    double *c = (double *)malloc(n * sizeof(double));
+    double best = 0;
+
+    if (a != NULL && b != NULL && c != NULL) {
+        #pragma omp parallel for num_threads(threads) schedule(static)
+        for (size_t i = 0; i < n; i++) {
+            a[i] = 0;
+            b[i] = 1;
+            c[i] = 2;
+        }
+
+        for (int rep = 0; rep < 3; rep++) {
+            double wtime = omp_get_wtime();
+            #pragma omp parallel for num_threads(threads) schedule(static)
+            for (size_t i = 0; i < n; i++) {
+                a[i] = b[i] + 3 * c[i];
+            }
+            wtime = omp_get_wtime() - wtime;
+            if (wtime > 0) {
+                best = fmax(best, 3 * n * sizeof(double) / wtime);
             }
         }
     }
+
+    free(a);
+    free(b);
+    free(c);
+    return best;
 }
 
-double **pathfinder_network(double **graph, int n, int q, int r)
+void perf_open(struct perf_state *perf, int threads)
 {
-    double **D = (double **)malloc(n * sizeof(double *));
-    #pragma omp parallel for
-    for (int i = 0; i < n; i++) {
-        D[i] = (double *)malloc(n * sizeof(double));
-        memcpy(D[i], graph[i], n * sizeof(double));
-    }
-    
-    const int L1_CACHE_SIZE = 384 * 1024; // 32KB
-    int block_size = sqrt(L1_CACHE_SIZE / (3 * sizeof(double)));
-    
-
-    block_size = (block_size / 4) * 4;
-    if (block_size < 4) block_size = 4;
-    
-    if (n % block_size != 0) {
-        for (int i = block_size; i >= 1; i--) {
-            if (n % i == 0) {
-                block_size = i;
-                break;
+    static const uint32_t types[PERF_COUNTERS] = {
+        PERF_TYPE_SOFTWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE};
+    static const uint64_t configs[PERF_COUNTERS] = {
+        PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES};
+    int slots = threads * PERF_COUNTERS;
+
+    memset(perf, 0, sizeof(*perf));
+    perf->threads = threads;
+    perf->fd = (int *)malloc(slots * sizeof(int));
+    perf->last = (double *)calloc(slots, sizeof(double));
+    perf->reading = (double *)calloc(slots, sizeof(double));
+    perf->count = (double *)calloc((size_t)STAGES * slots, sizeof(double));
+    perf->stage = STAGE_NONE;
+
+    // Measured before the counters exist, so it is in no stage.
+    perf->stream = stream_bandwidth(threads);
+
+    int error = 0;
+    #pragma omp parallel num_threads(threads)
+    {
+        int t = omp_get_thread_num();
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[c];
+            attr.config = configs[c];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            // Counters that share the PMU are multiplexed and scaled by
+            // the share of the time they ran.
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                               | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            perf->fd[t * PERF_COUNTERS + c] =
+                (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if (perf->fd[t * PERF_COUNTERS + c] < 0) {
+                #pragma omp atomic write
+                error = errno;
             }
         }
-        
-        if (n % block_size != 0) {
-            floyd_warshall(D, n, r);
-        } else {
-            blocked_floyd_warshall(D, n, block_size, r);
-        }
-    } else {
-        blocked_floyd_warshall(D, n, block_size, r);
     }
-    
-    #pragma omp parallel for collapse(2)
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            if (graph[i][j] < D[i][j]) {
-                D[i][j] = graph[i][j];
+
+    // A counter is only reported if every thread has it.
+    char missing[128] = "";
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+        perf->available[c] = 1;
+        for (int t = 0; t < threads; t++) {
+            perf->available[c] &= perf->fd[t * PERF_COUNTERS + c] >= 0;
+        }
+        if (!perf->available[c]) {
+            for (int t = 0; t < threads; t++) {
+                if (perf->fd[t * PERF_COUNTERS + c] >= 0) {
+                    close(perf->fd[t * PERF_COUNTERS + c]);
+                }
+                perf->fd[t * PERF_COUNTERS + c] = -1;
             }
+            strcat(missing, missing[0] != '\0' ? ", " : "");
+            strcat(missing, counter_names[c]);
         }
     }
-    
-    return D;
+    if (missing[0] != '\0') {
+        fprintf(stderr, "Warning: --perf cannot count %s (%s); "
+                        "check /proc/sys/kernel/perf_event_paranoid\n",
+                missing, strerror(error));
+    }
 }
 
-double cosine_similarity(double *a, double *b, int n)
+// Reads every counter, scaled up for the time it was multiplexed out.
+void perf_read(const struct perf_state *perf, double *values)
 {
-    double dot = 0.0, norm_a = 0.0, norm_b = 0.0;
+    for (int s = 0; s < perf->threads * PERF_COUNTERS; s++) {
+        uint64_t data[3];
+        values[s] = 0;
+        if (perf->fd[s] >= 0 && read(perf->fd[s], data, sizeof(data)) == sizeof(data)
+            && data[2] > 0) {
+            values[s] = (double)data[0] * data[1] / data[2];
+        }
+    }
+}
 
-    for (int i = 0; i < n; i++) {
-        dot += a[i] * b[i];
-        norm_a += a[i] * a[i];
-        norm_b += b[i] * b[i];
+// Charges everything since the last switch to the current stage and starts
+// the next one. A NULL perf (no --perf) does nothing.
+void perf_switch(struct perf_state *perf, int stage)
+{
+    if (perf == NULL) {
+        return;
     }
 
-    norm_a = sqrt(norm_a);
-    norm_b = sqrt(norm_b);
+    double now = omp_get_wtime();
+    int slots = perf->threads * PERF_COUNTERS;
+    perf_read(perf, perf->reading);
+    if (perf->stage != STAGE_NONE) {
+        double *count = perf->count + (size_t)perf->stage * slots;
+        for (int s = 0; s < slots; s++) {
+            count[s] += perf->reading[s] - perf->last[s];
+        }
+        perf->seconds[perf->stage] += now - perf->since;
+    }
+    memcpy(perf->last, perf->reading, slots * sizeof(double));
+    perf->stage = stage;
+    perf->since = now;
+}
 
-    if (norm_a == 0 || norm_b == 0)
-        return 0;
+// The phase hook of the closure. Work between its calls, and all of a
+// closure that has no phases, stays in the closure stage.
+void perf_phase(void *user, int phase)
+{
+    struct perf_state *perf = (struct perf_state *)user;
 
-    return dot / (norm_a * norm_b);
+    switch (phase) {
+    case PFNET_PHASE_PIVOT:
+        perf->rounds++;
+        perf_switch(perf, STAGE_PIVOT);
+        break;
+    case PFNET_PHASE_ROW_COLUMN:
+        perf_switch(perf, STAGE_ROW_COLUMN);
+        break;
+    case PFNET_PHASE_REMAINDER:
+        perf->unblocked |= perf->rounds == 0;
+        perf_switch(perf, STAGE_REMAINDER);
+        break;
+    default:
+        perf_switch(perf, STAGE_CLOSURE);
+        break;
+    }
 }
 
-int find_index(char **array, int size, const char *word)
+// Path updates and pow calls of the dense closure phases, from the rounds
+// the hook saw. An update is three pow calls, or none for r = 1 and
+// r = infinity, which the combine handles without pow.
+void closure_work(const struct perf_state *perf, double *updates, double *pow_calls)
 {
-    for (int i = 0; i < size; i++) {
-        if (strcmp(array[i], word) == 0) {
-            return i;
-        }
+    double pows = perf->r == 1 || perf->r == _INFINITY ? 0 : 3;
+
+    for (int s = 0; s < STAGES; s++) {
+        updates[s] = pow_calls[s] = 0;
+    }
+
+    double rows = perf->n - perf->start_k;
+    if (perf->rounds > 0) {
+        double block_size = rows / perf->rounds;
+        double others = perf->n / block_size - 1;
+        double tiles = perf->rounds * block_size * block_size * block_size;
+        updates[STAGE_PIVOT] = tiles;
+        pow_calls[STAGE_PIVOT] = pows * tiles;
+        updates[STAGE_ROW_COLUMN] = 2 * others * tiles;
+        pow_calls[STAGE_ROW_COLUMN] = pows * updates[STAGE_ROW_COLUMN];
+        updates[STAGE_REMAINDER] = others * others * tiles;
+        pow_calls[STAGE_REMAINDER] = pows * updates[STAGE_REMAINDER];
+    } else if (perf->unblocked) {
+        updates[STAGE_REMAINDER] = rows * perf->n * perf->n;
+        pow_calls[STAGE_REMAINDER] = pows * updates[STAGE_REMAINDER];
     }
-    return -1;
 }
 
-int word_exists(char **array, int size, const char *word)
+void print_cell(int width, int precision, int known, double value)
 {
-    return find_index(array, size, word) != -1;
+    if (known) {
+        fprintf(stderr, " %*.*f", width, precision, value);
+    } else {
+        fprintf(stderr, " %*s", width, "-");
+    }
 }
 
-int add_word(char ***array, int *size, const char *word)
+// The roofline-style summary on stderr, after the result: per stage the
+// achieved rate against the measured triad bandwidth, then per thread.
+// Bytes are LLC misses times the line size, so they leave out prefetched
+// lines and write-backs.
+void perf_report(const struct perf_state *perf)
 {
-    if (!word_exists(*array, *size, word)) {
-        *array = realloc(*array, (*size + 1) * sizeof(char *));
-        (*array)[*size] = strdup(word);
-        (*size)++;
-        return 1;
+    int slots = perf->threads * PERF_COUNTERS;
+    const int *have = perf->available;
+    double updates[STAGES], pow_calls[STAGES];
+    closure_work(perf, updates, pow_calls);
+
+    fprintf(stderr, "===============================================\n");
+    fprintf(stderr, "PERFORMANCE COUNTERS\n");
+    fprintf(stderr, "===============================================\n");
+    fprintf(stderr, "Stream triad:\t%.2f GB/s (%d threads)\n", perf->stream / 1e9,
+            perf->threads);
+    fprintf(stderr, "%-12s %8s %8s %6s %5s %9s %8s %7s %6s %9s %9s %8s %s\n", "stage",
+            "time s", "busy s", "GHz", "IPC", "LLC M", "GB", "GB/s", "stream", "G updates",
+            "G pow", "upd/B", "bound");
+
+    for (int stage = 0; stage < STAGES; stage++) {
+        if (perf->seconds[stage] <= 0) {
+            continue;
+        }
+        double sum[PERF_COUNTERS] = {0};
+        for (int s = 0; s < slots; s++) {
+            sum[s % PERF_COUNTERS] += perf->count[(size_t)stage * slots + s];
+        }
+        double seconds = perf->seconds[stage];
+        double busy = sum[COUNTER_TASK_CLOCK] / 1e9;
+        double bytes = sum[COUNTER_LLC_MISSES] * PERF_LINE_BYTES;
+        int work = updates[stage] > 0;
+
+        fprintf(stderr, "%-12s", stage_names[stage]);
+        print_cell(8, 3, 1, seconds);
+        print_cell(8, 3, have[COUNTER_TASK_CLOCK], busy);
+        print_cell(6, 2, have[COUNTER_CYCLES] && have[COUNTER_TASK_CLOCK] && busy > 0,
+                   sum[COUNTER_CYCLES] / 1e9 / busy);
+        print_cell(5, 2, have[COUNTER_CYCLES] && have[COUNTER_INSTRUCTIONS]
+                         && sum[COUNTER_CYCLES] > 0,
+                   sum[COUNTER_INSTRUCTIONS] / sum[COUNTER_CYCLES]);
+        print_cell(9, 2, have[COUNTER_LLC_MISSES], sum[COUNTER_LLC_MISSES] / 1e6);
+        print_cell(8, 3, have[COUNTER_LLC_MISSES], bytes / 1e9);
+        print_cell(7, 2, have[COUNTER_LLC_MISSES], bytes / seconds / 1e9);
+        fprintf(stderr, " ");
+        print_cell(4, 0, have[COUNTER_LLC_MISSES] && perf->stream > 0,
+                   100 * bytes / seconds / perf->stream);
+        fprintf(stderr, "%s", have[COUNTER_LLC_MISSES] && perf->stream > 0 ? "%" : " ");
+        print_cell(9, 3, work, updates[stage] / 1e9);
+        print_cell(9, 3, work, pow_calls[stage] / 1e9);
+        print_cell(8, 1, work && have[COUNTER_LLC_MISSES] && bytes > 0,
+                   updates[stage] / bytes);
+        if (!have[COUNTER_LLC_MISSES] || perf->stream <= 0) {
+            fprintf(stderr, " -\n");
+        } else if (bytes / seconds >= PERF_MEMORY_BOUND * perf->stream) {
+            fprintf(stderr, " memory\n");
+        } else {
+            fprintf(stderr, " compute\n");
+        }
+    }
+
+    fprintf(stderr, "%-12s %8s %6s %5s %9s %8s\n", "thread", "busy s", "GHz", "IPC",
+            "LLC M", "GB");
+    for (int t = 0; t < perf->threads; t++) {
+        double sum[PERF_COUNTERS] = {0};
+        for (int stage = 0; stage < STAGES; stage++) {
+            for (int c = 0; c < PERF_COUNTERS; c++) {
+                sum[c] += perf->count[(size_t)stage * slots + t * PERF_COUNTERS + c];
+            }
+        }
+        double busy = sum[COUNTER_TASK_CLOCK] / 1e9;
+
+        fprintf(stderr, "%-12d", t);
+        print_cell(8, 3, have[COUNTER_TASK_CLOCK], busy);
+        print_cell(6, 2, have[COUNTER_CYCLES] && have[COUNTER_TASK_CLOCK] && busy > 0,
+                   sum[COUNTER_CYCLES] / 1e9 / busy);
+        print_cell(5, 2, have[COUNTER_CYCLES] && have[COUNTER_INSTRUCTIONS]
+                         && sum[COUNTER_CYCLES] > 0,
+                   sum[COUNTER_INSTRUCTIONS] / sum[COUNTER_CYCLES]);
+        print_cell(9, 2, have[COUNTER_LLC_MISSES], sum[COUNTER_LLC_MISSES] / 1e6);
+        print_cell(8, 3, have[COUNTER_LLC_MISSES],
+                   sum[COUNTER_LLC_MISSES] * PERF_LINE_BYTES / 1e9);
+        fprintf(stderr, "\n");
     }
-    return 0;
 }
 
-int compare_strings(const void *a, const void *b)
+void perf_close(struct perf_state *perf)
 {
-    return strcmp(*(const char **)a, *(const char **)b);
+    if (perf == NULL) {
+        return;
+    }
+
+    for (int s = 0; s < perf->threads * PERF_COUNTERS; s++) {
+        if (perf->fd[s] >= 0) {
+            close(perf->fd[s]);
+        }
+    }
+    free(perf->fd);
+    free(perf->last);
+    free(perf->reading);
+    free(perf->count);
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    struct options opts;
+    parse_options(argc, argv, &opts);
+
+    const double r = 1;
+    // const double r = 2;
+    // const double r = _INFINITY;
+
     printf("===============================================\n");
     printf("PATHFINDER NETWORK\n");
     printf("===============================================\n");
@@ -317,136 +2381,404 @@ int main()
     omp_set_num_threads(num_threads);
     printf("Using %d OpenMP threads\n", num_threads);
 
-    char buffer[1024];
-    char **text = NULL;
-    int text_size = 0;
+    struct pfnet_options lib;
+    pfnet_default_options(&lib);
+    lib.threads = num_threads;
+    lib.window = _MAX_DISTANCE;
+    lib.r = r;
+    lib.numa = opts.numa;
 
-    while (scanf("%s", buffer) == 1) {
-        text = realloc(text, (text_size + 1) * sizeof(char *));
-        text[text_size] = strdup(buffer);
-        text_size++;
+    char tuning_buffer[4096];
+    const char *tuning = tuning_path(tuning_buffer, sizeof(tuning_buffer));
+    if (opts.tune) {
+        return run_tune(&opts, &lib, tuning);
+    }
+    // An unreadable tuning file only costs the tuned tile size.
+    if (tuning != NULL && pfnet_tuning_load(tuning, &lib) != PFNET_OK) {
+        fprintf(stderr, "Warning: could not read the tuning file %s\n", tuning);
+    }
+    if (lib.block_size > 0) {
+        printf("Tuned block:\t%d\n", lib.block_size);
     }
 
-    printf("Text size:\t%d\n", text_size);
+    // Without places the proc_bind clauses of the NUMA closure have nothing
+    // to bind to.
+    if (opts.numa && omp_get_num_places() == 0) {
+        fprintf(stderr, "Warning: --numa without OMP_PLACES leaves threads unpinned; "
+                        "run with OMP_PLACES=cores OMP_PROC_BIND=spread\n");
+    }
 
-    double wtime = omp_get_wtime();
+    // Stopwords are read like the text, so they match its tokens exactly.
+    char **stopwords = NULL;
+    int stopwords_capacity = 0;
+    struct arena stopword_strings = {NULL};
+    if (opts.stopwords_path != NULL) {
+        FILE *file = fopen(opts.stopwords_path, "r");
+        if (file == NULL) {
+            perror(opts.stopwords_path);
+            exit(EXIT_FAILURE);
+        }
+        lib.n_stopwords = read_tokens(file, &stopwords, 0, &stopwords_capacity,
+                                      &stopword_strings);
+        lib.stopwords = (const char *const *)stopwords;
+        fclose(file);
+    }
+    lib.min_count = opts.min_count;
+    lib.max_vocab = opts.max_vocab;
+    lib.prune_mode = opts.prune_mode;
 
-    char **wordSet = NULL;
-    int wordSetSize = 0;
+    if (opts.batch_path != NULL) {
+        return run_batch(&opts, &lib);
+    }
 
-    for (int i = 0; i < text_size; i++) {
-        add_word(&wordSet, &wordSetSize, text[i]);
+    char **text = NULL;
+    int text_capacity = 0;
+    struct arena strings = {NULL};
+    int text_size = read_tokens(stdin, &text, 0, &text_capacity, &strings);
+
+    printf("Text size:\t%d\n", text_size);
+
+    struct perf_state perf_state;
+    struct perf_state *perf = NULL;
+    if (opts.perf) {
+        perf = &perf_state;
+        perf_open(perf, num_threads);
+        lib.phase = perf_phase;
+        lib.phase_user = perf;
     }
 
-    qsort(wordSet, wordSetSize, sizeof(char *), compare_strings);
+    struct incremental_state inc;
+    int incremental = opts.incremental_path != NULL
+                      && incremental_open(&inc, opts.incremental_path, _MAX_DISTANCE, r);
+    int n_old = incremental ? (int)inc.header.n : 0;
+
+    double wtime = omp_get_wtime();
+    perf_switch(perf, STAGE_WORD_SET);
+
+    // Appended text adds its new words to the saved vocabulary, which keeps
+    // the old words in the same relative order.
+    struct pfnet_vocab *vocab;
+    if (incremental) {
+        const char **all = (const char **)malloc((n_old + text_size > 0 ? n_old + text_size : 1)
+                                                 * sizeof(char *));
+        memcpy(all, inc.words, n_old * sizeof(char *));
+        memcpy(all + n_old, text, text_size * sizeof(char *));
+        check_status(pfnet_vocab_build(all, n_old + text_size, &lib, &vocab), "word set");
+        free(all);
+    } else {
+        check_status(pfnet_vocab_build((const char *const *)text, text_size, &lib, &vocab),
+                     "word set");
+    }
+    const char *const *wordSet = pfnet_vocab_words(vocab);
+    int wordSetSize = pfnet_vocab_size(vocab);
 
     printf("Unique words:\t%d\n", wordSetSize);
+    if (opts.min_count > 1 || opts.max_vocab > 0 || opts.stopwords_path != NULL) {
+        int pruned_words;
+        size_t pruned_tokens;
+        pfnet_vocab_pruned(vocab, &pruned_words, &pruned_tokens);
+        printf("Pruned:\t%d words, %zu tokens %s\n", pruned_words, pruned_tokens,
+               opts.prune_mode == PFNET_PRUNE_SKIP ? "skipped" : "dropped");
+    }
 
     double wtime_wordset = omp_get_wtime();
+    perf_switch(perf, STAGE_GRAPH);
     printf("Word Set:\t%.2f s\n", 
            wtime_wordset - wtime);
 
     int n = wordSetSize;
 
-    double **graph = (double **)malloc(n * sizeof(double *));
-    #pragma omp parallel for
-    for (int i = 0; i < n; i++) {
-        graph[i] = (double *)calloc(n, sizeof(double));
+    struct checkpoint ckpt_state;
+    struct checkpoint *ckpt = NULL;
+    size_t stride = pfnet_matrix_stride(n);
+    double *matrix = NULL;
+    double **D = NULL;
+    struct pfnet_graph *graph = NULL;
+    struct pfnet_ooc *ooc = NULL;
+    struct kept_pairs kept = {NULL, NULL};
+    int resumed = 0;
+    // Old word i is word map[i] now; old_index is the inverse, -1 for new
+    // words. touched marks the words of the appended windows.
+    int *map = NULL;
+    int *old_index = NULL;
+    char *touched = NULL;
+    const char **appended = NULL;
+    int n_appended = 0;
+
+    if (incremental) {
+        map = (int *)malloc((n_old > 0 ? n_old : 1) * sizeof(int));
+        old_index = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+        touched = (char *)calloc(n > 0 ? n : 1, 1);
+        for (int i = 0; i < n; i++) {
+            old_index[i] = -1;
+        }
+        for (int i = 0; i < n_old; i++) {
+            map[i] = pfnet_vocab_find(vocab, inc.words[i]);
+            old_index[map[i]] = i;
+        }
+
+        n_appended = inc.header.n_context + text_size;
+        appended = (const char **)malloc((n_appended > 0 ? n_appended : 1) * sizeof(char *));
+        memcpy(appended, inc.context, inc.header.n_context * sizeof(char *));
+        memcpy(appended + inc.header.n_context, text, text_size * sizeof(char *));
+        for (int i = 0; i < n_appended; i++) {
+            touched[pfnet_vocab_find(vocab, appended[i])] = 1;
+        }
     }
 
-    #pragma omp parallel
-    {
-        #pragma omp for schedule(dynamic, 100)
-        for (int i = 0; i < text_size; i++) {
-            int token_i = find_index(wordSet, wordSetSize, text[i]);
-
-            int max_neighbor =
-                (i + 1 + _MAX_DISTANCE < text_size) ? i + 1 + _MAX_DISTANCE : text_size;
-            for (int j = i + 1; j < max_neighbor; j++) {
-                int token_j = find_index(wordSet, wordSetSize, text[j]);
-                if (token_i != token_j) {
-                    #pragma omp atomic
-                    graph[token_i][token_j]++;
-                    #pragma omp atomic
-                    graph[token_j][token_i]++;
-                }
-            }
+    // The in-memory closure runs on D where it is, so it is allocated (and
+    // with --numa placed) once, before anything is written to it.
+    if (opts.ooc_path == NULL) {
+        matrix = pfnet_matrix_alloc(n, &lib);
+        if (matrix == NULL) {
+            check_status(PFNET_ENOMEM, "matrix allocation");
         }
+        D = matrix_rows(matrix, n, stride);
     }
 
-    double wtime_graph = omp_get_wtime();
-    printf("Graph Init:\t%.2f s\n", 
-           wtime_graph - wtime_wordset);
+    if (opts.checkpoint_path != NULL) {
+        ckpt = &ckpt_state;
+        checkpoint_init(ckpt, opts.checkpoint_path,
+                        hash_pruning(hash_input(text, text_size, r), &lib),
+                        n, opts.checkpoint_interval);
 
-    double **D = (double **)malloc(n * sizeof(double *));
-    #pragma omp parallel for
-    for (int i = 0; i < n; i++) {
-        D[i] = (double *)malloc(n * sizeof(double));
-        D[i][i] = 0;
+        if (opts.resume) {
+            resumed = checkpoint_load(opts.checkpoint_path, ckpt->input_hash, n,
+                                      D, &ckpt->start_k);
+        }
     }
 
-    #pragma omp parallel for schedule(dynamic)
-    for (int i = 0; i < n; i++) {
-        for (int j = i + 1; j < n; j++) {
-            double similarity = cosine_similarity(graph[i], graph[j], n);
-            double inverse_similarity;
-            if (similarity == 0) {
-                inverse_similarity = _INFINITY;
-            } else {
-                inverse_similarity = 1 - similarity;
+    double wtime_graph, wtime_similarity;
+    double recall_time = 0;
+
+    if (resumed) {
+        // The checkpointed matrix already holds the similarities, partially
+        // closed, so graph construction and the similarity stage are skipped.
+        printf("Resumed:\t%s (k = %d of %d)\n", opts.checkpoint_path,
+               ckpt->start_k, n);
+        wtime_graph = wtime_similarity = omp_get_wtime();
+        perf_switch(perf, STAGE_CLOSURE);
+    } else {
+        if (incremental) {
+            // Only the windows that end in an appended token are counted.
+            check_status(pfnet_graph_extend(inc.graph, map, vocab, appended,
+                                            inc.header.n_context, text_size, &lib,
+                                            &graph),
+                         "graph construction");
+        } else {
+            check_status(pfnet_graph_build(vocab, (const char *const *)text, text_size,
+                                           &lib, &graph),
+                         "graph construction");
+        }
+
+        wtime_graph = omp_get_wtime();
+        perf_switch(perf, STAGE_SIMILARITY);
+        printf("Graph Init:\t%.2f s\n", 
+               wtime_graph - wtime_wordset);
+
+        if (opts.ooc_path != NULL) {
+            if (pfnet_ooc_open(opts.ooc_path, n, opts.memory_budget, &ooc) != PFNET_OK) {
+                fprintf(stderr, "Error: cannot create %s\n", opts.ooc_path);
+                return 1;
             }
-            D[i][j] = inverse_similarity;
-            D[j][i] = inverse_similarity;
+            printf("Out-of-core:\t%s (%d strips of %d rows)\n", opts.ooc_path,
+                   pfnet_ooc_strips(ooc), pfnet_ooc_block_size(ooc));
+            check_status(pfnet_ooc_similarity(ooc, graph, &lib), "similarity");
+        } else if (incremental) {
+            // D starts as the saved closure; the direct distances that
+            // changed are applied to it in place of the closure.
+            incremental_load_matrix(&inc, opts.incremental_path, matrix, stride, n, map);
+        } else if (opts.approximate) {
+            kept.offsets = (int *)malloc((n + 1) * sizeof(int));
+            check_status(pfnet_similarity_lsh_kept(graph, matrix, stride, &opts.lsh, &lib,
+                                                   kept.offsets, &kept.cols),
+                         "similarity");
+            printf("Approximate:\tLSH top %d, %d bands of %d bits, probe %d\n",
+                   opts.lsh.top_k, opts.lsh.bands, opts.lsh.band_bits, opts.lsh.probe);
+            printf("Kept pairs:\t%d of %lld\n", kept.offsets[n] / 2,
+                   (long long)n * (n - 1) / 2);
+
+            // The check computes exact rows, so its time is shown on its own
+            // line and left out of the similarity stage.
+            double wtime_recall = omp_get_wtime();
+            int sampled;
+            double recall = lsh_recall(graph, D, n, opts.lsh.top_k, &sampled);
+            recall_time = omp_get_wtime() - wtime_recall;
+            printf("Recall@%d:\t%.3f (%d sampled words, %.2f s)\n", opts.lsh.top_k,
+                   recall, sampled, recall_time);
+        } else {
+            check_status(pfnet_similarity(graph, matrix, stride, &lib), "similarity");
+        }
+
+        // Only the link modes look at the direct distances again, so plain
+        // pair output drops the co-occurrence counts before the closure and
+        // holds a single n x n matrix from here on. The incremental state
+        // keeps them for the next run, and --verify searches them.
+        if (opts.output_mode == OUTPUT_PAIRS && opts.incremental_path == NULL
+            && opts.verify == 0) {
+            pfnet_graph_free(graph);
+            graph = NULL;
         }
+
+        wtime_similarity = omp_get_wtime();
+        perf_switch(perf, STAGE_CLOSURE);
+        printf("Similarity:\t%.2f s\n",
+               wtime_similarity - wtime_graph - recall_time);
     }
 
-    double wtime_similarity = omp_get_wtime();
-    printf("Similarity:\t%.2f s\n",
-           wtime_similarity - wtime_graph);
 
-    const int q = n - 1;
-    const double r = 1;
-    // const double r = 2;
-    // const double r = _INFINITY;
+    // The closure starts from the direct distances and only shortens them,
+    // so once it has run in place D is the final network.
+    double **pf_net = NULL;
+    if (opts.ooc_path != NULL) {
+        check_status(pfnet_ooc_closure(ooc, &lib), "closure");
+    } else {
+        int updated = 0;
+        if (incremental) {
+            struct raised_graphs graphs = {inc.graph, old_index, graph};
+            int n_lowered;
+            updated = incremental_closure(&graphs, touched, matrix, D, n, stride, &lib,
+                                          &n_lowered);
+            if (updated) {
+                printf("Incremental:\t%d new words, %d lowered pairs\n", n - n_old,
+                       n_lowered);
+            } else {
+                printf("Incremental:\t%d new words, full closure\n", n - n_old);
+                check_status(pfnet_similarity(graph, matrix, stride, &lib), "similarity");
+            }
+        }
 
-    double **pf_net = pathfinder_network(D, n, q, r);
+        if (!updated) {
+            if (ckpt != NULL) {
+                lib.progress = checkpoint_progress;
+                lib.user = ckpt;
+            }
+            if (perf != NULL) {
+                perf->n = n;
+                perf->start_k = ckpt != NULL ? ckpt->start_k : 0;
+                perf->r = r;
+            }
+            if (opts.approximate) {
+                check_status(pfnet_closure_sparse(matrix, n, stride, &lib), "closure");
+            } else {
+                struct progress_reporter reporter;
+                progress_start(&reporter, &opts, num_threads, &lib);
+                check_status(pfnet_closure(matrix, n, stride,
+                                           ckpt != NULL ? ckpt->start_k : 0, &lib),
+                             "closure");
+                progress_stop(&reporter, &lib);
+            }
+            checkpoint_finish(ckpt);
+        }
+        pf_net = D;
+    }
 
     double wtime_pf = omp_get_wtime();
     printf("Pathfinder:\t%.2f s\n", 
            wtime_pf - wtime_similarity);
+
+    // Like the recall check, verification has its own time and is left out
+    // of the phases.
+    double verify_time = 0;
+    if (opts.verify > 0) {
+        perf_switch(perf, STAGE_NONE);
+        if (graph == NULL) {
+            // A resumed run starts without the co-occurrence counts.
+            check_status(pfnet_graph_build(vocab, (const char *const *)text, text_size,
+                                           &lib, &graph),
+                         "graph construction");
+        }
+        struct verify_result check;
+        verify_closure(graph, pf_net, n, r, opts.verify, &check);
+        verify_time = omp_get_wtime() - wtime_pf;
+        printf("Verify:\t%d pairs from %d words, max error %.3g, mean error %.3g, "
+               "%d reachability mismatches, %d link flips (%.2f s)\n",
+               check.pairs, check.sources, check.max_error, check.mean_error,
+               check.unreachable, check.link_flips, verify_time);
+    }
+    perf_switch(perf, STAGE_OUTPUT);
+
     printf("Total:\t%.2f s\n", 
            wtime_pf - wtime);
     printf("===============================================\n");
     printf("RESULT\n");
     printf("===============================================\n");
 
-    for (int i = 0; i < n; i++) {
-        for (int j = i + 1; j < n; j++) {
-            printf("%s %s %f\n", wordSet[i], wordSet[j], pf_net[i][j]);
-        }
+    if (opts.output_mode != OUTPUT_PAIRS && graph == NULL) {
+        // A resumed run never saw the direct distances the links are selected
+        // by, so the co-occurrence counts are rebuilt from the input.
+        check_status(pfnet_graph_build(vocab, (const char *const *)text, text_size,
+                                       &lib, &graph),
+                     "graph construction");
     }
 
-    #pragma omp parallel for
-    for (int i = 0; i < text_size; i++) {
-        free(text[i]);
+    if (opts.ooc_path != NULL) {
+        check_status(pfnet_ooc_rows(ooc, ooc_write_rows, vocab), "output");
+        pfnet_ooc_close(ooc);
+    } else if (opts.binary_path != NULL) {
+        write_binary_result(opts.binary_path, wordSet, graph, pf_net, n,
+                            kept.cols != NULL ? &kept : NULL, opts.output_mode);
+    } else if (opts.output_mode == OUTPUT_PAIRS) {
+        write_results(STDOUT_FILENO, wordSet, pf_net, n);
+    } else {
+        write_links(STDOUT_FILENO, wordSet, graph, pf_net, n,
+                    kept.cols != NULL ? &kept : NULL, opts.output_mode);
     }
-    free(text);
 
-    #pragma omp parallel for
-    for (int i = 0; i < wordSetSize; i++) {
-        free(wordSet[i]);
+    // The summary goes to stderr, after the result is out.
+    if (perf != NULL) {
+        fflush(stdout);
+        perf_switch(perf, STAGE_NONE);
+        perf_report(perf);
+        perf_close(perf);
     }
-    free(wordSet);
 
-    #pragma omp parallel for
-    for (int i = 0; i < n; i++) {
-        free(graph[i]);
-        free(D[i]);
-        free(pf_net[i]);
+    if (opts.stats_path != NULL) {
+        fflush(stdout);
+        double wtime_output = omp_get_wtime();
+        struct phase_times times = {
+            wtime_wordset - wtime, wtime_graph - wtime_wordset,
+            wtime_similarity - wtime_graph - recall_time, wtime_pf - wtime_similarity,
+            wtime_output - wtime_pf - verify_time, wtime_output - wtime - verify_time};
+        write_stats(opts.stats_path, &times, num_threads, text_size, n);
     }
-    free(graph);
+
+    if (opts.incremental_path != NULL) {
+        // The next run's windows reach back over the last _MAX_DISTANCE
+        // tokens of everything read so far.
+        int n_tokens = incremental ? n_appended : text_size;
+        const char *const *tokens = incremental ? appended : (const char *const *)text;
+        int n_context = min(n_tokens, _MAX_DISTANCE);
+        int32_t context[_MAX_DISTANCE];
+        for (int i = 0; i < n_context; i++) {
+            context[i] = pfnet_vocab_find(vocab, tokens[n_tokens - n_context + i]);
+        }
+
+        uint64_t total = (incremental ? inc.header.text_size : 0) + text_size;
+        incremental_save(opts.incremental_path, wordSet, n, context, n_context, total,
+                         graph, pf_net, _MAX_DISTANCE, r);
+    }
+    if (incremental) {
+        incremental_close(&inc);
+    }
+    free(map);
+    free(old_index);
+    free(touched);
+    free(appended);
+    free(kept.offsets);
+    free(kept.cols);
+
+    // The words point into the token strings, so they go before the arena.
+    pfnet_vocab_free(vocab);
+    free(text);
+    arena_free(&strings);
+    free(stopwords);
+    arena_free(&stopword_strings);
+
+    // The closure ran in place, so pf_net is D.
+    pfnet_graph_free(graph);
+    pfnet_matrix_free(matrix);
     free(D);
-    free(pf_net);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,3088 @@
+// libpfnet, see pfnet.h. Built from the same engine as mp.c:
+//   gcc -O2 -fPIC -fopenmp -c pfnet.c
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "pfnet.h"
+
+#define _INFINITY PFNET_INFINITY
+
+#define MATRIX_ALIGNMENT 64
+#define DEFAULT_WINDOW 5
+#define DEFAULT_L1D_SIZE (32 * 1024)
+#define DEFAULT_L2_SIZE (256 * 1024)
+#define TUNING_BACKEND "libpfnet"
+// build_sparse_graph() mode in which a token missing from the vocabulary is
+// an error rather than a pruned word.
+#define PRUNE_NONE (-1)
+// The size of struct pfnet_options in version 2.0, the first layout with a
+// size field. Later fields all come after reserved.
+#define OPTIONS_SIZE_2_0 (offsetof(struct pfnet_options, reserved) + 8 * sizeof(void *))
+
+struct pfnet_vocab {
+    const char **words;
+    int size;
+    int pruned_words;
+    size_t pruned_tokens;
+};
+
+// Written by the closure's threads and read by a watcher at the same time,
+// all with relaxed atomics: each counter only has to move forward.
+struct pfnet_telemetry {
+    int threads;
+    atomic_int round;
+    atomic_int rounds;
+    atomic_int running;
+    atomic_llong updates;
+    atomic_llong total_updates;
+    atomic_llong started_ns;
+    atomic_llong *busy_ns;
+};
+
+// Co-occurrence counts in compressed rows: the neighbours of word i are
+// col[row_start[i] .. row_start[i + 1]), in increasing order. A window holds
+// at most window following tokens, so this is O(text_size) where a dense
+// n x n count matrix would be O(n^2).
+struct pfnet_graph {
+    int n;
+    int *row_start;
+    int *col;
+    double *count;
+    double *norm;
+};
+
+void pfnet_default_options(struct pfnet_options *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->size = sizeof(*opts);
+    opts->threads = 0;
+    opts->window = DEFAULT_WINDOW;
+    opts->r = 1;
+    opts->numa = 0;
+    opts->block_size = 0;
+    opts->min_count = 0;
+    opts->max_vocab = 0;
+    opts->stopwords = NULL;
+    opts->n_stopwords = 0;
+    opts->prune_mode = PFNET_PRUNE_DROP;
+    opts->progress = NULL;
+    opts->user = NULL;
+    opts->phase = NULL;
+    opts->phase_user = NULL;
+    opts->telemetry = NULL;
+}
+
+const char *pfnet_strerror(int code)
+{
+    switch (code) {
+    case PFNET_OK:
+        return "success";
+    case PFNET_EINVAL:
+        return "invalid argument";
+    case PFNET_ENOMEM:
+        return "out of memory";
+    case PFNET_ERANGE:
+        return "buffer too small";
+    case PFNET_EIO:
+        return "I/O error";
+    default:
+        return "unknown error";
+    }
+}
+
+// The options to run with: the caller's, or the defaults for NULL. A caller
+// built against an older layout passes a smaller size, and its fields are
+// copied over the defaults of the ones it lacks. NULL for a size no version
+// of the layout has, such as options never passed through
+// pfnet_default_options().
+static const struct pfnet_options *resolve_options(const struct pfnet_options *opts,
+                                                   struct pfnet_options *defaults)
+{
+    if (opts != NULL && opts->size == sizeof(*opts)) {
+        return opts;
+    }
+    pfnet_default_options(defaults);
+    if (opts == NULL) {
+        return defaults;
+    }
+    if (opts->size < OPTIONS_SIZE_2_0 || opts->size > sizeof(*opts)) {
+        return NULL;
+    }
+    memcpy(defaults, opts, opts->size);
+    defaults->size = sizeof(*defaults);
+    return defaults;
+}
+
+// Every entry point runs its parallel regions on opts->threads threads and
+// hands the caller's own setting back before it returns.
+static int enter_threads(const struct pfnet_options *opts)
+{
+    int saved = omp_get_max_threads();
+    if (opts->threads > 0) {
+        omp_set_num_threads(opts->threads);
+    }
+    return saved;
+}
+
+static void leave_threads(int saved)
+{
+    omp_set_num_threads(saved);
+}
+
+static void report_progress(const struct pfnet_options *opts, double **D,
+                            size_t stride, int n, int next_k)
+{
+    if (opts->progress != NULL) {
+        opts->progress(opts->user, D[0], stride, n, next_k);
+    }
+}
+
+static void report_phase(const struct pfnet_options *opts, int phase)
+{
+    if (opts->phase != NULL) {
+        opts->phase(opts->phase_user, phase);
+    }
+}
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void telemetry_begin(const struct pfnet_options *opts, int round, int rounds,
+                            long long total_updates)
+{
+    struct pfnet_telemetry *t = opts->telemetry;
+    if (t == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < t->threads; i++) {
+        atomic_store_explicit(&t->busy_ns[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&t->updates, 0, memory_order_relaxed);
+    atomic_store_explicit(&t->total_updates, total_updates, memory_order_relaxed);
+    atomic_store_explicit(&t->round, round, memory_order_relaxed);
+    atomic_store_explicit(&t->rounds, rounds, memory_order_relaxed);
+    atomic_store_explicit(&t->started_ns, monotonic_ns(), memory_order_relaxed);
+    atomic_store_explicit(&t->running, 1, memory_order_relaxed);
+}
+
+static void telemetry_round(const struct pfnet_options *opts, int round)
+{
+    if (opts->telemetry != NULL) {
+        atomic_store_explicit(&opts->telemetry->round, round, memory_order_relaxed);
+    }
+}
+
+static void telemetry_end(const struct pfnet_options *opts)
+{
+    if (opts->telemetry != NULL) {
+        atomic_store_explicit(&opts->telemetry->running, 0, memory_order_relaxed);
+    }
+}
+
+// The start of a piece of work, for telemetry_work(); free without
+// telemetry.
+static long long telemetry_clock(const struct pfnet_options *opts)
+{
+    return opts->telemetry != NULL ? monotonic_ns() : 0;
+}
+
+// Charges the work since started to the calling thread. A tile is
+// thousands of updates, so two clock reads and two adds per tile cost
+// nothing measurable.
+static void telemetry_work(const struct pfnet_options *opts, long long started,
+                           long long updates)
+{
+    struct pfnet_telemetry *t = opts->telemetry;
+    if (t == NULL) {
+        return;
+    }
+
+    int tid = omp_get_thread_num();
+    if (tid < t->threads) {
+        atomic_fetch_add_explicit(&t->busy_ns[tid], monotonic_ns() - started,
+                                  memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&t->updates, updates, memory_order_relaxed);
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int compare_words(const void *key, const void *item)
+{
+    return strcmp((const char *)key, *(const char *const *)item);
+}
+
+static int pruning(const struct pfnet_options *opts)
+{
+    return opts->min_count > 1 || opts->max_vocab > 0 || opts->n_stopwords > 0;
+}
+
+static int valid_pruning(const struct pfnet_options *opts)
+{
+    return opts->min_count >= 0 && opts->max_vocab >= 0 && opts->n_stopwords >= 0
+           && (opts->n_stopwords == 0 || opts->stopwords != NULL)
+           && (opts->prune_mode == PFNET_PRUNE_DROP || opts->prune_mode == PFNET_PRUNE_SKIP);
+}
+
+struct word_count {
+    int count;
+    int word;
+};
+
+// Most frequent first, the earlier word first among equals.
+static int compare_frequency(const void *a, const void *b)
+{
+    const struct word_count *x = (const struct word_count *)a;
+    const struct word_count *y = (const struct word_count *)b;
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
+    }
+    return x->word - y->word;
+}
+
+// Drops the pruned words from the sorted distinct words, given how often
+// each occurs, keeping the others in order.
+static int prune_words(const char **words, const int *count, int *size,
+                       const struct pfnet_options *opts, struct pfnet_vocab *v)
+{
+    int n = *size;
+    char *keep = (char *)malloc(n > 0 ? n : 1);
+    const char **stop = (const char **)malloc((opts->n_stopwords > 0 ? opts->n_stopwords : 1)
+                                              * sizeof(char *));
+    struct word_count *ranked =
+        (struct word_count *)malloc((n > 0 ? n : 1) * sizeof(struct word_count));
+    if (keep == NULL || stop == NULL || ranked == NULL) {
+        free(keep);
+        free(stop);
+        free(ranked);
+        return PFNET_ENOMEM;
+    }
+
+    if (opts->n_stopwords > 0) {
+        memcpy(stop, opts->stopwords, opts->n_stopwords * sizeof(char *));
+        qsort(stop, opts->n_stopwords, sizeof(char *), compare_strings);
+    }
+
+    int n_ranked = 0;
+    for (int i = 0; i < n; i++) {
+        keep[i] = count[i] >= opts->min_count
+                  && bsearch(words[i], stop, opts->n_stopwords, sizeof(char *),
+                             compare_words) == NULL;
+        if (keep[i]) {
+            ranked[n_ranked].count = count[i];
+            ranked[n_ranked++].word = i;
+        }
+    }
+
+    if (opts->max_vocab > 0 && n_ranked > opts->max_vocab) {
+        qsort(ranked, n_ranked, sizeof(struct word_count), compare_frequency);
+        for (int r = opts->max_vocab; r < n_ranked; r++) {
+            keep[ranked[r].word] = 0;
+        }
+    }
+
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        if (keep[i]) {
+            words[kept++] = words[i];
+        } else {
+            v->pruned_words++;
+            v->pruned_tokens += count[i];
+        }
+    }
+    *size = kept;
+
+    free(keep);
+    free(stop);
+    free(ranked);
+    return PFNET_OK;
+}
+
+int pfnet_vocab_build(const char *const *tokens, int n_tokens,
+                      const struct pfnet_options *opts,
+                      struct pfnet_vocab **vocab)
+{
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if ((tokens == NULL && n_tokens > 0) || n_tokens < 0 || vocab == NULL
+        || opts == NULL || !valid_pruning(opts)) {
+        return PFNET_EINVAL;
+    }
+
+    struct pfnet_vocab *v = (struct pfnet_vocab *)calloc(1, sizeof(*v));
+    const char **words = (const char **)malloc((n_tokens > 0 ? n_tokens : 1) * sizeof(char *));
+    // The run lengths of the sorted tokens are the word counts pruning
+    // needs, so counting costs no pass of its own.
+    int *count = pruning(opts) ? (int *)malloc((n_tokens > 0 ? n_tokens : 1) * sizeof(int))
+                               : NULL;
+    if (v == NULL || words == NULL || (pruning(opts) && count == NULL)) {
+        free(v);
+        free(words);
+        free(count);
+        return PFNET_ENOMEM;
+    }
+
+    // Sorting all tokens and dropping the repeats gives the same sorted set
+    // as inserting them one by one, in O(N log N) instead of O(N * n).
+    memcpy(words, tokens, n_tokens * sizeof(char *));
+    qsort(words, n_tokens, sizeof(char *), compare_strings);
+
+    int size = 0;
+    for (int i = 0; i < n_tokens; i++) {
+        if (size == 0 || strcmp(words[size - 1], words[i]) != 0) {
+            if (count != NULL) {
+                count[size] = 0;
+            }
+            words[size++] = words[i];
+        }
+        if (count != NULL) {
+            count[size - 1]++;
+        }
+    }
+
+    if (count != NULL) {
+        int status = prune_words(words, count, &size, opts, v);
+        free(count);
+        if (status != PFNET_OK) {
+            free(v);
+            free(words);
+            return status;
+        }
+    }
+
+    const char **shrunk = (const char **)realloc(words, (size > 0 ? size : 1) * sizeof(char *));
+    v->words = shrunk != NULL ? shrunk : words;
+    v->size = size;
+
+    *vocab = v;
+    return PFNET_OK;
+}
+
+void pfnet_vocab_free(struct pfnet_vocab *vocab)
+{
+    if (vocab != NULL) {
+        free(vocab->words);
+        free(vocab);
+    }
+}
+
+int pfnet_vocab_size(const struct pfnet_vocab *vocab)
+{
+    return vocab->size;
+}
+
+const char *const *pfnet_vocab_words(const struct pfnet_vocab *vocab)
+{
+    return vocab->words;
+}
+
+void pfnet_vocab_pruned(const struct pfnet_vocab *vocab, int *words, size_t *tokens)
+{
+    if (words != NULL) {
+        *words = vocab->pruned_words;
+    }
+    if (tokens != NULL) {
+        *tokens = vocab->pruned_tokens;
+    }
+}
+
+int pfnet_vocab_find(const struct pfnet_vocab *vocab, const char *word)
+{
+    const char *const *found = (const char *const *)bsearch(
+        word, vocab->words, vocab->size, sizeof(char *), compare_words);
+    return found != NULL ? (int)(found - vocab->words) : -1;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Counts how often two different words appear within window tokens of each
+// other. The (row, col) keys are sorted and merged instead of being added
+// into an n x n matrix, and each row's norm is kept for direct_distance().
+// Only pairs whose later token is at first_new or beyond are counted; the
+// counts of base, its word i renamed to map[i], are merged in, so extending
+// a graph gives exactly the counts of building it from the whole text.
+// Tokens missing from wordSet are an error with prune_mode PRUNE_NONE, and
+// pruned words otherwise.
+static int build_sparse_graph(struct pfnet_graph *g, const char *const *text,
+                              int text_size, int first_new,
+                              const struct pfnet_graph *base, const int *map,
+                              const char *const *wordSet, int wordSetSize,
+                              int window, int prune_mode)
+{
+    int *token = (int *)malloc((text_size > 0 ? text_size : 1) * sizeof(int));
+    if (token == NULL) {
+        return PFNET_ENOMEM;
+    }
+
+    int unknown = 0;
+    #pragma omp parallel for
+    for (int i = 0; i < text_size; i++) {
+        const char *const *found = (const char *const *)bsearch(
+            text[i], wordSet, wordSetSize, sizeof(char *), compare_words);
+        if (found == NULL) {
+            token[i] = -1;
+            if (prune_mode == PRUNE_NONE) {
+                #pragma omp atomic write
+                unknown = 1;
+            }
+            continue;
+        }
+        token[i] = (int)(found - wordSet);
+    }
+    if (unknown) {
+        free(token);
+        return PFNET_EINVAL;
+    }
+
+    // Dropped tokens leave no gap, so their neighbours share windows. Skipped
+    // ones keep their -1 and are passed over by the window loop below.
+    if (prune_mode == PFNET_PRUNE_DROP) {
+        int kept = 0;
+        for (int i = 0; i < text_size; i++) {
+            if (token[i] >= 0) {
+                token[kept++] = token[i];
+            }
+        }
+        text_size = kept;
+    }
+
+    size_t capacity = 2 * (size_t)window * (text_size > 0 ? text_size : 1);
+    uint64_t *keys = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    if (keys == NULL) {
+        free(token);
+        return PFNET_ENOMEM;
+    }
+    size_t count = 0;
+    for (int i = 0; i < text_size; i++) {
+        if (token[i] < 0) {
+            continue;
+        }
+        int max_neighbor =
+            (i + 1 + window < text_size) ? i + 1 + window : text_size;
+        for (int j = i + 1 > first_new ? i + 1 : first_new; j < max_neighbor; j++) {
+            if (token[j] >= 0 && token[i] != token[j]) {
+                keys[count++] = (uint64_t)token[i] << 32 | (uint32_t)token[j];
+                keys[count++] = (uint64_t)token[j] << 32 | (uint32_t)token[i];
+            }
+        }
+    }
+    qsort(keys, count, sizeof(uint64_t), compare_keys);
+
+    // map is increasing, so the renamed base entries are still in key order
+    // and merge with the new keys in one pass.
+    size_t base_count = base != NULL ? (size_t)base->row_start[base->n] : 0;
+    size_t total = count + base_count;
+
+    g->n = wordSetSize;
+    g->row_start = (int *)calloc(wordSetSize + 1, sizeof(int));
+    g->col = (int *)malloc((total > 0 ? total : 1) * sizeof(int));
+    g->count = (double *)malloc((total > 0 ? total : 1) * sizeof(double));
+    g->norm = (double *)malloc((wordSetSize > 0 ? wordSetSize : 1) * sizeof(double));
+    if (g->row_start == NULL || g->col == NULL || g->count == NULL || g->norm == NULL) {
+        free(keys);
+        free(token);
+        return PFNET_ENOMEM;
+    }
+
+    int entries = 0;
+    uint64_t last_key = 0;
+    size_t e = 0;
+    size_t b = 0;
+    int base_row = 0;
+    while (e < count || b < base_count) {
+        uint64_t key = 0;
+        double weight = 1;
+        if (b < base_count) {
+            while ((size_t)base->row_start[base_row + 1] <= b) {
+                base_row++;
+            }
+            key = (uint64_t)map[base_row] << 32 | (uint32_t)map[base->col[b]];
+        }
+        if (b < base_count && (e == count || key <= keys[e])) {
+            weight = base->count[b++];
+        } else {
+            key = keys[e++];
+        }
+
+        if (entries > 0 && key == last_key) {
+            g->count[entries - 1] += weight;
+            continue;
+        }
+        g->row_start[(key >> 32) + 1]++;
+        g->col[entries] = (int)(uint32_t)key;
+        g->count[entries] = weight;
+        last_key = key;
+        entries++;
+    }
+    for (int i = 0; i < wordSetSize; i++) {
+        g->row_start[i + 1] += g->row_start[i];
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < wordSetSize; i++) {
+        double sum = 0.0;
+        for (int e = g->row_start[i]; e < g->row_start[i + 1]; e++) {
+            sum += g->count[e] * g->count[e];
+        }
+        g->norm[i] = sqrt(sum);
+    }
+
+    free(keys);
+    free(token);
+
+    return PFNET_OK;
+}
+
+void pfnet_graph_free(struct pfnet_graph *g)
+{
+    if (g != NULL) {
+        free(g->row_start);
+        free(g->col);
+        free(g->count);
+        free(g->norm);
+        free(g);
+    }
+}
+
+int pfnet_graph_size(const struct pfnet_graph *g)
+{
+    return g->n;
+}
+
+size_t pfnet_graph_entries(const struct pfnet_graph *g)
+{
+    return (size_t)g->row_start[g->n];
+}
+
+// Counts are small integers, so the sparse dot product and norms are exact
+// and equal to the sums over full dense rows.
+double pfnet_direct_distance(const struct pfnet_graph *g, int i, int j)
+{
+    if (g->norm[i] == 0 || g->norm[j] == 0) {
+        return _INFINITY;
+    }
+
+    double dot = 0.0;
+    int x = g->row_start[i];
+    int y = g->row_start[j];
+    while (x < g->row_start[i + 1] && y < g->row_start[j + 1]) {
+        if (g->col[x] < g->col[y]) {
+            x++;
+        } else if (g->col[x] > g->col[y]) {
+            y++;
+        } else {
+            dot += g->count[x++] * g->count[y++];
+        }
+    }
+
+    double similarity = dot / (g->norm[i] * g->norm[j]);
+    return similarity == 0 ? _INFINITY : 1 - similarity;
+}
+
+int pfnet_graph_build(const struct pfnet_vocab *vocab,
+                      const char *const *tokens, int n_tokens,
+                      const struct pfnet_options *opts,
+                      struct pfnet_graph **graph)
+{
+    if (vocab == NULL || (tokens == NULL && n_tokens > 0) || n_tokens < 0 || graph == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL || opts->window < 1 || !valid_pruning(opts)) {
+        return PFNET_EINVAL;
+    }
+
+    struct pfnet_graph *g = (struct pfnet_graph *)calloc(1, sizeof(*g));
+    if (g == NULL) {
+        return PFNET_ENOMEM;
+    }
+
+    int saved = enter_threads(opts);
+    int status = build_sparse_graph(g, tokens, n_tokens, 0, NULL, NULL, vocab->words,
+                                    vocab->size, opts->window,
+                                    pruning(opts) ? opts->prune_mode : PRUNE_NONE);
+    leave_threads(saved);
+
+    if (status != PFNET_OK) {
+        pfnet_graph_free(g);
+        return status;
+    }
+
+    *graph = g;
+    return PFNET_OK;
+}
+
+int pfnet_graph_extend(const struct pfnet_graph *graph, const int *map,
+                       const struct pfnet_vocab *vocab, const char *const *tokens,
+                       int n_context, int n_tokens, const struct pfnet_options *opts,
+                       struct pfnet_graph **extended)
+{
+    if (graph == NULL || (map == NULL && graph->n > 0) || vocab == NULL
+        || (tokens == NULL && n_context + n_tokens > 0) || n_context < 0
+        || n_tokens < 0 || extended == NULL) {
+        return PFNET_EINVAL;
+    }
+    for (int i = 0; i < graph->n; i++) {
+        if (map[i] < 0 || map[i] >= vocab->size || (i > 0 && map[i] <= map[i - 1])) {
+            return PFNET_EINVAL;
+        }
+    }
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL || opts->window < 1 || pruning(opts)) {
+        return PFNET_EINVAL;
+    }
+
+    struct pfnet_graph *g = (struct pfnet_graph *)calloc(1, sizeof(*g));
+    if (g == NULL) {
+        return PFNET_ENOMEM;
+    }
+
+    int saved = enter_threads(opts);
+    int status = build_sparse_graph(g, tokens, n_context + n_tokens, n_context, graph,
+                                    map, vocab->words, vocab->size, opts->window,
+                                    PRUNE_NONE);
+    leave_threads(saved);
+
+    if (status != PFNET_OK) {
+        pfnet_graph_free(g);
+        return status;
+    }
+
+    *extended = g;
+    return PFNET_OK;
+}
+
+// n and the entry count as int64_t, then row_start, col and count; the
+// norms are recomputed on reading.
+int pfnet_graph_write(const struct pfnet_graph *graph, FILE *file)
+{
+    if (graph == NULL || file == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    int64_t n = graph->n;
+    int64_t entries = graph->row_start[graph->n];
+    if (fwrite(&n, sizeof(n), 1, file) != 1
+        || fwrite(&entries, sizeof(entries), 1, file) != 1
+        || fwrite(graph->row_start, sizeof(int), n + 1, file) != (size_t)n + 1
+        || fwrite(graph->col, sizeof(int), entries, file) != (size_t)entries
+        || fwrite(graph->count, sizeof(double), entries, file) != (size_t)entries) {
+        return PFNET_EIO;
+    }
+    return PFNET_OK;
+}
+
+int pfnet_graph_read(FILE *file, struct pfnet_graph **graph)
+{
+    if (file == NULL || graph == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    int64_t n;
+    int64_t entries;
+    if (fread(&n, sizeof(n), 1, file) != 1 || fread(&entries, sizeof(entries), 1, file) != 1) {
+        return PFNET_EIO;
+    }
+    if (n < 0 || n > INT32_MAX || entries < 0 || entries > INT32_MAX) {
+        return PFNET_EINVAL;
+    }
+
+    struct pfnet_graph *g = (struct pfnet_graph *)calloc(1, sizeof(*g));
+    if (g == NULL) {
+        return PFNET_ENOMEM;
+    }
+    g->n = (int)n;
+    g->row_start = (int *)malloc((n + 1) * sizeof(int));
+    g->col = (int *)malloc((entries > 0 ? entries : 1) * sizeof(int));
+    g->count = (double *)malloc((entries > 0 ? entries : 1) * sizeof(double));
+    g->norm = (double *)malloc((n > 0 ? n : 1) * sizeof(double));
+    if (g->row_start == NULL || g->col == NULL || g->count == NULL || g->norm == NULL) {
+        pfnet_graph_free(g);
+        return PFNET_ENOMEM;
+    }
+
+    if (fread(g->row_start, sizeof(int), n + 1, file) != (size_t)n + 1
+        || fread(g->col, sizeof(int), entries, file) != (size_t)entries
+        || fread(g->count, sizeof(double), entries, file) != (size_t)entries) {
+        pfnet_graph_free(g);
+        return PFNET_EIO;
+    }
+
+    int valid = g->row_start[0] == 0 && g->row_start[n] == entries;
+    for (int64_t i = 0; i < n && valid; i++) {
+        valid = g->row_start[i] <= g->row_start[i + 1];
+    }
+    for (int64_t e = 0; e < entries && valid; e++) {
+        valid = g->col[e] >= 0 && g->col[e] < n;
+    }
+    if (!valid) {
+        pfnet_graph_free(g);
+        return PFNET_EINVAL;
+    }
+
+    for (int64_t i = 0; i < n; i++) {
+        double sum = 0.0;
+        for (int e = g->row_start[i]; e < g->row_start[i + 1]; e++) {
+            sum += g->count[e] * g->count[e];
+        }
+        g->norm[i] = sqrt(sum);
+    }
+
+    *graph = g;
+    return PFNET_OK;
+}
+
+// Length of a path made of two parts a and b under the Minkowski r metric,
+// the combine of every closure engine. pow(x, 1) is exact, so r = 1 only
+// skips the three calls, and r = infinity, where pow would overflow, is the
+// longer part.
+static inline double path_length(double a, double b, double r)
+{
+    if (a == _INFINITY || b == _INFINITY) {
+        return _INFINITY;
+    }
+    if (r == 1) {
+        return a + b;
+    }
+    if (r == _INFINITY) {
+        return fmax(a, b);
+    }
+    return pow(pow(a, r) + pow(b, r), 1.0 / r);
+}
+
+// NUMA-aware closure (the numa option). A strip is one row of tiles, and thread t
+// of a team of T owns strips strip_begin(t) .. strip_begin(t + 1) - 1. The
+// owner first-touches its strips, so their pages sit on its node, and it is
+// the only thread that updates their tiles outside the pivot strip. Every
+// team in this mode has the same size and uses proc_bind(spread), so thread
+// t is bound to the same place in each of them.
+struct numa_layout {
+    int n_threads;
+    int n_nodes;
+    int *thread_node;
+    int *node_leader;
+};
+
+static int strip_begin(int t, int n_threads, int n_blocks)
+{
+    return (int)((long long)t * n_blocks / n_threads);
+}
+
+// Node of a CPU from sysfs, where /sys/devices/system/cpu/cpuN holds a nodeM
+// entry. Machines without one are a single node.
+static int cpu_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && isdigit((unsigned char)entry->d_name[4])) {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return node;
+}
+
+static int numa_init(struct numa_layout *layout)
+{
+    layout->n_threads = omp_get_max_threads();
+    layout->thread_node = (int *)malloc(layout->n_threads * sizeof(int));
+    if (layout->thread_node == NULL) {
+        return PFNET_ENOMEM;
+    }
+
+    #pragma omp parallel proc_bind(spread) num_threads(layout->n_threads)
+    {
+        int cpu = sched_getcpu();
+        layout->thread_node[omp_get_thread_num()] = cpu >= 0 ? cpu_node(cpu) : 0;
+    }
+
+    layout->n_nodes = 1;
+    for (int t = 0; t < layout->n_threads; t++) {
+        if (layout->thread_node[t] >= layout->n_nodes) {
+            layout->n_nodes = layout->thread_node[t] + 1;
+        }
+    }
+
+    layout->node_leader = (int *)malloc(layout->n_nodes * sizeof(int));
+    if (layout->node_leader == NULL) {
+        free(layout->thread_node);
+        return PFNET_ENOMEM;
+    }
+    for (int node = 0; node < layout->n_nodes; node++) {
+        layout->node_leader[node] = -1;
+    }
+    for (int t = layout->n_threads - 1; t >= 0; t--) {
+        layout->node_leader[layout->thread_node[t]] = t;
+    }
+
+    return PFNET_OK;
+}
+
+static void free_numa_layout(struct numa_layout *layout)
+{
+    free(layout->thread_node);
+    free(layout->node_leader);
+}
+
+// Every strip of M first touched by the thread that owns it. Pages that
+// straddle two strips go to whichever owner touches them first.
+static void place_strips(double *M, int n, size_t stride, int block_size,
+                         const struct numa_layout *layout)
+{
+    int n_blocks = n / block_size;
+
+    #pragma omp parallel proc_bind(spread) num_threads(layout->n_threads)
+    {
+        int tid = omp_get_thread_num();
+        int T = omp_get_num_threads();
+        size_t first_row = (size_t)strip_begin(tid, T, n_blocks) * block_size;
+        size_t last_row = (size_t)strip_begin(tid + 1, T, n_blocks) * block_size;
+
+        if (last_row > first_row) {
+            memset(M + first_row * stride, 0, (last_row - first_row) * stride * sizeof(double));
+        }
+    }
+}
+
+// blocked_floyd_warshall() with the static strip ownership above. Phase 3
+// reads the pivot column tile from the thread's own strip, which is local,
+// and the pivot row from a copy of the pivot strip on the thread's node, so
+// the only remote traffic per k_block is one strip copied once per node.
+static int numa_floyd_warshall(double **D, int n, size_t stride,
+                               int block_size, int start_k_block,
+                               const struct pfnet_options *opts)
+{
+    struct numa_layout layout_state;
+    struct numa_layout *layout = &layout_state;
+    if (numa_init(layout) != PFNET_OK) {
+        return PFNET_ENOMEM;
+    }
+
+    int n_blocks = n / block_size;
+    long long tile_updates = (long long)block_size * block_size * block_size;
+    double r = opts->r;
+    size_t strip_bytes = (size_t)block_size * stride * sizeof(double);
+    double **pivot_copy = (double **)calloc(layout->n_nodes, sizeof(double *));
+    if (pivot_copy == NULL) {
+        free_numa_layout(layout);
+        return PFNET_ENOMEM;
+    }
+
+    // Each node leader allocates its node's copy, so the copy is first
+    // touched on that node.
+    #pragma omp parallel proc_bind(spread) num_threads(layout->n_threads)
+    {
+        int tid = omp_get_thread_num();
+        int node = layout->thread_node[tid];
+
+        if (layout->node_leader[node] == tid) {
+            pivot_copy[node] = (double *)aligned_alloc(MATRIX_ALIGNMENT, strip_bytes);
+            if (pivot_copy[node] != NULL) {
+                memset(pivot_copy[node], 0, strip_bytes);
+            }
+        }
+    }
+
+    int failed = 0;
+    for (int node = 0; node < layout->n_nodes; node++) {
+        if (layout->node_leader[node] >= 0 && pivot_copy[node] == NULL) {
+            failed = 1;
+        }
+    }
+
+    for (int k_block = start_k_block; k_block < n_blocks && !failed; k_block++) {
+        double *A = &D[k_block * block_size][k_block * block_size];
+        double *pivot_strip = D[k_block * block_size];
+
+        #pragma omp parallel proc_bind(spread) num_threads(layout->n_threads)
+        {
+            int tid = omp_get_thread_num();
+            int T = omp_get_num_threads();
+            int node = layout->thread_node[tid];
+            int my_begin = strip_begin(tid, T, n_blocks);
+            int my_end = strip_begin(tid + 1, T, n_blocks);
+
+            // The phase hook runs on the master while the team waits, so
+            // the extra barriers are only paid when there is a hook.
+            if (opts->phase != NULL) {
+                #pragma omp master
+                report_phase(opts, PFNET_PHASE_PIVOT);
+                #pragma omp barrier
+            }
+
+            // Phase 1: Dependent phase, on the owner of the pivot strip
+            if (k_block >= my_begin && k_block < my_end) {
+                long long started = telemetry_clock(opts);
+                for (int k = 0; k < block_size; k++) {
+                    for (int i = 0; i < block_size; i++) {
+                        for (int j = 0; j < block_size; j++) {
+                            double a = A[i * stride + k];
+                            double b = A[k * stride + j];
+                            double t = path_length(a, b, r);
+
+                            if (t < A[i * stride + j]) {
+                                A[i * stride + j] = t;
+                            }
+                        }
+                    }
+                }
+                telemetry_work(opts, started, tile_updates);
+            }
+            #pragma omp barrier
+            if (opts->phase != NULL) {
+                #pragma omp master
+                report_phase(opts, PFNET_PHASE_ROW_COLUMN);
+                #pragma omp barrier
+            }
+
+            // Phase 2: Partially dependent phase. The pivot strip is shared by
+            // all threads, the pivot column tiles stay with their owners.
+            #pragma omp for schedule(dynamic) nowait
+            for (int j_block = 0; j_block < n_blocks; j_block++) {
+                if (j_block == k_block) continue;
+
+                double *B = &D[k_block * block_size][j_block * block_size];
+
+                long long started = telemetry_clock(opts);
+                for (int k = 0; k < block_size; k++) {
+                    for (int i = 0; i < block_size; i++) {
+                        for (int j = 0; j < block_size; j++) {
+                            double a = A[i * stride + k];
+                            double b = B[k * stride + j];
+                            double t = path_length(a, b, r);
+
+                            if (t < B[i * stride + j]) {
+                                B[i * stride + j] = t;
+                            }
+                        }
+                    }
+                }
+                telemetry_work(opts, started, tile_updates);
+            }
+
+            for (int i_block = my_begin; i_block < my_end; i_block++) {
+                if (i_block == k_block) continue;
+
+                double *C = &D[i_block * block_size][k_block * block_size];
+
+                long long started = telemetry_clock(opts);
+                for (int k = 0; k < block_size; k++) {
+                    for (int i = 0; i < block_size; i++) {
+                        for (int j = 0; j < block_size; j++) {
+                            double a = C[i * stride + k];
+                            double b = A[k * stride + j];
+                            double t = path_length(a, b, r);
+
+                            if (t < C[i * stride + j]) {
+                                C[i * stride + j] = t;
+                            }
+                        }
+                    }
+                }
+                telemetry_work(opts, started, tile_updates);
+            }
+            #pragma omp barrier
+
+            if (layout->node_leader[node] == tid) {
+                memcpy(pivot_copy[node], pivot_strip, strip_bytes);
+            }
+            #pragma omp barrier
+            if (opts->phase != NULL) {
+                #pragma omp master
+                report_phase(opts, PFNET_PHASE_REMAINDER);
+                #pragma omp barrier
+            }
+
+            // Phase 3: Independent phase, every thread on its own strips
+            const double *pivot_local = pivot_copy[node];
+            for (int i_block = my_begin; i_block < my_end; i_block++) {
+                if (i_block == k_block) continue;
+
+                const double *A_col = &D[i_block * block_size][k_block * block_size];
+
+                for (int j_block = 0; j_block < n_blocks; j_block++) {
+                    if (j_block == k_block) continue;
+
+                    double *C = &D[i_block * block_size][j_block * block_size];
+                    const double *B_row = pivot_local + j_block * block_size;
+
+                    long long started = telemetry_clock(opts);
+                    for (int k = 0; k < block_size; k++) {
+                        for (int i = 0; i < block_size; i++) {
+                            for (int j = 0; j < block_size; j++) {
+                                double a = A_col[i * stride + k];
+                                double b = B_row[k * stride + j];
+                                double t = path_length(a, b, r);
+
+                                if (t < C[i * stride + j]) {
+                                    C[i * stride + j] = t;
+                                }
+                            }
+                        }
+                    }
+                    telemetry_work(opts, started, tile_updates);
+                }
+            }
+        }
+
+        telemetry_round(opts, k_block + 1);
+        report_progress(opts, D, stride, n, (k_block + 1) * block_size);
+    }
+
+    for (int node = 0; node < layout->n_nodes; node++) {
+        free(pivot_copy[node]);
+    }
+    free(pivot_copy);
+    free_numa_layout(layout);
+
+    return failed ? PFNET_ENOMEM : PFNET_OK;
+}
+
+// Sizes in sysfs read like "48K" or "32M".
+static size_t read_cache_size(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    unsigned long long size = 0;
+    char unit = 0;
+    int fields = fscanf(file, "%llu%c", &size, &unit);
+    fclose(file);
+
+    if (fields < 1) {
+        return 0;
+    }
+    if (fields == 2 && unit == 'K') {
+        size <<= 10;
+    } else if (fields == 2 && unit == 'M') {
+        size <<= 20;
+    }
+    return (size_t)size;
+}
+
+// Each indexN directory under cpuN/cache describes one cache: its level,
+// its type (Data, Instruction or Unified) and its size.
+void pfnet_read_caches(struct pfnet_caches *caches)
+{
+    caches->l1d = 0;
+    caches->l2 = 0;
+    caches->l3 = 0;
+
+    int cpu = sched_getcpu();
+    if (cpu < 0) {
+        cpu = 0;
+    }
+
+    for (int index = 0;; index++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+                 cpu, index);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            break;
+        }
+        int level = 0;
+        if (fscanf(file, "%d", &level) != 1) {
+            level = 0;
+        }
+        fclose(file);
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/type",
+                 cpu, index);
+        char type[32] = "";
+        file = fopen(path, "r");
+        if (file != NULL) {
+            if (fscanf(file, "%31s", type) != 1) {
+                type[0] = '\0';
+            }
+            fclose(file);
+        }
+        if (strcmp(type, "Instruction") == 0) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/size",
+                 cpu, index);
+        size_t size = read_cache_size(path);
+        if (level == 1) {
+            caches->l1d = size;
+        } else if (level == 2) {
+            caches->l2 = size;
+        } else if (level == 3) {
+            caches->l3 = size;
+        }
+    }
+}
+
+// Three tiles (the one being updated and its pivot row and column tiles)
+// should share the L1 data cache, unless a tuned size was given. Machines
+// that do not report their L1 are assumed to have 32KB.
+static int closure_block_size(int n, const struct pfnet_options *opts)
+{
+    int block_size = opts->block_size;
+    if (block_size <= 0) {
+        struct pfnet_caches caches;
+        pfnet_read_caches(&caches);
+        size_t l1d = caches.l1d > 0 ? caches.l1d : DEFAULT_L1D_SIZE;
+
+        block_size = sqrt(l1d / (3 * sizeof(double)));
+        block_size = (block_size / 4) * 4;
+        if (block_size < 4) block_size = 4;
+    }
+    
+    if (n % block_size != 0) {
+        for (int i = block_size; i >= 1; i--) {
+            if (n % i == 0) {
+                block_size = i;
+                break;
+            }
+        }
+    }
+
+    return block_size;
+}
+
+size_t pfnet_matrix_stride(int n)
+{
+    size_t per_line = MATRIX_ALIGNMENT / sizeof(double);
+    return ((size_t)n + per_line - 1) / per_line * per_line;
+}
+
+double *pfnet_matrix_alloc(int n, const struct pfnet_options *opts)
+{
+    if (n < 0) {
+        return NULL;
+    }
+
+    size_t stride = pfnet_matrix_stride(n);
+    size_t bytes = (size_t)n * stride * sizeof(double);
+    double *M = (double *)aligned_alloc(MATRIX_ALIGNMENT, bytes > 0 ? bytes : MATRIX_ALIGNMENT);
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL) {
+        free(M);
+        return NULL;
+    }
+    if (M != NULL && opts->numa && n > 0) {
+        struct numa_layout layout;
+        int saved = enter_threads(opts);
+        if (numa_init(&layout) == PFNET_OK) {
+            place_strips(M, n, stride, closure_block_size(n, opts), &layout);
+            free_numa_layout(&layout);
+        }
+        leave_threads(saved);
+    }
+
+    return M;
+}
+
+void pfnet_matrix_free(double *D)
+{
+    free(D);
+}
+
+// Row table over a caller's matrix, so the engines keep D[i][j] indexing.
+static double **matrix_rows(double *D, int n, size_t stride)
+{
+    double **rows = (double **)malloc((n > 0 ? n : 1) * sizeof(double *));
+    if (rows != NULL) {
+        for (int i = 0; i < n; i++) {
+            rows[i] = D + i * stride;
+        }
+    }
+    return rows;
+}
+
+int pfnet_similarity(const struct pfnet_graph *g, double *D, size_t stride,
+                     const struct pfnet_options *opts)
+{
+    if (g == NULL || D == NULL || stride < (size_t)g->n) {
+        return PFNET_EINVAL;
+    }
+
+    int n = g->n;
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL) {
+        return PFNET_EINVAL;
+    }
+    int saved = enter_threads(opts);
+
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        D[i * stride + i] = 0;
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            double inverse_similarity = pfnet_direct_distance(g, i, j);
+            D[i * stride + j] = inverse_similarity;
+            D[j * stride + i] = inverse_similarity;
+        }
+    }
+
+    leave_threads(saved);
+    return PFNET_OK;
+}
+
+void pfnet_default_lsh(struct pfnet_lsh *lsh)
+{
+    lsh->top_k = 10;
+    lsh->bands = 32;
+    lsh->band_bits = 6;
+    lsh->probe = 8;
+    lsh->seed = 0x9e3779b97f4a7c15ULL;
+}
+
+// splitmix64 finalizer; hyperplane components are derived from it instead
+// of being stored, so the sketches need no n x bits table.
+static uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Sign bit b of the sketch of row i: the side of hyperplane b the row lies
+// on. The hyperplane has a +-1 component per column, 64 of them per hash.
+static void sketch_row(const struct pfnet_graph *g, int i, uint64_t seed,
+                       int bits, double *acc, uint64_t *sketch)
+{
+    for (int b = 0; b < bits; b++) {
+        acc[b] = 0;
+    }
+    for (int x = g->row_start[i]; x < g->row_start[i + 1]; x++) {
+        for (int w = 0; w * 64 < bits; w++) {
+            uint64_t h = mix64(seed ^ ((uint64_t)g->col[x] << 32 | (uint64_t)w));
+            for (int b = w * 64; b < bits && b < (w + 1) * 64; b++) {
+                acc[b] += h >> (b % 64) & 1 ? g->count[x] : -g->count[x];
+            }
+        }
+    }
+    for (int w = 0; w * 64 < bits; w++) {
+        sketch[w] = 0;
+    }
+    for (int b = 0; b < bits; b++) {
+        if (acc[b] > 0) {
+            sketch[b / 64] |= (uint64_t)1 << (b % 64);
+        }
+    }
+}
+
+// The 64 sketch bits from bit first on, wrapping around: the band's bits on
+// top, so equal keys share a bucket, then the bits of the following bands,
+// so words close in the sort order agree on more of the sketch.
+static uint64_t band_key(const uint64_t *sketch, int bits, int first)
+{
+    uint64_t key = 0;
+    for (int b = 0; b < 64; b++) {
+        int bit = (first + b) % bits;
+        key = key << 1 | (sketch[bit / 64] >> (bit % 64) & 1);
+    }
+    return key;
+}
+
+struct lsh_entry {
+    uint64_t key;
+    int word;
+};
+
+static int compare_lsh_entries(const void *a, const void *b)
+{
+    const struct lsh_entry *x = (const struct lsh_entry *)a;
+    const struct lsh_entry *y = (const struct lsh_entry *)b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->word - y->word;
+}
+
+// Max-heap of the k best candidates of one word by (distance, word), so the
+// root is the one to replace.
+static int lsh_worse(double d1, int w1, double d2, int w2)
+{
+    return d1 > d2 || (d1 == d2 && w1 > w2);
+}
+
+static int lsh_holds(const int *word, int size, int j)
+{
+    for (int s = 0; s < size; s++) {
+        if (word[s] == j) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void lsh_offer(double *dist, int *word, int *size, int k, double d, int j)
+{
+    int s;
+    if (*size < k) {
+        s = (*size)++;
+        while (s > 0 && lsh_worse(d, j, dist[(s - 1) / 2], word[(s - 1) / 2])) {
+            dist[s] = dist[(s - 1) / 2];
+            word[s] = word[(s - 1) / 2];
+            s = (s - 1) / 2;
+        }
+    } else if (lsh_worse(dist[0], word[0], d, j)) {
+        s = 0;
+        for (;;) {
+            int c = 2 * s + 1;
+            if (c >= k) {
+                break;
+            }
+            if (c + 1 < k && lsh_worse(dist[c + 1], word[c + 1], dist[c], word[c])) {
+                c++;
+            }
+            if (!lsh_worse(dist[c], word[c], d, j)) {
+                break;
+            }
+            dist[s] = dist[c];
+            word[s] = word[c];
+            s = c;
+        }
+    } else {
+        return;
+    }
+    dist[s] = d;
+    word[s] = j;
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Every band sorts all words by key once; a word then only compares with the
+// probe words on each side of it that share its bucket. Each word's heap is
+// only written by the iteration of that word, so the scans need no locks.
+// With offsets set, the kept pairs also go to *kept as compressed rows.
+static int similarity_lsh(const struct pfnet_graph *g, double *D, size_t stride,
+                          const struct pfnet_lsh *lsh,
+                          const struct pfnet_options *opts, size_t *n_pairs,
+                          int *offsets, int **kept_pairs)
+{
+    if (g == NULL || D == NULL || stride < (size_t)g->n || lsh == NULL
+        || lsh->top_k < 1 || lsh->bands < 1 || lsh->band_bits < 1
+        || lsh->band_bits > 32 || lsh->probe < 1) {
+        return PFNET_EINVAL;
+    }
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    int n = g->n;
+    int k = lsh->top_k;
+    int bits = lsh->bands * lsh->band_bits;
+    int words = (bits + 63) / 64;
+    size_t rows = n > 0 ? n : 1;
+
+    uint64_t *sketches = (uint64_t *)malloc(rows * words * sizeof(uint64_t));
+    struct lsh_entry *order = (struct lsh_entry *)malloc(rows * sizeof(struct lsh_entry));
+    double *best = (double *)malloc(rows * k * sizeof(double));
+    int *best_word = (int *)malloc(rows * k * sizeof(int));
+    int *kept = (int *)calloc(rows, sizeof(int));
+    // Each new pair once, as (i, j), for the compressed rows.
+    int *found = offsets != NULL ? (int *)malloc(rows * k * 2 * sizeof(int)) : NULL;
+    if (sketches == NULL || order == NULL || best == NULL || best_word == NULL
+        || kept == NULL || (offsets != NULL && found == NULL)) {
+        free(sketches);
+        free(order);
+        free(best);
+        free(best_word);
+        free(kept);
+        free(found);
+        return PFNET_ENOMEM;
+    }
+
+    int saved = enter_threads(opts);
+    int failed = 0;
+
+    #pragma omp parallel reduction(||:failed)
+    {
+        double *acc = (double *)malloc(bits * sizeof(double));
+        failed = acc == NULL;
+
+        #pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < n; i++) {
+            if (!failed) {
+                sketch_row(g, i, lsh->seed, bits, acc, sketches + (size_t)i * words);
+            }
+        }
+        free(acc);
+    }
+
+    for (int band = 0; band < lsh->bands && !failed; band++) {
+        int first = band * lsh->band_bits;
+        int shift = 64 - lsh->band_bits;
+
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            order[i].key = band_key(sketches + (size_t)i * words, bits, first);
+            order[i].word = i;
+        }
+        qsort(order, n, sizeof(struct lsh_entry), compare_lsh_entries);
+
+        #pragma omp parallel for schedule(dynamic, 64)
+        for (int p = 0; p < n; p++) {
+            int i = order[p].word;
+            uint64_t bucket = order[p].key >> shift;
+            int lo = p - lsh->probe > 0 ? p - lsh->probe : 0;
+            int hi = p + lsh->probe < n - 1 ? p + lsh->probe : n - 1;
+
+            for (int q = lo; q <= hi; q++) {
+                if (q == p || order[q].key >> shift != bucket) {
+                    continue;
+                }
+                // Words met again in a later band are already held.
+                int j = order[q].word;
+                int *held = best_word + (size_t)i * k;
+                if (lsh_holds(held, kept[i], j)) {
+                    continue;
+                }
+                double d = pfnet_direct_distance(g, i, j);
+                if (d != _INFINITY) {
+                    lsh_offer(best + (size_t)i * k, held, &kept[i], k, d, j);
+                }
+            }
+        }
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        double *row = D + i * stride;
+        for (int j = 0; j < n; j++) {
+            row[j] = _INFINITY;
+        }
+        row[i] = 0;
+    }
+
+    // A pair kept by both of its words is written twice with the same
+    // distance, so this runs serially; it is O(n * top_k).
+    size_t pairs = 0;
+    for (int i = 0; i < n; i++) {
+        for (int s = 0; s < kept[i]; s++) {
+            int j = best_word[(size_t)i * k + s];
+            if (D[i * stride + j] == _INFINITY) {
+                if (found != NULL) {
+                    found[2 * pairs] = i;
+                    found[2 * pairs + 1] = j;
+                }
+                pairs++;
+            }
+            D[i * stride + j] = best[(size_t)i * k + s];
+            D[j * stride + i] = best[(size_t)i * k + s];
+        }
+    }
+    if (n_pairs != NULL) {
+        *n_pairs = pairs;
+    }
+
+    if (offsets != NULL && !failed) {
+        int *cols = (int *)malloc((pairs > 0 ? 2 * pairs : 1) * sizeof(int));
+        if (cols == NULL) {
+            failed = 1;
+        } else {
+            for (int i = 0; i <= n; i++) {
+                offsets[i] = 0;
+            }
+            for (size_t p = 0; p < 2 * pairs; p++) {
+                offsets[found[p] + 1]++;
+            }
+            for (int i = 0; i < n; i++) {
+                offsets[i + 1] += offsets[i];
+            }
+            // kept[i] now is the next free place of row i.
+            for (int i = 0; i < n; i++) {
+                kept[i] = offsets[i];
+            }
+            for (size_t p = 0; p < pairs; p++) {
+                int i = found[2 * p];
+                int j = found[2 * p + 1];
+                cols[kept[i]++] = j;
+                cols[kept[j]++] = i;
+            }
+
+            #pragma omp parallel for schedule(dynamic, 64)
+            for (int i = 0; i < n; i++) {
+                qsort(cols + offsets[i], offsets[i + 1] - offsets[i], sizeof(int),
+                      compare_ints);
+            }
+            *kept_pairs = cols;
+        }
+    }
+
+    leave_threads(saved);
+    free(sketches);
+    free(order);
+    free(best);
+    free(best_word);
+    free(kept);
+    free(found);
+
+    return failed ? PFNET_ENOMEM : PFNET_OK;
+}
+
+int pfnet_similarity_lsh(const struct pfnet_graph *g, double *D, size_t stride,
+                         const struct pfnet_lsh *lsh,
+                         const struct pfnet_options *opts, size_t *n_pairs)
+{
+    return similarity_lsh(g, D, stride, lsh, opts, n_pairs, NULL, NULL);
+}
+
+int pfnet_similarity_lsh_kept(const struct pfnet_graph *g, double *D, size_t stride,
+                              const struct pfnet_lsh *lsh,
+                              const struct pfnet_options *opts, int *offsets,
+                              int **kept)
+{
+    if (offsets == NULL || kept == NULL) {
+        return PFNET_EINVAL;
+    }
+    *kept = NULL;
+    return similarity_lsh(g, D, stride, lsh, opts, NULL, offsets, kept);
+}
+
+static void blocked_floyd_warshall(double **D, int n, size_t stride,
+                                   int block_size, int start_k_block,
+                                   const struct pfnet_options *opts)
+{
+    int n_blocks = n / block_size;
+    long long tile_updates = (long long)block_size * block_size * block_size;
+    double r = opts->r;
+
+    // D is one contiguous buffer, so every tile is updated in place through
+    // its top-left pointer and the row stride; no tile copies.
+    for (int k_block = start_k_block; k_block < n_blocks; k_block++) {
+        double *A = &D[k_block * block_size][k_block * block_size];
+
+        // Phase 1: Dependent phase
+        report_phase(opts, PFNET_PHASE_PIVOT);
+        long long started = telemetry_clock(opts);
+        for (int k = 0; k < block_size; k++) {
+            for (int i = 0; i < block_size; i++) {
+                for (int j = 0; j < block_size; j++) {
+                    double a = A[i * stride + k];
+                    double b = A[k * stride + j];
+                    double t = path_length(a, b, r);
+
+                    if (t < A[i * stride + j]) {
+                        A[i * stride + j] = t;
+                    }
+                }
+            }
+        }
+        telemetry_work(opts, started, tile_updates);
+        
+        // Phase 2: Partially dependent phase
+        report_phase(opts, PFNET_PHASE_ROW_COLUMN);
+        #pragma omp parallel
+        {
+            #pragma omp for schedule(dynamic)
+            for (int j_block = 0; j_block < n_blocks; j_block++) {
+                if (j_block == k_block) continue;
+
+                double *B = &D[k_block * block_size][j_block * block_size];
+                
+                long long started = telemetry_clock(opts);
+                for (int k = 0; k < block_size; k++) {
+                    for (int i = 0; i < block_size; i++) {
+                        for (int j = 0; j < block_size; j++) {
+                            double a = A[i * stride + k];
+                            double b = B[k * stride + j];
+                            double t = path_length(a, b, r);
+
+                            if (t < B[i * stride + j]) {
+                                B[i * stride + j] = t;
+                            }
+                        }
+                    }
+                }
+                telemetry_work(opts, started, tile_updates);
+            }
+            
+            #pragma omp for schedule(dynamic)
+            for (int i_block = 0; i_block < n_blocks; i_block++) {
+                if (i_block == k_block) continue;
+
+                double *C = &D[i_block * block_size][k_block * block_size];
+                
+                long long started = telemetry_clock(opts);
+                for (int k = 0; k < block_size; k++) {
+                    for (int i = 0; i < block_size; i++) {
+                        for (int j = 0; j < block_size; j++) {
+                            double a = C[i * stride + k];
+                            double b = A[k * stride + j];
+                            double t = path_length(a, b, r);
+
+                            if (t < C[i * stride + j]) {
+                                C[i * stride + j] = t;
+                            }
+                        }
+                    }
+                }
+                telemetry_work(opts, started, tile_updates);
+            }
+        }
+
+        // Phase 3: Independent phase. The end of the phase 2 region is the
+        // barrier between the phases; a barrier out here would bind to the
+        // caller's team when the closure is called from a parallel region.
+        // The pivot row and column tiles are only read here, so updating the
+        // remaining tiles in place is race-free.
+        report_phase(opts, PFNET_PHASE_REMAINDER);
+        #pragma omp parallel
+        {
+            #pragma omp for collapse(2) schedule(dynamic)
+            for (int i_block = 0; i_block < n_blocks; i_block++) {
+                for (int j_block = 0; j_block < n_blocks; j_block++) {
+                    if (i_block == k_block || j_block == k_block) continue;
+
+                    double *C = &D[i_block * block_size][j_block * block_size];
+                    const double *A_col = &D[i_block * block_size][k_block * block_size];
+                    const double *B_row = &D[k_block * block_size][j_block * block_size];
+                    
+                    long long started = telemetry_clock(opts);
+                    for (int k = 0; k < block_size; k++) {
+                        for (int i = 0; i < block_size; i++) {
+                            for (int j = 0; j < block_size; j++) {
+                                double a = A_col[i * stride + k];
+                                double b = B_row[k * stride + j];
+                                double t = path_length(a, b, r);
+
+                                if (t < C[i * stride + j]) {
+                                    C[i * stride + j] = t;
+                                }
+                            }
+                        }
+                    }
+                    telemetry_work(opts, started, tile_updates);
+                }
+            }
+        }
+
+        telemetry_round(opts, k_block + 1);
+        report_progress(opts, D, stride, n, (k_block + 1) * block_size);
+    }
+}
+
+static void floyd_warshall(double **D, int n, size_t stride, int start_k,
+                           const struct pfnet_options *opts)
+{
+    double r = opts->r;
+
+    report_phase(opts, PFNET_PHASE_REMAINDER);
+    for (int k = start_k; k < n; k++) {
+        // Elements are too small to time one by one, so each thread's busy
+        // time is its share of the loop, up to the barrier it then waits at.
+        #pragma omp parallel
+        {
+            long long started = telemetry_clock(opts);
+            #pragma omp for collapse(2) schedule(dynamic, 32) nowait
+            for (int i = 0; i < n; i++) {
+                for (int j = 0; j < n; j++) {
+                    double a = D[i][k];
+                    double b = D[k][j];
+                    double t = path_length(a, b, r);
+                    
+                    if (t < D[i][j]) {
+                        D[i][j] = t;
+                    }
+                }
+            }
+            telemetry_work(opts, started, 0);
+        }
+
+        if (opts->telemetry != NULL) {
+            atomic_fetch_add_explicit(&opts->telemetry->updates, (long long)n * n,
+                                      memory_order_relaxed);
+        }
+        telemetry_round(opts, k + 1);
+        report_progress(opts, D, stride, n, k + 1);
+    }
+}
+
+// The closure starts from the direct distances and only ever shortens them,
+// so the result already keeps every direct link that is a shortest path and
+// no copy of the input is needed. A numa run expects D from
+// pfnet_matrix_alloc() with the same options, so strips are where their
+// owners are.
+int pfnet_closure(double *D, int n, size_t stride, int first_k,
+                  const struct pfnet_options *opts)
+{
+    if ((D == NULL && n > 0) || n < 0 || stride < (size_t)n || first_k < 0) {
+        return PFNET_EINVAL;
+    }
+    if (n == 0 || first_k >= n) {
+        return PFNET_OK;
+    }
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    double **rows = matrix_rows(D, n, stride);
+    if (rows == NULL) {
+        return PFNET_ENOMEM;
+    }
+
+    int saved = enter_threads(opts);
+    int block_size = closure_block_size(n, opts);
+    int status = PFNET_OK;
+
+    // Progress is counted in rounds of the engine that runs: tile rows for
+    // the blocked closures, single k for the unblocked one.
+    int tiled = n % block_size == 0;
+    telemetry_begin(opts, tiled ? first_k / block_size : first_k, tiled ? n / block_size : n,
+                    (long long)(n - (tiled ? first_k / block_size * block_size : first_k)) * n * n);
+
+    if (n % block_size == 0 && opts->numa) {
+        status = numa_floyd_warshall(rows, n, stride, block_size, first_k / block_size, opts);
+    } else if (n % block_size == 0) {
+        blocked_floyd_warshall(rows, n, stride, block_size, first_k / block_size, opts);
+    } else {
+        floyd_warshall(rows, n, stride, first_k, opts);
+    }
+    report_phase(opts, PFNET_PHASE_DONE);
+    telemetry_end(opts);
+
+    leave_threads(saved);
+    free(rows);
+
+    return status;
+}
+
+struct pfnet_telemetry *pfnet_telemetry_alloc(int threads)
+{
+    if (threads < 1) {
+        return NULL;
+    }
+
+    struct pfnet_telemetry *t = (struct pfnet_telemetry *)calloc(1, sizeof(*t));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->busy_ns = (atomic_llong *)calloc(threads, sizeof(atomic_llong));
+    if (t->busy_ns == NULL) {
+        free(t);
+        return NULL;
+    }
+    t->threads = threads;
+    return t;
+}
+
+void pfnet_telemetry_free(struct pfnet_telemetry *telemetry)
+{
+    if (telemetry != NULL) {
+        free(telemetry->busy_ns);
+        free(telemetry);
+    }
+}
+
+void pfnet_telemetry_read(const struct pfnet_telemetry *telemetry,
+                          struct pfnet_progress *progress, double *busy,
+                          int n_busy)
+{
+    // The atomics are only read, but C11 loads take a non-const pointer.
+    struct pfnet_telemetry *t = (struct pfnet_telemetry *)telemetry;
+
+    progress->running = atomic_load_explicit(&t->running, memory_order_relaxed);
+    progress->round = atomic_load_explicit(&t->round, memory_order_relaxed);
+    progress->rounds = atomic_load_explicit(&t->rounds, memory_order_relaxed);
+    progress->updates = atomic_load_explicit(&t->updates, memory_order_relaxed);
+    progress->total_updates = atomic_load_explicit(&t->total_updates, memory_order_relaxed);
+    long long started = atomic_load_explicit(&t->started_ns, memory_order_relaxed);
+    progress->elapsed = started > 0 ? (monotonic_ns() - started) / 1e9 : 0;
+
+    for (int i = 0; busy != NULL && i < n_busy; i++) {
+        busy[i] = i < t->threads
+                      ? atomic_load_explicit(&t->busy_ns[i], memory_order_relaxed) / 1e9
+                      : 0;
+    }
+}
+
+// Closes a copy of the sample over its last `rounds` intermediates, which is
+// enough rounds for the tile size to show while keeping a trial short.
+static double time_closure(const double *sample, int n, size_t stride, int rounds,
+                           const struct pfnet_options *opts, int *status)
+{
+    double *M = pfnet_matrix_alloc(n, opts);
+    if (M == NULL) {
+        *status = PFNET_ENOMEM;
+        return 0;
+    }
+
+    double best = 0;
+    for (int rep = 0; rep < 2 && *status == PFNET_OK; rep++) {
+        memcpy(M, sample, (size_t)n * stride * sizeof(double));
+
+        double start = omp_get_wtime();
+        *status = pfnet_closure(M, n, stride, n - rounds, opts);
+        double seconds = omp_get_wtime() - start;
+
+        if (rep == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+
+    pfnet_matrix_free(M);
+    return best;
+}
+
+int pfnet_tune(int n, const struct pfnet_options *opts,
+               struct pfnet_tuning_trial *trials, int capacity, int *n_trials,
+               int *best)
+{
+    if (n < 8 || capacity < 0 || (capacity > 0 && trials == NULL) || n_trials == NULL
+        || best == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    struct pfnet_caches caches;
+    pfnet_read_caches(&caches);
+    size_t l2 = caches.l2 > 0 ? caches.l2 : DEFAULT_L2_SIZE;
+
+    int count = 0;
+    for (int b = 8; b <= n; b += 4) {
+        if (n % b == 0 && 3 * (size_t)b * b * sizeof(double) <= l2) {
+            if (count < capacity) {
+                trials[count].block_size = b;
+                trials[count].seconds = 0;
+            }
+            count++;
+        }
+    }
+    *n_trials = count;
+    if (count == 0) {
+        return PFNET_EINVAL;
+    }
+    if (count > capacity) {
+        return PFNET_ERANGE;
+    }
+
+    // Random direct distances in [0.05, 1.05), the same for every trial.
+    size_t stride = pfnet_matrix_stride(n);
+    double *sample = pfnet_matrix_alloc(n, NULL);
+    if (sample == NULL) {
+        return PFNET_ENOMEM;
+    }
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < n; i++) {
+        sample[i * stride + i] = 0;
+        for (int j = i + 1; j < n; j++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            double distance = 0.05 + (double)(state >> 11) / (double)(1ULL << 53);
+            sample[i * stride + j] = distance;
+            sample[j * stride + i] = distance;
+        }
+    }
+
+    int status = PFNET_OK;
+    *best = 0;
+    for (int t = 0; t < count && status == PFNET_OK; t++) {
+        struct pfnet_options trial = *opts;
+        trial.block_size = trials[t].block_size;
+        trial.progress = NULL;
+
+        int b = trials[t].block_size;
+        int rounds = (n / 8 + b / 2) / b * b;
+        if (rounds < b) {
+            rounds = b;
+        }
+
+        double seconds = time_closure(sample, n, stride, rounds, &trial, &status);
+        trials[t].seconds = seconds * n / rounds;
+        if (trials[t].seconds < trials[*best].seconds) {
+            *best = t;
+        }
+    }
+    *best = trials[*best].block_size;
+
+    pfnet_matrix_free(sample);
+    return status;
+}
+
+// The machine part of a tuning line: the CPU model with blanks replaced, so
+// the line splits on whitespace, and the L1 data and L2 sizes.
+static void machine_key(char *model, size_t size, struct pfnet_caches *caches)
+{
+    snprintf(model, size, "unknown");
+
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (file != NULL) {
+        char line[512];
+        while (fgets(line, sizeof(line), file) != NULL) {
+            char *colon = strchr(line, ':');
+            if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+                char *value = colon + 1;
+                while (*value == ' ' || *value == '\t') {
+                    value++;
+                }
+                value[strcspn(value, "\n")] = '\0';
+                if (*value != '\0') {
+                    snprintf(model, size, "%s", value);
+                }
+                break;
+            }
+        }
+        fclose(file);
+    }
+
+    for (char *c = model; *c; c++) {
+        if (isspace((unsigned char)*c)) {
+            *c = '_';
+        }
+    }
+
+    pfnet_read_caches(caches);
+}
+
+// Lines are "backend model l1d l2 block_size"; # starts a comment.
+static int parse_tuning_line(const char *line, char *backend, char *model,
+                             unsigned long long *l1d, unsigned long long *l2,
+                             int *block_size)
+{
+    return sscanf(line, "%31s %255s %llu %llu %d", backend, model, l1d, l2, block_size) == 5
+           && backend[0] != '#';
+}
+
+int pfnet_tuning_load(const char *path, struct pfnet_options *opts)
+{
+    if (path == NULL || opts == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return PFNET_OK;
+    }
+
+    char model[256];
+    struct pfnet_caches caches;
+    machine_key(model, sizeof(model), &caches);
+
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char backend[32], line_model[256];
+        unsigned long long l1d, l2;
+        int block_size;
+        if (parse_tuning_line(line, backend, line_model, &l1d, &l2, &block_size)
+            && strcmp(backend, TUNING_BACKEND) == 0 && strcmp(line_model, model) == 0
+            && l1d == caches.l1d && l2 == caches.l2 && block_size > 0) {
+            opts->block_size = block_size;
+        }
+    }
+
+    int failed = ferror(file);
+    fclose(file);
+    return failed ? PFNET_EIO : PFNET_OK;
+}
+
+// Written to path.tmp and renamed over path, so a reader never sees half a
+// file.
+int pfnet_tuning_save(const char *path, int block_size)
+{
+    if (path == NULL || block_size <= 0) {
+        return PFNET_EINVAL;
+    }
+
+    char model[256];
+    struct pfnet_caches caches;
+    machine_key(model, sizeof(model), &caches);
+
+    size_t tmp_size = strlen(path) + 5;
+    char *tmp_path = (char *)malloc(tmp_size);
+    if (tmp_path == NULL) {
+        return PFNET_ENOMEM;
+    }
+    snprintf(tmp_path, tmp_size, "%s.tmp", path);
+
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        free(tmp_path);
+        return PFNET_EIO;
+    }
+
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(out, "# backend cpu_model l1d_bytes l2_bytes block_size\n");
+    } else {
+        char line[512];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            char backend[32], line_model[256];
+            unsigned long long l1d, l2;
+            int old_size;
+            if (parse_tuning_line(line, backend, line_model, &l1d, &l2, &old_size)
+                && strcmp(backend, TUNING_BACKEND) == 0 && strcmp(line_model, model) == 0
+                && l1d == caches.l1d && l2 == caches.l2) {
+                continue;
+            }
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+
+    fprintf(out, "%s %s %llu %llu %d\n", TUNING_BACKEND, model,
+            (unsigned long long)caches.l1d, (unsigned long long)caches.l2, block_size);
+
+    int failed = ferror(out);
+    if (fclose(out) != 0) {
+        failed = 1;
+    }
+    if (!failed && rename(tmp_path, path) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        remove(tmp_path);
+    }
+    free(tmp_path);
+
+    return failed ? PFNET_EIO : PFNET_OK;
+}
+
+// The pairs are taken in runs sharing u[e]. A shortest path passes such a
+// vertex a at most once, so with the new distances from and to a, computed
+// from its lowered pairs, one relaxation of every i, j through a closes D
+// again: O(n^2) per run plus O(n) per pair.
+int pfnet_closure_update(double *D, int n, size_t stride, const int *u,
+                         const int *v, const double *w, int n_pairs,
+                         const struct pfnet_options *opts)
+{
+    if ((D == NULL && n > 0) || n < 0 || stride < (size_t)n || n_pairs < 0
+        || (n_pairs > 0 && (u == NULL || v == NULL || w == NULL))) {
+        return PFNET_EINVAL;
+    }
+    for (int e = 0; e < n_pairs; e++) {
+        if (u[e] < 0 || u[e] >= n || v[e] < 0 || v[e] >= n || u[e] == v[e] || w[e] < 0) {
+            return PFNET_EINVAL;
+        }
+    }
+    if (n_pairs == 0) {
+        return PFNET_OK;
+    }
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    double *from_a = (double *)malloc(n * sizeof(double));
+    double *to_a = (double *)malloc(n * sizeof(double));
+    if (from_a == NULL || to_a == NULL) {
+        free(from_a);
+        free(to_a);
+        return PFNET_ENOMEM;
+    }
+    int saved = enter_threads(opts);
+    double r = opts->r;
+
+    #pragma omp parallel
+    for (int first = 0; first < n_pairs;) {
+        int a = u[first];
+        int last = first + 1;
+        while (last < n_pairs && u[last] == a) {
+            last++;
+        }
+
+        // A path that gains from the run leaves or enters a through one of
+        // its pairs, and its other part never comes back to a.
+        #pragma omp for
+        for (int j = 0; j < n; j++) {
+            double out = D[a * stride + j];
+            double in = D[j * stride + a];
+            for (int e = first; e < last; e++) {
+                double t = path_length(w[e], D[v[e] * stride + j], r);
+                if (t < out) {
+                    out = t;
+                }
+                t = path_length(D[j * stride + v[e]], w[e], r);
+                if (t < in) {
+                    in = t;
+                }
+            }
+            from_a[j] = out;
+            to_a[j] = in;
+        }
+
+        #pragma omp for schedule(static)
+        for (int i = 0; i < n; i++) {
+            double *row = D + i * stride;
+            double to = i == a ? 0 : to_a[i];
+            row[a] = to;
+
+            for (int j = 0; j < n; j++) {
+                double t = i == a ? from_a[j] : path_length(to, from_a[j], r);
+                if (t < row[j]) {
+                    row[j] = t;
+                }
+            }
+        }
+
+        first = last;
+    }
+
+    leave_threads(saved);
+    free(from_a);
+    free(to_a);
+
+    return PFNET_OK;
+}
+
+// Pairs are suspect when a shortest path may pass one of the vertices: the
+// two halves through it add up to D[i][j] within rounding, since the closure
+// summed the same path in another order. Row i is then recomputed from its
+// settled entries, as a Dijkstra run over its suspect entries only.
+int pfnet_closure_raise(double *D, int n, size_t stride, const int *vertices,
+                        int n_vertices, double (*weight)(void *user, int i, int j),
+                        void *user, size_t max_pairs, const struct pfnet_options *opts)
+{
+    if ((D == NULL && n > 0) || n < 0 || stride < (size_t)n || n_vertices < 0
+        || (n_vertices > 0 && vertices == NULL) || weight == NULL) {
+        return PFNET_EINVAL;
+    }
+    for (int x = 0; x < n_vertices; x++) {
+        if (vertices[x] < 0 || vertices[x] >= n) {
+            return PFNET_EINVAL;
+        }
+    }
+    if (n_vertices == 0 || n == 0) {
+        return PFNET_OK;
+    }
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    size_t row_words = ((size_t)n + 63) / 64;
+    uint64_t *suspect = (uint64_t *)calloc(n * row_words, sizeof(uint64_t));
+    if (suspect == NULL) {
+        return PFNET_ENOMEM;
+    }
+
+    int saved = enter_threads(opts);
+    double r = opts->r;
+    size_t total = 0;
+
+    #pragma omp parallel for schedule(dynamic, 16) reduction(+:total)
+    for (int i = 0; i < n; i++) {
+        const double *row = D + i * stride;
+        uint64_t *bits = suspect + i * row_words;
+
+        for (int x = 0; x < n_vertices; x++) {
+            int a = vertices[x];
+            const double *row_a = D + a * stride;
+            if (row[a] == _INFINITY) {
+                continue;
+            }
+
+            for (int j = 0; j < n; j++) {
+                if (j != i && row[j] != _INFINITY
+                    && path_length(row[a], row_a[j], r) <= row[j] * (1 + 1e-9)) {
+                    bits[j / 64] |= (uint64_t)1 << (j % 64);
+                }
+            }
+        }
+
+        for (size_t b = 0; b < row_words; b++) {
+            total += __builtin_popcountll(bits[b]);
+        }
+    }
+
+    if (total == 0 || total > max_pairs) {
+        free(suspect);
+        leave_threads(saved);
+        return total == 0 ? PFNET_OK : PFNET_ERANGE;
+    }
+
+    // Every suspect entry (i, j) is rebuilt from the weights into j, so they
+    // are computed once per suspect column for all rows: into[slot[j] * n + k]
+    // is weight(k, j). That is n calls per column instead of n per entry.
+    int *slot = (int *)malloc(n * sizeof(int));
+    int *column = (int *)malloc(n * sizeof(int));
+    int n_columns = 0;
+    if (slot == NULL || column == NULL) {
+        free(slot);
+        free(column);
+        free(suspect);
+        leave_threads(saved);
+        return PFNET_ENOMEM;
+    }
+    for (size_t b = 0; b < row_words; b++) {
+        uint64_t any = 0;
+        for (int i = 0; i < n; i++) {
+            any |= suspect[i * row_words + b];
+        }
+        for (int j = (int)b * 64; j < n && j < (int)b * 64 + 64; j++) {
+            slot[j] = any >> (j % 64) & 1 ? n_columns : -1;
+            if (slot[j] >= 0) {
+                column[n_columns++] = j;
+            }
+        }
+    }
+
+    // All scratch, including each thread's pending entries and labels, is
+    // taken before the first write to D, so PFNET_ENOMEM leaves D alone.
+    int threads = omp_get_max_threads();
+    double *into = (double *)malloc((size_t)n_columns * n * sizeof(double));
+    int *pending_all = (int *)malloc((size_t)threads * n * sizeof(int));
+    double *label_all = (double *)malloc((size_t)threads * n * sizeof(double));
+    if (into == NULL || pending_all == NULL || label_all == NULL) {
+        free(into);
+        free(pending_all);
+        free(label_all);
+        free(slot);
+        free(column);
+        free(suspect);
+        leave_threads(saved);
+        return PFNET_ENOMEM;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < n_columns; c++) {
+        int j = column[c];
+        double *weights = into + (size_t)c * n;
+        for (int k = 0; k < n; k++) {
+            weights[k] = k == j ? 0 : weight(user, k, j);
+        }
+    }
+
+    #pragma omp parallel
+    {
+        int *pending = pending_all + (size_t)omp_get_thread_num() * n;
+        double *label = label_all + (size_t)omp_get_thread_num() * n;
+
+        #pragma omp for schedule(dynamic, 1)
+        for (int i = 0; i < n; i++) {
+            double *row = D + i * stride;
+            const uint64_t *bits = suspect + i * row_words;
+            int count = 0;
+            for (int j = 0; j < n; j++) {
+                if (bits[j / 64] >> (j % 64) & 1) {
+                    pending[count++] = j;
+                }
+            }
+            if (count == 0) {
+                continue;
+            }
+
+            // The settled entries are still exact: none of their shortest
+            // paths passes a raised pair. Each suspect entry starts from its
+            // best last step out of them.
+            for (int s = 0; s < count; s++) {
+                int j = pending[s];
+                double best = _INFINITY;
+                for (int k = 0; k < n; k++) {
+                    if (k == j || (bits[k / 64] >> (k % 64) & 1)) {
+                        continue;
+                    }
+                    double t = path_length(row[k], into[(size_t)slot[j] * n + k], r);
+                    if (t < best) {
+                        best = t;
+                    }
+                }
+                label[s] = best;
+            }
+
+            while (count > 0) {
+                int next = 0;
+                for (int s = 1; s < count; s++) {
+                    if (label[s] < label[next]) {
+                        next = s;
+                    }
+                }
+
+                int j = pending[next];
+                double d = label[next];
+                row[j] = d;
+                pending[next] = pending[--count];
+                label[next] = label[count];
+
+                for (int s = 0; s < count; s++) {
+                    double t = path_length(d, into[(size_t)slot[pending[s]] * n + j], r);
+                    if (t < label[s]) {
+                        label[s] = t;
+                    }
+                }
+            }
+        }
+
+    }
+
+    free(into);
+    free(pending_all);
+    free(label_all);
+    free(column);
+    free(slot);
+    free(suspect);
+    leave_threads(saved);
+
+    return PFNET_OK;
+}
+
+// Entry of the Dijkstra frontier; stale entries, whose vertex has been
+// settled with a shorter distance since, are skipped when popped.
+struct frontier_entry {
+    double distance;
+    int vertex;
+};
+
+static void frontier_push(struct frontier_entry *heap, int *size, double d, int v)
+{
+    int s = (*size)++;
+    while (s > 0 && heap[(s - 1) / 2].distance > d) {
+        heap[s] = heap[(s - 1) / 2];
+        s = (s - 1) / 2;
+    }
+    heap[s].distance = d;
+    heap[s].vertex = v;
+}
+
+static struct frontier_entry frontier_pop(struct frontier_entry *heap, int *size)
+{
+    struct frontier_entry top = heap[0];
+    struct frontier_entry last = heap[--(*size)];
+    int s = 0;
+    for (;;) {
+        int c = 2 * s + 1;
+        if (c >= *size) {
+            break;
+        }
+        if (c + 1 < *size && heap[c + 1].distance < heap[c].distance) {
+            c++;
+        }
+        if (heap[c].distance >= last.distance) {
+            break;
+        }
+        heap[s] = heap[c];
+        s = c;
+    }
+    heap[s] = last;
+    return top;
+}
+
+// The finite pairs are copied to compressed rows first, so every run only
+// touches the links of the vertices it settles. Path lengths under r only
+// grow along a path, which is all Dijkstra needs.
+int pfnet_closure_sparse(double *D, int n, size_t stride,
+                         const struct pfnet_options *opts)
+{
+    if ((D == NULL && n > 0) || n < 0 || stride < (size_t)n) {
+        return PFNET_EINVAL;
+    }
+    if (n == 0) {
+        return PFNET_OK;
+    }
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    int *row_start = (int *)malloc((n + 1) * sizeof(int));
+    if (row_start == NULL) {
+        return PFNET_ENOMEM;
+    }
+    int saved = enter_threads(opts);
+    double r = opts->r;
+
+    row_start[0] = 0;
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < n; i++) {
+        const double *row = D + i * stride;
+        int count = 0;
+        for (int j = 0; j < n; j++) {
+            count += j != i && row[j] != _INFINITY;
+        }
+        row_start[i + 1] = count;
+    }
+    for (int i = 0; i < n; i++) {
+        row_start[i + 1] += row_start[i];
+    }
+
+    int m = row_start[n];
+    int *col = (int *)malloc((m > 0 ? m : 1) * sizeof(int));
+    double *weight = (double *)malloc((m > 0 ? m : 1) * sizeof(double));
+    if (col == NULL || weight == NULL) {
+        free(row_start);
+        free(col);
+        free(weight);
+        leave_threads(saved);
+        return PFNET_ENOMEM;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < n; i++) {
+        const double *row = D + i * stride;
+        int e = row_start[i];
+        for (int j = 0; j < n; j++) {
+            if (j != i && row[j] != _INFINITY) {
+                col[e] = j;
+                weight[e++] = row[j];
+            }
+        }
+    }
+
+    int failed = 0;
+    #pragma omp parallel reduction(||:failed)
+    {
+        // Every link is pushed at most once per run, plus the source.
+        struct frontier_entry *heap =
+            (struct frontier_entry *)malloc((m + 1) * sizeof(struct frontier_entry));
+        double *distance = (double *)malloc(n * sizeof(double));
+        failed = heap == NULL || distance == NULL;
+
+        #pragma omp for schedule(dynamic, 1)
+        for (int s = 0; s < n; s++) {
+            if (failed) {
+                continue;
+            }
+
+            for (int j = 0; j < n; j++) {
+                distance[j] = _INFINITY;
+            }
+            distance[s] = 0;
+            int size = 0;
+            frontier_push(heap, &size, 0, s);
+
+            while (size > 0) {
+                struct frontier_entry top = frontier_pop(heap, &size);
+                int v = top.vertex;
+                if (top.distance > distance[v]) {
+                    continue;
+                }
+                for (int e = row_start[v]; e < row_start[v + 1]; e++) {
+                    // The source is 0 away; the first step is the link itself.
+                    double t = v == s ? weight[e] : path_length(top.distance, weight[e], r);
+                    if (t < distance[col[e]]) {
+                        distance[col[e]] = t;
+                        frontier_push(heap, &size, t, col[e]);
+                    }
+                }
+            }
+
+            memcpy(D + s * stride, distance, n * sizeof(double));
+        }
+
+        free(heap);
+        free(distance);
+    }
+
+    free(row_start);
+    free(col);
+    free(weight);
+    leave_threads(saved);
+
+    return failed ? PFNET_ENOMEM : PFNET_OK;
+}
+
+// Out-of-core closure. D lives in a scratch file as an n_pad x n_pad
+// row-major matrix, n_pad being n rounded up to block_size, so each strip of
+// block_size rows (one row of tiles) is one contiguous range of the file.
+// Padding cells hold _INFINITY and never shorten a path.
+struct pfnet_ooc {
+    char *path;
+    int fd;
+    int n;
+    int n_pad;
+    int block_size;
+    int n_blocks;
+    size_t strip_bytes;
+};
+
+// One asynchronous I/O step: write one strip back, then read another. Either
+// half is skipped when its buffer is NULL.
+struct ooc_job {
+    struct pfnet_ooc *m;
+    double *write_buffer;
+    int write_block;
+    double *read_buffer;
+    int read_block;
+    pthread_t thread;
+    int active;
+    int status;
+};
+
+static int ooc_transfer(struct pfnet_ooc *m, double *buffer, int block, int write)
+{
+    char *p = (char *)buffer;
+    size_t left = m->strip_bytes;
+    off_t offset = (off_t)block * m->strip_bytes;
+
+    while (left > 0) {
+        ssize_t done = write ? pwrite(m->fd, p, left, offset)
+                             : pread(m->fd, p, left, offset);
+        if (done <= 0) {
+            return PFNET_EIO;
+        }
+        p += done;
+        offset += done;
+        left -= done;
+    }
+    return PFNET_OK;
+}
+
+static void *ooc_worker(void *arg)
+{
+    struct ooc_job *job = (struct ooc_job *)arg;
+    job->status = PFNET_OK;
+    if (job->write_buffer != NULL) {
+        job->status = ooc_transfer(job->m, job->write_buffer, job->write_block, 1);
+    }
+    if (job->status == PFNET_OK && job->read_buffer != NULL) {
+        job->status = ooc_transfer(job->m, job->read_buffer, job->read_block, 0);
+    }
+    return NULL;
+}
+
+static void ooc_start(struct ooc_job *job, struct pfnet_ooc *m, double *write_buffer,
+                      int write_block, double *read_buffer, int read_block)
+{
+    job->m = m;
+    job->write_buffer = write_buffer;
+    job->write_block = write_block;
+    job->read_buffer = read_buffer;
+    job->read_block = read_block;
+    job->active = pthread_create(&job->thread, NULL, ooc_worker, job) == 0;
+    if (!job->active) {
+        ooc_worker(job);
+    }
+}
+
+// The status of the last job, which is then cleared; PFNET_OK if there was
+// none.
+static int ooc_wait(struct ooc_job *job)
+{
+    if (job->active) {
+        pthread_join(job->thread, NULL);
+        job->active = 0;
+    }
+    int status = job->status;
+    job->status = PFNET_OK;
+    return status;
+}
+
+static double *ooc_alloc_strip(const struct pfnet_ooc *m)
+{
+    return (double *)aligned_alloc(MATRIX_ALIGNMENT, m->strip_bytes);
+}
+
+// The closure keeps four strips resident (the pivot strip plus the strips
+// being read, updated and written back), so block_size is the largest
+// multiple of 8 for which they fit the budget. Larger strips mean fewer
+// passes over the file: the closure reads and writes it n_blocks times.
+int pfnet_ooc_open(const char *path, int n, size_t budget, struct pfnet_ooc **ooc)
+{
+    if (path == NULL || n < 0 || ooc == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    int block_size = n > 8 ? (n + 7) / 8 * 8 : 8;
+    for (;;) {
+        size_t n_pad = (size_t)(n + block_size - 1) / block_size * block_size;
+        if (block_size == 8 || 4 * block_size * n_pad * sizeof(double) <= budget) {
+            break;
+        }
+        block_size -= 8;
+    }
+
+    struct pfnet_ooc *m = (struct pfnet_ooc *)calloc(1, sizeof(*m));
+    if (m == NULL || (m->path = strdup(path)) == NULL) {
+        free(m);
+        return PFNET_ENOMEM;
+    }
+    m->n = n;
+    m->block_size = block_size;
+    m->n_blocks = (n + block_size - 1) / block_size;
+    m->n_pad = m->n_blocks * block_size;
+    m->strip_bytes = (size_t)block_size * m->n_pad * sizeof(double);
+
+    m->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (m->fd < 0) {
+        free(m->path);
+        free(m);
+        return PFNET_EIO;
+    }
+
+    *ooc = m;
+    return PFNET_OK;
+}
+
+void pfnet_ooc_close(struct pfnet_ooc *ooc)
+{
+    if (ooc == NULL) {
+        return;
+    }
+    close(ooc->fd);
+    remove(ooc->path);
+    free(ooc->path);
+    free(ooc);
+}
+
+int pfnet_ooc_block_size(const struct pfnet_ooc *ooc)
+{
+    return ooc != NULL ? ooc->block_size : 0;
+}
+
+int pfnet_ooc_strips(const struct pfnet_ooc *ooc)
+{
+    return ooc != NULL ? ooc->n_blocks : 0;
+}
+
+// Writes the similarity matrix strip by strip without ever holding it whole.
+int pfnet_ooc_similarity(struct pfnet_ooc *m, const struct pfnet_graph *g,
+                         const struct pfnet_options *opts)
+{
+    if (m == NULL || g == NULL || g->n != m->n) {
+        return PFNET_EINVAL;
+    }
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    int n = m->n;
+    int n_pad = m->n_pad;
+    int block_size = m->block_size;
+
+    double *strip[2] = {ooc_alloc_strip(m), ooc_alloc_strip(m)};
+    if (strip[0] == NULL || strip[1] == NULL) {
+        free(strip[0]);
+        free(strip[1]);
+        return PFNET_ENOMEM;
+    }
+
+    int saved = enter_threads(opts);
+    struct ooc_job job = {0};
+    int status = PFNET_OK;
+
+    for (int b = 0; b < m->n_blocks && status == PFNET_OK; b++) {
+        double *S = strip[b % 2];
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int row = 0; row < block_size; row++) {
+            int i = b * block_size + row;
+            double *out = S + (size_t)row * n_pad;
+
+            for (int j = 0; j < n_pad; j++) {
+                if (i >= n || j >= n) {
+                    out[j] = _INFINITY;
+                    continue;
+                }
+
+                out[j] = i == j ? 0 : pfnet_direct_distance(g, i, j);
+            }
+        }
+
+        // One write is in flight at a time; its buffer is refilled only after
+        // the next strip has been computed into the other one.
+        status = ooc_wait(&job);
+        if (status == PFNET_OK) {
+            ooc_start(&job, m, S, b, NULL, 0);
+        }
+    }
+
+    int last = ooc_wait(&job);
+    leave_threads(saved);
+    free(strip[0]);
+    free(strip[1]);
+
+    return status != PFNET_OK ? status : last;
+}
+
+// Phases 1 and 2 on the pivot strip P (rows k0 .. k0 + block_size - 1): close
+// the diagonal tile, then relax the rest of the strip through it.
+static void ooc_update_pivot(double *P, int k0, int block_size, int n_pad, double r)
+{
+    double *A = P + k0;
+
+    for (int k = 0; k < block_size; k++) {
+        #pragma omp parallel for
+        for (int i = 0; i < block_size; i++) {
+            for (int j = 0; j < block_size; j++) {
+                double a = A[(size_t)i * n_pad + k];
+                double b = A[(size_t)k * n_pad + j];
+                double t = path_length(a, b, r);
+
+                if (t < A[(size_t)i * n_pad + j]) {
+                    A[(size_t)i * n_pad + j] = t;
+                }
+            }
+        }
+    }
+
+    // Columns are independent here, so each thread owns a range of them.
+    #pragma omp parallel for schedule(dynamic)
+    for (int j0 = 0; j0 < n_pad; j0 += block_size) {
+        if (j0 == k0) continue;
+
+        for (int k = 0; k < block_size; k++) {
+            for (int i = 0; i < block_size; i++) {
+                double a = A[(size_t)i * n_pad + k];
+                double *row = P + (size_t)i * n_pad;
+                const double *pivot = P + (size_t)k * n_pad;
+
+                for (int j = j0; j < j0 + block_size; j++) {
+                    double t = path_length(a, pivot[j], r);
+
+                    if (t < row[j]) {
+                        row[j] = t;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Phases 2 and 3 on a non-pivot strip S: relax its tile in the pivot columns
+// through the diagonal tile, then every other tile through that tile and the
+// pivot strip P. Rows are independent, so each thread owns whole rows.
+static void ooc_update_strip(double *S, const double *P, int k0, int block_size,
+                             int n_pad, double r)
+{
+    const double *A = P + k0;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < block_size; i++) {
+        double *row = S + (size_t)i * n_pad;
+        double *C = row + k0;
+
+        for (int k = 0; k < block_size; k++) {
+            for (int j = 0; j < block_size; j++) {
+                double t = path_length(C[k], A[(size_t)k * n_pad + j], r);
+
+                if (t < C[j]) {
+                    C[j] = t;
+                }
+            }
+        }
+
+        for (int k = 0; k < block_size; k++) {
+            double a = C[k];
+            const double *pivot = P + (size_t)k * n_pad;
+
+            for (int j0 = 0; j0 < n_pad; j0 += block_size) {
+                if (j0 == k0) continue;
+
+                for (int j = j0; j < j0 + block_size; j++) {
+                    double t = path_length(a, pivot[j], r);
+
+                    if (t < row[j]) {
+                        row[j] = t;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Blocked Floyd-Warshall over the strips of the file. Round k reads the pivot
+// strip, then streams every other strip through a three-buffer pipeline: a
+// helper thread writes strip s - 1 back and reads strip s + 1 while strip s
+// is being updated.
+int pfnet_ooc_closure(struct pfnet_ooc *m, const struct pfnet_options *opts)
+{
+    if (m == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    int n_blocks = m->n_blocks;
+    int block_size = m->block_size;
+    int n_pad = m->n_pad;
+    double r = opts->r;
+
+    double *pivot = ooc_alloc_strip(m);
+    double *work[3] = {ooc_alloc_strip(m), ooc_alloc_strip(m), ooc_alloc_strip(m)};
+    int *order = (int *)malloc((n_blocks > 0 ? n_blocks : 1) * sizeof(int));
+    int status = pivot != NULL && work[0] != NULL && work[1] != NULL && work[2] != NULL
+                         && order != NULL
+                     ? PFNET_OK
+                     : PFNET_ENOMEM;
+
+    int saved = enter_threads(opts);
+    struct ooc_job job = {0};
+
+    for (int k_block = 0; k_block < n_blocks && status == PFNET_OK; k_block++) {
+        int k0 = k_block * block_size;
+
+        int count = 0;
+        for (int b = 0; b < n_blocks; b++) {
+            if (b != k_block) {
+                order[count++] = b;
+            }
+        }
+
+        // The first working strip is read while the pivot strip is updated.
+        status = ooc_transfer(m, pivot, k_block, 0);
+        if (status != PFNET_OK) {
+            break;
+        }
+        if (count > 0) {
+            ooc_start(&job, m, NULL, 0, work[0], order[0]);
+        }
+        ooc_update_pivot(pivot, k0, block_size, n_pad, r);
+        status = ooc_wait(&job);
+
+        // The pivot strip is only read from here on, so the first step
+        // writes it back in place of a previous working strip.
+        for (int s = 0; s < count && status == PFNET_OK; s++) {
+            double *prev = s > 0 ? work[(s - 1) % 3] : pivot;
+            double *next = s + 1 < count ? work[(s + 1) % 3] : NULL;
+
+            ooc_start(&job, m, prev, s > 0 ? order[s - 1] : k_block,
+                      next, s + 1 < count ? order[s + 1] : 0);
+            ooc_update_strip(work[s % 3], pivot, k0, block_size, n_pad, r);
+            status = ooc_wait(&job);
+        }
+
+        if (status == PFNET_OK) {
+            status = ooc_transfer(m, count > 0 ? work[(count - 1) % 3] : pivot,
+                                  count > 0 ? order[count - 1] : k_block, 1);
+        }
+    }
+
+    leave_threads(saved);
+    free(order);
+    free(work[0]);
+    free(work[1]);
+    free(work[2]);
+    free(pivot);
+
+    return status;
+}
+
+// Reads the next strip while the caller works on the current one.
+int pfnet_ooc_rows(struct pfnet_ooc *m,
+                   void (*visit)(void *user, double **rows, int row_begin, int row_end),
+                   void *user)
+{
+    if (m == NULL || visit == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    int n = m->n;
+    int block_size = m->block_size;
+
+    double *strip[2] = {ooc_alloc_strip(m), ooc_alloc_strip(m)};
+    double **rows = (double **)malloc((n > 0 ? n : 1) * sizeof(double *));
+    int status = strip[0] != NULL && strip[1] != NULL && rows != NULL ? PFNET_OK
+                                                                      : PFNET_ENOMEM;
+    struct ooc_job job = {0};
+
+    if (status == PFNET_OK && m->n_blocks > 0) {
+        status = ooc_transfer(m, strip[0], 0, 0);
+    }
+
+    for (int b = 0; b < m->n_blocks && status == PFNET_OK; b++) {
+        double *S = strip[b % 2];
+        if (b + 1 < m->n_blocks) {
+            ooc_start(&job, m, NULL, 0, strip[(b + 1) % 2], b + 1);
+        }
+
+        int row_begin = b * block_size;
+        int row_end = row_begin + block_size < n ? row_begin + block_size : n;
+        for (int i = row_begin; i < row_end; i++) {
+            rows[i] = S + (size_t)(i - row_begin) * m->n_pad;
+        }
+        visit(user, rows, row_begin, row_end);
+
+        status = ooc_wait(&job);
+    }
+
+    free(rows);
+    free(strip[0]);
+    free(strip[1]);
+
+    return status;
+}
+
+// Finds the links with two parallel passes over the rows. With allocated
+// set, cols is ignored and the filling pass writes to a new array of the
+// size the counting pass found. With among set, only the pairs in its rows
+// are tested.
+static int find_links(const struct pfnet_graph *g, const double *D, size_t stride,
+                      int symmetric, const int *among_start, const int *among,
+                      int *row_start, int *cols, size_t capacity,
+                      int **allocated, const struct pfnet_options *opts)
+{
+    if (g == NULL || D == NULL || row_start == NULL || stride < (size_t)g->n
+        || (among != NULL && among_start == NULL)) {
+        return PFNET_EINVAL;
+    }
+
+    struct pfnet_options defaults;
+    opts = resolve_options(opts, &defaults);
+    if (opts == NULL) {
+        return PFNET_EINVAL;
+    }
+
+    int n = g->n;
+
+    // One bit per pair keeps the test from the counting pass for the filling
+    // pass. Every row starts on a fresh word, so threads never share one.
+    size_t row_words = ((size_t)n + 63) / 64;
+    uint64_t *linked = (uint64_t *)calloc(n > 0 ? n * row_words : 1, sizeof(uint64_t));
+    if (linked == NULL) {
+        return PFNET_ENOMEM;
+    }
+    row_start[0] = 0;
+
+    int saved = enter_threads(opts);
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < n; i++) {
+        uint64_t *bits = linked + i * row_words;
+        const double *row = D + i * stride;
+        int count = 0;
+        int first = symmetric ? 0 : i + 1;
+        int end = among != NULL ? among_start[i + 1] : n;
+        for (int e = among != NULL ? among_start[i] : first; e < end; e++) {
+            int j = among != NULL ? among[e] : e;
+            // The closure never exceeds the direct distance, so an unreachable
+            // pair has no direct link to test.
+            if (j >= first && j != i && row[j] != _INFINITY
+                && pfnet_direct_distance(g, i, j) <= row[j]) {
+                bits[j / 64] |= (uint64_t)1 << (j % 64);
+                count++;
+            }
+        }
+        row_start[i + 1] = count;
+    }
+
+    for (int i = 0; i < n; i++) {
+        row_start[i + 1] += row_start[i];
+    }
+
+    if (allocated != NULL) {
+        cols = (int *)malloc((row_start[n] > 0 ? row_start[n] : 1) * sizeof(int));
+        if (cols == NULL) {
+            free(linked);
+            leave_threads(saved);
+            return PFNET_ENOMEM;
+        }
+        *allocated = cols;
+    } else if ((size_t)row_start[n] > capacity || (row_start[n] > 0 && cols == NULL)) {
+        free(linked);
+        leave_threads(saved);
+        return PFNET_ERANGE;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < n; i++) {
+        const uint64_t *bits = linked + i * row_words;
+        int *out = cols + row_start[i];
+        for (int j = 0; j < n; j++) {
+            if (bits[j / 64] >> (j % 64) & 1) {
+                *out++ = j;
+            }
+        }
+    }
+
+    free(linked);
+    leave_threads(saved);
+
+    return PFNET_OK;
+}
+
+int pfnet_links(const struct pfnet_graph *g, const double *D, size_t stride,
+                int symmetric, int *row_start, int *cols, size_t capacity,
+                const struct pfnet_options *opts)
+{
+    return find_links(g, D, stride, symmetric, NULL, NULL, row_start, cols, capacity,
+                      NULL, opts);
+}
+
+int pfnet_links_alloc(const struct pfnet_graph *g, const double *D, size_t stride,
+                      int symmetric, int *row_start, int **cols,
+                      const struct pfnet_options *opts)
+{
+    if (cols == NULL) {
+        return PFNET_EINVAL;
+    }
+    *cols = NULL;
+    return find_links(g, D, stride, symmetric, NULL, NULL, row_start, NULL, 0, cols,
+                      opts);
+}
+
+int pfnet_links_among(const struct pfnet_graph *g, const double *D, size_t stride,
+                      int symmetric, const int *kept_offsets, const int *kept,
+                      int *row_start, int **cols, const struct pfnet_options *opts)
+{
+    if (cols == NULL || kept_offsets == NULL || kept == NULL) {
+        return PFNET_EINVAL;
+    }
+    *cols = NULL;
+    return find_links(g, D, stride, symmetric, kept_offsets, kept, row_start, NULL, 0,
+                      cols, opts);
+}
@@ -0,0 +1,368 @@
+#ifndef PFNET_H
+#define PFNET_H
+
+// libpfnet: the OpenMP PFNET pipeline as a library. The stages are separate
+// calls so a caller can keep or reuse any intermediate:
+//
+//   tokens -> pfnet_vocab_build -> pfnet_graph_build -> pfnet_similarity
+//          -> pfnet_closure -> pfnet_links
+//
+// Distance matrices are caller-owned buffers of n rows of `stride` doubles
+// (stride >= n), row i starting at D + i * stride. pfnet_matrix_alloc()
+// returns a suitably aligned and, with the numa option, NUMA-placed one, but
+// any buffer of that shape works.
+//
+// Functions that can fail return PFNET_OK or a negative PFNET_E* code. None
+// of them print or exit, and none keep global state: every call runs on its
+// own OpenMP team of opts->threads threads and restores the caller's thread
+// count before returning.
+
+#include <float.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The major version changes with every break of the ABI and is the soname
+// of libpfnet.so; the minor version with every addition.
+#define PFNET_VERSION_MAJOR 2
+#define PFNET_VERSION_MINOR 3
+
+#define PFNET_OK 0
+#define PFNET_EINVAL (-1)
+#define PFNET_ENOMEM (-2)
+// A caller buffer is too small; the call reports the size it needs.
+#define PFNET_ERANGE (-3)
+#define PFNET_EIO (-4)
+
+// Distance of word pairs that never share a neighbour, and of pairs the
+// closure cannot connect.
+#define PFNET_INFINITY DBL_MAX
+
+// What pfnet_graph_build() does with a token of a pruned word: DROP removes
+// it, so the tokens around it move closer; SKIP keeps its place in the
+// window but counts no pair with it.
+#define PFNET_PRUNE_DROP 0
+#define PFNET_PRUNE_SKIP 1
+
+// Phases of a round of the blocked closure, as reported to the phase hook:
+// the pivot tile, the pivot row and column tiles, and all other tiles. DONE
+// follows the last round.
+#define PFNET_PHASE_DONE 0
+#define PFNET_PHASE_PIVOT 1
+#define PFNET_PHASE_ROW_COLUMN 2
+#define PFNET_PHASE_REMAINDER 3
+
+struct pfnet_telemetry;
+
+// Set up with pfnet_default_options(), never by hand: size records the
+// layout the caller was built against. Later minor versions only append
+// fields, so a library reads an older caller's options and takes the
+// defaults for the fields it lacks; reserved keeps room for options that
+// fit in it. A size smaller than version 2.0's or larger than the library
+// knows fails the call with PFNET_EINVAL.
+struct pfnet_options {
+    size_t size;
+    // OpenMP threads per call; 0 keeps the caller's omp_get_max_threads().
+    int threads;
+    // Two tokens co-occur when at most window - 1 tokens lie between them.
+    int window;
+    // Minkowski parameter r of PFNET(r, n - 1): a path of links a, b is
+    // (a^r + b^r)^(1/r) long, so r = 1 sums the link weights and
+    // r = PFNET_INFINITY takes the longest one.
+    double r;
+    // Non-zero places matrices from pfnet_matrix_alloc() strip by strip on
+    // the NUMA node of the thread that closes them, and runs the closure
+    // with that static ownership. Pin threads with OMP_PLACES for effect.
+    int numa;
+    // Tile edge of the blocked closure. 0 derives one from the L1 data cache
+    // size; pfnet_tuning_load() sets a measured one. Either way the closure
+    // uses the largest tile up to this size that divides n.
+    int block_size;
+    // Vocabulary pruning by pfnet_vocab_build(): words seen fewer than
+    // min_count times, the n_stopwords words of stopwords, and then all but
+    // the max_vocab most frequent words (ties to the earlier word) are left
+    // out. 0 disables each.
+    int min_count;
+    int max_vocab;
+    const char *const *stopwords;
+    int n_stopwords;
+    // PFNET_PRUNE_DROP or PFNET_PRUNE_SKIP, used when any pruning is set.
+    int prune_mode;
+    // Called by pfnet_closure() after every completed round with the matrix
+    // closed over the intermediates 0 .. next_k - 1, outside any parallel
+    // region. May be NULL.
+    void (*progress)(void *user, const double *D, size_t stride, int n,
+                     int next_k);
+    void *user;
+    // Called by pfnet_closure() from the calling thread, with phase_user, as
+    // each PFNET_PHASE_* starts, while no thread of the call is working, so
+    // it can read per-thread counters. The unblocked closure, used when no
+    // tile size divides n, reports all of its work as REMAINDER. May be NULL.
+    void (*phase)(void *user, int phase);
+    void *phase_user;
+    // Live progress of pfnet_closure(), for another thread to poll with
+    // pfnet_telemetry_read() while the closure runs. May be NULL.
+    struct pfnet_telemetry *telemetry;
+    // Zero; room for later options whose default is zero.
+    void *reserved[8];
+};
+
+// threads 0, window 5, r 1, numa off, block_size 0, no pruning (drop mode),
+// no progress or phase callback, no telemetry.
+void pfnet_default_options(struct pfnet_options *opts);
+
+const char *pfnet_strerror(int code);
+
+// Sorted set of the distinct tokens that survive the pruning options. The
+// words point into the caller's token strings, which must outlive the
+// vocabulary.
+struct pfnet_vocab;
+
+int pfnet_vocab_build(const char *const *tokens, int n_tokens,
+                      const struct pfnet_options *opts,
+                      struct pfnet_vocab **vocab);
+void pfnet_vocab_free(struct pfnet_vocab *vocab);
+int pfnet_vocab_size(const struct pfnet_vocab *vocab);
+// Distinct words and tokens the pruning left out; either may be NULL.
+void pfnet_vocab_pruned(const struct pfnet_vocab *vocab, int *words,
+                        size_t *tokens);
+// All words in increasing strcmp() order; word i is row and column i of
+// every matrix built from this vocabulary.
+const char *const *pfnet_vocab_words(const struct pfnet_vocab *vocab);
+// Index of word, or -1 if it is not in the vocabulary.
+int pfnet_vocab_find(const struct pfnet_vocab *vocab, const char *word);
+
+// Co-occurrence counts of the vocabulary words in a token sequence, kept as
+// sparse rows: O(n_tokens * window) memory instead of O(n^2).
+struct pfnet_graph;
+
+// Every token must be in vocab (PFNET_EINVAL otherwise) unless opts sets
+// pruning; tokens missing from vocab are then handled by opts->prune_mode.
+// The graph does not reference tokens or vocab once built.
+int pfnet_graph_build(const struct pfnet_vocab *vocab,
+                      const char *const *tokens, int n_tokens,
+                      const struct pfnet_options *opts,
+                      struct pfnet_graph **graph);
+void pfnet_graph_free(struct pfnet_graph *graph);
+int pfnet_graph_size(const struct pfnet_graph *graph);
+// Number of stored (word, neighbour) co-occurrences, twice the number of
+// word pairs with a direct distance below PFNET_INFINITY at most.
+size_t pfnet_graph_entries(const struct pfnet_graph *graph);
+// 1 - cosine similarity of the co-occurrence rows of words i != j, or
+// PFNET_INFINITY if they share no neighbour.
+double pfnet_direct_distance(const struct pfnet_graph *graph, int i, int j);
+
+// The graph of a text grown by n_tokens appended tokens, over vocab, a
+// vocabulary holding every word of both. map[i] is the index in vocab of
+// word i of graph (increasing in i). tokens holds the last n_context tokens
+// of the earlier text, at least opts->window of them unless the text was
+// shorter, followed by the new ones; only windows ending in a new token are
+// counted. The result equals pfnet_graph_build() over the whole text.
+// Pruning depends on the counts of the whole text, so opts must not set it
+// (PFNET_EINVAL).
+int pfnet_graph_extend(const struct pfnet_graph *graph, const int *map,
+                       const struct pfnet_vocab *vocab, const char *const *tokens,
+                       int n_context, int n_tokens, const struct pfnet_options *opts,
+                       struct pfnet_graph **extended);
+
+// Saves a graph at the current position of file, in host byte order, and
+// reads it back (PFNET_EIO on a short read or write).
+int pfnet_graph_write(const struct pfnet_graph *graph, FILE *file);
+int pfnet_graph_read(FILE *file, struct pfnet_graph **graph);
+
+// Row stride pfnet_matrix_alloc() uses: n rounded up to a cache line.
+size_t pfnet_matrix_stride(int n);
+// n x n matrix with pfnet_matrix_stride(n), or NULL. Release it with
+// pfnet_matrix_free().
+double *pfnet_matrix_alloc(int n, const struct pfnet_options *opts);
+void pfnet_matrix_free(double *D);
+
+// Fills the n x n matrix D (n = pfnet_graph_size()) with the direct
+// distances, 0 on the diagonal.
+int pfnet_similarity(const struct pfnet_graph *graph, double *D,
+                     size_t stride, const struct pfnet_options *opts);
+
+// Approximate similarity: each co-occurrence row is sketched by the signs of
+// bands * band_bits random projections (SimHash). Two words are candidates
+// when a band of their sketches matches and they lie within probe places of
+// each other in that band's sorted order; each word keeps its top_k
+// candidates by exact distance.
+struct pfnet_lsh {
+    int top_k;
+    int bands;
+    // 1 .. 32 sketch bits per band; more bits make smaller buckets.
+    int band_bits;
+    int probe;
+    unsigned long long seed;
+};
+
+// top_k 10, 32 bands of 6 bits, probe 8, a fixed seed.
+void pfnet_default_lsh(struct pfnet_lsh *lsh);
+
+// Like pfnet_similarity(), but only the pairs some word kept (in either
+// direction) get their direct distance; every other pair is PFNET_INFINITY.
+// *n_pairs, if not NULL, receives the number of kept pairs i < j. The
+// sketches take O(nnz * bands * band_bits) time and the candidates
+// O(n * bands * probe) distances instead of O(n^2).
+int pfnet_similarity_lsh(const struct pfnet_graph *graph, double *D,
+                         size_t stride, const struct pfnet_lsh *lsh,
+                         const struct pfnet_options *opts, size_t *n_pairs);
+// Same, and the kept pairs in both directions as compressed rows: row i lists
+// its kept words in increasing order at (*kept)[offsets[i] .. offsets[i + 1]),
+// offsets holding n + 1 entries and *kept allocated (free() it). They are the
+// only pairs of D with a direct distance, so the links of its closure come
+// from pfnet_links_among() over them.
+int pfnet_similarity_lsh_kept(const struct pfnet_graph *graph, double *D,
+                              size_t stride, const struct pfnet_lsh *lsh,
+                              const struct pfnet_options *opts, int *offsets,
+                              int **kept);
+
+// Closes D in place into the PFNET minimal path distances. first_k is 0 for
+// a fresh matrix, or the next_k of a progress callback to continue a matrix
+// saved there.
+int pfnet_closure(double *D, int n, size_t stride, int first_k,
+                  const struct pfnet_options *opts);
+
+// A snapshot of a closure's telemetry. A round is a tile row of the blocked
+// closure, or a single k of the unblocked one. A closure that continues a
+// saved matrix starts at the round it was saved at, while updates and
+// total_updates only count the path updates of this call.
+struct pfnet_progress {
+    int running;
+    int round;
+    int rounds;
+    long long updates;
+    long long total_updates;
+    double elapsed;
+};
+
+// Telemetry for closures of up to threads threads. The closure publishes
+// into it with relaxed atomic stores, a few per tile, so it can stay on
+// for whole runs.
+struct pfnet_telemetry *pfnet_telemetry_alloc(int threads);
+void pfnet_telemetry_free(struct pfnet_telemetry *telemetry);
+
+// Safe to call from any thread at any time. Each counter is read once, so
+// the fields may be a tile apart. busy, if not NULL, gets the seconds each
+// of the first n_busy threads spent updating tiles since the closure
+// started.
+void pfnet_telemetry_read(const struct pfnet_telemetry *telemetry,
+                          struct pfnet_progress *progress, double *busy,
+                          int n_busy);
+
+// Same result as pfnet_closure() with first_k 0, for a D with few finite
+// pairs such as pfnet_similarity_lsh() leaves: one Dijkstra run per row over
+// the finite pairs, O(n * m log m) for m of them. Never calls progress.
+int pfnet_closure_sparse(double *D, int n, size_t stride,
+                         const struct pfnet_options *opts);
+
+// Keeps a closed matrix closed after the direct distance of each pair
+// (u[e], v[e]), in both directions, is lowered to w[e]. Pairs are applied in
+// runs of equal u[e], in O(n^2) per run, so pairs sorted by u cost O(n^2)
+// per distinct vertex.
+int pfnet_closure_update(double *D, int n, size_t stride, const int *u,
+                         const int *v, const double *w, int n_pairs,
+                         const struct pfnet_options *opts);
+
+// Keeps a closed matrix closed after direct distances grew. Every grown pair
+// that was a shortest path must have an endpoint in vertices; weight(user,
+// i, j) returns the direct distance of i != j after the change and is called
+// from several threads at once. Only the pairs with a shortest path through
+// one of the vertices are recomputed, each suspect column j at the cost of
+// n weight(user, k, j) calls and n doubles of scratch, then O(p^2) per row
+// with p suspect entries. If there are more than max_pairs of them, D is left
+// alone and PFNET_ERANGE returned: a new pfnet_similarity() and
+// pfnet_closure() is cheaper then, so n^2 / deg for an average of deg
+// neighbours per word is a sensible max_pairs. D is also left alone on
+// PFNET_ENOMEM, as all scratch is taken before D is written.
+int pfnet_closure_raise(double *D, int n, size_t stride, const int *vertices,
+                        int n_vertices, double (*weight)(void *user, int i, int j),
+                        void *user, size_t max_pairs, const struct pfnet_options *opts);
+
+// Out-of-core closure, for an n x n matrix that does not fit in memory. The
+// matrix lives in a scratch file at path, which open creates (truncating it)
+// and close removes, as strips of block_size rows. Four strips stay
+// resident, and block_size is the largest multiple of 8 for which they fit
+// in budget bytes. File errors return PFNET_EIO.
+struct pfnet_ooc;
+
+int pfnet_ooc_open(const char *path, int n, size_t budget, struct pfnet_ooc **ooc);
+void pfnet_ooc_close(struct pfnet_ooc *ooc);
+int pfnet_ooc_block_size(const struct pfnet_ooc *ooc);
+int pfnet_ooc_strips(const struct pfnet_ooc *ooc);
+// Writes the direct distances of graph, like pfnet_similarity().
+int pfnet_ooc_similarity(struct pfnet_ooc *ooc, const struct pfnet_graph *graph,
+                         const struct pfnet_options *opts);
+// Closes the matrix in the file like pfnet_closure() with first_k 0. Every
+// round reads and writes the whole file once, overlapping the I/O with the
+// updates. Never calls progress or phase.
+int pfnet_ooc_closure(struct pfnet_ooc *ooc, const struct pfnet_options *opts);
+// Calls visit for each strip in order, with rows[i] pointing at row i for
+// row_begin <= i < row_end, while the next strip is read.
+int pfnet_ooc_rows(struct pfnet_ooc *ooc,
+                   void (*visit)(void *user, double **rows, int row_begin, int row_end),
+                   void *user);
+
+// Cache sizes in bytes of the CPU the caller runs on, from sysfs; 0 where
+// the machine does not report one.
+struct pfnet_caches {
+    size_t l1d;
+    size_t l2;
+    size_t l3;
+};
+
+void pfnet_read_caches(struct pfnet_caches *caches);
+
+struct pfnet_tuning_trial {
+    int block_size;
+    double seconds;
+};
+
+// Times pfnet_closure() under opts (threads, r, numa) on a sample n x n
+// matrix for every candidate tile size: the multiples of 4 from 8 up that
+// divide n and keep three tiles within the L2 cache. Each trial closes over
+// about n / 8 intermediates and reports the time scaled to all n. trials
+// receives the candidates in increasing size and *best the fastest of them;
+// with more candidates than capacity nothing is timed, *n_trials says how
+// many there are and PFNET_ERANGE is returned.
+int pfnet_tune(int n, const struct pfnet_options *opts,
+               struct pfnet_tuning_trial *trials, int capacity, int *n_trials,
+               int *best);
+
+// A tuning file holds one line per backend and machine, where a machine is
+// its CPU model and cache sizes, so a home directory shared by several hosts
+// keeps a winner for each. load sets opts->block_size from the libpfnet line
+// of this machine if there is one (a missing file is not an error); save
+// replaces that line, keeping all others.
+int pfnet_tuning_load(const char *path, struct pfnet_options *opts);
+int pfnet_tuning_save(const char *path, int block_size);
+
+// The PFNET links of a closed matrix: pairs whose direct distance is finite
+// and equals their minimal path distance. Row i lists its neighbours j in
+// increasing order at cols[offsets[i] .. offsets[i + 1]), only those with
+// j > i unless symmetric is set. offsets (n + 1 entries) is always filled;
+// cols only if offsets[n] <= capacity, PFNET_ERANGE otherwise, so a call with
+// cols NULL and capacity 0 counts the links.
+int pfnet_links(const struct pfnet_graph *graph, const double *D,
+                size_t stride, int symmetric, int *offsets, int *cols,
+                size_t capacity, const struct pfnet_options *opts);
+// Same, with *cols allocated at the size found (free() it).
+int pfnet_links_alloc(const struct pfnet_graph *graph, const double *D,
+                      size_t stride, int symmetric, int *offsets, int **cols,
+                      const struct pfnet_options *opts);
+// pfnet_links_alloc() for the closure of a pfnet_similarity_lsh_kept()
+// matrix: only the kept pairs are tested, as a dropped pair has no direct
+// link whatever its exact distance. O(kept_offsets[n]) distances, not O(n^2).
+int pfnet_links_among(const struct pfnet_graph *graph, const double *D,
+                      size_t stride, int symmetric, const int *kept_offsets,
+                      const int *kept, int *offsets, int **cols,
+                      const struct pfnet_options *opts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
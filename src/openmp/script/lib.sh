@@ -0,0 +1,20 @@
+#!/bin/bash
+
+echo "Creating libpfnet..."
+
+# The soname carries the major version, which changes with every ABI break.
+major=$(sed -n 's/^#define PFNET_VERSION_MAJOR \([0-9]*\)$/\1/p' pfnet.h)
+
+gcc -O2 -fPIC -fopenmp -pthread -c pfnet.c -o pfnet.o &&
+    ar rcs libpfnet.a pfnet.o &&
+    gcc -shared -fopenmp -pthread -Wl,-soname,libpfnet.so.$major pfnet.o -o libpfnet.so.$major -lm &&
+    ln -sf libpfnet.so.$major libpfnet.so
+
+if [ $? -ne 0 ]; then
+    echo "Error: Compilation failed."
+    exit 1
+fi
+
+rm -f pfnet.o
+
+echo "libpfnet.a and libpfnet.so.$major created successfully!"
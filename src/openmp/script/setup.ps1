@@ -1,6 +1,6 @@
 echo "Creating compiled code..."
 
-gcc mp.c -o mp -fopenmp -lm
+gcc mp.c pfnet.c -o mp -fopenmp -pthread -lm
 
 if ($LASTEXITCODE -ne 0) {
     Write-Host "Error: Compilation failed."
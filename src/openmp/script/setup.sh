@@ -2,7 +2,7 @@
 
 echo "Creating compiled code..."
 
-gcc mp.c -o mp -fopenmp -lm
+gcc mp.c pfnet.c -o mp -fopenmp -pthread -lm
 
 if [ $? -ne 0 ]; then
     echo "Error: Compilation failed."
@@ -1,13 +1,51 @@
 #include <float.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+#define MATRIX_ALIGNMENT 64
+#define OUTPUT_BUFFER_SIZE (1 << 22)
+// Bytes a result line needs beyond its two words: two separators, the
+// newline and the value, which is up to DBL_MAX_10_EXP + 9 characters.
+#define SLOW_LINE_EXTRA (DBL_MAX_10_EXP + 12)
+#define ARENA_BLOCK_SIZE (1 << 20)
 
 const double _INFINITY = DBL_MAX;
 const int _MAX_DISTANCE = 5;
 
+// Every n x n matrix is a single MATRIX_ALIGNMENT-aligned allocation with rows
+// padded to a multiple of 8 doubles, the layout shared by all backends. The
+// returned row table keeps D[i][j] indexing working.
+int matrix_stride(int n) {
+  int per_line = MATRIX_ALIGNMENT / sizeof(double);
+  return (n + per_line - 1) / per_line * per_line;
+}
+
+double **alloc_matrix(int n) {
+  size_t stride = matrix_stride(n);
+  size_t bytes = (size_t)n * stride * sizeof(double);
+  double **M = (double **)malloc((n > 0 ? n : 1) * sizeof(double *));
+
+  M[0] = (double *)aligned_alloc(MATRIX_ALIGNMENT,
+                                 bytes > 0 ? bytes : MATRIX_ALIGNMENT);
+  for (int i = 1; i < n; i++) {
+    M[i] = M[0] + i * stride;
+  }
+
+  return M;
+}
+
+void free_matrix(double **M) {
+  if (M != NULL) {
+    free(M[0]);
+    free(M);
+  }
+}
+
 void update_row(double **D, const int i, const int n, const int k,
                 const double r) {
   for (int j = 0; j < n; j++) {
@@ -33,25 +71,12 @@ void floyd_warshall(double **D, int q, int r) {
   }
 }
 
-double **pathfinder_network(double **graph, int n, int q, int r) {
-  double **D = (double **)malloc(n * sizeof(double *));
-  for (int i = 0; i < n; i++) {
-    D[i] = (double *)malloc(n * sizeof(double));
-    for (int j = 0; j < n; j++) {
-      D[i][j] = graph[i][j];
-    }
-  }
-
+// Closes D in place. The closure only ever shortens a distance, so it
+// already keeps every direct link that is a shortest path and no copy of the
+// input is needed.
+double **pathfinder_network(double **D, int q, int r) {
   floyd_warshall(D, q, r);
 
-  for (int i = 0; i < n; i++) {
-    for (int j = 0; j < n; j++) {
-      if (graph[i][j] < D[i][j]) {
-        D[i][j] = graph[i][j];
-      }
-    }
-  }
-
   return D;
 }
 
@@ -73,6 +98,46 @@ double cosine_similarity(double *a, double *b, int n) {
   return dot / (norm_a * norm_b);
 }
 
+// Bump-pointer storage for the token strings, which all live until exit:
+// they are packed back to back in ARENA_BLOCK_SIZE blocks instead of one
+// malloc each, and the whole arena is released with one pass over the blocks.
+struct arena_block {
+  struct arena_block *next;
+  size_t used;
+  size_t size;
+};
+
+struct arena {
+  struct arena_block *head;
+};
+
+char *arena_strdup(struct arena *arena, const char *s) {
+  size_t len = strlen(s) + 1;
+  struct arena_block *block = arena->head;
+
+  if (block == NULL || block->size - block->used < len) {
+    size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+    block = (struct arena_block *)malloc(sizeof(struct arena_block) + size);
+    block->next = arena->head;
+    block->used = 0;
+    block->size = size;
+    arena->head = block;
+  }
+
+  char *copy = (char *)(block + 1) + block->used;
+  memcpy(copy, s, len);
+  block->used += len;
+  return copy;
+}
+
+void arena_free(struct arena *arena) {
+  while (arena->head != NULL) {
+    struct arena_block *next = arena->head->next;
+    free(arena->head);
+    arena->head = next;
+  }
+}
+
 int find_index(char **array, int size, const char *word) {
   for (int i = 0; i < size; i++) {
     if (strcmp(array[i], word) == 0) {
@@ -86,10 +151,10 @@ int word_exists(char **array, int size, const char *word) {
   return find_index(array, size, word) != -1;
 }
 
-int add_word(char ***array, int *size, const char *word) {
+int add_word(char ***array, int *size, char *word) {
   if (!word_exists(*array, *size, word)) {
     *array = realloc(*array, (*size + 1) * sizeof(char *));
-    (*array)[*size] = strdup(word);
+    (*array)[*size] = word;
     (*size)++;
     return 1;
   }
@@ -100,7 +165,176 @@ int compare_strings(const void *a, const void *b) {
   return strcmp(*(const char **)a, *(const char **)b);
 }
 
-int main() {
+// Renders value exactly like printf("%f") (six decimals, round-half-even on
+// the exact binary value) without going through stdio or the locale. Values
+// of 1e12 and above, infinities and NaNs are rare and handed to sprintf, so
+// out needs room for DBL_MAX_10_EXP + 9 characters.
+int format_fixed6(char *out, double value) {
+  char *p = out;
+
+  if (signbit(value)) {
+    *p++ = '-';
+    value = -value;
+  }
+
+  if (!(value < 1e12)) {
+    return (int)(p - out) + sprintf(p, "%f", value);
+  }
+
+  // value = m * 2^e exactly, with m < 2^53 and e < 0 for every value below
+  // 1e12, so value * 10^6 = (m * 10^6) / 2^-e fits 128-bit arithmetic.
+  int exp;
+  double mant = frexp(value, &exp);
+  uint64_t m = (uint64_t)ldexp(mant, 53);
+  int shift = 53 - exp;
+
+  unsigned __int128 scaled = (unsigned __int128)m * 1000000;
+  uint64_t q = 0;
+  if (shift < 128) {
+    unsigned __int128 whole = scaled >> shift;
+    unsigned __int128 rem = scaled - (whole << shift);
+    unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+
+    q = (uint64_t)whole;
+    if (rem > half || (rem == half && (q & 1))) {
+      q++;
+    }
+  }
+
+  uint64_t int_part = q / 1000000;
+  uint32_t frac_part = (uint32_t)(q % 1000000);
+
+  char digits[20];
+  int len = 0;
+  do {
+    digits[len++] = (char)('0' + int_part % 10);
+    int_part /= 10;
+  } while (int_part > 0);
+  while (len > 0) {
+    *p++ = digits[--len];
+  }
+
+  *p++ = '.';
+  for (int i = 5; i >= 0; i--) {
+    p[i] = (char)('0' + frac_part % 10);
+    frac_part /= 10;
+  }
+  p += 6;
+
+  return (int)(p - out);
+}
+
+void write_all(int fd, const char *buffer, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, buffer, length);
+    if (written <= 0) {
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+    buffer += written;
+    length -= written;
+  }
+}
+
+// Prints every pair (i, j > i) as "%s %s %f\n", with "inf" for missing
+// links. Lines are rendered into one OUTPUT_BUFFER_SIZE buffer that is
+// flushed with large write() calls, so the text is identical to the printf
+// loop it replaces.
+void write_results(char **wordSet, double **pf_net, int n) {
+  fflush(stdout);
+
+  int *word_len = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+  for (int i = 0; i < n; i++) {
+    word_len[i] = strlen(wordSet[i]);
+  }
+
+  // Missing links print as "inf" rather than the %f text of _INFINITY.
+  const char *inf_text = "inf";
+  int inf_len = 3;
+
+  char *buffer = (char *)malloc(OUTPUT_BUFFER_SIZE);
+  size_t used = 0;
+
+  for (int i = 0; i < n; i++) {
+    for (int j = i + 1; j < n; j++) {
+      // Words are shorter than the 1024-byte input buffer, so one line
+      // always fits an empty buffer.
+      if (used + word_len[i] + word_len[j] + SLOW_LINE_EXTRA >
+          OUTPUT_BUFFER_SIZE) {
+        write_all(STDOUT_FILENO, buffer, used);
+        used = 0;
+      }
+
+      char *p = buffer + used;
+      memcpy(p, wordSet[i], word_len[i]);
+      p += word_len[i];
+      *p++ = ' ';
+      memcpy(p, wordSet[j], word_len[j]);
+      p += word_len[j];
+      *p++ = ' ';
+      if (pf_net[i][j] == _INFINITY) {
+        memcpy(p, inf_text, inf_len);
+        p += inf_len;
+      } else {
+        p += format_fixed6(p, pf_net[i][j]);
+      }
+      *p++ = '\n';
+      used = p - buffer;
+    }
+  }
+
+  write_all(STDOUT_FILENO, buffer, used);
+
+  free(buffer);
+  free(word_len);
+}
+
+// Seconds on the monotonic clock. clock() counts CPU time in coarse steps
+// and would hide everything below a second.
+double wall_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Per-phase wall times of one run.
+struct phase_times {
+  double word_set;
+  double graph;
+  double similarity;
+  double pathfinder;
+  double output;
+  double total;
+};
+
+// Appends one JSON object per run to path, with the fields of the other
+// backends' --stats.
+void write_stats(const char *path, const struct phase_times *times,
+                 int text_size, int unique_words) {
+  FILE *file = fopen(path, "a");
+  if (file == NULL) {
+    fprintf(stderr, "Warning: cannot open stats file %s\n", path);
+    return;
+  }
+
+  fprintf(file,
+          "{\"backend\":\"serial\",\"threads\":1,\"text_size\":%d,"
+          "\"unique_words\":%d,\"word_set\":%.6f,\"graph\":%.6f,"
+          "\"similarity\":%.6f,\"pathfinder\":%.6f,\"output\":%.6f,"
+          "\"total\":%.6f}\n",
+          text_size, unique_words, times->word_set, times->graph,
+          times->similarity, times->pathfinder, times->output, times->total);
+  fclose(file);
+}
+
+int main(int argc, char **argv) {
+  const char *stats_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+      stats_path = argv[++i];
+    }
+  }
+
   printf("===============================================\n");
   printf("PATHFINDER NETWORK\n");
   printf("===============================================\n");
@@ -108,16 +342,22 @@ int main() {
   char buffer[1024];
   char **text = NULL;
   int text_size = 0;
+  int text_capacity = 0;
+  struct arena strings = {NULL};
 
   while (scanf("%s", buffer) == 1) {
-    text = realloc(text, (text_size + 1) * sizeof(char *));
-    text[text_size] = strdup(buffer);
+    if (text_size == text_capacity) {
+      text_capacity = text_capacity > 0 ? 2 * text_capacity : 1024;
+      text = realloc(text, text_capacity * sizeof(char *));
+    }
+    text[text_size] = arena_strdup(&strings, buffer);
     text_size++;
   }
 
   printf("Text size:\t%d\n", text_size);
 
-  clock_t start = clock();
+  struct phase_times times;
+  double start = wall_time();
 
   char **wordSet = NULL;
   int wordSetSize = 0;
@@ -130,14 +370,15 @@ int main() {
 
   printf("Unique words:\t%d\n", wordSetSize);
 
-  clock_t wordSetEnd = clock();
-  printf("Word Set:\t%ld s\n", (wordSetEnd - start) / CLOCKS_PER_SEC);
+  double wordSetEnd = wall_time();
+  times.word_set = wordSetEnd - start;
+  printf("Word Set:\t%.2f s\n", times.word_set);
 
   int n = wordSetSize;
 
-  double **graph = (double **)malloc(n * sizeof(double *));
+  double **graph = alloc_matrix(n);
   for (int i = 0; i < n; i++) {
-    graph[i] = (double *)calloc(n, sizeof(double));
+    memset(graph[i], 0, n * sizeof(double));
   }
 
   for (int i = 0; i < text_size; i++) {
@@ -154,13 +395,11 @@ int main() {
     }
   }
 
-  clock_t graphInitEnd = clock();
-  printf("Graph Init:\t%ld s\n", (graphInitEnd - wordSetEnd) / CLOCKS_PER_SEC);
+  double graphInitEnd = wall_time();
+  times.graph = graphInitEnd - wordSetEnd;
+  printf("Graph Init:\t%.2f s\n", times.graph);
 
-  double **D = (double **)malloc(n * sizeof(double *));
-  for (int i = 0; i < n; i++) {
-    D[i] = (double *)malloc(n * sizeof(double));
-  }
+  double **D = alloc_matrix(n);
 
   for (int i = 0; i < n; i++) {
     D[i][i] = 0;
@@ -177,50 +416,42 @@ int main() {
     }
   }
 
-  clock_t similarityEnd = clock();
-  printf("Similarity:\t%ld s\n",
-         (similarityEnd - graphInitEnd) / CLOCKS_PER_SEC);
+  // The co-occurrence counts are not needed past this point, so the closure
+  // runs with a single n x n matrix.
+  free_matrix(graph);
+
+  double similarityEnd = wall_time();
+  times.similarity = similarityEnd - graphInitEnd;
+  printf("Similarity:\t%.2f s\n", times.similarity);
 
   const int q = n - 1;
   const double r = 1;
 
-  double **pf_net = pathfinder_network(D, n, q, r);
+  double **pf_net = pathfinder_network(D, q, r);
 
-  clock_t pfEnd = clock();
-  printf("Pathfinder:\t%ld s\n", (pfEnd - similarityEnd) / CLOCKS_PER_SEC);
-  printf("Total:\t%ld s\n", (pfEnd - start) / CLOCKS_PER_SEC);
+  double pfEnd = wall_time();
+  times.pathfinder = pfEnd - similarityEnd;
+  printf("Pathfinder:\t%.2f s\n", times.pathfinder);
+  printf("Total:\t%.2f s\n", pfEnd - start);
   printf("===============================================\n");
   printf("RESULT\n");
   printf("===============================================\n");
 
-  for (int i = 0; i < n; i++) {
-    for (int j = i + 1; j < n; j++) {
-      if (pf_net[i][j] == _INFINITY) {
-        printf("%s %s inf\n", wordSet[i], wordSet[j]);
-      } else {
-        printf("%s %s %f\n", wordSet[i], wordSet[j], pf_net[i][j]);
-      }
-    }
-  }
+  write_results(wordSet, pf_net, n);
 
-  for (int i = 0; i < text_size; i++) {
-    free(text[i]);
+  if (stats_path != NULL) {
+    times.output = wall_time() - pfEnd;
+    times.total = wall_time() - start;
+    write_stats(stats_path, &times, text_size, wordSetSize);
   }
-  free(text);
 
-  for (int i = 0; i < wordSetSize; i++) {
-    free(wordSet[i]);
-  }
+  // The words point into the token strings, so one release frees both.
+  free(text);
   free(wordSet);
+  arena_free(&strings);
 
-  for (int i = 0; i < n; i++) {
-    free(graph[i]);
-    free(D[i]);
-    free(pf_net[i]);
-  }
-  free(graph);
-  free(D);
-  free(pf_net);
+  // The closure ran in place, so pf_net is D.
+  free_matrix(pf_net);
 
   return 0;
 }
@@ -0,0 +1,226 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RESULT_MAGIC "PFNETB1"
+#define RESULT_MATRIX 0
+#define RESULT_EDGES 1
+
+// Binary result layout written by `mp --binary` and `mpi --binary`. All
+// fields are little-endian and every section starts on an 8-byte boundary:
+//   struct result_header
+//   vocabulary: uint64_t offsets[n + 1] into the string pool that follows,
+//     then the NUL-terminated words in sorted order, padded to 8 bytes
+//   RESULT_MATRIX: the closure distances of the pairs i < j row by row, as
+//     doubles, pair (i, j) at i * n - i * (i + 1) / 2 + j - i - 1
+//   RESULT_EDGES: uint64_t row_offsets[n + 1], then one struct result_edge
+//     per PFNET link i < j, grouped by i and sorted by j
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the binary result format is read in host byte order"
+#endif
+
+struct result_header {
+    char magic[8];
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t n;
+    uint64_t vocab_offset;
+    uint64_t data_offset;
+    uint64_t data_count;
+    uint64_t file_size;
+};
+
+struct result_edge {
+    uint32_t i;
+    uint32_t j;
+    double weight;
+};
+
+// A mapped result file with pointers into its sections.
+struct result {
+    const struct result_header *header;
+    size_t size;
+    const uint64_t *vocab;
+    const char *pool;
+    const double *matrix;
+    const uint64_t *row_offsets;
+    const struct result_edge *edges;
+};
+
+int open_result(const char *path, struct result *result)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct result_header)) {
+        fprintf(stderr, "Error: %s is not a binary result\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    const struct result_header *header = (const struct result_header *)base;
+    if (memcmp(header->magic, RESULT_MAGIC, sizeof(RESULT_MAGIC)) != 0
+        || header->file_size != (uint64_t)st.st_size
+        || (header->kind != RESULT_MATRIX && header->kind != RESULT_EDGES)) {
+        fprintf(stderr, "Error: %s is not a binary result\n", path);
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    const char *bytes = (const char *)base;
+    uint64_t n = header->n;
+
+    result->header = header;
+    result->size = st.st_size;
+    result->vocab = (const uint64_t *)(bytes + header->vocab_offset);
+    result->pool = (const char *)(result->vocab + n + 1);
+    result->matrix = NULL;
+    result->row_offsets = NULL;
+    result->edges = NULL;
+
+    if (header->kind == RESULT_MATRIX) {
+        result->matrix = (const double *)(bytes + header->data_offset);
+    } else {
+        result->row_offsets = (const uint64_t *)(bytes + header->data_offset);
+        result->edges = (const struct result_edge *)(result->row_offsets + n + 1);
+    }
+
+    return 0;
+}
+
+const char *result_word(const struct result *result, uint64_t i)
+{
+    return result->pool + result->vocab[i];
+}
+
+// The words are stored sorted, so a lookup is a binary search.
+int64_t find_word(const struct result *result, const char *word)
+{
+    int64_t lo = 0;
+    int64_t hi = (int64_t)result->header->n - 1;
+
+    while (lo <= hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(result_word(result, mid), word);
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return -1;
+}
+
+// Prints the same lines as the RESULT section of the text output.
+void dump(const struct result *result)
+{
+    uint64_t n = result->header->n;
+
+    if (result->header->kind == RESULT_MATRIX) {
+        const double *cell = result->matrix;
+        for (uint64_t i = 0; i < n; i++) {
+            for (uint64_t j = i + 1; j < n; j++) {
+                printf("%s %s %f\n", result_word(result, i), result_word(result, j),
+                       *cell++);
+            }
+        }
+    } else {
+        for (uint64_t e = 0; e < result->header->data_count; e++) {
+            const struct result_edge *edge = &result->edges[e];
+            printf("%s %s %f\n", result_word(result, edge->i),
+                   result_word(result, edge->j), edge->weight);
+        }
+    }
+}
+
+// Prints the distance of one pair: a direct O(1) index into the matrix, or a
+// binary search within row i of the edge list.
+int lookup(const struct result *result, const char *a, const char *b)
+{
+    int64_t i = find_word(result, a);
+    int64_t j = find_word(result, b);
+    if (i < 0 || j < 0) {
+        fprintf(stderr, "Error: %s is not in the vocabulary\n", i < 0 ? a : b);
+        return 1;
+    }
+    if (i > j) {
+        int64_t tmp = i;
+        i = j;
+        j = tmp;
+    }
+    if (i == j) {
+        printf("%s %s %f\n", a, b, 0.0);
+        return 0;
+    }
+
+    uint64_t n = result->header->n;
+
+    if (result->header->kind == RESULT_MATRIX) {
+        uint64_t index = i * n - i * (i + 1) / 2 + j - i - 1;
+        printf("%s %s %f\n", result_word(result, i), result_word(result, j),
+               result->matrix[index]);
+        return 0;
+    }
+
+    uint64_t lo = result->row_offsets[i];
+    uint64_t hi = result->row_offsets[i + 1];
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (result->edges[mid].j < (uint32_t)j) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < result->row_offsets[i + 1] && result->edges[lo].j == (uint32_t)j) {
+        printf("%s %s %f\n", result_word(result, i), result_word(result, j),
+               result->edges[lo].weight);
+    } else {
+        printf("%s %s not a link\n", result_word(result, i), result_word(result, j));
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 4) {
+        fprintf(stderr, "Usage: %s <result.bin> [word1 word2]\n", argv[0]);
+        return 1;
+    }
+
+    struct result result;
+    if (open_result(argv[1], &result) != 0) {
+        return 1;
+    }
+
+    int status = 0;
+    if (argc == 2) {
+        dump(&result);
+    } else {
+        status = lookup(&result, argv[2], argv[3]);
+    }
+
+    munmap((void *)result.header, result.size);
+    return status;
+}
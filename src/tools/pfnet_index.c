@@ -0,0 +1,403 @@
+#include <fcntl.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pfnet_index.h"
+
+#define RESULT_MAGIC "PFNETB1"
+#define RESULT_MATRIX 0
+#define RESULT_EDGES 1
+
+#define DEFAULT_NEAREST 10
+
+// Binary result layout written by `mp --binary` and `mpi --binary`, see
+// pfnet_dump.c.
+struct result_header {
+    char magic[8];
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t n;
+    uint64_t vocab_offset;
+    uint64_t data_offset;
+    uint64_t data_count;
+    uint64_t file_size;
+};
+
+struct result_edge {
+    uint32_t i;
+    uint32_t j;
+    double weight;
+};
+
+struct result {
+    const struct result_header *header;
+    size_t size;
+    const uint64_t *vocab;
+    const char *pool;
+    const double *matrix;
+    const uint64_t *row_offsets;
+    const struct result_edge *edges;
+};
+
+int open_result(const char *path, struct result *result)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct result_header)) {
+        fprintf(stderr, "Error: %s is not a binary result\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    const struct result_header *header = (const struct result_header *)base;
+    if (memcmp(header->magic, RESULT_MAGIC, sizeof(RESULT_MAGIC)) != 0
+        || header->file_size != (uint64_t)st.st_size
+        || (header->kind != RESULT_MATRIX && header->kind != RESULT_EDGES)) {
+        fprintf(stderr, "Error: %s is not a binary result\n", path);
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    const char *bytes = (const char *)base;
+    uint64_t n = header->n;
+
+    result->header = header;
+    result->size = st.st_size;
+    result->vocab = (const uint64_t *)(bytes + header->vocab_offset);
+    result->pool = (const char *)(result->vocab + n + 1);
+    result->matrix = NULL;
+    result->row_offsets = NULL;
+    result->edges = NULL;
+
+    if (header->kind == RESULT_MATRIX) {
+        result->matrix = (const double *)(bytes + header->data_offset);
+    } else {
+        result->row_offsets = (const uint64_t *)(bytes + header->data_offset);
+        result->edges = (const struct result_edge *)(result->row_offsets + n + 1);
+    }
+
+    return 0;
+}
+
+// Two results can only be combined if they were written for the same text.
+int same_vocabulary(const struct result *a, const struct result *b)
+{
+    uint64_t n = a->header->n;
+    return n == b->header->n
+           && memcmp(a->vocab, b->vocab, (n + 1) * sizeof(uint64_t)) == 0
+           && memcmp(a->pool, b->pool, a->vocab[n]) == 0;
+}
+
+double pair_distance(const struct result *matrix, uint64_t i, uint64_t j)
+{
+    uint64_t n = matrix->header->n;
+    if (i > j) {
+        uint64_t tmp = i;
+        i = j;
+        j = tmp;
+    }
+    return matrix->matrix[i * n - i * (i + 1) / 2 + j - i - 1];
+}
+
+// Bounded max-heap of the k best (distance, id) candidates of one row; ties
+// go to the smaller id, so the lists do not depend on the scan order.
+struct candidate {
+    double distance;
+    uint32_t id;
+};
+
+int worse(const struct candidate *a, const struct candidate *b)
+{
+    return a->distance > b->distance || (a->distance == b->distance && a->id > b->id);
+}
+
+void sift_down(struct candidate *heap, uint64_t size, uint64_t i)
+{
+    for (;;) {
+        uint64_t largest = i;
+        uint64_t left = 2 * i + 1;
+        uint64_t right = left + 1;
+        if (left < size && worse(&heap[left], &heap[largest])) {
+            largest = left;
+        }
+        if (right < size && worse(&heap[right], &heap[largest])) {
+            largest = right;
+        }
+        if (largest == i) {
+            return;
+        }
+        struct candidate tmp = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = tmp;
+        i = largest;
+    }
+}
+
+int compare_candidates(const void *a, const void *b)
+{
+    const struct candidate *x = (const struct candidate *)a;
+    const struct candidate *y = (const struct candidate *)b;
+    return worse(x, y) - worse(y, x);
+}
+
+// The k nearest words of every row, O(n^2 log k) over the closure matrix.
+void build_nearest(const struct result *matrix, uint64_t k, uint32_t *ids,
+                   double *distances)
+{
+    uint64_t n = matrix->header->n;
+    struct candidate *heap = (struct candidate *)malloc((k > 0 ? k : 1) * sizeof(*heap));
+
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t size = 0;
+        for (uint64_t j = 0; j < n; j++) {
+            if (j == i) {
+                continue;
+            }
+            struct candidate c = {pair_distance(matrix, i, j), (uint32_t)j};
+            if (c.distance == DBL_MAX) {
+                continue;
+            }
+
+            if (size < k) {
+                heap[size++] = c;
+                if (size == k) {
+                    for (uint64_t h = k / 2; h-- > 0;) {
+                        sift_down(heap, size, h);
+                    }
+                }
+            } else if (worse(&heap[0], &c)) {
+                heap[0] = c;
+                sift_down(heap, size, 0);
+            }
+        }
+
+        qsort(heap, size, sizeof(*heap), compare_candidates);
+        for (uint64_t s = 0; s < k; s++) {
+            ids[i * k + s] = s < size ? heap[s].id : INDEX_NO_WORD;
+            distances[i * k + s] = s < size ? heap[s].distance : DBL_MAX;
+        }
+    }
+
+    free(heap);
+}
+
+uint64_t align8(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+int write_padding(FILE *file, uint64_t from, uint64_t to)
+{
+    static const char padding[8] = {0};
+    size_t pad = to - from;
+    return fwrite(padding, 1, pad, file) == pad;
+}
+
+int build_index(const char *path, const struct result *base, const struct result *matrix,
+                const struct result *links, uint64_t k)
+{
+    uint64_t n = base->header->n;
+    if (n >= INDEX_NO_WORD) {
+        fprintf(stderr, "Error: %llu words do not fit 32-bit ids\n", (unsigned long long)n);
+        return 1;
+    }
+
+    struct index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.n = n;
+
+    // Sections in file order; each size is known up front.
+    uint64_t offset = sizeof(header);
+    header.vocab_offset = offset;
+    offset += (n + 1) * sizeof(uint64_t) + base->vocab[n];
+
+    header.hash_size = 1;
+    while (header.hash_size < 2 * n) {
+        header.hash_size *= 2;
+    }
+    header.hash_offset = offset = align8(offset);
+    offset += header.hash_size * sizeof(uint32_t);
+
+    uint64_t cols_end = 0;
+    if (links != NULL) {
+        header.link_count = 2 * links->header->data_count;
+        header.links_offset = offset = align8(offset);
+        cols_end = offset + (n + 1) * sizeof(uint64_t) + header.link_count * sizeof(uint32_t);
+        offset = align8(cols_end) + header.link_count * sizeof(double);
+    }
+
+    uint64_t matrix_bytes = 0;
+    if (matrix != NULL) {
+        matrix_bytes = matrix->header->data_count * sizeof(double);
+        header.matrix_offset = offset = align8(offset);
+        offset += matrix_bytes;
+    }
+
+    uint64_t ids_end = 0;
+    if (matrix != NULL && k > 0) {
+        header.k = k;
+        header.nearest_offset = offset = align8(offset);
+        ids_end = offset + n * k * sizeof(uint32_t);
+        offset = align8(ids_end) + n * k * sizeof(double);
+    }
+    header.file_size = offset;
+
+    uint32_t *slots = (uint32_t *)calloc(header.hash_size, sizeof(uint32_t));
+    uint64_t mask = header.hash_size - 1;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t s = index_hash(base->pool + base->vocab[i]) & mask;
+        while (slots[s] != 0) {
+            s = (s + 1) & mask;
+        }
+        slots[s] = (uint32_t)(i + 1);
+    }
+
+    // Each link i < j goes to both rows. The links come grouped by i and
+    // sorted by j, so appending in that order keeps every row sorted.
+    uint64_t *row_offsets = NULL;
+    uint32_t *cols = NULL;
+    double *weights = NULL;
+    if (links != NULL) {
+        row_offsets = (uint64_t *)calloc(n + 1, sizeof(uint64_t));
+        cols = (uint32_t *)malloc((header.link_count > 0 ? header.link_count : 1) * sizeof(uint32_t));
+        weights = (double *)malloc((header.link_count > 0 ? header.link_count : 1) * sizeof(double));
+        for (uint64_t e = 0; e < links->header->data_count; e++) {
+            row_offsets[links->edges[e].i + 1]++;
+            row_offsets[links->edges[e].j + 1]++;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            row_offsets[i + 1] += row_offsets[i];
+        }
+
+        uint64_t *next = (uint64_t *)malloc((n > 0 ? n : 1) * sizeof(uint64_t));
+        memcpy(next, row_offsets, n * sizeof(uint64_t));
+        for (uint64_t e = 0; e < links->header->data_count; e++) {
+            const struct result_edge *edge = &links->edges[e];
+            cols[next[edge->i]] = edge->j;
+            weights[next[edge->i]++] = edge->weight;
+            cols[next[edge->j]] = edge->i;
+            weights[next[edge->j]++] = edge->weight;
+        }
+        free(next);
+    }
+
+    uint32_t *ids = NULL;
+    double *distances = NULL;
+    if (header.k > 0) {
+        ids = (uint32_t *)malloc((n > 0 ? n * k : 1) * sizeof(uint32_t));
+        distances = (double *)malloc((n > 0 ? n * k : 1) * sizeof(double));
+        build_nearest(matrix, k, ids, distances);
+    }
+
+    FILE *file = fopen(path, "wb");
+    int ok = file != NULL;
+    uint64_t at = 0;
+    if (ok) {
+        ok &= fwrite(&header, sizeof(header), 1, file) == 1;
+        ok &= fwrite(base->vocab, sizeof(uint64_t), n + 1, file) == n + 1;
+        ok &= fwrite(base->pool, 1, base->vocab[n], file) == base->vocab[n];
+        at = header.vocab_offset + (n + 1) * sizeof(uint64_t) + base->vocab[n];
+
+        ok &= write_padding(file, at, header.hash_offset);
+        ok &= fwrite(slots, sizeof(uint32_t), header.hash_size, file) == header.hash_size;
+        at = header.hash_offset + header.hash_size * sizeof(uint32_t);
+    }
+    if (ok && links != NULL) {
+        ok &= write_padding(file, at, header.links_offset);
+        ok &= fwrite(row_offsets, sizeof(uint64_t), n + 1, file) == n + 1;
+        ok &= fwrite(cols, sizeof(uint32_t), header.link_count, file) == header.link_count;
+        ok &= write_padding(file, cols_end, align8(cols_end));
+        ok &= fwrite(weights, sizeof(double), header.link_count, file) == header.link_count;
+        at = align8(cols_end) + header.link_count * sizeof(double);
+    }
+    if (ok && matrix != NULL) {
+        ok &= write_padding(file, at, header.matrix_offset);
+        ok &= fwrite(matrix->matrix, 1, matrix_bytes, file) == matrix_bytes;
+        at = header.matrix_offset + matrix_bytes;
+    }
+    if (ok && header.k > 0) {
+        ok &= write_padding(file, at, header.nearest_offset);
+        ok &= fwrite(ids, sizeof(uint32_t), n * k, file) == n * k;
+        ok &= write_padding(file, ids_end, align8(ids_end));
+        ok &= fwrite(distances, sizeof(double), n * k, file) == n * k;
+    }
+    if (file != NULL && fclose(file) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: failed to write index %s\n", path);
+    }
+
+    free(slots);
+    free(row_offsets);
+    free(cols);
+    free(weights);
+    free(ids);
+    free(distances);
+
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t k = DEFAULT_NEAREST;
+    int arg = 1;
+    if (arg + 1 < argc && strcmp(argv[arg], "-k") == 0) {
+        k = strtoull(argv[arg + 1], NULL, 10);
+        arg += 2;
+    }
+
+    if (argc - arg < 2 || argc - arg > 3) {
+        fprintf(stderr, "Usage: %s [-k nearest] <index> <result.bin> [result.bin]\n",
+                argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[arg];
+    struct result inputs[2];
+    int n_inputs = argc - arg - 1;
+    struct result *matrix = NULL;
+    struct result *links = NULL;
+
+    for (int r = 0; r < n_inputs; r++) {
+        if (open_result(argv[arg + 1 + r], &inputs[r]) != 0) {
+            return 1;
+        }
+        struct result **slot = inputs[r].header->kind == RESULT_MATRIX ? &matrix : &links;
+        if (*slot != NULL) {
+            fprintf(stderr, "Error: give at most one pair result and one link result\n");
+            return 1;
+        }
+        *slot = &inputs[r];
+    }
+    if (n_inputs == 2 && !same_vocabulary(&inputs[0], &inputs[1])) {
+        fprintf(stderr, "Error: the two results were written for different texts\n");
+        return 1;
+    }
+
+    int status = build_index(path, &inputs[0], matrix, links, k);
+
+    for (int r = 0; r < n_inputs; r++) {
+        munmap((void *)inputs[r].header, inputs[r].size);
+    }
+    return status;
+}
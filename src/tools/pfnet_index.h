@@ -0,0 +1,71 @@
+#ifndef PFNET_INDEX_H
+#define PFNET_INDEX_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Query index layout, written by pfnet_index and mmapped by pfnet_query. All
+// fields are little-endian and every section starts on an 8-byte boundary;
+// a section whose offset is 0 is absent:
+//   struct index_header
+//   vocabulary: uint64_t offsets[n + 1] into the string pool that follows,
+//     then the NUL-terminated words in sorted order
+//   hash: hash_size uint32_t slots (a power of two), each 0 or word id + 1,
+//     open addressing with linear probing on index_hash()
+//   links: uint64_t row_offsets[n + 1], then uint32_t cols[link_count],
+//     then double weights[link_count]; row i lists every PFNET neighbour of
+//     word i (both directions) in increasing id order
+//   matrix: the closure distances of the pairs i < j row by row as in the
+//     binary result, pair (i, j) at i * n - i * (i + 1) / 2 + j - i - 1
+//   nearest: uint32_t ids[n * k], then double distances[n * k]; row i holds
+//     the k words closest to word i by closure distance, nearest first,
+//     padded with INDEX_NO_WORD when fewer are reachable
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the query index is written in host byte order"
+#endif
+
+#define INDEX_MAGIC "PFIDX1"
+#define INDEX_NO_WORD UINT32_MAX
+
+struct index_header {
+    char magic[8];
+    uint64_t n;
+    uint64_t vocab_offset;
+    uint64_t hash_offset;
+    uint64_t hash_size;
+    uint64_t links_offset;
+    uint64_t link_count;
+    uint64_t matrix_offset;
+    uint64_t nearest_offset;
+    uint64_t k;
+    uint64_t file_size;
+};
+
+// FNV-1a over the bytes of the word.
+static inline uint64_t index_hash(const char *word)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)word; *c; c++) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Id of word in a mapped vocabulary and hash table, or -1.
+static inline int64_t index_find(const uint32_t *slots, uint64_t hash_size,
+                                 const uint64_t *vocab, const char *pool,
+                                 const char *word)
+{
+    uint64_t mask = hash_size - 1;
+    for (uint64_t s = index_hash(word) & mask;; s = (s + 1) & mask) {
+        uint32_t slot = slots[s];
+        if (slot == 0) {
+            return -1;
+        }
+        if (strcmp(pool + vocab[slot - 1], word) == 0) {
+            return slot - 1;
+        }
+    }
+}
+
+#endif
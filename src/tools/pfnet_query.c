@@ -0,0 +1,264 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pfnet_index.h"
+
+struct index {
+    const struct index_header *header;
+    size_t size;
+    const uint64_t *vocab;
+    const char *pool;
+    const uint32_t *slots;
+    const uint64_t *row_offsets;
+    const uint32_t *cols;
+    const double *weights;
+    const double *matrix;
+    const uint32_t *nearest_ids;
+    const double *nearest_distances;
+};
+
+uint64_t align8(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+int open_index(const char *path, struct index *index)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct index_header)) {
+        fprintf(stderr, "Error: %s is not a query index\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    const struct index_header *header = (const struct index_header *)base;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+        || header->file_size != (uint64_t)st.st_size) {
+        fprintf(stderr, "Error: %s is not a query index\n", path);
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    const char *bytes = (const char *)base;
+    uint64_t n = header->n;
+
+    memset(index, 0, sizeof(*index));
+    index->header = header;
+    index->size = st.st_size;
+    index->vocab = (const uint64_t *)(bytes + header->vocab_offset);
+    index->pool = (const char *)(index->vocab + n + 1);
+    index->slots = (const uint32_t *)(bytes + header->hash_offset);
+
+    if (header->links_offset != 0) {
+        index->row_offsets = (const uint64_t *)(bytes + header->links_offset);
+        index->cols = (const uint32_t *)(index->row_offsets + n + 1);
+        uint64_t cols_end = header->links_offset + (n + 1) * sizeof(uint64_t)
+                            + header->link_count * sizeof(uint32_t);
+        index->weights = (const double *)(bytes + align8(cols_end));
+    }
+    if (header->matrix_offset != 0) {
+        index->matrix = (const double *)(bytes + header->matrix_offset);
+    }
+    if (header->nearest_offset != 0) {
+        index->nearest_ids = (const uint32_t *)(bytes + header->nearest_offset);
+        uint64_t ids_end = header->nearest_offset + n * header->k * sizeof(uint32_t);
+        index->nearest_distances = (const double *)(bytes + align8(ids_end));
+    }
+
+    return 0;
+}
+
+const char *index_word(const struct index *index, uint64_t i)
+{
+    return index->pool + index->vocab[i];
+}
+
+int64_t find(const struct index *index, const char *word)
+{
+    int64_t i = index_find(index->slots, index->header->hash_size, index->vocab,
+                           index->pool, word);
+    if (i < 0) {
+        fprintf(stderr, "Error: %s is not in the vocabulary\n", word);
+    }
+    return i;
+}
+
+// Row i of the CSR adjacency: every PFNET link of the word.
+int neighbors(const struct index *index, const char *word)
+{
+    if (index->row_offsets == NULL) {
+        fprintf(stderr, "Error: the index was built without a link result\n");
+        return 1;
+    }
+    int64_t i = find(index, word);
+    if (i < 0) {
+        return 1;
+    }
+
+    for (uint64_t e = index->row_offsets[i]; e < index->row_offsets[i + 1]; e++) {
+        printf("%s %s %f\n", index_word(index, i), index_word(index, index->cols[e]),
+               index->weights[e]);
+    }
+    return 0;
+}
+
+// Closure distance of one pair from the matrix section, or the link weight
+// (binary search in row i) when the index has no matrix.
+int distance(const struct index *index, const char *a, const char *b)
+{
+    int64_t i = find(index, a);
+    int64_t j = find(index, b);
+    if (i < 0 || j < 0) {
+        return 1;
+    }
+    if (i > j) {
+        int64_t tmp = i;
+        i = j;
+        j = tmp;
+    }
+    if (i == j) {
+        printf("%s %s %f\n", a, b, 0.0);
+        return 0;
+    }
+
+    uint64_t n = index->header->n;
+
+    if (index->matrix != NULL) {
+        printf("%s %s %f\n", index_word(index, i), index_word(index, j),
+               index->matrix[i * n - i * (i + 1) / 2 + j - i - 1]);
+        return 0;
+    }
+
+    uint64_t lo = index->row_offsets[i];
+    uint64_t hi = index->row_offsets[i + 1];
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (index->cols[mid] < (uint32_t)j) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < index->row_offsets[i + 1] && index->cols[lo] == (uint32_t)j) {
+        printf("%s %s %f\n", index_word(index, i), index_word(index, j),
+               index->weights[lo]);
+    } else {
+        printf("%s %s not a link\n", index_word(index, i), index_word(index, j));
+    }
+    return 0;
+}
+
+// The first k entries of the precomputed nearest list of the word.
+int nearest(const struct index *index, const char *word, uint64_t k)
+{
+    if (index->nearest_ids == NULL) {
+        fprintf(stderr, "Error: the index was built without nearest lists\n");
+        return 1;
+    }
+    int64_t i = find(index, word);
+    if (i < 0) {
+        return 1;
+    }
+
+    uint64_t stored = index->header->k;
+    if (k == 0 || k > stored) {
+        k = stored;
+    }
+    for (uint64_t s = 0; s < k; s++) {
+        uint32_t j = index->nearest_ids[i * stored + s];
+        if (j == INDEX_NO_WORD) {
+            break;
+        }
+        printf("%s %s %f\n", index_word(index, i), index_word(index, j),
+               index->nearest_distances[i * stored + s]);
+    }
+    return 0;
+}
+
+// One query: "neighbors w", "distance w1 w2" or "nearest w [k]".
+int query(const struct index *index, int argc, char **argv)
+{
+    if (argc == 2 && strcmp(argv[0], "neighbors") == 0) {
+        return neighbors(index, argv[1]);
+    }
+    if (argc == 3 && strcmp(argv[0], "distance") == 0) {
+        return distance(index, argv[1], argv[2]);
+    }
+    if ((argc == 2 || argc == 3) && strcmp(argv[0], "nearest") == 0) {
+        return nearest(index, argv[1], argc == 3 ? strtoull(argv[2], NULL, 10) : 0);
+    }
+    fprintf(stderr, "Error: unknown query");
+    for (int a = 0; a < argc; a++) {
+        fprintf(stderr, " %s", argv[a]);
+    }
+    fprintf(stderr, "\n");
+    return 1;
+}
+
+// Queries one per line on stdin, so a single mapping serves many of them.
+int query_stream(const struct index *index)
+{
+    char line[4096];
+    int status = 0;
+
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        char *argv[4];
+        int argc = 0;
+        for (char *token = strtok(line, " \t\r\n"); token != NULL && argc < 4;
+             token = strtok(NULL, " \t\r\n")) {
+            argv[argc++] = token;
+        }
+        if (argc == 0) {
+            continue;
+        }
+        status |= query(index, argc, argv);
+    }
+
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr,
+                "Usage: %s <index> [neighbors <word> | distance <word1> <word2> | "
+                "nearest <word> [k]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    struct index index;
+    if (open_index(argv[1], &index) != 0) {
+        return 1;
+    }
+
+    int status;
+    if (argc == 2) {
+        status = query_stream(&index);
+    } else {
+        status = query(&index, argc - 2, argv + 2);
+    }
+
+    munmap((void *)index.header, index.size);
+    return status;
+}
@@ -0,0 +1,14 @@
+#!/bin/bash
+
+for tool in pfnet_dump pfnet_index pfnet_query; do
+    echo "Compiling $tool.c..."
+
+    gcc -O2 $tool.c -o $tool
+
+    if [ $? -ne 0 ]; then
+        echo "Error: Compilation failed."
+        exit 1
+    fi
+done
+
+echo "Compiled code created successfully!"